@@ -0,0 +1,11 @@
+#pragma once
+
+// 各スイートは main.cpp の SUITES に登録する
+
+void bench_mutex();
+void bench_queue();
+void bench_ring_buffer();
+void bench_semaphore();
+void bench_timer();
+void bench_uart();
+void bench_uart_rx();
@@ -0,0 +1,30 @@
+#include <cstdint>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/core/benchmark.hpp>
+
+#include "bench.hpp"
+
+using namespace stm32rcos::core;
+
+namespace {
+
+constexpr size_t ITERATIONS = 10000;
+
+uint32_t samples[ITERATIONS];
+
+} // namespace
+
+void bench_mutex() {
+  Mutex mutex;
+  run_benchmark("mutex_lock_unlock", samples, [&] {
+    mutex.lock();
+    mutex.unlock();
+  }).print_json();
+
+  run_benchmark("mutex_try_lock_0", samples, [&] {
+    if (mutex.try_lock(0)) {
+      mutex.unlock();
+    }
+  }).print_json();
+}
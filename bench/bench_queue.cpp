@@ -0,0 +1,90 @@
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/core/benchmark.hpp>
+
+#include "bench.hpp"
+
+using namespace stm32rcos::core;
+
+namespace {
+
+constexpr size_t ITERATIONS = 10000;
+constexpr size_t BATCH = 16;
+
+uint32_t samples[ITERATIONS];
+
+struct Consumer {
+  Queue<uint32_t> queue{BATCH};
+  Semaphore done{1, 0};
+  bool batch;
+};
+
+// BATCH 個届くたびに done を返す。batch なら pop_all() でまとめて取り出す
+void consume(void *args) {
+  auto consumer = static_cast<Consumer *>(args);
+  std::array<uint32_t, BATCH> values;
+  while (true) {
+    size_t count = 0;
+    while (count < BATCH) {
+      if (consumer->batch) {
+        count += consumer->queue.pop_all(
+            std::span{values}.subspan(count), osWaitForever);
+      } else if (consumer->queue.pop(values[count], osWaitForever)) {
+        ++count;
+      }
+    }
+    consumer->done.release();
+  }
+}
+
+void bench_consumer(const char *name, bool batch) {
+  Consumer consumer{.batch = batch};
+  Thread thread(consume, &consumer, 1024, osPriorityNormal);
+  std::array<uint32_t, BATCH> values{};
+  run_benchmark(name, samples, [&] {
+    consumer.queue.push_n(values, osWaitForever);
+    consumer.done.acquire();
+  }).print_json();
+}
+
+} // namespace
+
+void bench_queue() {
+  Queue<uint32_t> queue(16);
+  run_benchmark("queue_push_pop", samples, [&] {
+    queue.push(1, 0);
+    queue.pop(0);
+  }).print_json();
+
+  run_benchmark("queue_pop_empty", ITERATIONS, [&] {
+    queue.pop(0);
+  }).print_json();
+
+  // BATCH 個を1個ずつ出し入れする場合と、まとめて出し入れする場合の比較
+  std::array<uint32_t, BATCH> values{};
+  run_benchmark("queue_push_pop_single_16", samples, [&] {
+    for (uint32_t value : values) {
+      queue.push(value, 0);
+    }
+    for (uint32_t &value : values) {
+      queue.pop(value, 0);
+    }
+  }).print_json();
+
+  run_benchmark("queue_push_n_pop_n_16", samples, [&] {
+    queue.push_n(values, 0);
+    queue.pop_n(values, 0);
+  }).print_json();
+
+  run_benchmark("queue_push_n_pop_all_16", samples, [&] {
+    queue.push_n(values, 0);
+    queue.pop_all(values, 0);
+  }).print_json();
+
+  // 別スレッドの受け手が1個ずつ起きる場合と、まとめて受け取る場合の比較
+  bench_consumer("queue_consumer_pop_16", false);
+  bench_consumer("queue_consumer_pop_all_16", true);
+}
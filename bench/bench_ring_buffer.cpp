@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <thread>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/core/benchmark.hpp>
+
+#include "bench.hpp"
+
+using namespace stm32rcos::core;
+
+namespace {
+
+constexpr size_t ITERATIONS = 10000;
+
+uint32_t samples[ITERATIONS];
+
+/**
+ * producer と consumer を別の std::thread で動かし、COUNT 個を 32 個ずつ
+ * 受け渡す速さを測ります。進めないときは相手に譲ります。
+ */
+void bench_spsc(const char *name) {
+  constexpr uint32_t COUNT = 1000000;
+  RingBuffer<uint32_t, 256, 64> ring;
+  uint32_t start = osKernelGetSysTimerCount();
+  std::thread producer([&ring] {
+    std::array<uint32_t, 32> data{};
+    uint32_t sent = 0;
+    while (sent < COUNT) {
+      size_t size = ring.push_n(std::span{data}.first(
+          std::min<size_t>(data.size(), COUNT - sent)));
+      if (size == 0) {
+        std::this_thread::yield();
+      }
+      sent += size;
+    }
+  });
+  std::array<uint32_t, 32> data;
+  uint32_t received = 0;
+  while (received < COUNT) {
+    size_t size = ring.pop_n(data);
+    if (size == 0) {
+      std::this_thread::yield();
+    }
+    received += size;
+  }
+  producer.join();
+  uint64_t elapsed = osKernelGetSysTimerCount() - start;
+  uint64_t freq = osKernelGetSysTimerFreq();
+  std::printf("{\"name\":\"%s\",\"items\":%" PRIu32
+              ",\"items_per_sec\":%" PRIu64 "}\r\n",
+              name, COUNT, elapsed != 0 ? COUNT * freq / elapsed : 0);
+}
+
+} // namespace
+
+void bench_ring_buffer() {
+  RingBuffer<uint32_t, 64> ring;
+  run_benchmark("ring_buffer_push_pop", samples, [&] {
+    uint32_t value;
+    ring.push(1);
+    ring.pop(value);
+  }).print_json();
+
+  std::array<uint32_t, 32> data{};
+  run_benchmark("ring_buffer_push_n_pop_n_32", samples, [&] {
+    ring.push_n(data);
+    ring.pop_n(data);
+  }).print_json();
+
+  run_benchmark("ring_buffer_write_span_commit_32", samples, [&] {
+    auto span = ring.write_span();
+    ring.commit(std::min(span.size(), data.size()));
+    ring.consume(ring.size());
+  }).print_json();
+
+  bench_spsc("ring_buffer_spsc_threads_32");
+}
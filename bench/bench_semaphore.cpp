@@ -0,0 +1,45 @@
+#include <cstdint>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/core/benchmark.hpp>
+
+#include "bench.hpp"
+
+using namespace stm32rcos::core;
+
+namespace {
+
+constexpr size_t ITERATIONS = 10000;
+
+uint32_t samples[ITERATIONS];
+
+struct PingPong {
+  Semaphore ping{1, 0};
+  Semaphore pong{1, 0};
+};
+
+void echo(void *args) {
+  auto ping_pong = static_cast<PingPong *>(args);
+  while (true) {
+    ping_pong->ping.acquire();
+    ping_pong->pong.release();
+  }
+}
+
+} // namespace
+
+void bench_semaphore() {
+  Semaphore semaphore(1, 0);
+  run_benchmark("semaphore_release_acquire", samples, [&] {
+    semaphore.release();
+    semaphore.acquire(0);
+  }).print_json();
+
+  // 別スレッドを起こして、起こし返されるまでの往復
+  PingPong ping_pong;
+  Thread thread(echo, &ping_pong, 1024, osPriorityNormal);
+  run_benchmark("semaphore_ping_pong", samples, [&] {
+    ping_pong.ping.release();
+    ping_pong.pong.acquire();
+  }).print_json();
+}
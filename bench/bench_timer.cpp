@@ -0,0 +1,46 @@
+#include <cstdint>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/core/benchmark.hpp>
+
+#include "bench.hpp"
+
+using namespace stm32rcos::core;
+
+namespace {
+
+constexpr size_t CALLBACKS = 500;
+constexpr uint32_t PERIOD = 1;
+
+// タイマーのコールバックが呼ばれた間隔を記録する
+struct Recorder {
+  uint32_t samples[CALLBACKS];
+  uint32_t last = 0;
+  size_t count = 0;
+  Semaphore done{1, 0};
+};
+
+void record(void *args) {
+  auto recorder = static_cast<Recorder *>(args);
+  uint32_t now = osKernelGetSysTimerCount();
+  if (recorder->last != 0 && recorder->count < CALLBACKS) {
+    recorder->samples[recorder->count++] = now - recorder->last;
+    if (recorder->count == CALLBACKS) {
+      recorder->done.release();
+    }
+  }
+  recorder->last = now;
+}
+
+Recorder recorder;
+
+} // namespace
+
+// 周期 1ms のタイマーのコールバック間隔。p50 と p99 の差がジッタになる
+void bench_timer() {
+  Timer timer(record, &recorder, osTimerPeriodic);
+  timer.start(PERIOD);
+  recorder.done.acquire();
+  timer.stop();
+  summarize_benchmark("timer_period_1ms", recorder.samples).print_json();
+}
@@ -0,0 +1,165 @@
+#include <array>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/core/benchmark.hpp>
+#include <stm32rcos/hal.hpp>
+#include <stm32rcos/peripheral.hpp>
+#include <stm32cubemx_helper/context.hpp>
+#include <stm32rcos_host.hpp>
+
+#include "bench.hpp"
+
+using namespace stm32rcos::core;
+using namespace stm32rcos::peripheral;
+
+UART_HandleTypeDef huart1;
+UART_HandleTypeDef huart2;
+
+namespace {
+
+constexpr uint32_t BAUD_RATE = 1000000;
+constexpr size_t SIZE = 64;
+constexpr size_t ITERATIONS = 200;
+
+/**
+ * huart1 を TxType/RxType で動かし、DMA で動く huart2 と 64 バイトずつ
+ * やり取りします。送信は transmit() が戻るまで、受信は相手が送り始めてから
+ * receive() が揃うまでの時間です。どちらも通信路の時間 (640us) を含みます。
+ */
+template <UartType TxType, UartType RxType>
+void bench_mode(const char *tx_name, const char *rx_name) {
+  Uart<&huart1, TxType, RxType> uart(256, 256);
+  Uart<&huart2, UartType::DMA, UartType::DMA> peer(1024, 1024);
+  std::array<uint8_t, SIZE> data{};
+  std::array<uint8_t, SIZE> received;
+
+  run_benchmark(tx_name, ITERATIONS, [&] {
+    uart.transmit(data.data(), data.size(), 1000);
+  }).print_json();
+
+  run_benchmark(rx_name, ITERATIONS, [&] {
+    peer.transmit_async(data.data(), data.size(), 1000);
+    uart.receive(received.data(), received.size(), 1000);
+  }).print_json();
+}
+
+/**
+ * 以前の IT 受信の実装です。1バイトごとに受信割り込みを起こして
+ * Queue<uint8_t> に入れ、receive() も1バイトずつ取り出します。
+ * RingBuffer を使う今の実装との比較のためだけに残しています。
+ */
+template <UART_HandleTypeDef *Handle> class QueueUartRx {
+public:
+  QueueUartRx(size_t buf_size) : queue_{buf_size} {
+    stm32cubemx_helper::set_context<Handle, QueueUartRx>(this);
+    HAL_UART_RegisterCallback(
+        Handle, HAL_UART_RX_COMPLETE_CB_ID, [](UART_HandleTypeDef *) {
+          auto uart = stm32cubemx_helper::get_context<Handle, QueueUartRx>();
+          uart->queue_.push(uart->byte_, 0);
+          HAL_UART_Receive_IT(Handle, &uart->byte_, 1);
+        });
+    HAL_UART_Receive_IT(Handle, &byte_, 1);
+  }
+
+  ~QueueUartRx() {
+    HAL_UART_AbortReceive(Handle);
+    HAL_UART_UnRegisterCallback(Handle, HAL_UART_RX_COMPLETE_CB_ID);
+    stm32cubemx_helper::set_context<Handle, QueueUartRx>(nullptr);
+  }
+
+  bool receive(uint8_t *data, size_t size, uint32_t timeout) {
+    for (size_t i = 0; i < size; ++i) {
+      if (!queue_.pop(data[i], timeout)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  Queue<uint8_t> queue_;
+  uint8_t byte_;
+};
+
+uint64_t cpu_time_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * huart2 から 32KiB を連続で流し、rx が 64 バイトずつ受け取ります。
+ * 受け取れたバイト数、実時間あたりのバイト数と、プロセス全体の
+ * CPU 時間を1バイトあたりに割った値を出します。
+ * CPU 時間には擬似ハードウェアのスレッドの分も同じだけ含まれます。
+ */
+template <class Rx> void bench_rx_throughput(const char *name, Rx &rx) {
+  constexpr size_t TOTAL = 32768;
+  Uart<&huart2, UartType::DMA, UartType::DMA> peer(64, TOTAL);
+  std::vector<uint8_t> data(TOTAL);
+  std::array<uint8_t, SIZE> received;
+
+  uint32_t start = osKernelGetSysTimerCount();
+  uint64_t cpu_start = cpu_time_ns();
+  peer.transmit_async(data.data(), data.size(), 1000);
+  size_t total = 0;
+  while (total < TOTAL && rx.receive(received.data(), SIZE, 100)) {
+    total += SIZE;
+  }
+  uint64_t elapsed = osKernelGetSysTimerCount() - start;
+  uint64_t cpu = cpu_time_ns() - cpu_start;
+  uint64_t freq = osKernelGetSysTimerFreq();
+  std::printf("{\"name\":\"%s\",\"bytes\":%u,\"bytes_per_sec\":%" PRIu64
+              ",\"cpu_ns_per_byte\":%" PRIu64 "}\r\n",
+              name, static_cast<unsigned>(total),
+              elapsed != 0 ? total * freq / elapsed : 0,
+              total != 0 ? cpu / total : 0);
+}
+
+} // namespace
+
+void bench_uart() {
+  for (UART_HandleTypeDef *huart : {&huart1, &huart2}) {
+    huart->Init.BaudRate = BAUD_RATE;
+    HAL_UART_Init(huart);
+  }
+  stm32rcos_host::uart_connect(&huart1, &huart2);
+
+  bench_mode<UartType::POLL, UartType::POLL>("uart_tx_poll_64B",
+                                             "uart_rx_poll_64B");
+  bench_mode<UartType::IT, UartType::IT>("uart_tx_it_64B", "uart_rx_it_64B");
+  bench_mode<UartType::DMA, UartType::DMA>("uart_tx_dma_64B",
+                                           "uart_rx_dma_64B");
+
+  // transmit_async() は送信バッファにコピーした時点で戻る
+  Uart<&huart1, UartType::DMA, UartType::DMA> uart(256, 4096);
+  std::array<uint8_t, SIZE> data{};
+  run_benchmark("uart_tx_dma_async_64B", 32, [&] {
+    uart.transmit_async(data.data(), data.size(), 1000);
+  }).print_json();
+}
+
+// 10Mbaud で流し続け、IT 受信の処理にかかる CPU 時間を比べる。
+// PC のスケジューリングの揺れで取りこぼさないよう、受信バッファは大きめにする
+void bench_uart_rx() {
+  constexpr size_t RX_BUF_SIZE = 8192;
+  for (UART_HandleTypeDef *huart : {&huart1, &huart2}) {
+    huart->Init.BaudRate = 10000000;
+    HAL_UART_Init(huart);
+  }
+  stm32rcos_host::uart_connect(&huart1, &huart2);
+  {
+    QueueUartRx<&huart1> rx(RX_BUF_SIZE);
+    bench_rx_throughput("uart_rx_it_queue_per_byte", rx);
+  }
+  {
+    Uart<&huart1, UartType::IT, UartType::IT> rx(RX_BUF_SIZE, 64);
+    bench_rx_throughput("uart_rx_it_ring_buffer", rx);
+  }
+}
@@ -0,0 +1,36 @@
+#include <cstring>
+
+#include "bench.hpp"
+
+namespace {
+
+struct Suite {
+  const char *name;
+  void (*func)();
+};
+
+constexpr Suite SUITES[] = {
+    {"mutex", bench_mutex},
+    {"queue", bench_queue},
+    {"ring_buffer", bench_ring_buffer},
+    {"semaphore", bench_semaphore},
+    {"timer", bench_timer},
+    {"uart", bench_uart},
+    {"uart_rx", bench_uart_rx},
+};
+
+} // namespace
+
+// 引数にスイート名を渡すと、そのスイートだけを実行する
+int main(int argc, char **argv) {
+  for (const Suite &suite : SUITES) {
+    bool selected = argc < 2;
+    for (int i = 1; i < argc; ++i) {
+      selected |= std::strcmp(argv[i], suite.name) == 0;
+    }
+    if (selected) {
+      suite.func();
+    }
+  }
+  return 0;
+}
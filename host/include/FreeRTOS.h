@@ -0,0 +1,47 @@
+#pragma once
+
+// ホスト (PC) 上でテストとベンチマークを動かすための FreeRTOS の代用品です。
+// stm32rcos が使う型、マクロ、関数だけを用意しています。
+
+#include <cstdint>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t StackType_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFFU)
+
+#define configTICK_RATE_HZ 1000
+#define configMAX_PRIORITIES 56
+#define configSUPPORT_STATIC_ALLOCATION 1
+#define configSUPPORT_DYNAMIC_ALLOCATION 1
+#define configUSE_TRACE_FACILITY 0
+#define configGENERATE_RUN_TIME_STATS 0
+
+// 制御ブロックの領域は受け取るだけで使わない
+typedef struct {
+  void *dummy[32];
+} StaticTask_t;
+typedef struct {
+  void *dummy[20];
+} StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+typedef struct {
+  void *dummy[12];
+} StaticTimer_t;
+
+// 割り込みの禁止は、プロセス全体で1つの再帰ミューテックスで表す
+// 擬似的な割り込みハンドラは、これを取った状態で呼ばれる
+void vPortEnterCritical(void);
+void vPortExitCritical(void);
+UBaseType_t ulPortRaiseBASEPRI(void);
+void vPortSetBASEPRI(UBaseType_t);
+
+#define taskENTER_CRITICAL() vPortEnterCritical()
+#define taskEXIT_CRITICAL() vPortExitCritical()
+#define taskENTER_CRITICAL_FROM_ISR() ulPortRaiseBASEPRI()
+#define taskEXIT_CRITICAL_FROM_ISR(x) vPortSetBASEPRI(x)
+#define portYIELD_FROM_ISR(x) (void)(x)
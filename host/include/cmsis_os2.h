@@ -0,0 +1,173 @@
+#pragma once
+
+// ホスト上で std::thread を使って動く CMSIS-RTOS2 の代用品です。
+// stm32rcos が使う API だけを実装しています。
+// 優先度は保持するだけで、プリエンプションは再現しません。
+
+#include <cstddef>
+#include <cstdint>
+
+#define osWaitForever 0xFFFFFFFFU
+
+#define osFlagsWaitAny 0x00000000U
+#define osFlagsWaitAll 0x00000001U
+#define osFlagsNoClear 0x00000002U
+
+#define osFlagsError 0x80000000U
+#define osFlagsErrorUnknown 0xFFFFFFFFU
+#define osFlagsErrorTimeout 0xFFFFFFFEU
+#define osFlagsErrorResource 0xFFFFFFFDU
+#define osFlagsErrorParameter 0xFFFFFFFCU
+#define osFlagsErrorISR 0xFFFFFFFAU
+
+#define osThreadDetached 0x00000000U
+#define osThreadJoinable 0x00000001U
+
+#define osMutexRecursive 0x00000001U
+#define osMutexPrioInherit 0x00000002U
+#define osMutexRobust 0x00000008U
+
+typedef enum {
+  osOK = 0,
+  osError = -1,
+  osErrorTimeout = -2,
+  osErrorResource = -3,
+  osErrorParameter = -4,
+  osErrorNoMemory = -5,
+  osErrorISR = -6,
+} osStatus_t;
+
+typedef enum {
+  osThreadInactive = 0,
+  osThreadReady = 1,
+  osThreadRunning = 2,
+  osThreadBlocked = 3,
+  osThreadTerminated = 4,
+  osThreadError = -1,
+} osThreadState_t;
+
+typedef enum {
+  osPriorityNone = 0,
+  osPriorityIdle = 1,
+  osPriorityLow = 8,
+  osPriorityBelowNormal = 16,
+  osPriorityNormal = 24,
+  osPriorityAboveNormal = 32,
+  osPriorityHigh = 40,
+  osPriorityRealtime = 48,
+  osPriorityISR = 56,
+  osPriorityError = -1,
+} osPriority_t;
+
+typedef enum {
+  osTimerOnce = 0,
+  osTimerPeriodic = 1,
+} osTimerType_t;
+
+typedef void (*osThreadFunc_t)(void *argument);
+typedef void (*osTimerFunc_t)(void *argument);
+
+typedef void *osThreadId_t;
+typedef void *osTimerId_t;
+typedef void *osMutexId_t;
+typedef void *osSemaphoreId_t;
+typedef void *osMessageQueueId_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+  void *stack_mem;
+  uint32_t stack_size;
+  osPriority_t priority;
+  uint32_t tz_module;
+  uint32_t reserved;
+} osThreadAttr_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+} osTimerAttr_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+} osMutexAttr_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+} osSemaphoreAttr_t;
+
+typedef struct {
+  const char *name;
+  uint32_t attr_bits;
+  void *cb_mem;
+  uint32_t cb_size;
+  void *mq_mem;
+  uint32_t mq_size;
+} osMessageQueueAttr_t;
+
+int32_t osKernelLock(void);
+int32_t osKernelUnlock(void);
+int32_t osKernelRestoreLock(int32_t lock);
+uint32_t osKernelGetTickCount(void);
+uint32_t osKernelGetTickFreq(void);
+uint32_t osKernelGetSysTimerCount(void);
+uint32_t osKernelGetSysTimerFreq(void);
+
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument,
+                         const osThreadAttr_t *attr);
+const char *osThreadGetName(osThreadId_t thread_id);
+osThreadId_t osThreadGetId(void);
+osPriority_t osThreadGetPriority(osThreadId_t thread_id);
+osStatus_t osThreadYield(void);
+osStatus_t osThreadDetach(osThreadId_t thread_id);
+osStatus_t osThreadJoin(osThreadId_t thread_id);
+osStatus_t osThreadTerminate(osThreadId_t thread_id);
+
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags);
+uint32_t osThreadFlagsClear(uint32_t flags);
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout);
+
+osStatus_t osDelay(uint32_t ticks);
+osStatus_t osDelayUntil(uint32_t ticks);
+
+osTimerId_t osTimerNew(osTimerFunc_t func, osTimerType_t type, void *argument,
+                       const osTimerAttr_t *attr);
+osStatus_t osTimerStart(osTimerId_t timer_id, uint32_t ticks);
+osStatus_t osTimerStop(osTimerId_t timer_id);
+uint32_t osTimerIsRunning(osTimerId_t timer_id);
+osStatus_t osTimerDelete(osTimerId_t timer_id);
+
+osMutexId_t osMutexNew(const osMutexAttr_t *attr);
+osStatus_t osMutexAcquire(osMutexId_t mutex_id, uint32_t timeout);
+osStatus_t osMutexRelease(osMutexId_t mutex_id);
+osStatus_t osMutexDelete(osMutexId_t mutex_id);
+
+osSemaphoreId_t osSemaphoreNew(uint32_t max_count, uint32_t initial_count,
+                               const osSemaphoreAttr_t *attr);
+osStatus_t osSemaphoreAcquire(osSemaphoreId_t semaphore_id, uint32_t timeout);
+osStatus_t osSemaphoreRelease(osSemaphoreId_t semaphore_id);
+uint32_t osSemaphoreGetCount(osSemaphoreId_t semaphore_id);
+osStatus_t osSemaphoreDelete(osSemaphoreId_t semaphore_id);
+
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size,
+                                     const osMessageQueueAttr_t *attr);
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr,
+                             uint8_t msg_prio, uint32_t timeout);
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr,
+                             uint8_t *msg_prio, uint32_t timeout);
+uint32_t osMessageQueueGetCapacity(osMessageQueueId_t mq_id);
+uint32_t osMessageQueueGetMsgSize(osMessageQueueId_t mq_id);
+uint32_t osMessageQueueGetCount(osMessageQueueId_t mq_id);
+uint32_t osMessageQueueGetSpace(osMessageQueueId_t mq_id);
+osStatus_t osMessageQueueReset(osMessageQueueId_t mq_id);
+osStatus_t osMessageQueueDelete(osMessageQueueId_t mq_id);
@@ -0,0 +1,19 @@
+#pragma once
+
+namespace stm32cubemx_helper {
+
+namespace detail {
+
+template <auto *Handle, class T> inline T *context = nullptr;
+
+} // namespace detail
+
+template <auto *Handle, class T> inline void set_context(T *context) {
+  detail::context<Handle, T> = context;
+}
+
+template <auto *Handle, class T> inline T *get_context() {
+  return detail::context<Handle, T>;
+}
+
+} // namespace stm32cubemx_helper
@@ -0,0 +1,175 @@
+#pragma once
+
+// ホスト上で動く HAL の代用品です。UART だけを用意しています。
+// 送受信は host/src/hal_uart.cpp の擬似ハードウェアがボーレートに従って進め、
+// コールバックは割り込みハンドラと同じく、割り込み禁止の状態で呼ばれます。
+
+#include <cstdint>
+
+#include <FreeRTOS.h>
+#include <cmsis_os2.h>
+
+#define HAL_UART_MODULE_ENABLED
+
+#define __IO volatile
+#define HAL_MAX_DELAY 0xFFFFFFFFU
+
+typedef enum {
+  HAL_OK = 0x00U,
+  HAL_ERROR = 0x01U,
+  HAL_BUSY = 0x02U,
+  HAL_TIMEOUT = 0x03U,
+} HAL_StatusTypeDef;
+
+typedef enum {
+  HAL_UNLOCKED = 0x00U,
+  HAL_LOCKED = 0x01U,
+} HAL_LockTypeDef;
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+
+// DMA
+
+#define DMA_NORMAL 0x00000000U
+#define DMA_CIRCULAR 0x00000020U
+
+typedef struct {
+  __IO uint32_t CNDTR;
+} DMA_Channel_TypeDef;
+
+typedef struct {
+  uint32_t Mode;
+} DMA_InitTypeDef;
+
+typedef struct __DMA_HandleTypeDef {
+  DMA_Channel_TypeDef *Instance;
+  DMA_InitTypeDef Init;
+} DMA_HandleTypeDef;
+
+#define __HAL_DMA_GET_COUNTER(__HANDLE__) ((__HANDLE__)->Instance->CNDTR)
+
+// UART
+
+#define HAL_UART_STATE_RESET 0x00000000U
+#define HAL_UART_STATE_READY 0x00000020U
+#define HAL_UART_STATE_BUSY 0x00000024U
+#define HAL_UART_STATE_BUSY_TX 0x00000021U
+#define HAL_UART_STATE_BUSY_RX 0x00000022U
+
+#define HAL_UART_ERROR_NONE 0x00000000U
+#define HAL_UART_ERROR_PE 0x00000001U
+#define HAL_UART_ERROR_NE 0x00000002U
+#define HAL_UART_ERROR_FE 0x00000004U
+#define HAL_UART_ERROR_ORE 0x00000008U
+#define HAL_UART_ERROR_DMA 0x00000010U
+
+#define HAL_UART_RECEPTION_STANDARD 0x00000000U
+#define HAL_UART_RECEPTION_TOIDLE 0x00000001U
+
+#define HAL_UART_RXEVENT_TC 0x00000000U
+#define HAL_UART_RXEVENT_HT 0x00000001U
+#define HAL_UART_RXEVENT_IDLE 0x00000002U
+
+typedef uint32_t HAL_UART_StateTypeDef;
+typedef uint32_t HAL_UART_RxTypeTypeDef;
+typedef uint32_t HAL_UART_RxEventTypeTypeDef;
+
+typedef struct {
+  uint32_t Dummy;
+} USART_TypeDef;
+
+typedef struct {
+  uint32_t BaudRate;
+  uint32_t WordLength;
+  uint32_t StopBits;
+  uint32_t Parity;
+  uint32_t Mode;
+  uint32_t HwFlowCtl;
+  uint32_t OverSampling;
+} UART_InitTypeDef;
+
+typedef struct __UART_HandleTypeDef {
+  USART_TypeDef *Instance;
+  UART_InitTypeDef Init;
+  const uint8_t *pTxBuffPtr;
+  uint16_t TxXferSize;
+  __IO uint16_t TxXferCount;
+  uint8_t *pRxBuffPtr;
+  uint16_t RxXferSize;
+  __IO uint16_t RxXferCount;
+  __IO HAL_UART_RxTypeTypeDef ReceptionType;
+  __IO HAL_UART_RxEventTypeTypeDef RxEventType;
+  DMA_HandleTypeDef *hdmatx;
+  DMA_HandleTypeDef *hdmarx;
+  HAL_LockTypeDef Lock;
+  __IO HAL_UART_StateTypeDef gState;
+  __IO HAL_UART_StateTypeDef RxState;
+  __IO uint32_t ErrorCode;
+  void (*TxHalfCpltCallback)(struct __UART_HandleTypeDef *huart);
+  void (*TxCpltCallback)(struct __UART_HandleTypeDef *huart);
+  void (*RxHalfCpltCallback)(struct __UART_HandleTypeDef *huart);
+  void (*RxCpltCallback)(struct __UART_HandleTypeDef *huart);
+  void (*ErrorCallback)(struct __UART_HandleTypeDef *huart);
+  void (*AbortCpltCallback)(struct __UART_HandleTypeDef *huart);
+  void (*AbortTransmitCpltCallback)(struct __UART_HandleTypeDef *huart);
+  void (*AbortReceiveCpltCallback)(struct __UART_HandleTypeDef *huart);
+  void (*RxEventCallback)(struct __UART_HandleTypeDef *huart, uint16_t Pos);
+} UART_HandleTypeDef;
+
+typedef enum {
+  HAL_UART_TX_HALFCOMPLETE_CB_ID = 0x00U,
+  HAL_UART_TX_COMPLETE_CB_ID = 0x01U,
+  HAL_UART_RX_HALFCOMPLETE_CB_ID = 0x02U,
+  HAL_UART_RX_COMPLETE_CB_ID = 0x03U,
+  HAL_UART_ERROR_CB_ID = 0x04U,
+  HAL_UART_ABORT_COMPLETE_CB_ID = 0x05U,
+  HAL_UART_ABORT_TRANSMIT_COMPLETE_CB_ID = 0x06U,
+  HAL_UART_ABORT_RECEIVE_COMPLETE_CB_ID = 0x07U,
+} HAL_UART_CallbackIDTypeDef;
+
+typedef void (*pUART_CallbackTypeDef)(UART_HandleTypeDef *huart);
+typedef void (*pUART_RxEventCallbackTypeDef)(UART_HandleTypeDef *huart,
+                                             uint16_t Pos);
+
+// Init.BaudRate を設定してから呼ぶ。DMA のハンドルがなければ用意する
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart);
+
+HAL_StatusTypeDef
+HAL_UART_RegisterCallback(UART_HandleTypeDef *huart,
+                          HAL_UART_CallbackIDTypeDef CallbackID,
+                          pUART_CallbackTypeDef pCallback);
+HAL_StatusTypeDef
+HAL_UART_UnRegisterCallback(UART_HandleTypeDef *huart,
+                            HAL_UART_CallbackIDTypeDef CallbackID);
+HAL_StatusTypeDef
+HAL_UART_RegisterRxEventCallback(UART_HandleTypeDef *huart,
+                                 pUART_RxEventCallbackTypeDef pCallback);
+HAL_StatusTypeDef HAL_UART_UnRegisterRxEventCallback(UART_HandleTypeDef *huart);
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart,
+                                    const uint8_t *pData, uint16_t Size,
+                                    uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData,
+                                   uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart,
+                                       const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart,
+                                      uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart,
+                                        const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_IT(UART_HandleTypeDef *huart,
+                                              uint8_t *pData, uint16_t Size);
+// 受信側の DMA は常に循環モードとして動く
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart,
+                                               uint8_t *pData, uint16_t Size);
+HAL_UART_RxEventTypeTypeDef
+HAL_UARTEx_GetRxEventType(const UART_HandleTypeDef *huart);
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_AbortTransmit_IT(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_AbortReceive_IT(UART_HandleTypeDef *huart);
+
+uint32_t HAL_UART_GetError(const UART_HandleTypeDef *huart);
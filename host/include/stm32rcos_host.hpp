@@ -0,0 +1,50 @@
+#pragma once
+
+// ホスト上の擬似ハードウェアを操作する、テストとベンチマーク用の関数です。
+
+#include <cstddef>
+#include <cstdint>
+
+#include <stm32cubemx_helper/device.hpp>
+
+namespace stm32rcos_host {
+
+// 擬似的な割り込みハンドラの中なら true
+bool in_isr();
+
+void isr_enter();
+void isr_exit();
+
+/**
+ * func を割り込みハンドラとして呼びます。
+ * 割り込みから使う API (osSemaphoreRelease() など) を試すのに使います。
+ */
+template <class F> void run_isr(F &&func) {
+  isr_enter();
+  func();
+  isr_exit();
+}
+
+/**
+ * a の Tx を b の Rx に、b の Tx を a の Rx につなぎます。
+ * a と b に同じハンドルを渡すとループバックになります。
+ * 1バイトは 8N1 の 10 ビットとして、送信側のボーレートで流れます。
+ */
+void uart_connect(UART_HandleTypeDef *a, UART_HandleTypeDef *b);
+
+/**
+ * 受信エラーを起こします。ORE は HAL と同じく受信を中断してから
+ * ErrorCallback を呼びます。
+ */
+void uart_inject_error(UART_HandleTypeDef *huart, uint32_t error);
+
+// 次の count 回の HAL_UART_Transmit*() を HAL_ERROR で失敗させます。
+void uart_fail_transmit(UART_HandleTypeDef *huart, size_t count);
+
+// 受信を始めていないときに届いて捨てたバイト数
+size_t uart_dropped(UART_HandleTypeDef *huart);
+
+// 最後に送信を終えた (TxCpltCallback を呼んだ) 時刻。osKernelGetSysTimerCount()
+uint32_t uart_tx_complete_time(UART_HandleTypeDef *huart);
+
+} // namespace stm32rcos_host
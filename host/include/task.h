@@ -0,0 +1,16 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+
+typedef struct {
+  BaseType_t xOverflowCount;
+  TickType_t xTimeOnEntering;
+} TimeOut_t;
+
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void vTaskSetTimeOutState(TimeOut_t *pxTimeOut);
+BaseType_t xTaskCheckForTimeOut(TimeOut_t *pxTimeOut,
+                                TickType_t *pxTicksToWait);
@@ -0,0 +1,585 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <FreeRTOS.h>
+#include <cmsis_os2.h>
+#include <stm32cubemx_helper/device.hpp>
+
+#include "stm32rcos_host.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+// 擬似ハードウェアを進める間隔
+constexpr auto HARDWARE_PERIOD = 20us;
+constexpr uint64_t BITS_PER_BYTE = 10;
+
+enum class Mode {
+  NONE,
+  POLL,
+  IT,
+  DMA,
+};
+
+struct Port {
+  UART_HandleTypeDef *handle;
+  Port *peer = nullptr;
+  DMA_Channel_TypeDef tx_channel{};
+  DMA_Channel_TypeDef rx_channel{};
+  DMA_HandleTypeDef tx_dma{};
+  DMA_HandleTypeDef rx_dma{};
+  Mode tx_mode = Mode::NONE;
+  Mode rx_mode = Mode::NONE;
+  // 送信中のバイトを送り終える時刻
+  Clock::time_point tx_next{};
+  // 最後のバイトを送り終えた時刻
+  Clock::time_point line_free{};
+  // 最後のバイトを受け取った時刻。1バイト分空くとアイドルラインになる
+  Clock::time_point rx_last{};
+  bool rx_idle_pending = false;
+  // 受信を始めていないときに届いた1バイト
+  std::optional<uint8_t> rdr{};
+  size_t dropped = 0;
+  uint32_t tx_complete_time = 0;
+  // この回数だけ、送信の開始を HAL_ERROR で失敗させる
+  size_t tx_failures = 0;
+};
+
+// 状態の変更は割り込み禁止の中で行う
+class Critical {
+public:
+  Critical() { vPortEnterCritical(); }
+  ~Critical() { vPortExitCritical(); }
+};
+
+// コールバックは割り込みハンドラとして呼ぶ
+class Isr {
+public:
+  Isr() { stm32rcos_host::isr_enter(); }
+  ~Isr() { stm32rcos_host::isr_exit(); }
+};
+
+std::vector<Port *> &ports() {
+  static auto &ports = *new std::vector<Port *>;
+  return ports;
+}
+
+Port *find(UART_HandleTypeDef *huart) {
+  for (Port *port : ports()) {
+    if (port->handle == huart) {
+      return port;
+    }
+  }
+  return nullptr;
+}
+
+Clock::duration byte_time(const Port &port) {
+  uint32_t baud_rate = std::max<uint32_t>(port.handle->Init.BaudRate, 1);
+  return std::chrono::nanoseconds(BITS_PER_BYTE * 1000000000 / baud_rate);
+}
+
+void finish_receive(Port &port, HAL_UART_RxEventTypeTypeDef event,
+                    uint16_t size) {
+  UART_HandleTypeDef *huart = port.handle;
+  Mode mode = port.rx_mode;
+  port.rx_mode = Mode::NONE;
+  huart->RxState = HAL_UART_STATE_READY;
+  if (mode == Mode::POLL) {
+    return;
+  }
+  huart->RxEventType = event;
+  if (huart->ReceptionType == HAL_UART_RECEPTION_TOIDLE) {
+    if (huart->RxEventCallback) {
+      huart->RxEventCallback(huart, size);
+    }
+  } else if (huart->RxCpltCallback) {
+    huart->RxCpltCallback(huart);
+  }
+}
+
+void receive(Port &port, uint8_t byte, Clock::time_point time) {
+  UART_HandleTypeDef *huart = port.handle;
+  port.rx_last = time;
+  port.rx_idle_pending = true;
+  switch (port.rx_mode) {
+  case Mode::NONE:
+    if (port.rdr) {
+      ++port.dropped;
+    } else {
+      port.rdr = byte;
+    }
+    break;
+  case Mode::POLL:
+  case Mode::IT:
+    huart->pRxBuffPtr[huart->RxXferSize - huart->RxXferCount] = byte;
+    huart->RxXferCount = huart->RxXferCount - 1;
+    if (huart->RxXferCount == 0) {
+      finish_receive(port, HAL_UART_RXEVENT_TC, huart->RxXferSize);
+    }
+    break;
+  case Mode::DMA: {
+    // 循環モードなので、最後まで書いたら先頭に戻って受信を続ける
+    uint16_t pos = huart->RxXferSize - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+    huart->pRxBuffPtr[pos++] = byte;
+    if (pos == huart->RxXferSize) {
+      huart->hdmarx->Instance->CNDTR = huart->RxXferSize;
+      huart->RxEventType = HAL_UART_RXEVENT_TC;
+      if (huart->RxEventCallback) {
+        huart->RxEventCallback(huart, huart->RxXferSize);
+      }
+      break;
+    }
+    huart->hdmarx->Instance->CNDTR = huart->RxXferSize - pos;
+    if (pos == huart->RxXferSize / 2) {
+      huart->RxEventType = HAL_UART_RXEVENT_HT;
+      if (huart->RxEventCallback) {
+        huart->RxEventCallback(huart, pos);
+      }
+    }
+    break;
+  }
+  }
+}
+
+void step_tx(Port &port, Clock::time_point now) {
+  UART_HandleTypeDef *huart = port.handle;
+  while (port.tx_mode != Mode::NONE && port.tx_next <= now) {
+    uint8_t byte = huart->pTxBuffPtr[huart->TxXferSize - huart->TxXferCount];
+    huart->TxXferCount = huart->TxXferCount - 1;
+    if (port.tx_mode == Mode::DMA) {
+      huart->hdmatx->Instance->CNDTR = huart->TxXferCount;
+    }
+    if (port.peer) {
+      receive(*port.peer, byte, port.tx_next);
+    }
+    port.line_free = port.tx_next;
+    port.tx_next += byte_time(port);
+    if (huart->TxXferCount == 0) {
+      Mode mode = port.tx_mode;
+      port.tx_mode = Mode::NONE;
+      huart->gState = HAL_UART_STATE_READY;
+      port.tx_complete_time = osKernelGetSysTimerCount();
+      if (mode != Mode::POLL && huart->TxCpltCallback) {
+        huart->TxCpltCallback(huart);
+      }
+    }
+  }
+}
+
+void step_idle(Port &port, Clock::time_point now) {
+  UART_HandleTypeDef *huart = port.handle;
+  if (!port.rx_idle_pending || now < port.rx_last + byte_time(port)) {
+    return;
+  }
+  // 相手が送信中なら次のバイトが続くので、ラインはアイドルではない
+  if (port.peer && port.peer->tx_mode != Mode::NONE) {
+    return;
+  }
+  port.rx_idle_pending = false;
+  if (huart->ReceptionType != HAL_UART_RECEPTION_TOIDLE) {
+    return;
+  }
+  if (port.rx_mode == Mode::IT && huart->RxXferCount != huart->RxXferSize) {
+    finish_receive(port, HAL_UART_RXEVENT_IDLE,
+                   huart->RxXferSize - huart->RxXferCount);
+  } else if (port.rx_mode == Mode::DMA) {
+    uint16_t pos = huart->RxXferSize - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+    if (pos != 0) {
+      huart->RxEventType = HAL_UART_RXEVENT_IDLE;
+      if (huart->RxEventCallback) {
+        huart->RxEventCallback(huart, pos);
+      }
+    }
+  }
+}
+
+void hardware() {
+  while (true) {
+    std::this_thread::sleep_for(HARDWARE_PERIOD);
+    Isr isr;
+    auto now = Clock::now();
+    for (size_t i = 0; i < ports().size(); ++i) {
+      step_tx(*ports()[i], now);
+    }
+    for (size_t i = 0; i < ports().size(); ++i) {
+      step_idle(*ports()[i], now);
+    }
+  }
+}
+
+HAL_StatusTypeDef start_transmit(UART_HandleTypeDef *huart,
+                                 const uint8_t *data, uint16_t size,
+                                 Mode mode) {
+  Critical critical;
+  Port *port = find(huart);
+  if (!port || !data || size == 0) {
+    return HAL_ERROR;
+  }
+  if (huart->gState != HAL_UART_STATE_READY) {
+    return HAL_BUSY;
+  }
+  if (port->tx_failures > 0) {
+    --port->tx_failures;
+    return HAL_ERROR;
+  }
+  huart->pTxBuffPtr = data;
+  huart->TxXferSize = size;
+  huart->TxXferCount = size;
+  huart->gState = HAL_UART_STATE_BUSY_TX;
+  if (mode == Mode::DMA) {
+    huart->hdmatx->Instance->CNDTR = size;
+  }
+  port->tx_mode = mode;
+  port->tx_next = std::max(Clock::now(), port->line_free) + byte_time(*port);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef start_receive(UART_HandleTypeDef *huart, uint8_t *data,
+                                uint16_t size, Mode mode,
+                                HAL_UART_RxTypeTypeDef type) {
+  Isr isr;
+  Port *port = find(huart);
+  if (!port || !data || size == 0) {
+    return HAL_ERROR;
+  }
+  if (huart->RxState != HAL_UART_STATE_READY) {
+    return HAL_BUSY;
+  }
+  huart->pRxBuffPtr = data;
+  huart->RxXferSize = size;
+  huart->RxXferCount = size;
+  huart->ReceptionType = type;
+  huart->RxEventType = HAL_UART_RXEVENT_TC;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->RxState = HAL_UART_STATE_BUSY_RX;
+  if (mode == Mode::DMA) {
+    huart->hdmarx->Instance->CNDTR = size;
+  }
+  port->rx_mode = mode;
+  // 受信を始める前に届いていた1バイトは、すぐに読み出される
+  if (port->rdr) {
+    uint8_t byte = *port->rdr;
+    port->rdr.reset();
+    receive(*port, byte, Clock::now());
+  }
+  return HAL_OK;
+}
+
+// ポーリングの API は、擬似ハードウェアが終えるまで待つ
+template <class F>
+HAL_StatusTypeDef poll(UART_HandleTypeDef *huart, uint32_t timeout,
+                       F &&done) {
+  uint32_t start = HAL_GetTick();
+  while (true) {
+    {
+      Critical critical;
+      if (done(*find(huart))) {
+        return HAL_OK;
+      }
+    }
+    if (timeout != HAL_MAX_DELAY && HAL_GetTick() - start >= timeout) {
+      return HAL_TIMEOUT;
+    }
+    std::this_thread::sleep_for(HARDWARE_PERIOD);
+  }
+}
+
+} // namespace
+
+uint32_t HAL_GetTick(void) { return osKernelGetTickCount(); }
+
+void HAL_Delay(uint32_t Delay) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(Delay));
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart) {
+  static std::once_flag hardware_started;
+  std::call_once(hardware_started, [] { std::thread{hardware}.detach(); });
+  Critical critical;
+  Port *port = find(huart);
+  if (!port) {
+    port = new Port{huart};
+    ports().push_back(port);
+  }
+  // CubeMX が HAL_UART_MspInit() で DMA をつなぐ代わり
+  if (!huart->hdmatx) {
+    port->tx_dma.Instance = &port->tx_channel;
+    port->tx_dma.Init.Mode = DMA_NORMAL;
+    huart->hdmatx = &port->tx_dma;
+  }
+  if (!huart->hdmarx) {
+    port->rx_dma.Instance = &port->rx_channel;
+    port->rx_dma.Init.Mode = DMA_CIRCULAR;
+    huart->hdmarx = &port->rx_dma;
+  }
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->gState = HAL_UART_STATE_READY;
+  huart->RxState = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart) {
+  Critical critical;
+  Port *port = find(huart);
+  if (!port) {
+    return HAL_ERROR;
+  }
+  port->tx_mode = Mode::NONE;
+  port->rx_mode = Mode::NONE;
+  huart->gState = HAL_UART_STATE_RESET;
+  huart->RxState = HAL_UART_STATE_RESET;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef
+HAL_UART_RegisterCallback(UART_HandleTypeDef *huart,
+                          HAL_UART_CallbackIDTypeDef CallbackID,
+                          pUART_CallbackTypeDef pCallback) {
+  if (!pCallback) {
+    return HAL_ERROR;
+  }
+  Critical critical;
+  switch (CallbackID) {
+  case HAL_UART_TX_HALFCOMPLETE_CB_ID:
+    huart->TxHalfCpltCallback = pCallback;
+    break;
+  case HAL_UART_TX_COMPLETE_CB_ID:
+    huart->TxCpltCallback = pCallback;
+    break;
+  case HAL_UART_RX_HALFCOMPLETE_CB_ID:
+    huart->RxHalfCpltCallback = pCallback;
+    break;
+  case HAL_UART_RX_COMPLETE_CB_ID:
+    huart->RxCpltCallback = pCallback;
+    break;
+  case HAL_UART_ERROR_CB_ID:
+    huart->ErrorCallback = pCallback;
+    break;
+  case HAL_UART_ABORT_COMPLETE_CB_ID:
+    huart->AbortCpltCallback = pCallback;
+    break;
+  case HAL_UART_ABORT_TRANSMIT_COMPLETE_CB_ID:
+    huart->AbortTransmitCpltCallback = pCallback;
+    break;
+  case HAL_UART_ABORT_RECEIVE_COMPLETE_CB_ID:
+    huart->AbortReceiveCpltCallback = pCallback;
+    break;
+  default:
+    return HAL_ERROR;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef
+HAL_UART_UnRegisterCallback(UART_HandleTypeDef *huart,
+                            HAL_UART_CallbackIDTypeDef CallbackID) {
+  Critical critical;
+  switch (CallbackID) {
+  case HAL_UART_TX_HALFCOMPLETE_CB_ID:
+    huart->TxHalfCpltCallback = nullptr;
+    break;
+  case HAL_UART_TX_COMPLETE_CB_ID:
+    huart->TxCpltCallback = nullptr;
+    break;
+  case HAL_UART_RX_HALFCOMPLETE_CB_ID:
+    huart->RxHalfCpltCallback = nullptr;
+    break;
+  case HAL_UART_RX_COMPLETE_CB_ID:
+    huart->RxCpltCallback = nullptr;
+    break;
+  case HAL_UART_ERROR_CB_ID:
+    huart->ErrorCallback = nullptr;
+    break;
+  case HAL_UART_ABORT_COMPLETE_CB_ID:
+    huart->AbortCpltCallback = nullptr;
+    break;
+  case HAL_UART_ABORT_TRANSMIT_COMPLETE_CB_ID:
+    huart->AbortTransmitCpltCallback = nullptr;
+    break;
+  case HAL_UART_ABORT_RECEIVE_COMPLETE_CB_ID:
+    huart->AbortReceiveCpltCallback = nullptr;
+    break;
+  default:
+    return HAL_ERROR;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef
+HAL_UART_RegisterRxEventCallback(UART_HandleTypeDef *huart,
+                                 pUART_RxEventCallbackTypeDef pCallback) {
+  if (!pCallback) {
+    return HAL_ERROR;
+  }
+  Critical critical;
+  huart->RxEventCallback = pCallback;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef
+HAL_UART_UnRegisterRxEventCallback(UART_HandleTypeDef *huart) {
+  Critical critical;
+  huart->RxEventCallback = nullptr;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart,
+                                    const uint8_t *pData, uint16_t Size,
+                                    uint32_t Timeout) {
+  HAL_StatusTypeDef status = start_transmit(huart, pData, Size, Mode::POLL);
+  if (status != HAL_OK) {
+    return status;
+  }
+  status = poll(huart, Timeout,
+                [](Port &port) { return port.tx_mode == Mode::NONE; });
+  if (status != HAL_OK) {
+    HAL_UART_AbortTransmit(huart);
+  }
+  return status;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData,
+                                   uint16_t Size, uint32_t Timeout) {
+  HAL_StatusTypeDef status = start_receive(huart, pData, Size, Mode::POLL,
+                                           HAL_UART_RECEPTION_STANDARD);
+  if (status != HAL_OK) {
+    return status;
+  }
+  status = poll(huart, Timeout,
+                [](Port &port) { return port.rx_mode == Mode::NONE; });
+  if (status != HAL_OK) {
+    HAL_UART_AbortReceive(huart);
+  }
+  return status;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart,
+                                       const uint8_t *pData, uint16_t Size) {
+  return start_transmit(huart, pData, Size, Mode::IT);
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart,
+                                      uint8_t *pData, uint16_t Size) {
+  return start_receive(huart, pData, Size, Mode::IT,
+                       HAL_UART_RECEPTION_STANDARD);
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart,
+                                        const uint8_t *pData, uint16_t Size) {
+  return start_transmit(huart, pData, Size, Mode::DMA);
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_IT(UART_HandleTypeDef *huart,
+                                              uint8_t *pData, uint16_t Size) {
+  return start_receive(huart, pData, Size, Mode::IT,
+                       HAL_UART_RECEPTION_TOIDLE);
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart,
+                                               uint8_t *pData, uint16_t Size) {
+  return start_receive(huart, pData, Size, Mode::DMA,
+                       HAL_UART_RECEPTION_TOIDLE);
+}
+
+HAL_UART_RxEventTypeTypeDef
+HAL_UARTEx_GetRxEventType(const UART_HandleTypeDef *huart) {
+  return huart->RxEventType;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart) {
+  Critical critical;
+  Port *port = find(huart);
+  if (!port) {
+    return HAL_ERROR;
+  }
+  port->tx_mode = Mode::NONE;
+  huart->TxXferCount = 0;
+  huart->gState = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart) {
+  Critical critical;
+  Port *port = find(huart);
+  if (!port) {
+    return HAL_ERROR;
+  }
+  port->rx_mode = Mode::NONE;
+  huart->RxXferCount = 0;
+  huart->RxState = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit_IT(UART_HandleTypeDef *huart) {
+  Isr isr;
+  HAL_StatusTypeDef status = HAL_UART_AbortTransmit(huart);
+  if (status == HAL_OK && huart->AbortTransmitCpltCallback) {
+    huart->AbortTransmitCpltCallback(huart);
+  }
+  return status;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive_IT(UART_HandleTypeDef *huart) {
+  Isr isr;
+  HAL_StatusTypeDef status = HAL_UART_AbortReceive(huart);
+  if (status == HAL_OK && huart->AbortReceiveCpltCallback) {
+    huart->AbortReceiveCpltCallback(huart);
+  }
+  return status;
+}
+
+uint32_t HAL_UART_GetError(const UART_HandleTypeDef *huart) {
+  return huart->ErrorCode;
+}
+
+void stm32rcos_host::uart_connect(UART_HandleTypeDef *a,
+                                  UART_HandleTypeDef *b) {
+  Critical critical;
+  Port *port_a = find(a);
+  Port *port_b = find(b);
+  port_a->peer = port_b;
+  port_b->peer = port_a;
+}
+
+void stm32rcos_host::uart_inject_error(UART_HandleTypeDef *huart,
+                                       uint32_t error) {
+  Isr isr;
+  Port *port = find(huart);
+  huart->ErrorCode = huart->ErrorCode | error;
+  // HAL と同じく、オーバーランと DMA のエラーでは受信を中断する
+  bool blocking = error & (HAL_UART_ERROR_ORE | HAL_UART_ERROR_DMA);
+  if (blocking && port->rx_mode != Mode::NONE) {
+    port->rx_mode = Mode::NONE;
+    huart->RxState = HAL_UART_STATE_READY;
+  }
+  if (huart->ErrorCallback) {
+    huart->ErrorCallback(huart);
+  }
+  if (!blocking) {
+    huart->ErrorCode = HAL_UART_ERROR_NONE;
+  }
+}
+
+size_t stm32rcos_host::uart_dropped(UART_HandleTypeDef *huart) {
+  Critical critical;
+  return find(huart)->dropped;
+}
+
+uint32_t stm32rcos_host::uart_tx_complete_time(UART_HandleTypeDef *huart) {
+  Critical critical;
+  return find(huart)->tx_complete_time;
+}
+
+void stm32rcos_host::uart_fail_transmit(UART_HandleTypeDef *huart,
+                                        size_t count) {
+  Critical critical;
+  find(huart)->tx_failures = count;
+}
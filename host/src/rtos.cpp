@@ -0,0 +1,736 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <FreeRTOS.h>
+#include <cmsis_os2.h>
+#include <task.h>
+
+#include "stm32rcos_host.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// 終了時にまだ動いているスレッドから触られても壊れないよう、解放しない
+
+Clock::time_point start_time() {
+  static const Clock::time_point time = Clock::now();
+  return time;
+}
+
+std::recursive_mutex &irq_mutex() {
+  static auto &mutex = *new std::recursive_mutex;
+  return mutex;
+}
+
+// カーネルオブジェクトの状態はすべてこの1つのミューテックスで守る
+std::mutex &kernel_mutex() {
+  static auto &mutex = *new std::mutex;
+  return mutex;
+}
+
+std::condition_variable &kernel_cv() {
+  static auto &cv = *new std::condition_variable;
+  return cv;
+}
+
+thread_local int isr_depth = 0;
+thread_local int kernel_lock = 0;
+
+// osThreadTerminate() で止められたスレッドを、待ちの箇所から抜けさせる
+struct ThreadExit {};
+
+struct HostThread {
+  const char *name;
+  osPriority_t priority;
+  bool finished = false;
+  bool terminate = false;
+  uint32_t flags = 0;
+};
+
+thread_local HostThread *current_thread = nullptr;
+
+// osThreadNew() 以外で作られたスレッド (main など) にも ID を割り当てる
+HostThread *self() {
+  if (!current_thread) {
+    current_thread = new HostThread{"main", osPriorityNormal};
+  }
+  return current_thread;
+}
+
+Clock::time_point deadline(uint32_t ticks) {
+  return Clock::now() + std::chrono::milliseconds(ticks);
+}
+
+/**
+ * pred が真になるまで最大 timeout ティック待ちます。
+ * kernel_mutex() を取った lock を渡してください。
+ */
+template <class Pred>
+bool wait(std::unique_lock<std::mutex> &lock, uint32_t timeout, Pred pred) {
+  if (pred()) {
+    return true;
+  }
+  if (timeout == 0) {
+    return false;
+  }
+  HostThread *thread = self();
+  auto until = deadline(timeout);
+  while (true) {
+    if (thread->terminate) {
+      throw ThreadExit{};
+    }
+    if (timeout == osWaitForever) {
+      kernel_cv().wait(lock);
+    } else if (kernel_cv().wait_until(lock, until) ==
+               std::cv_status::timeout) {
+      return pred();
+    }
+    if (pred()) {
+      return true;
+    }
+  }
+}
+
+osStatus_t wait_status(bool ok, uint32_t timeout) {
+  if (ok) {
+    return osOK;
+  }
+  return timeout == 0 ? osErrorResource : osErrorTimeout;
+}
+
+struct Semaphore {
+  uint32_t max;
+  uint32_t count;
+};
+
+struct Mutex {
+  bool recursive;
+  HostThread *owner = nullptr;
+  uint32_t depth = 0;
+};
+
+struct MessageQueue {
+  uint32_t capacity;
+  uint32_t msg_size;
+  std::vector<uint8_t> buf;
+  uint32_t head = 0;
+  uint32_t count = 0;
+};
+
+struct Timer {
+  osTimerFunc_t func;
+  void *argument;
+  osTimerType_t type;
+  uint32_t period = 0;
+  bool running = false;
+  Clock::time_point expiry{};
+};
+
+// タイマーのコールバックはデーモンスレッドから呼ぶ (FreeRTOS と同じ)
+// コールバック中に osTimerDelete() されないよう、呼ぶ間 callback_mutex を持つ
+struct TimerService {
+  std::list<Timer *> timers;
+  std::mutex callback_mutex;
+  std::thread::id daemon_id;
+};
+
+TimerService &timer_service();
+
+Timer *next_expired(TimerService &service, Clock::time_point now) {
+  for (Timer *timer : service.timers) {
+    if (timer->running && timer->expiry <= now) {
+      return timer;
+    }
+  }
+  return nullptr;
+}
+
+void timer_daemon(TimerService *service) {
+  current_thread = new HostThread{"Tmr Svc", osPriorityRealtime};
+  while (true) {
+    {
+      std::unique_lock lock{kernel_mutex()};
+      while (!next_expired(*service, Clock::now())) {
+        auto until = Clock::time_point::max();
+        for (Timer *timer : service->timers) {
+          if (timer->running) {
+            until = std::min(until, timer->expiry);
+          }
+        }
+        if (until == Clock::time_point::max()) {
+          kernel_cv().wait(lock);
+        } else {
+          kernel_cv().wait_until(lock, until);
+        }
+      }
+    }
+    std::lock_guard callback_lock{service->callback_mutex};
+    osTimerFunc_t func;
+    void *argument;
+    {
+      std::lock_guard lock{kernel_mutex()};
+      Timer *timer = next_expired(*service, Clock::now());
+      if (!timer) {
+        continue;
+      }
+      if (timer->type == osTimerPeriodic) {
+        timer->expiry += std::chrono::milliseconds(timer->period);
+      } else {
+        timer->running = false;
+      }
+      func = timer->func;
+      argument = timer->argument;
+    }
+    func(argument);
+  }
+}
+
+TimerService &timer_service() {
+  static auto &service = []() -> TimerService & {
+    auto service = new TimerService;
+    std::thread daemon{timer_daemon, service};
+    service->daemon_id = daemon.get_id();
+    daemon.detach();
+    return *service;
+  }();
+  return service;
+}
+
+} // namespace
+
+// 割り込み禁止
+
+void vPortEnterCritical(void) { irq_mutex().lock(); }
+
+void vPortExitCritical(void) { irq_mutex().unlock(); }
+
+UBaseType_t ulPortRaiseBASEPRI(void) {
+  irq_mutex().lock();
+  return 0;
+}
+
+void vPortSetBASEPRI(UBaseType_t) { irq_mutex().unlock(); }
+
+bool stm32rcos_host::in_isr() { return isr_depth != 0; }
+
+void stm32rcos_host::isr_enter() {
+  irq_mutex().lock();
+  ++isr_depth;
+}
+
+void stm32rcos_host::isr_exit() {
+  --isr_depth;
+  irq_mutex().unlock();
+}
+
+// カーネル
+
+// スケジューラの停止は再現せず、状態だけを返す
+int32_t osKernelLock(void) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  return std::exchange(kernel_lock, 1);
+}
+
+int32_t osKernelUnlock(void) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  return std::exchange(kernel_lock, 0);
+}
+
+int32_t osKernelRestoreLock(int32_t lock) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  kernel_lock = lock;
+  return lock;
+}
+
+uint32_t osKernelGetTickCount(void) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() -
+                                                               start_time())
+      .count();
+}
+
+uint32_t osKernelGetTickFreq(void) { return configTICK_RATE_HZ; }
+
+uint32_t osKernelGetSysTimerCount(void) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                              start_time())
+      .count();
+}
+
+uint32_t osKernelGetSysTimerFreq(void) { return 1000000000; }
+
+TickType_t xTaskGetTickCount(void) { return osKernelGetTickCount(); }
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return self(); }
+
+void vTaskSetTimeOutState(TimeOut_t *pxTimeOut) {
+  pxTimeOut->xOverflowCount = 0;
+  pxTimeOut->xTimeOnEntering = xTaskGetTickCount();
+}
+
+BaseType_t xTaskCheckForTimeOut(TimeOut_t *pxTimeOut,
+                                TickType_t *pxTicksToWait) {
+  if (*pxTicksToWait == portMAX_DELAY) {
+    return pdFALSE;
+  }
+  TickType_t elapsed = xTaskGetTickCount() - pxTimeOut->xTimeOnEntering;
+  if (elapsed < *pxTicksToWait) {
+    *pxTicksToWait -= elapsed;
+    vTaskSetTimeOutState(pxTimeOut);
+    return pdFALSE;
+  }
+  *pxTicksToWait = 0;
+  return pdTRUE;
+}
+
+// スレッド
+
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument,
+                         const osThreadAttr_t *attr) {
+  if (stm32rcos_host::in_isr() || !func) {
+    return nullptr;
+  }
+  auto thread = new HostThread{
+      attr && attr->name ? attr->name : "",
+      attr && attr->priority != osPriorityNone ? attr->priority
+                                               : osPriorityNormal};
+  std::thread{[thread, func, argument] {
+    current_thread = thread;
+    try {
+      func(argument);
+    } catch (ThreadExit &) {
+    }
+    std::lock_guard lock{kernel_mutex()};
+    thread->finished = true;
+    kernel_cv().notify_all();
+  }}.detach();
+  return thread;
+}
+
+const char *osThreadGetName(osThreadId_t thread_id) {
+  return static_cast<HostThread *>(thread_id)->name;
+}
+
+osThreadId_t osThreadGetId(void) { return self(); }
+
+osPriority_t osThreadGetPriority(osThreadId_t thread_id) {
+  return static_cast<HostThread *>(thread_id)->priority;
+}
+
+osStatus_t osThreadYield(void) {
+  std::this_thread::yield();
+  return osOK;
+}
+
+osStatus_t osThreadDetach(osThreadId_t thread_id) {
+  return thread_id ? osOK : osErrorParameter;
+}
+
+osStatus_t osThreadJoin(osThreadId_t thread_id) {
+  if (!thread_id || thread_id == self()) {
+    return osErrorParameter;
+  }
+  auto thread = static_cast<HostThread *>(thread_id);
+  std::unique_lock lock{kernel_mutex()};
+  wait(lock, osWaitForever, [thread] { return thread->finished; });
+  return osOK;
+}
+
+// 他のスレッドは、次に待ちに入った時点で止まるまで待ってから解放する
+osStatus_t osThreadTerminate(osThreadId_t thread_id) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!thread_id) {
+    return osErrorParameter;
+  }
+  auto thread = static_cast<HostThread *>(thread_id);
+  if (thread == self()) {
+    throw ThreadExit{};
+  }
+  {
+    std::unique_lock lock{kernel_mutex()};
+    thread->terminate = true;
+    kernel_cv().notify_all();
+    kernel_cv().wait(lock, [thread] { return thread->finished; });
+  }
+  delete thread;
+  return osOK;
+}
+
+osStatus_t osDelay(uint32_t ticks) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (ticks == 0) {
+    return osThreadYield();
+  }
+  std::unique_lock lock{kernel_mutex()};
+  wait(lock, ticks, [] { return false; });
+  return osOK;
+}
+
+osStatus_t osDelayUntil(uint32_t ticks) {
+  uint32_t delay = ticks - osKernelGetTickCount();
+  if (delay == 0 || delay > 0x7FFFFFFF) {
+    return osErrorParameter;
+  }
+  return osDelay(delay);
+}
+
+// スレッドフラグ
+
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags) {
+  if (!thread_id || (flags & osFlagsError)) {
+    return osFlagsErrorParameter;
+  }
+  auto thread = static_cast<HostThread *>(thread_id);
+  std::lock_guard lock{kernel_mutex()};
+  thread->flags |= flags;
+  kernel_cv().notify_all();
+  return thread->flags;
+}
+
+uint32_t osThreadFlagsClear(uint32_t flags) {
+  if (stm32rcos_host::in_isr()) {
+    return osFlagsErrorISR;
+  }
+  if (flags & osFlagsError) {
+    return osFlagsErrorParameter;
+  }
+  HostThread *thread = self();
+  std::lock_guard lock{kernel_mutex()};
+  uint32_t previous = thread->flags;
+  thread->flags &= ~flags;
+  return previous;
+}
+
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options,
+                           uint32_t timeout) {
+  if (stm32rcos_host::in_isr()) {
+    return osFlagsErrorISR;
+  }
+  if (flags & osFlagsError) {
+    return osFlagsErrorParameter;
+  }
+  HostThread *thread = self();
+  std::unique_lock lock{kernel_mutex()};
+  bool ok = wait(lock, timeout, [thread, flags, options] {
+    uint32_t set = thread->flags & flags;
+    return (options & osFlagsWaitAll) ? set == flags : set != 0;
+  });
+  if (!ok) {
+    return timeout == 0 ? osFlagsErrorResource : osFlagsErrorTimeout;
+  }
+  uint32_t result = thread->flags;
+  if (!(options & osFlagsNoClear)) {
+    thread->flags &= ~flags;
+  }
+  return result;
+}
+
+// タイマー
+
+osTimerId_t osTimerNew(osTimerFunc_t func, osTimerType_t type, void *argument,
+                       const osTimerAttr_t *) {
+  if (stm32rcos_host::in_isr() || !func) {
+    return nullptr;
+  }
+  TimerService &service = timer_service();
+  auto timer = new Timer{func, argument, type};
+  std::lock_guard lock{kernel_mutex()};
+  service.timers.push_back(timer);
+  return timer;
+}
+
+osStatus_t osTimerStart(osTimerId_t timer_id, uint32_t ticks) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!timer_id || ticks == 0) {
+    return osErrorParameter;
+  }
+  auto timer = static_cast<Timer *>(timer_id);
+  std::lock_guard lock{kernel_mutex()};
+  timer->period = ticks;
+  timer->expiry = deadline(ticks);
+  timer->running = true;
+  kernel_cv().notify_all();
+  return osOK;
+}
+
+osStatus_t osTimerStop(osTimerId_t timer_id) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!timer_id) {
+    return osErrorParameter;
+  }
+  auto timer = static_cast<Timer *>(timer_id);
+  std::lock_guard lock{kernel_mutex()};
+  if (!timer->running) {
+    return osErrorResource;
+  }
+  timer->running = false;
+  return osOK;
+}
+
+uint32_t osTimerIsRunning(osTimerId_t timer_id) {
+  if (!timer_id) {
+    return 0;
+  }
+  std::lock_guard lock{kernel_mutex()};
+  return static_cast<Timer *>(timer_id)->running;
+}
+
+osStatus_t osTimerDelete(osTimerId_t timer_id) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!timer_id) {
+    return osErrorParameter;
+  }
+  auto timer = static_cast<Timer *>(timer_id);
+  TimerService &service = timer_service();
+  std::unique_lock<std::mutex> callback_lock;
+  if (std::this_thread::get_id() != service.daemon_id) {
+    callback_lock = std::unique_lock{service.callback_mutex};
+  }
+  std::lock_guard lock{kernel_mutex()};
+  service.timers.remove(timer);
+  delete timer;
+  return osOK;
+}
+
+// ミューテックス
+
+osMutexId_t osMutexNew(const osMutexAttr_t *attr) {
+  if (stm32rcos_host::in_isr()) {
+    return nullptr;
+  }
+  return new Mutex{attr && (attr->attr_bits & osMutexRecursive)};
+}
+
+osStatus_t osMutexAcquire(osMutexId_t mutex_id, uint32_t timeout) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!mutex_id) {
+    return osErrorParameter;
+  }
+  auto mutex = static_cast<Mutex *>(mutex_id);
+  HostThread *thread = self();
+  std::unique_lock lock{kernel_mutex()};
+  if (mutex->owner == thread && mutex->recursive) {
+    ++mutex->depth;
+    return osOK;
+  }
+  bool ok = wait(lock, timeout, [mutex] { return !mutex->owner; });
+  if (ok) {
+    mutex->owner = thread;
+    mutex->depth = 1;
+  }
+  return wait_status(ok, timeout);
+}
+
+osStatus_t osMutexRelease(osMutexId_t mutex_id) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!mutex_id) {
+    return osErrorParameter;
+  }
+  auto mutex = static_cast<Mutex *>(mutex_id);
+  std::lock_guard lock{kernel_mutex()};
+  if (mutex->owner != self()) {
+    return osErrorResource;
+  }
+  if (--mutex->depth == 0) {
+    mutex->owner = nullptr;
+    kernel_cv().notify_all();
+  }
+  return osOK;
+}
+
+osStatus_t osMutexDelete(osMutexId_t mutex_id) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!mutex_id) {
+    return osErrorParameter;
+  }
+  delete static_cast<Mutex *>(mutex_id);
+  return osOK;
+}
+
+// セマフォ
+
+osSemaphoreId_t osSemaphoreNew(uint32_t max_count, uint32_t initial_count,
+                               const osSemaphoreAttr_t *) {
+  if (stm32rcos_host::in_isr() || max_count == 0 ||
+      initial_count > max_count) {
+    return nullptr;
+  }
+  return new Semaphore{max_count, initial_count};
+}
+
+osStatus_t osSemaphoreAcquire(osSemaphoreId_t semaphore_id, uint32_t timeout) {
+  if (!semaphore_id ||
+      (stm32rcos_host::in_isr() && timeout != 0)) {
+    return osErrorParameter;
+  }
+  auto semaphore = static_cast<Semaphore *>(semaphore_id);
+  std::unique_lock lock{kernel_mutex()};
+  bool ok = wait(lock, timeout, [semaphore] { return semaphore->count != 0; });
+  if (ok) {
+    --semaphore->count;
+  }
+  return wait_status(ok, timeout);
+}
+
+osStatus_t osSemaphoreRelease(osSemaphoreId_t semaphore_id) {
+  if (!semaphore_id) {
+    return osErrorParameter;
+  }
+  auto semaphore = static_cast<Semaphore *>(semaphore_id);
+  std::lock_guard lock{kernel_mutex()};
+  if (semaphore->count == semaphore->max) {
+    return osErrorResource;
+  }
+  ++semaphore->count;
+  kernel_cv().notify_all();
+  return osOK;
+}
+
+uint32_t osSemaphoreGetCount(osSemaphoreId_t semaphore_id) {
+  if (!semaphore_id) {
+    return 0;
+  }
+  std::lock_guard lock{kernel_mutex()};
+  return static_cast<Semaphore *>(semaphore_id)->count;
+}
+
+osStatus_t osSemaphoreDelete(osSemaphoreId_t semaphore_id) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!semaphore_id) {
+    return osErrorParameter;
+  }
+  delete static_cast<Semaphore *>(semaphore_id);
+  return osOK;
+}
+
+// メッセージキュー
+
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size,
+                                     const osMessageQueueAttr_t *) {
+  if (stm32rcos_host::in_isr() || msg_count == 0 || msg_size == 0) {
+    return nullptr;
+  }
+  return new MessageQueue{msg_count, msg_size,
+                          std::vector<uint8_t>(msg_count * msg_size)};
+}
+
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr,
+                             uint8_t, uint32_t timeout) {
+  if (!mq_id || !msg_ptr || (stm32rcos_host::in_isr() && timeout != 0)) {
+    return osErrorParameter;
+  }
+  auto queue = static_cast<MessageQueue *>(mq_id);
+  std::unique_lock lock{kernel_mutex()};
+  bool ok = wait(lock, timeout,
+                 [queue] { return queue->count != queue->capacity; });
+  if (ok) {
+    uint32_t idx = (queue->head + queue->count) % queue->capacity;
+    std::memcpy(&queue->buf[idx * queue->msg_size], msg_ptr, queue->msg_size);
+    ++queue->count;
+    kernel_cv().notify_all();
+  }
+  return wait_status(ok, timeout);
+}
+
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr,
+                             uint8_t *msg_prio, uint32_t timeout) {
+  if (!mq_id || !msg_ptr || (stm32rcos_host::in_isr() && timeout != 0)) {
+    return osErrorParameter;
+  }
+  auto queue = static_cast<MessageQueue *>(mq_id);
+  std::unique_lock lock{kernel_mutex()};
+  bool ok = wait(lock, timeout, [queue] { return queue->count != 0; });
+  if (ok) {
+    std::memcpy(msg_ptr, &queue->buf[queue->head * queue->msg_size],
+                queue->msg_size);
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+    kernel_cv().notify_all();
+    if (msg_prio) {
+      *msg_prio = 0;
+    }
+  }
+  return wait_status(ok, timeout);
+}
+
+uint32_t osMessageQueueGetCapacity(osMessageQueueId_t mq_id) {
+  return mq_id ? static_cast<MessageQueue *>(mq_id)->capacity : 0;
+}
+
+uint32_t osMessageQueueGetMsgSize(osMessageQueueId_t mq_id) {
+  return mq_id ? static_cast<MessageQueue *>(mq_id)->msg_size : 0;
+}
+
+uint32_t osMessageQueueGetCount(osMessageQueueId_t mq_id) {
+  if (!mq_id) {
+    return 0;
+  }
+  std::lock_guard lock{kernel_mutex()};
+  return static_cast<MessageQueue *>(mq_id)->count;
+}
+
+uint32_t osMessageQueueGetSpace(osMessageQueueId_t mq_id) {
+  if (!mq_id) {
+    return 0;
+  }
+  auto queue = static_cast<MessageQueue *>(mq_id);
+  std::lock_guard lock{kernel_mutex()};
+  return queue->capacity - queue->count;
+}
+
+osStatus_t osMessageQueueReset(osMessageQueueId_t mq_id) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!mq_id) {
+    return osErrorParameter;
+  }
+  auto queue = static_cast<MessageQueue *>(mq_id);
+  std::lock_guard lock{kernel_mutex()};
+  queue->head = 0;
+  queue->count = 0;
+  kernel_cv().notify_all();
+  return osOK;
+}
+
+osStatus_t osMessageQueueDelete(osMessageQueueId_t mq_id) {
+  if (stm32rcos_host::in_isr()) {
+    return osErrorISR;
+  }
+  if (!mq_id) {
+    return osErrorParameter;
+  }
+  delete static_cast<MessageQueue *>(mq_id);
+  return osOK;
+}
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "core/instrumentation.hpp"
+#include "core/log.hpp"
 #include "core/mutex.hpp"
 #include "core/queue.hpp"
+#include "core/ring_buffer.hpp"
 #include "core/semaphore.hpp"
 #include "core/thread.hpp"
 #include "core/timer.hpp"
+#include "core/trace.hpp"
 #include "core/utility.hpp"
\ No newline at end of file
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <span>
+
+#include <cmsis_os2.h>
+
+namespace stm32rcos {
+namespace core {
+
+/**
+ * run_benchmark() の結果です。時間はすべてナノ秒です。
+ * パーセンタイルは、各回の時間を受け取る領域を渡したときだけ求まります。
+ */
+struct BenchmarkResult {
+  const char *name;
+  size_t iterations;
+  uint64_t ops_per_sec;
+  uint32_t min_ns;
+  uint32_t mean_ns;
+  uint32_t max_ns;
+  bool has_percentiles;
+  uint32_t p50_ns;
+  uint32_t p90_ns;
+  uint32_t p99_ns;
+
+  /**
+   * 1行の JSON として stdout に出力します。
+   * enable_stdout() と組み合わせるとUARTからそのまま取り出せます。
+   * 浮動小数点の printf は使いません。
+   */
+  void print_json() const {
+    std::printf("{\"name\":\"%s\",\"iterations\":%u,\"ops_per_sec\":%" PRIu64
+                ",\"min_ns\":%" PRIu32 ",\"mean_ns\":%" PRIu32
+                ",\"max_ns\":%" PRIu32,
+                name, static_cast<unsigned>(iterations), ops_per_sec, min_ns,
+                mean_ns, max_ns);
+    if (has_percentiles) {
+      std::printf(",\"p50_ns\":%" PRIu32 ",\"p90_ns\":%" PRIu32
+                  ",\"p99_ns\":%" PRIu32,
+                  p50_ns, p90_ns, p99_ns);
+    }
+    std::printf("}\r\n");
+  }
+};
+
+namespace detail {
+
+// 最小、最大、合計だけを持ち、ヒープを使わずに集計する
+class BenchmarkStats {
+public:
+  void add(uint32_t count) {
+    min_ = std::min(min_, count);
+    max_ = std::max(max_, count);
+    total_ += count;
+    ++iterations_;
+  }
+
+  BenchmarkResult result(const char *name) const {
+    BenchmarkResult result{};
+    result.name = name;
+    result.iterations = iterations_;
+    if (iterations_ == 0) {
+      return result;
+    }
+    uint64_t freq = osKernelGetSysTimerFreq();
+    result.ops_per_sec = total_ != 0 ? iterations_ * freq / total_ : 0;
+    result.min_ns = to_ns(min_);
+    result.mean_ns = to_ns(total_ / iterations_);
+    result.max_ns = to_ns(max_);
+    return result;
+  }
+
+  static uint32_t to_ns(uint64_t count) {
+    return static_cast<uint32_t>(count * 1000000000 /
+                                 osKernelGetSysTimerFreq());
+  }
+
+private:
+  uint32_t min_ = std::numeric_limits<uint32_t>::max();
+  uint32_t max_ = 0;
+  uint64_t total_ = 0;
+  size_t iterations_ = 0;
+};
+
+} // namespace detail
+
+/**
+ * 別の方法で測ったシステムタイマのカウント数 (osKernelGetSysTimerCount()
+ * の差) をまとめます。samples は並べ替えられます。
+ * タイマーのコールバックの間隔など、run_benchmark() で囲めないものに使います。
+ */
+inline BenchmarkResult summarize_benchmark(const char *name,
+                                           std::span<uint32_t> samples) {
+  detail::BenchmarkStats stats;
+  for (uint32_t sample : samples) {
+    stats.add(sample);
+  }
+  BenchmarkResult result = stats.result(name);
+  if (samples.empty()) {
+    return result;
+  }
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&samples](size_t permille) {
+    return detail::BenchmarkStats::to_ns(
+        samples[(samples.size() - 1) * permille / 1000]);
+  };
+  result.has_percentiles = true;
+  result.p50_ns = percentile(500);
+  result.p90_ns = percentile(900);
+  result.p99_ns = percentile(990);
+  return result;
+}
+
+/**
+ * func を iterations 回呼び、1回ごとの時間を osKernelGetSysTimerCount() で
+ * 測ります。分解能はカーネルのシステムタイマ (多くはコアクロック) です。
+ *
+ * ヒープは使わず、最小、平均、最大だけを求めます。
+ * 測定中に他のスレッドや割り込みが入った分も含まれます。
+ *
+ * @code{.cpp}
+ * #include <stm32rcos/core/benchmark.hpp>
+ *
+ * Queue<uint32_t> queue(16);
+ * run_benchmark("queue_push_pop", 10000, [&] {
+ *   queue.push(1, 0);
+ *   queue.pop(0);
+ * }).print_json();
+ * @endcode
+ */
+template <class F>
+BenchmarkResult run_benchmark(const char *name, size_t iterations, F &&func) {
+  detail::BenchmarkStats stats;
+  for (size_t i = 0; i < iterations; ++i) {
+    uint32_t start = osKernelGetSysTimerCount();
+    func();
+    stats.add(osKernelGetSysTimerCount() - start);
+  }
+  return stats.result(name);
+}
+
+/**
+ * samples.size() 回 func を呼び、各回の時間を samples に書いて
+ * パーセンタイルも求めます。p50 と p99 の差がそのままジッタの目安になります。
+ *
+ * @code{.cpp}
+ * static uint32_t samples[1000];
+ * run_benchmark("queue_push_pop", samples, [&] {
+ *   queue.push(1, 0);
+ *   queue.pop(0);
+ * }).print_json();
+ * @endcode
+ */
+template <class F>
+BenchmarkResult run_benchmark(const char *name, std::span<uint32_t> samples,
+                              F &&func) {
+  for (uint32_t &sample : samples) {
+    uint32_t start = osKernelGetSysTimerCount();
+    func();
+    sample = osKernelGetSysTimerCount() - start;
+  }
+  return summarize_benchmark(name, samples);
+}
+
+} // namespace core
+} // namespace stm32rcos
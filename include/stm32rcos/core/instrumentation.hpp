@@ -0,0 +1,332 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <FreeRTOS.h>
+#include <cmsis_os2.h>
+
+#include <task.h>
+
+#include "utility.hpp"
+
+// STM32RCOS_INSTRUMENTATION を定義すると、Queue と Semaphore が自身を
+// 登録し、ピーク時の個数や失敗した回数を数えるようになる。
+// スレッドの情報は FreeRTOS のタスク一覧から取るので、
+// configUSE_TRACE_FACILITY と configGENERATE_RUN_TIME_STATS も 1 のときだけ
+// get_thread_info() を定義し、dump_instrumentation() にスレッドを含める
+
+namespace stm32rcos {
+namespace core {
+
+enum class InstrumentedKind : uint8_t {
+  QUEUE,
+  SEMAPHORE,
+};
+
+#ifdef STM32RCOS_INSTRUMENTATION
+
+struct ThreadInfo {
+  const char *name;
+  // 起動してからの CPU 時間の割合 [0.1%]
+  uint32_t cpu_permille;
+  // スタックの残りの最小値 [バイト]
+  uint32_t stack_free_min;
+};
+
+struct QueueInfo {
+  const char *name;
+  uint32_t size;
+  uint32_t capacity;
+  uint32_t high_water;
+  // 一杯で push できなかった回数
+  uint32_t overflows;
+};
+
+struct SemaphoreInfo {
+  const char *name;
+  uint32_t count;
+  // acquire() がタイムアウトした回数
+  uint32_t timeouts;
+};
+
+namespace detail {
+
+// Queue/Semaphore が持つ、登録簿の要素
+class InstrumentationNode {
+public:
+  InstrumentationNode(InstrumentedKind kind, const char *name)
+      : kind_{kind}, name_{name} {}
+
+  // Queue/Semaphore を移動できるよう、登録簿の位置を引き継ぐ
+  InstrumentationNode(InstrumentationNode &&other)
+      : kind_{other.kind_}, name_{other.name_} {
+    take_over(other);
+  }
+
+  InstrumentationNode &operator=(InstrumentationNode &&other) {
+    if (this != &other) {
+      unlink();
+      kind_ = other.kind_;
+      name_ = other.name_;
+      take_over(other);
+    }
+    return *this;
+  }
+
+  ~InstrumentationNode() { unlink(); }
+
+  void link(void *id) {
+    CriticalSection critical_section;
+    id_ = id;
+    next_ = head();
+    if (next_) {
+      next_->prev_ = this;
+    }
+    head() = this;
+  }
+
+  // 割り込みからも呼ばれる。M0 には不可分な加算がないので、更新するときだけ
+  // 割り込みを止める
+  template <class F> void record(bool success, F &&level_func) {
+    uint32_t level = level_func();
+    if (success && level <= high_water_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    CriticalSectionFromISR critical_section;
+    if (!success) {
+      failures_.store(failures_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+    }
+    if (level > high_water_.load(std::memory_order_relaxed)) {
+      high_water_.store(level, std::memory_order_relaxed);
+    }
+  }
+
+  template <class F> static void for_each(InstrumentedKind kind, F &&f) {
+    for (InstrumentationNode *node = head(); node; node = node->next_) {
+      if (node->kind_ == kind) {
+        f(*node);
+      }
+    }
+  }
+
+  void *id() const { return id_; }
+  const char *name() const { return name_; }
+  uint32_t high_water() const {
+    return high_water_.load(std::memory_order_relaxed);
+  }
+  uint32_t failures() const {
+    return failures_.load(std::memory_order_relaxed);
+  }
+
+private:
+  InstrumentedKind kind_;
+  const char *name_;
+  void *id_ = nullptr;
+  InstrumentationNode *prev_ = nullptr;
+  InstrumentationNode *next_ = nullptr;
+  std::atomic<uint32_t> high_water_{0};
+  std::atomic<uint32_t> failures_{0};
+
+  InstrumentationNode(const InstrumentationNode &) = delete;
+  InstrumentationNode &operator=(const InstrumentationNode &) = delete;
+
+  static InstrumentationNode *&head() {
+    static InstrumentationNode *head = nullptr;
+    return head;
+  }
+
+  void take_over(InstrumentationNode &other) {
+    CriticalSection critical_section;
+    high_water_.store(other.high_water(), std::memory_order_relaxed);
+    failures_.store(other.failures(), std::memory_order_relaxed);
+    if (!other.id_) {
+      return;
+    }
+    id_ = other.id_;
+    prev_ = other.prev_;
+    next_ = other.next_;
+    if (prev_) {
+      prev_->next_ = this;
+    } else {
+      head() = this;
+    }
+    if (next_) {
+      next_->prev_ = this;
+    }
+    other.id_ = nullptr;
+    other.prev_ = nullptr;
+    other.next_ = nullptr;
+  }
+
+  void unlink() {
+    CriticalSection critical_section;
+    if (!id_) {
+      return;
+    }
+    if (prev_) {
+      prev_->next_ = next_;
+    } else {
+      head() = next_;
+    }
+    if (next_) {
+      next_->prev_ = prev_;
+    }
+    id_ = nullptr;
+    prev_ = nullptr;
+    next_ = nullptr;
+  }
+};
+
+// 登録簿を辿る間はクリティカルセクションに入るので、先に領域を確保しておく
+template <class Info, class F>
+std::vector<Info> collect_instrumentation(InstrumentedKind kind, F &&f) {
+  size_t count = 0;
+  {
+    CriticalSection critical_section;
+    InstrumentationNode::for_each(
+        kind, [&count](const InstrumentationNode &) { ++count; });
+  }
+  std::vector<Info> infos;
+  infos.reserve(count);
+  CriticalSection critical_section;
+  InstrumentationNode::for_each(
+      kind, [&](const InstrumentationNode &node) {
+        if (infos.size() < infos.capacity()) {
+          infos.push_back(f(node));
+        }
+      });
+  return infos;
+}
+
+using InstrumentationHook = InstrumentationNode;
+
+} // namespace detail
+
+#if configUSE_TRACE_FACILITY == 1 && configGENERATE_RUN_TIME_STATS == 1
+
+/**
+ * 全スレッドの CPU 使用率とスタックの残りを返します。
+ * STM32RCOS のスレッドに限らず、FreeRTOS のタスクをすべて含みます。
+ */
+inline std::vector<ThreadInfo> get_thread_info() {
+  // 数えてから取るまでに増えた分も入るよう、少し余裕を持たせる
+  std::vector<TaskStatus_t> tasks(uxTaskGetNumberOfTasks() + 4);
+  uint32_t total = 0;
+  tasks.resize(uxTaskGetSystemState(tasks.data(), tasks.size(), &total));
+  std::vector<ThreadInfo> infos;
+  infos.reserve(tasks.size());
+  for (const TaskStatus_t &task : tasks) {
+    ThreadInfo info;
+    info.name = task.pcTaskName;
+    info.cpu_permille =
+        total != 0 ? static_cast<uint64_t>(task.ulRunTimeCounter) * 1000 / total
+                   : 0;
+    info.stack_free_min = task.usStackHighWaterMark * sizeof(StackType_t);
+    infos.push_back(info);
+  }
+  return infos;
+}
+
+#endif
+
+inline std::vector<QueueInfo> get_queue_info() {
+  return detail::collect_instrumentation<QueueInfo>(
+      InstrumentedKind::QUEUE, [](const detail::InstrumentationNode &node) {
+        QueueInfo info;
+        info.name = node.name();
+        info.size = osMessageQueueGetCount(node.id());
+        info.capacity = osMessageQueueGetCapacity(node.id());
+        info.high_water = node.high_water();
+        info.overflows = node.failures();
+        return info;
+      });
+}
+
+inline std::vector<SemaphoreInfo> get_semaphore_info() {
+  return detail::collect_instrumentation<SemaphoreInfo>(
+      InstrumentedKind::SEMAPHORE,
+      [](const detail::InstrumentationNode &node) {
+        SemaphoreInfo info;
+        info.name = node.name();
+        info.count = osSemaphoreGetCount(node.id());
+        info.timeouts = node.failures();
+        return info;
+      });
+}
+
+/**
+ * スレッド、Queue、Semaphore の情報を1行ずつ文字列にして write(data, size)
+ * に渡します。浮動小数点の printf は使いません。スレッドは get_thread_info()
+ * が使えるときだけ含めます。
+ *
+ * @code{.cpp}
+ * dump_instrumentation([&uart](const char *data, size_t size) {
+ *   uart.transmit(reinterpret_cast<const uint8_t *>(data), size,
+ *                 osWaitForever);
+ * });
+ * @endcode
+ */
+template <class Write> void dump_instrumentation(Write &&write) {
+  char line[96];
+  auto emit = [&](int length) {
+    if (length <= 0) {
+      return;
+    }
+    // 切り詰めた行も改行で終え、次の行とつながらないようにする
+    size_t size = std::min<size_t>(length, sizeof(line) - 1);
+    if (size < static_cast<size_t>(length)) {
+      line[size - 2] = '\r';
+      line[size - 1] = '\n';
+    }
+    write(line, size);
+  };
+  auto name_or = [](const char *name) { return name ? name : "-"; };
+#if configUSE_TRACE_FACILITY == 1 && configGENERATE_RUN_TIME_STATS == 1
+  for (const ThreadInfo &info : get_thread_info()) {
+    emit(std::snprintf(line, sizeof(line),
+                       "thread %s cpu=%u.%u%% stack_free=%u\r\n",
+                       name_or(info.name),
+                       static_cast<unsigned>(info.cpu_permille / 10),
+                       static_cast<unsigned>(info.cpu_permille % 10),
+                       static_cast<unsigned>(info.stack_free_min)));
+  }
+#endif
+  for (const QueueInfo &info : get_queue_info()) {
+    emit(std::snprintf(line, sizeof(line),
+                       "queue %s size=%u/%u peak=%u overflows=%u\r\n",
+                       name_or(info.name), static_cast<unsigned>(info.size),
+                       static_cast<unsigned>(info.capacity),
+                       static_cast<unsigned>(info.high_water),
+                       static_cast<unsigned>(info.overflows)));
+  }
+  for (const SemaphoreInfo &info : get_semaphore_info()) {
+    emit(std::snprintf(line, sizeof(line),
+                       "semaphore %s count=%u timeouts=%u\r\n",
+                       name_or(info.name), static_cast<unsigned>(info.count),
+                       static_cast<unsigned>(info.timeouts)));
+  }
+}
+
+#else
+
+namespace detail {
+
+// 計測しないときは何もせず、メンバとしても領域を取らない
+struct InstrumentationHook {
+  InstrumentationHook(InstrumentedKind, const char *) {}
+  void link(void *) {}
+  template <class F> void record(bool, F &&) {}
+};
+
+} // namespace detail
+
+#endif
+
+} // namespace core
+} // namespace stm32rcos
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <cmsis_os2.h>
+
+#include "log_format.hpp"
+#include "ring_buffer.hpp"
+#include "utility.hpp"
+
+#ifndef STM32RCOS_LOG_SIZE
+#define STM32RCOS_LOG_SIZE 2048
+#endif
+
+namespace stm32rcos {
+namespace core {
+
+namespace detail {
+
+// 書式と引数が合わないとき、定数式にならないようにして止める
+void log_format_error_mismatched_argument();
+void log_format_error_unsupported_conversion();
+void log_format_error_too_long();
+
+// 書式の変換指定と引数の型を、コンパイル時に照合する
+template <class... Args> consteval void check_log_format(const char *format) {
+  constexpr LogArgType types[] = {log_arg_type<Args>()..., LogArgType::I32};
+  size_t index = 0;
+  for (const char *p = format; *p; ++p) {
+    if (*p != '%') {
+      continue;
+    }
+    ++p;
+    if (*p == '%') {
+      continue;
+    }
+    while (*p && std::string_view{"-+ #0123456789.hlLqjzt"}.contains(*p)) {
+      ++p;
+    }
+    if (index >= sizeof...(Args)) {
+      log_format_error_mismatched_argument();
+    }
+    LogArgType type = types[index++];
+    bool is_string = type == LogArgType::STR;
+    bool is_float = type == LogArgType::F32 || type == LogArgType::F64;
+    if (std::string_view{"diouxXc"}.contains(*p)) {
+      if (is_string || is_float) {
+        log_format_error_mismatched_argument();
+      }
+    } else if (std::string_view{"fFeEgGaA"}.contains(*p)) {
+      if (!is_float) {
+        log_format_error_mismatched_argument();
+      }
+    } else if (*p == 's') {
+      if (!is_string) {
+        log_format_error_mismatched_argument();
+      }
+    } else {
+      log_format_error_unsupported_conversion();
+    }
+  }
+  if (index != sizeof...(Args)) {
+    log_format_error_mismatched_argument();
+  }
+}
+
+struct LogBuffer {
+  RingBuffer<uint8_t, STM32RCOS_LOG_SIZE> ring;
+  uint32_t dropped = 0;
+};
+
+inline LogBuffer &log_buffer() {
+  static LogBuffer buffer;
+  return buffer;
+}
+
+} // namespace detail
+
+/**
+ * log() の書式文字列です。文字列リテラルから暗黙に作られ、変換指定と
+ * 引数の型が合わなければコンパイルエラーになります。
+ *
+ * 使える変換指定は diouxXc (整数)、fFeEgGaA (float/double)、s (文字列)
+ * です。h/l/ll などの長さ指定は書いても無視され、引数の型に従います。
+ * 書式文字列は FORMAT パケットに入る 251 バイトまでで、長ければ
+ * コンパイルエラーになります。
+ */
+template <class... Args> class LogFormat {
+public:
+  template <size_t N>
+  consteval LogFormat(const char (&format)[N]) : format_{format} {
+    if (N - 1 > detail::LOG_FORMAT_MAX) {
+      detail::log_format_error_too_long();
+    }
+    detail::check_log_format<Args...>(format);
+  }
+
+  const char *get() const { return format_; }
+
+private:
+  const char *format_;
+};
+
+/**
+ * 書式文字列を整形せずに、その ID と引数の値だけをログバッファに書き込み
+ * ます。スレッドからも割り込みからも呼べ、待つことはありません。
+ * 書式文字列のアドレスを ID に使うので、文字列リテラルしか渡せません。
+ *
+ * ログバッファは LogStream が UART へ流し、decode_log() で文字列に
+ * 戻します。float/double も生の値で送るので、マイコン側で浮動小数点の
+ * printf を使いません。文字列の引数は LOG_MAX_STRING バイトまでコピー
+ * します。
+ *
+ * @code{.cpp}
+ * log("loop %u: error=%f\r\n", count, error);
+ * @endcode
+ *
+ * @return バッファが一杯で捨てたら false
+ */
+template <class... Args>
+bool log(LogFormat<std::type_identity_t<Args>...> format,
+         const Args &...args) {
+  std::array<uint8_t, detail::LOG_PACKET_MAX> packet;
+  detail::LogPacketWriter writer{packet, LogPacket::RECORD};
+  // ID への変換と書式文字列の送信は LogReader が後で行う
+  writer.put(format.get());
+  writer.put(osKernelGetTickCount());
+  (writer.put_arg(args), ...);
+  size_t size = writer.finish();
+
+  auto &buffer = detail::log_buffer();
+  // 書き込み側は割り込みを止めて1つにする。取り出し側とはロックしない
+  CriticalSectionFromISR critical_section;
+  if (buffer.ring.capacity() - buffer.ring.size() < size) {
+    ++buffer.dropped;
+    return false;
+  }
+  buffer.ring.push_n({packet.data(), size});
+  return true;
+}
+
+/**
+ * log() で書き込んだ記録を取り出し、送信するパケットにします。
+ * 初めて出てきた書式には、RECORD の前に FORMAT パケットを付けます。
+ * 取り出すのは1つのスレッドからだけにしてください。
+ */
+class LogReader {
+public:
+  LogReader() = default;
+
+  /**
+   * たまった記録を1パケットずつ write(data, size) に渡します。
+   *
+   * @return 渡した RECORD の数
+   */
+  template <class Write> size_t read(Write &&write) {
+    auto &buffer = detail::log_buffer();
+    std::array<uint8_t, detail::LOG_PACKET_MAX> packet;
+    uint32_t dropped;
+    {
+      CriticalSectionFromISR critical_section;
+      dropped = buffer.dropped;
+      buffer.dropped = 0;
+    }
+    if (dropped != 0) {
+      detail::LogPacketWriter writer{packet, LogPacket::DROPPED};
+      writer.put(dropped);
+      write(packet.data(), writer.finish());
+    }
+    std::array<uint8_t, detail::LOG_PACKET_MAX> record;
+    std::span<uint8_t> header =
+        std::span{record}.first(detail::LOG_HEADER_SIZE);
+    size_t count = 0;
+    // 記録は丸ごと書き込まれるので、先頭が読めれば残りも読める
+    while (buffer.ring.pop_n(header) == header.size()) {
+      size_t length = record[2];
+      std::span<uint8_t> payload =
+          std::span{record}.subspan(detail::LOG_HEADER_SIZE, length);
+      buffer.ring.pop_n(payload);
+      const char *format;
+      std::memcpy(&format, payload.data(), sizeof(format));
+      uint32_t id = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(format));
+      if (std::find(formats_.begin(), formats_.end(), id) == formats_.end()) {
+        formats_.push_back(id);
+        detail::LogPacketWriter writer{packet, LogPacket::FORMAT};
+        writer.put(id);
+        writer.put_bytes(format, std::strlen(format));
+        write(packet.data(), writer.finish());
+      }
+      detail::LogPacketWriter writer{packet, LogPacket::RECORD};
+      writer.put(id);
+      writer.put_bytes(payload.data() + sizeof(format),
+                       payload.size() - sizeof(format));
+      write(packet.data(), writer.finish());
+      ++count;
+    }
+    return count;
+  }
+
+  // 送った書式を忘れ、次に出てきたときにもう一度送る
+  void reset() { formats_.clear(); }
+
+private:
+  std::vector<uint32_t> formats_;
+
+  LogReader(const LogReader &) = delete;
+  LogReader &operator=(const LogReader &) = delete;
+};
+
+} // namespace core
+} // namespace stm32rcos
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// ログのパケットの形式と、ホストでの復元。FreeRTOS や HAL には依存しないので、
+// PC のプログラムからもこのヘッダだけを include して使える
+
+namespace stm32rcos {
+namespace core {
+
+// パケットの先頭のバイト。トレースの SYNC (0xA5) とは別の値にしてある
+inline constexpr uint8_t LOG_MAGIC = 0xA6;
+
+// 1つの文字列引数からコピーする最大のバイト数
+inline constexpr size_t LOG_MAX_STRING = 32;
+
+/**
+ * ログのパケットの種類です。どのパケットも
+ * [LOG_MAGIC][LogPacket][ペイロードのバイト数] の3バイトで始まります。
+ * 数値はすべてリトルエンディアンです。
+ *
+ * - RECORD: [書式 ID (4)][tick (4)][引数...]
+ *   書式 ID は書式文字列のアドレスの下位 32 ビット
+ *   引数は [LogArgType (1)][値] の並びで、STR の値は [長さ (1)][バイト列]
+ * - FORMAT: [書式 ID (4)][書式文字列 (NUL なし)]
+ * - DROPPED: [バッファが一杯で捨てた RECORD の数 (4)]
+ */
+enum class LogPacket : uint8_t {
+  RECORD,
+  FORMAT,
+  DROPPED,
+};
+
+enum class LogArgType : uint8_t {
+  I32,
+  U32,
+  I64,
+  U64,
+  F32,
+  F64,
+  STR,
+};
+
+namespace detail {
+
+inline constexpr size_t LOG_HEADER_SIZE = 3;
+inline constexpr size_t LOG_PACKET_MAX = LOG_HEADER_SIZE + UINT8_MAX;
+// FORMAT パケットには ID の後ろに書式文字列が入る
+inline constexpr size_t LOG_FORMAT_MAX = UINT8_MAX - sizeof(uint32_t);
+
+template <class T> consteval LogArgType log_arg_type() {
+  using U = std::remove_cvref_t<T>;
+  if constexpr (std::is_same_v<U, float>) {
+    return LogArgType::F32;
+  } else if constexpr (std::is_same_v<U, double>) {
+    return LogArgType::F64;
+  } else if constexpr (std::is_convertible_v<U, std::string_view>) {
+    return LogArgType::STR;
+  } else if constexpr (std::is_integral_v<U> && sizeof(U) <= 4) {
+    return std::is_signed_v<U> ? LogArgType::I32 : LogArgType::U32;
+  } else if constexpr (std::is_integral_v<U> && sizeof(U) == 8) {
+    return std::is_signed_v<U> ? LogArgType::I64 : LogArgType::U64;
+  } else {
+    static_assert(sizeof(T) == 0,
+                  "log() の引数は整数、float、double、文字列のみ");
+  }
+}
+
+// 長さの分からない文字列は、LOG_MAX_STRING バイトまでしか数えない
+template <class T> std::string_view log_string(const T &value) {
+  if constexpr (std::is_convertible_v<const T &, const char *>) {
+    const char *str = value;
+    if (!str) {
+      return "(null)";
+    }
+    size_t length = 0;
+    while (length < LOG_MAX_STRING && str[length]) {
+      ++length;
+    }
+    return {str, length};
+  } else {
+    std::string_view str = value;
+    return str.substr(0, LOG_MAX_STRING);
+  }
+}
+
+class LogPacketWriter {
+public:
+  LogPacketWriter(std::span<uint8_t, LOG_PACKET_MAX> buf, LogPacket packet)
+      : buf_{buf} {
+    buf_[0] = LOG_MAGIC;
+    buf_[1] = static_cast<uint8_t>(packet);
+  }
+
+  template <class T> void put(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    put_bytes(&value, sizeof(value));
+  }
+
+  void put_bytes(const void *data, size_t size) {
+    size = std::min(size, buf_.size() - size_);
+    std::memcpy(buf_.data() + size_, data, size);
+    size_ += size;
+  }
+
+  template <class T> void put_arg(const T &value) {
+    constexpr LogArgType type = log_arg_type<T>();
+    // 引数の途中で切れないよう、入りきらない引数は丸ごと落とす
+    if constexpr (type == LogArgType::STR) {
+      if (size_ + 2 > buf_.size()) {
+        return;
+      }
+      std::string_view str = log_string(value);
+      uint8_t length = std::min(str.size(), buf_.size() - size_ - 2);
+      put(type);
+      put(length);
+      put_bytes(str.data(), length);
+    } else {
+      using Stored = std::conditional_t<
+          type == LogArgType::I32, int32_t,
+          std::conditional_t<type == LogArgType::U32, uint32_t,
+                             std::remove_cvref_t<T>>>;
+      if (size_ + 1 + sizeof(Stored) > buf_.size()) {
+        return;
+      }
+      put(type);
+      put(static_cast<Stored>(value));
+    }
+  }
+
+  // 先頭の3バイトを埋め、パケット全体のバイト数を返す
+  size_t finish() {
+    buf_[2] = size_ - LOG_HEADER_SIZE;
+    return size_;
+  }
+
+private:
+  std::span<uint8_t, LOG_PACKET_MAX> buf_;
+  size_t size_ = LOG_HEADER_SIZE;
+};
+
+} // namespace detail
+
+/**
+ * LogStream が送ったバイト列を文字列に戻して write(data, size) に渡します。
+ * 浮動小数点の printf を使うので、ホストのプログラム (tools/log2text.cpp
+ * など) から使ってください。
+ * 書式文字列は送られてきた FORMAT パケットから覚えます。途中から受信した
+ * などで書式が分からない RECORD は、ID と引数の数だけを出力します。
+ * 直後に次のパケットの先頭が続かないパケットは、欠けたものとして捨てます。
+ *
+ * @code{.cpp}
+ * std::vector<uint8_t> data{std::istreambuf_iterator<char>(std::cin), {}};
+ * decode_log(data, [](const char *s, size_t n) {
+ *   std::fwrite(s, 1, n, stdout);
+ * });
+ * @endcode
+ *
+ * @return 復元した RECORD の数
+ */
+template <class Write>
+size_t decode_log(std::span<const uint8_t> data, Write &&write) {
+  std::vector<std::pair<uint32_t, std::string>> formats;
+  std::string out;
+  char text[128];
+  auto read_u32 = [](const uint8_t *p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  };
+  auto append = [&](int length) {
+    if (length > 0) {
+      out.append(text, std::min<size_t>(length, sizeof(text) - 1));
+    }
+  };
+
+  size_t count = 0;
+  size_t offset = 0;
+  while (offset + detail::LOG_HEADER_SIZE <= data.size()) {
+    const uint8_t *header = data.data() + offset;
+    size_t length = header[2];
+    size_t next = offset + detail::LOG_HEADER_SIZE + length;
+    // 欠けたパケットの長さは後ろのパケットにはみ出すので、直後が次の
+    // パケットの先頭になっているかも確かめる
+    bool valid = header[0] == LOG_MAGIC &&
+                 header[1] <= static_cast<uint8_t>(LogPacket::DROPPED) &&
+                 length >= 4 && next <= data.size() &&
+                 (next == data.size() || data[next] == LOG_MAGIC);
+    if (!valid) {
+      // 途中でバイトが欠けたら、次の先頭バイトまで読み飛ばす
+      ++offset;
+      continue;
+    }
+    const uint8_t *payload = header + detail::LOG_HEADER_SIZE;
+    offset = next;
+    uint32_t id = read_u32(payload);
+    switch (static_cast<LogPacket>(header[1])) {
+    case LogPacket::FORMAT: {
+      std::string format{reinterpret_cast<const char *>(payload + 4),
+                         length - 4};
+      auto it = std::find_if(formats.begin(), formats.end(),
+                             [id](const auto &entry) {
+                               return entry.first == id;
+                             });
+      if (it != formats.end()) {
+        it->second = std::move(format);
+      } else {
+        formats.emplace_back(id, std::move(format));
+      }
+      continue;
+    }
+    case LogPacket::DROPPED:
+      out.clear();
+      append(std::snprintf(text, sizeof(text), "<dropped %u records>\r\n",
+                           static_cast<unsigned>(id)));
+      write(out.data(), out.size());
+      continue;
+    case LogPacket::RECORD:
+      break;
+    }
+    if (length < 8) {
+      continue;
+    }
+
+    // 引数を順に取り出す。足りなければ type は空になる
+    const uint8_t *arg = payload + 8;
+    const uint8_t *end = payload + length;
+    auto next_arg = [&](LogArgType &type, uint64_t &bits, std::string &str) {
+      if (arg >= end || *arg > static_cast<uint8_t>(LogArgType::STR)) {
+        return false;
+      }
+      type = static_cast<LogArgType>(*arg++);
+      size_t size = 0;
+      switch (type) {
+      case LogArgType::I32:
+      case LogArgType::U32:
+      case LogArgType::F32:
+        size = 4;
+        break;
+      case LogArgType::I64:
+      case LogArgType::U64:
+      case LogArgType::F64:
+        size = 8;
+        break;
+      case LogArgType::STR:
+        if (arg >= end) {
+          return false;
+        }
+        size = *arg++;
+        break;
+      }
+      if (static_cast<size_t>(end - arg) < size) {
+        arg = end;
+        return false;
+      }
+      if (type == LogArgType::STR) {
+        str.assign(reinterpret_cast<const char *>(arg), size);
+      } else {
+        bits = 0;
+        std::memcpy(&bits, arg, size);
+      }
+      arg += size;
+      return true;
+    };
+
+    out.clear();
+    append(std::snprintf(text, sizeof(text), "[%10u] ",
+                         static_cast<unsigned>(read_u32(payload + 4))));
+    auto it = std::find_if(
+        formats.begin(), formats.end(),
+        [id](const auto &entry) { return entry.first == id; });
+    if (it == formats.end()) {
+      append(std::snprintf(text, sizeof(text), "<format 0x%08x>",
+                           static_cast<unsigned>(id)));
+      LogArgType type;
+      uint64_t bits;
+      std::string str;
+      while (next_arg(type, bits, str)) {
+        out += " ?";
+      }
+      out += "\r\n";
+      write(out.data(), out.size());
+      ++count;
+      continue;
+    }
+
+    const std::string &format = it->second;
+    for (size_t i = 0; i < format.size(); ++i) {
+      if (format[i] != '%') {
+        out += format[i];
+        continue;
+      }
+      if (i + 1 < format.size() && format[i + 1] == '%') {
+        out += '%';
+        ++i;
+        continue;
+      }
+      // 長さ指定を除いた変換指定を組み立て直す
+      std::string spec = "%";
+      size_t j = i + 1;
+      while (j < format.size() &&
+             std::string_view{"-+ #0123456789."}.contains(format[j])) {
+        spec += format[j++];
+      }
+      while (j < format.size() &&
+             std::string_view{"hlLqjzt"}.contains(format[j])) {
+        ++j;
+      }
+      if (j >= format.size()) {
+        break;
+      }
+      char conversion = format[j];
+      i = j;
+      LogArgType type;
+      uint64_t bits = 0;
+      std::string str;
+      if (!next_arg(type, bits, str)) {
+        out += "<?>";
+        continue;
+      }
+      int length = 0;
+      if (conversion == 's' && type == LogArgType::STR) {
+        spec += 's';
+        length = std::snprintf(text, sizeof(text), spec.c_str(), str.c_str());
+      } else if (type == LogArgType::F32 || type == LogArgType::F64) {
+        double value;
+        if (type == LogArgType::F32) {
+          float f;
+          std::memcpy(&f, &bits, sizeof(f));
+          value = f;
+        } else {
+          std::memcpy(&value, &bits, sizeof(value));
+        }
+        spec += conversion;
+        length = std::snprintf(text, sizeof(text), spec.c_str(), value);
+      } else if (type != LogArgType::STR && conversion == 'c') {
+        spec += 'c';
+        length = std::snprintf(text, sizeof(text), spec.c_str(),
+                               static_cast<int>(bits));
+      } else if (type != LogArgType::STR) {
+        // 符号付きの値は元の幅から符号拡張してから整形する
+        long long value =
+            type == LogArgType::I32
+                ? static_cast<int32_t>(static_cast<uint32_t>(bits))
+                : static_cast<long long>(bits);
+        spec += "ll";
+        spec += conversion;
+        length = std::string_view{"di"}.contains(conversion)
+                     ? std::snprintf(text, sizeof(text), spec.c_str(), value)
+                     : std::snprintf(text, sizeof(text), spec.c_str(),
+                                     static_cast<unsigned long long>(
+                                         type == LogArgType::I32
+                                             ? static_cast<uint32_t>(bits)
+                                             : bits));
+      } else {
+        out += "<?>";
+        continue;
+      }
+      append(length);
+    }
+    write(out.data(), out.size());
+    ++count;
+  }
+  return count;
+}
+
+} // namespace core
+} // namespace stm32rcos
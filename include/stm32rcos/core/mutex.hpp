@@ -4,6 +4,7 @@
 #include <memory>
 #include <type_traits>
 
+#include <FreeRTOS.h>
 #include <cmsis_os2.h>
 
 namespace stm32rcos {
@@ -32,9 +33,45 @@ public:
 
   void unlock() { osMutexRelease(mutex_id_.get()); }
 
+protected:
+  Mutex(uint32_t attr_bits, void *cb_mem, uint32_t cb_size) {
+    osMutexAttr_t attr{};
+    attr.attr_bits = attr_bits;
+    attr.cb_mem = cb_mem;
+    attr.cb_size = cb_size;
+    mutex_id_ = MutexId{osMutexNew(&attr)};
+  }
+
 private:
   MutexId mutex_id_;
 };
 
+// configSUPPORT_STATIC_ALLOCATION が 0 のプロジェクトでは定義しない
+#if configSUPPORT_STATIC_ALLOCATION == 1
+
+namespace detail {
+
+struct StaticMutexStorage {
+  StaticSemaphore_t cb_mem_;
+};
+
+} // namespace detail
+
+/**
+ * 制御ブロックをオブジェクト内に持つ Mutex です。
+ * FreeRTOSのヒープを使用しません。
+ */
+class StaticMutex : private detail::StaticMutexStorage, public Mutex {
+public:
+  StaticMutex(uint32_t attr_bits = 0)
+      : Mutex(attr_bits, &cb_mem_, sizeof(cb_mem_)) {}
+
+private:
+  StaticMutex(const StaticMutex &) = delete;
+  StaticMutex &operator=(const StaticMutex &) = delete;
+};
+
+#endif
+
 } // namespace core
 } // namespace stm32rcos
@@ -4,10 +4,16 @@
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <span>
 #include <type_traits>
 
+#include <FreeRTOS.h>
 #include <cmsis_os2.h>
 
+#include "instrumentation.hpp"
+#include "trace.hpp"
+#include "utility.hpp"
+
 namespace stm32rcos {
 namespace core {
 
@@ -23,21 +29,34 @@ private:
       std::unique_ptr<std::remove_pointer_t<osMessageQueueId_t>, Deleter>;
 
 public:
-  Queue(size_t capacity, uint32_t attr_bits = 0) {
+  /**
+   * @param name RTOS のデバッガや dump_instrumentation() に出る名前
+   */
+  Queue(size_t capacity, uint32_t attr_bits = 0, const char *name = nullptr)
+      : instrumentation_{InstrumentedKind::QUEUE, name} {
     osMessageQueueAttr_t attr{};
+    attr.name = name;
     attr.attr_bits = attr_bits;
     queue_id_ = QueueId{osMessageQueueNew(capacity, sizeof(T), &attr)};
+    instrumentation_.link(queue_id_.get());
   }
 
   bool push(const T &value, uint32_t timeout) {
-    return osMessageQueuePut(queue_id_.get(), &value, 0, timeout) == osOK;
+    bool pushed =
+        osMessageQueuePut(queue_id_.get(), &value, 0, timeout) == osOK;
+    instrumentation_.record(pushed, [this] { return size(); });
+    trace(TraceEvent::QUEUE_PUSH, queue_id_.get(), pushed);
+    return pushed;
   }
 
   bool push(const T &value) { return push(value, 0); }
 
   std::optional<T> pop(uint32_t timeout) {
     T value;
-    if (osMessageQueueGet(queue_id_.get(), &value, nullptr, timeout) != osOK) {
+    bool popped =
+        osMessageQueueGet(queue_id_.get(), &value, nullptr, timeout) == osOK;
+    trace(TraceEvent::QUEUE_POP, queue_id_.get(), popped);
+    if (!popped) {
       return std::nullopt;
     }
     return value;
@@ -53,15 +72,123 @@ public:
     return false;
   }
 
+  /**
+   * values を先頭から順に入れ、入れた個数を返します。
+   * timeout は全体にかかります。
+   */
+  size_t push_n(std::span<const T> values, uint32_t timeout) {
+    size_t count =
+        transfer_n(values.size(), [&](size_t i) { return push(values[i], 0); });
+    if (count == values.size() || timeout == 0) {
+      return count;
+    }
+    TimeoutHelper timeout_helper;
+    while (count < values.size() && push(values[count], timeout)) {
+      ++count;
+      timeout_helper.is_timeout(timeout);
+    }
+    return count;
+  }
+
+  /**
+   * values が埋まるまで取り出し、取り出した個数を返します。
+   * timeout は全体にかかります。
+   */
+  size_t pop_n(std::span<T> values, uint32_t timeout) {
+    size_t count =
+        transfer_n(values.size(), [&](size_t i) { return pop(values[i], 0); });
+    if (count == values.size() || timeout == 0) {
+      return count;
+    }
+    TimeoutHelper timeout_helper;
+    while (count < values.size() && pop(values[count], timeout)) {
+      ++count;
+      timeout_helper.is_timeout(timeout);
+    }
+    return count;
+  }
+
+  /**
+   * 最初の1個だけ timeout まで待ち、残りはキューにある分だけ取り出します。
+   */
+  size_t pop_all(std::span<T> values, uint32_t timeout) {
+    if (values.empty() || !pop(values[0], timeout)) {
+      return 0;
+    }
+    return 1 + pop_n(values.subspan(1), 0);
+  }
+
   void clear() { osMessageQueueReset(queue_id_.get()); }
 
   size_t size() const { return osMessageQueueGetCount(queue_id_.get()); }
 
   size_t capacity() const { return osMessageQueueGetCapacity(queue_id_.get()); }
 
+protected:
+  Queue(size_t capacity, uint32_t attr_bits, const char *name, void *cb_mem,
+        uint32_t cb_size, void *mq_mem, uint32_t mq_size)
+      : instrumentation_{InstrumentedKind::QUEUE, name} {
+    osMessageQueueAttr_t attr{};
+    attr.name = name;
+    attr.attr_bits = attr_bits;
+    attr.cb_mem = cb_mem;
+    attr.cb_size = cb_size;
+    attr.mq_mem = mq_mem;
+    attr.mq_size = mq_size;
+    queue_id_ = QueueId{osMessageQueueNew(capacity, sizeof(T), &attr)};
+    instrumentation_.link(queue_id_.get());
+  }
+
 private:
   QueueId queue_id_;
+  [[no_unique_address]] detail::InstrumentationHook instrumentation_;
+
+  // 待たずに移せる分は、スケジューラを止めてまとめて移す
+  // 相手側のタスクは1個ごとではなく、最後に1回だけ起床する
+  // 割り込みからは osKernelLock() が失敗するので、そのまま移す
+  template <class F> static size_t transfer_n(size_t size, F &&f) {
+    int32_t lock = osKernelLock();
+    size_t count = 0;
+    while (count < size && f(count)) {
+      ++count;
+    }
+    if (lock >= 0) {
+      osKernelRestoreLock(lock);
+    }
+    return count;
+  }
+};
+
+// configSUPPORT_STATIC_ALLOCATION が 0 のプロジェクトでは定義しない
+#if configSUPPORT_STATIC_ALLOCATION == 1
+
+namespace detail {
+
+template <class T, size_t Capacity> struct StaticQueueStorage {
+  StaticQueue_t cb_mem_;
+  alignas(T) uint8_t mq_mem_[Capacity * sizeof(T)];
 };
 
+} // namespace detail
+
+/**
+ * 制御ブロックとメッセージ領域をオブジェクト内に持つ Queue です。
+ * FreeRTOSのヒープを使用しません。
+ */
+template <class T, size_t Capacity>
+class StaticQueue : private detail::StaticQueueStorage<T, Capacity>,
+                    public Queue<T> {
+public:
+  StaticQueue(uint32_t attr_bits = 0, const char *name = nullptr)
+      : Queue<T>(Capacity, attr_bits, name, &this->cb_mem_,
+                 sizeof(this->cb_mem_), this->mq_mem_, sizeof(this->mq_mem_)) {}
+
+private:
+  StaticQueue(const StaticQueue &) = delete;
+  StaticQueue &operator=(const StaticQueue &) = delete;
+};
+
+#endif
+
 } // namespace core
 } // namespace stm32rcos
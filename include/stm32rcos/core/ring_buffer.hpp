@@ -1,50 +1,189 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <bit>
 #include <cstddef>
 #include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-template <class T, size_t N> class RingBuffer {
+namespace stm32rcos {
+namespace core {
+
+/**
+ * 1 producer, 1 consumer 向けのロックフリーなリングバッファです。
+ *
+ * 格納領域は2のべき乗に切り上げられ、インデックスはマスクで折り返します。
+ * N に std::dynamic_extent を指定すると、容量をコンストラクタで指定できます。
+ * キャッシュを持つコアやホストでは、Alignment にキャッシュラインサイズを
+ * 指定すると、読み書きのインデックスが別々のラインに配置されます。
+ */
+template <class T, size_t N = std::dynamic_extent,
+          size_t Alignment = alignof(std::atomic<size_t>)>
+class RingBuffer {
 public:
-  bool push(const T &value) {
+  RingBuffer()
+    requires(N != std::dynamic_extent)
+  = default;
+
+  explicit RingBuffer(size_t capacity)
+    requires(N == std::dynamic_extent)
+      : buf_(std::bit_ceil(capacity)), capacity_{capacity} {}
+
+  bool push(const T &value) { return emplace(value); }
+
+  /**
+   * args から T を作り、空いている要素に代入します。
+   * 要素はすべて構築済みなので、その場での構築ではなく一時オブジェクトの
+   * ムーブ代入になります。T にはデフォルト構築とムーブ代入が必要です。
+   */
+  template <class... Args> bool emplace(Args &&...args) {
     size_t write_idx = write_idx_.load(std::memory_order_relaxed);
-    size_t next_idx = (write_idx + 1) % buf_.size();
-    if (next_idx == read_idx_.load(std::memory_order_acquire)) {
+    if (writable(write_idx, 1) == 0) {
       return false;
     }
-    buf_[write_idx] = value;
-    write_idx_.store(next_idx, std::memory_order_release);
+    buf_[write_idx & mask()] = T(std::forward<Args>(args)...);
+    write_idx_.store(write_idx + 1, std::memory_order_release);
     return true;
   }
 
+  size_t push_n(std::span<const T> data) {
+    size_t write_idx = write_idx_.load(std::memory_order_relaxed);
+    size_t size = std::min(data.size(), writable(write_idx, data.size()));
+    size_t idx = write_idx & mask();
+    size_t first = std::min(size, buf_.size() - idx);
+    std::copy_n(data.begin(), first, buf_.begin() + idx);
+    std::copy_n(data.begin() + first, size - first, buf_.begin());
+    write_idx_.store(write_idx + size, std::memory_order_release);
+    return size;
+  }
+
+  /**
+   * 書き込み可能な連続領域を返します。書き込んだ後に commit() してください。
+   */
+  std::span<T> write_span() {
+    size_t write_idx = write_idx_.load(std::memory_order_relaxed);
+    size_t idx = write_idx & mask();
+    return {buf_.data() + idx,
+            std::min(writable(write_idx, capacity()), buf_.size() - idx)};
+  }
+
+  void commit(size_t size) {
+    write_idx_.store(write_idx_.load(std::memory_order_relaxed) + size,
+                     std::memory_order_release);
+  }
+
   std::optional<T> pop() {
-    size_t write_idx = write_idx_.load(std::memory_order_acquire);
+    std::optional<T> value;
     size_t read_idx = read_idx_.load(std::memory_order_relaxed);
-    if (write_idx == read_idx) {
-      return std::nullopt;
+    if (readable(read_idx, 1) == 0) {
+      return value;
     }
-    std::optional<T> value = buf_[read_idx];
-    size_t next_idx = (read_idx + 1) % buf_.size();
-    read_idx_.store(next_idx, std::memory_order_release);
+    value.emplace(std::move(buf_[read_idx & mask()]));
+    read_idx_.store(read_idx + 1, std::memory_order_release);
     return value;
   }
 
+  bool pop(T &value) {
+    size_t read_idx = read_idx_.load(std::memory_order_relaxed);
+    if (readable(read_idx, 1) == 0) {
+      return false;
+    }
+    value = std::move(buf_[read_idx & mask()]);
+    read_idx_.store(read_idx + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t pop_n(std::span<T> data) {
+    size_t read_idx = read_idx_.load(std::memory_order_relaxed);
+    size_t size = std::min(data.size(), readable(read_idx, data.size()));
+    size_t idx = read_idx & mask();
+    size_t first = std::min(size, buf_.size() - idx);
+    std::copy_n(buf_.begin() + idx, first, data.begin());
+    std::copy_n(buf_.begin(), size - first, data.begin() + first);
+    read_idx_.store(read_idx + size, std::memory_order_release);
+    return size;
+  }
+
+  /**
+   * 読み出し可能な連続領域を返します。読み終えた分は consume() してください。
+   */
+  std::span<const T> read_span() {
+    size_t read_idx = read_idx_.load(std::memory_order_relaxed);
+    size_t idx = read_idx & mask();
+    return {buf_.data() + idx,
+            std::min(readable(read_idx, capacity()), buf_.size() - idx)};
+  }
+
+  void consume(size_t size) {
+    size_t read_idx = read_idx_.load(std::memory_order_relaxed);
+    size = std::min(size, readable(read_idx, size));
+    read_idx_.store(read_idx + size, std::memory_order_release);
+  }
+
   void clear() {
     write_idx_.store(0, std::memory_order_relaxed);
-    read_idx_.store(0, std::memory_order_release);
+    read_idx_.store(0, std::memory_order_relaxed);
+    cached_read_idx_ = 0;
+    cached_write_idx_ = 0;
   }
 
   size_t size() const {
-    size_t write_idx = write_idx_.load(std::memory_order_acquire);
-    size_t read_idx = read_idx_.load(std::memory_order_relaxed);
-    return (write_idx + buf_.size() - read_idx) % buf_.size();
+    size_t read_idx = read_idx_.load(std::memory_order_acquire);
+    return write_idx_.load(std::memory_order_acquire) - read_idx;
   }
 
-  constexpr size_t capacity() const { return N; }
+  bool empty() const { return size() == 0; }
+
+  constexpr size_t capacity() const {
+    if constexpr (N == std::dynamic_extent) {
+      return capacity_;
+    } else {
+      return N;
+    }
+  }
 
 private:
-  std::array<T, N + 1> buf_;
-  std::atomic<size_t> write_idx_{0};
-  std::atomic<size_t> read_idx_{0};
+  struct Empty {};
+
+  static constexpr size_t STORAGE_SIZE =
+      N == std::dynamic_extent ? 0 : std::bit_ceil(N);
+
+  std::conditional_t<N == std::dynamic_extent, std::vector<T>,
+                     std::array<T, STORAGE_SIZE>>
+      buf_;
+  [[no_unique_address]] std::conditional_t<N == std::dynamic_extent, size_t,
+                                           Empty> capacity_;
+
+  // producer側
+  alignas(Alignment) std::atomic<size_t> write_idx_{0};
+  size_t cached_read_idx_ = 0;
+
+  // consumer側
+  alignas(Alignment) std::atomic<size_t> read_idx_{0};
+  size_t cached_write_idx_ = 0;
+
+  constexpr size_t mask() const { return buf_.size() - 1; }
+
+  // 相手側のインデックスは、キャッシュした値で足りないときだけ読み直す
+  size_t writable(size_t write_idx, size_t size) {
+    if (capacity() - (write_idx - cached_read_idx_) < size) {
+      cached_read_idx_ = read_idx_.load(std::memory_order_acquire);
+    }
+    return capacity() - (write_idx - cached_read_idx_);
+  }
+
+  size_t readable(size_t read_idx, size_t size) {
+    if (cached_write_idx_ - read_idx < size) {
+      cached_write_idx_ = write_idx_.load(std::memory_order_acquire);
+    }
+    return cached_write_idx_ - read_idx;
+  }
 };
+
+} // namespace core
+} // namespace stm32rcos
@@ -4,8 +4,11 @@
 #include <memory>
 #include <type_traits>
 
+#include <FreeRTOS.h>
 #include <cmsis_os2.h>
 
+#include "instrumentation.hpp"
+
 namespace stm32rcos {
 namespace core {
 
@@ -19,23 +22,76 @@ private:
       std::unique_ptr<std::remove_pointer_t<osSemaphoreId_t>, Deleter>;
 
 public:
-  Semaphore(uint32_t max, uint32_t initial, uint32_t attr_bits = 0) {
+  /**
+   * @param name RTOS のデバッガや dump_instrumentation() に出る名前
+   */
+  Semaphore(uint32_t max, uint32_t initial, uint32_t attr_bits = 0,
+            const char *name = nullptr)
+      : instrumentation_{InstrumentedKind::SEMAPHORE, name} {
     osSemaphoreAttr_t attr{};
+    attr.name = name;
     attr.attr_bits = attr_bits;
     semaphore_id_ = SemaphoreId{osSemaphoreNew(max, initial, &attr)};
+    instrumentation_.link(semaphore_id_.get());
   }
 
   bool acquire(uint32_t timeout) {
-    return osSemaphoreAcquire(semaphore_id_.get(), timeout) == osOK;
+    bool acquired = osSemaphoreAcquire(semaphore_id_.get(), timeout) == osOK;
+    // 待たない acquire の失敗はタイムアウトとして数えない
+    instrumentation_.record(acquired || timeout == 0, [] { return 0; });
+    return acquired;
   }
 
   void acquire() { acquire(osWaitForever); }
 
   void release() { osSemaphoreRelease(semaphore_id_.get()); }
 
+protected:
+  Semaphore(uint32_t max, uint32_t initial, uint32_t attr_bits,
+            const char *name, void *cb_mem, uint32_t cb_size)
+      : instrumentation_{InstrumentedKind::SEMAPHORE, name} {
+    osSemaphoreAttr_t attr{};
+    attr.name = name;
+    attr.attr_bits = attr_bits;
+    attr.cb_mem = cb_mem;
+    attr.cb_size = cb_size;
+    semaphore_id_ = SemaphoreId{osSemaphoreNew(max, initial, &attr)};
+    instrumentation_.link(semaphore_id_.get());
+  }
+
 private:
   SemaphoreId semaphore_id_;
+  [[no_unique_address]] detail::InstrumentationHook instrumentation_;
 };
 
+// configSUPPORT_STATIC_ALLOCATION が 0 のプロジェクトでは定義しない
+#if configSUPPORT_STATIC_ALLOCATION == 1
+
+namespace detail {
+
+struct StaticSemaphoreStorage {
+  StaticSemaphore_t cb_mem_;
+};
+
+} // namespace detail
+
+/**
+ * 制御ブロックをオブジェクト内に持つ Semaphore です。
+ * FreeRTOSのヒープを使用しません。
+ */
+class StaticSemaphore : private detail::StaticSemaphoreStorage,
+                        public Semaphore {
+public:
+  StaticSemaphore(uint32_t max, uint32_t initial, uint32_t attr_bits = 0,
+                  const char *name = nullptr)
+      : Semaphore(max, initial, attr_bits, name, &cb_mem_, sizeof(cb_mem_)) {}
+
+private:
+  StaticSemaphore(const StaticSemaphore &) = delete;
+  StaticSemaphore &operator=(const StaticSemaphore &) = delete;
+};
+
+#endif
+
 } // namespace core
 } // namespace stm32rcos
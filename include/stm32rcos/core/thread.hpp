@@ -5,6 +5,7 @@
 #include <memory>
 #include <type_traits>
 
+#include <FreeRTOS.h>
 #include <cmsis_os2.h>
 
 namespace stm32rcos {
@@ -20,9 +21,14 @@ private:
       std::unique_ptr<std::remove_pointer_t<osThreadId_t>, Deleter>;
 
 public:
+  /**
+   * @param name RTOS のデバッガや dump_instrumentation() に出る名前
+   */
   Thread(void (*func)(void *), void *args, size_t stack_size,
-         osPriority_t priority, uint32_t attr_bits = 0) {
+         osPriority_t priority, uint32_t attr_bits = 0,
+         const char *name = nullptr) {
     osThreadAttr_t attr{};
+    attr.name = name;
     attr.stack_size = stack_size;
     attr.priority = priority;
     attr.attr_bits = attr_bits;
@@ -33,9 +39,59 @@ public:
 
   bool join() { return osThreadJoin(thread_id_.get()) == osOK; }
 
+protected:
+  Thread(void (*func)(void *), void *args, osPriority_t priority,
+         uint32_t attr_bits, const char *name, void *cb_mem, uint32_t cb_size,
+         void *stack_mem, uint32_t stack_size) {
+    osThreadAttr_t attr{};
+    attr.name = name;
+    attr.cb_mem = cb_mem;
+    attr.cb_size = cb_size;
+    attr.stack_mem = stack_mem;
+    attr.stack_size = stack_size;
+    attr.priority = priority;
+    attr.attr_bits = attr_bits;
+    thread_id_ = ThreadId{osThreadNew(func, args, &attr)};
+  }
+
 private:
   ThreadId thread_id_;
 };
 
+// configSUPPORT_STATIC_ALLOCATION が 0 のプロジェクトでは定義しない
+#if configSUPPORT_STATIC_ALLOCATION == 1
+
+namespace detail {
+
+template <size_t StackSize> struct StaticThreadStorage {
+  StaticTask_t cb_mem_;
+  alignas(8) StackType_t stack_mem_[StackSize / sizeof(StackType_t)];
+};
+
+} // namespace detail
+
+/**
+ * 制御ブロックとスタックをオブジェクト内に持つ Thread です。
+ * FreeRTOSのヒープを使用しません。StackSize はバイト単位で指定します。
+ */
+template <size_t StackSize>
+class StaticThread : private detail::StaticThreadStorage<StackSize>,
+                     public Thread {
+  static_assert(StackSize % sizeof(StackType_t) == 0);
+
+public:
+  StaticThread(void (*func)(void *), void *args, osPriority_t priority,
+               uint32_t attr_bits = 0, const char *name = nullptr)
+      : Thread(func, args, priority, attr_bits, name, &this->cb_mem_,
+               sizeof(this->cb_mem_), this->stack_mem_,
+               sizeof(this->stack_mem_)) {}
+
+private:
+  StaticThread(const StaticThread &) = delete;
+  StaticThread &operator=(const StaticThread &) = delete;
+};
+
+#endif
+
 } // namespace core
 } // namespace stm32rcos
@@ -4,6 +4,7 @@
 #include <memory>
 #include <type_traits>
 
+#include <FreeRTOS.h>
 #include <cmsis_os2.h>
 
 namespace stm32rcos {
@@ -33,9 +34,47 @@ public:
 
   bool is_running() { return osTimerIsRunning(timer_id_.get()) == 1; }
 
+protected:
+  Timer(void (*func)(void *), void *args, osTimerType_t type,
+        uint32_t attr_bits, void *cb_mem, uint32_t cb_size) {
+    osTimerAttr_t attr{};
+    attr.attr_bits = attr_bits;
+    attr.cb_mem = cb_mem;
+    attr.cb_size = cb_size;
+    timer_id_ = TimerId{osTimerNew(func, type, args, &attr)};
+  }
+
 private:
   TimerId timer_id_;
 };
 
+// configSUPPORT_STATIC_ALLOCATION が 0 のプロジェクトでは定義しない
+#if configSUPPORT_STATIC_ALLOCATION == 1
+
+namespace detail {
+
+struct StaticTimerStorage {
+  StaticTimer_t cb_mem_;
+};
+
+} // namespace detail
+
+/**
+ * 制御ブロックをオブジェクト内に持つ Timer です。
+ * FreeRTOSのヒープを使用しません。
+ */
+class StaticTimer : private detail::StaticTimerStorage, public Timer {
+public:
+  StaticTimer(void (*func)(void *), void *args, osTimerType_t type,
+              uint32_t attr_bits = 0)
+      : Timer(func, args, type, attr_bits, &cb_mem_, sizeof(cb_mem_)) {}
+
+private:
+  StaticTimer(const StaticTimer &) = delete;
+  StaticTimer &operator=(const StaticTimer &) = delete;
+};
+
+#endif
+
 } // namespace core
 } // namespace stm32rcos
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "ring_buffer.hpp"
+#include "trace_format.hpp"
+#include "utility.hpp"
+
+#ifdef STM32RCOS_TRACE
+#include <FreeRTOS.h>
+#include <cmsis_os2.h>
+
+#include <stm32cubemx_helper/device.hpp>
+#endif
+
+// STM32RCOS_TRACE を定義すると、スレッドの切り替え、UART/CAN の割り込み、
+// Queue の push/pop、transmit() がトレースバッファに記録される。
+// 定義しなければ記録する処理はすべて空になる。
+//
+// スレッドの切り替えを記録するには、FreeRTOSConfig.h に以下を追加する。
+//
+//   void stm32rcos_trace_task_switched_in(void);
+//   void stm32rcos_trace_task_switched_out(void);
+//   #define traceTASK_SWITCHED_IN() stm32rcos_trace_task_switched_in()
+//   #define traceTASK_SWITCHED_OUT() stm32rcos_trace_task_switched_out()
+
+namespace stm32rcos {
+namespace core {
+
+#ifdef STM32RCOS_TRACE
+
+#ifndef STM32RCOS_TRACE_SIZE
+#define STM32RCOS_TRACE_SIZE 512
+#endif
+
+namespace detail {
+
+inline constexpr size_t TRACE_IGNORE_SIZE = 4;
+
+struct TraceBuffer {
+  RingBuffer<TraceRecord, STM32RCOS_TRACE_SIZE> ring;
+  uint32_t dropped = 0;
+  std::array<uint32_t, TRACE_IGNORE_SIZE> ignored{};
+  size_t ignored_count = 0;
+};
+
+inline uint32_t trace_id(const volatile void *id) {
+  return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(id));
+}
+
+inline TraceBuffer &trace_buffer() {
+  static TraceBuffer buffer;
+  return buffer;
+}
+
+inline uint32_t trace_timestamp() {
+#ifdef DWT
+  return DWT->CYCCNT;
+#else
+  // Cortex-M0 には DWT のサイクルカウンタがない
+  return osKernelGetSysTimerCount();
+#endif
+}
+
+} // namespace detail
+
+/**
+ * DWT のサイクルカウンタを動かします。記録を始める前に1回呼んでください。
+ */
+inline void trace_start() {
+#ifdef DWT
+  CoreDebug->DEMCR = CoreDebug->DEMCR | CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL = DWT->CTRL | DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+/**
+ * 1記録を書き込みます。スレッドからも割り込みからも呼べます。
+ * バッファが一杯なら捨てて、次の SYNC で捨てた数を知らせます。
+ */
+inline void trace(TraceEvent event, const volatile void *id,
+                  uint16_t arg = 0) {
+  auto &buffer = detail::trace_buffer();
+  uint32_t trace_id = detail::trace_id(id);
+  // 書き込み側は割り込みを止めて1つにする。取り出し側とはロックしない
+  CriticalSectionFromISR critical_section;
+  for (size_t i = 0; i < buffer.ignored_count; ++i) {
+    if (buffer.ignored[i] == trace_id) {
+      return;
+    }
+  }
+  TraceRecord record{detail::trace_timestamp(), trace_id, arg, event, 0};
+  if (!buffer.ring.push(record)) {
+    ++buffer.dropped;
+  }
+}
+
+inline void trace_mark(uint16_t value, const volatile void *id = nullptr) {
+  trace(TraceEvent::MARK, id, value);
+}
+
+/**
+ * id の記録をこれ以降残さないようにします。トレースを送り出すスレッドや
+ * ペリフェラル自身の記録で、バッファが埋まらないようにするためのものです。
+ *
+ * @return 登録できる数 (4個) を超えたら false
+ */
+inline bool trace_ignore(const volatile void *id) {
+  auto &buffer = detail::trace_buffer();
+  CriticalSectionFromISR critical_section;
+  if (buffer.ignored_count == buffer.ignored.size()) {
+    return false;
+  }
+  buffer.ignored[buffer.ignored_count++] = detail::trace_id(id);
+  return true;
+}
+
+// 割り込みハンドラの入口と出口を記録する
+class TraceIsrScope {
+public:
+  TraceIsrScope(const volatile void *id, TraceIsr isr) : id_{id}, isr_{isr} {
+    trace(TraceEvent::ISR_ENTER, id_, static_cast<uint16_t>(isr_));
+  }
+
+  ~TraceIsrScope() {
+    trace(TraceEvent::ISR_EXIT, id_, static_cast<uint16_t>(isr_));
+  }
+
+private:
+  const volatile void *id_;
+  TraceIsr isr_;
+
+  TraceIsrScope(const TraceIsrScope &) = delete;
+  TraceIsrScope &operator=(const TraceIsrScope &) = delete;
+};
+
+/**
+ * たまった記録をバイト列として write(data, size) に渡し、渡した記録の数を
+ * 返します。先頭には SYNC の記録を1つ付けます。
+ * 取り出すのは1つのスレッドからだけにしてください。
+ */
+template <class Write> size_t trace_drain(Write &&write) {
+  auto &buffer = detail::trace_buffer();
+  uint32_t now = detail::trace_timestamp();
+  std::span<const TraceRecord> records = buffer.ring.read_span();
+  // SYNC の時刻は続く記録より後にならないようにする
+  TraceRecord sync{records.empty() ? now : records.front().timestamp,
+                   osKernelGetSysTimerFreq(), 0, TraceEvent::SYNC,
+                   TRACE_SYNC_MAGIC};
+  {
+    CriticalSectionFromISR critical_section;
+    sync.arg = std::min<uint32_t>(buffer.dropped, UINT16_MAX);
+    buffer.dropped = 0;
+  }
+  write(reinterpret_cast<const uint8_t *>(&sync), sizeof(sync));
+  size_t count = 0;
+  // 折り返しの前後で最大2回に分かれる
+  for (int i = 0; i < 2 && !records.empty(); ++i) {
+    write(reinterpret_cast<const uint8_t *>(records.data()),
+          records.size_bytes());
+    buffer.ring.consume(records.size());
+    count += records.size();
+    records = buffer.ring.read_span();
+  }
+  return count;
+}
+
+#else
+
+inline void trace_start() {}
+
+inline void trace(TraceEvent, const volatile void *, uint16_t = 0) {}
+
+inline void trace_mark(uint16_t, const volatile void * = nullptr) {}
+
+inline bool trace_ignore(const volatile void *) { return true; }
+
+struct TraceIsrScope {
+  TraceIsrScope(const volatile void *, TraceIsr) {}
+};
+
+#endif
+
+} // namespace core
+} // namespace stm32rcos
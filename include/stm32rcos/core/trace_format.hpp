@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <span>
+
+// トレースの記録の形式と、ホストでの変換。FreeRTOS や HAL には依存しないので、
+// PC のプログラムからもこのヘッダだけを include して使える
+
+namespace stm32rcos {
+namespace core {
+
+enum class TraceEvent : uint8_t {
+  // 取り出し側が先頭に入れる。id はタイムスタンプの周波数、
+  // arg はバッファが一杯で捨てた記録の数
+  SYNC,
+  THREAD_IN,
+  THREAD_OUT,
+  ISR_ENTER,
+  ISR_EXIT,
+  // arg は成功したら 1
+  QUEUE_PUSH,
+  QUEUE_POP,
+  // arg は送信するバイト数、またはフレーム数
+  TRANSMIT,
+  // trace_mark() で記録する。arg は任意の値
+  MARK,
+};
+
+// ISR_ENTER/ISR_EXIT の arg
+enum class TraceIsr : uint16_t {
+  UART_TX,
+  UART_RX,
+  UART_ERROR,
+  CAN_RX,
+  CAN_TX,
+  CAN_ERROR,
+};
+
+/**
+ * トレースの1記録です。リトルエンディアンの 12 バイトで、そのまま
+ * 送信されます。
+ *
+ * | offset | size | |
+ * |---|---|---|
+ * | 0 | 4 | タイムスタンプ (DWT のサイクルカウンタ) |
+ * | 4 | 4 | スレッドのハンドル、ペリフェラルのハンドルなどのアドレス |
+ * | 8 | 2 | イベントごとの値 |
+ * | 10 | 1 | TraceEvent |
+ * | 11 | 1 | SYNC なら 0xA5、それ以外は 0 |
+ */
+struct TraceRecord {
+  uint32_t timestamp;
+  uint32_t id;
+  uint16_t arg;
+  TraceEvent event;
+  uint8_t magic;
+};
+
+static_assert(sizeof(TraceRecord) == 12);
+
+inline constexpr uint8_t TRACE_SYNC_MAGIC = 0xA5;
+
+/**
+ * trace_drain() で取り出したバイト列を、Chrome の about:tracing や
+ * Perfetto で開ける JSON に変換します。マイコンには依存しないので、
+ * ホストのプログラムから使えます。
+ *
+ * スレッドは id ごとの行に、割り込みは "isr" の行に表示されます。
+ * 先頭は SYNC の記録に揃え、それより前のバイトは読み飛ばします。
+ * 途中で形式の合わない記録があれば、次の SYNC まで読み飛ばします。
+ * 検査は形式だけなので、ずれた位置がたまたま記録に見えると、その次の
+ * SYNC までまとめて失うことがあります。
+ *
+ * @code{.cpp}
+ * // stdin から読んだバイト列を変換する
+ * std::vector<uint8_t> data{std::istreambuf_iterator<char>(std::cin), {}};
+ * write_chrome_trace(data, [](const char *s, size_t n) {
+ *   std::fwrite(s, 1, n, stdout);
+ * });
+ * @endcode
+ *
+ * @return 変換した記録の数
+ */
+template <class Write>
+size_t write_chrome_trace(std::span<const uint8_t> data, Write &&write) {
+  constexpr uint32_t ISR_TID = 0;
+  static constexpr const char *ISR_NAMES[] = {
+      "UART_TX", "UART_RX", "UART_ERROR", "CAN_RX", "CAN_TX", "CAN_ERROR"};
+  static constexpr const char *EVENT_NAMES[] = {
+      "SYNC",   "THREAD_IN", "THREAD_OUT", "ISR_ENTER", "ISR_EXIT",
+      "QUEUE_PUSH", "QUEUE_POP", "TRANSMIT", "MARK"};
+  char line[160];
+  auto emit = [&](int length) {
+    if (length > 0) {
+      write(line, std::min<size_t>(length, sizeof(line) - 1));
+    }
+  };
+  auto read = [&data](size_t offset) {
+    TraceRecord record;
+    std::memcpy(&record, data.data() + offset, sizeof(record));
+    return record;
+  };
+  auto is_sync = [](const TraceRecord &record) {
+    return record.event == TraceEvent::SYNC &&
+           record.magic == TRACE_SYNC_MAGIC && record.id != 0;
+  };
+  auto is_valid = [&is_sync](const TraceRecord &record) {
+    return is_sync(record) ||
+           (record.magic == 0 && record.event > TraceEvent::SYNC &&
+            record.event <= TraceEvent::MARK);
+  };
+  auto find_sync = [&](size_t offset) {
+    while (offset + sizeof(TraceRecord) <= data.size() &&
+           !is_sync(read(offset))) {
+      ++offset;
+    }
+    return offset;
+  };
+
+  emit(std::snprintf(line, sizeof(line),
+                     "{\"traceEvents\":[\n{\"ph\":\"M\",\"name\":"
+                     "\"thread_name\",\"pid\":0,\"tid\":%u,"
+                     "\"args\":{\"name\":\"isr\"}}",
+                     static_cast<unsigned>(ISR_TID)));
+
+  size_t offset = find_sync(0);
+  uint32_t freq = 0;
+  uint32_t last = 0;
+  if (offset + sizeof(TraceRecord) <= data.size()) {
+    freq = read(offset).id;
+    last = read(offset).timestamp;
+  }
+  int64_t time = 0;
+  uint32_t current = ISR_TID;
+  uint32_t isr_depth = 0;
+  size_t count = 0;
+  while (offset + sizeof(TraceRecord) <= data.size()) {
+    TraceRecord record = read(offset);
+    if (!is_valid(record)) {
+      // 途中でバイトが欠けたら、次の SYNC まで読み飛ばす
+      offset = find_sync(offset + 1);
+      continue;
+    }
+    offset += sizeof(TraceRecord);
+    // 32 ビットのカウンタは数十秒で一周するので、差分を積み上げる
+    time += static_cast<int32_t>(record.timestamp - last);
+    last = record.timestamp;
+    uint64_t ns = std::max<int64_t>(time, 0) * 1000000000 / freq;
+    unsigned long long us = ns / 1000;
+    unsigned frac = ns % 1000;
+    const char *name = EVENT_NAMES[static_cast<size_t>(record.event)];
+    switch (record.event) {
+    case TraceEvent::SYNC:
+      freq = record.id;
+      if (record.arg != 0) {
+        emit(std::snprintf(line, sizeof(line),
+                           ",\n{\"ph\":\"i\",\"name\":\"dropped\",\"pid\":0,"
+                           "\"tid\":%u,\"ts\":%llu.%03u,\"s\":\"g\","
+                           "\"args\":{\"count\":%u}}",
+                           static_cast<unsigned>(ISR_TID), us, frac,
+                           static_cast<unsigned>(record.arg)));
+      }
+      break;
+    case TraceEvent::THREAD_IN:
+    case TraceEvent::THREAD_OUT:
+      current = record.event == TraceEvent::THREAD_IN ? record.id : ISR_TID;
+      emit(std::snprintf(line, sizeof(line),
+                         ",\n{\"ph\":\"%c\",\"name\":\"0x%08" PRIx32
+                         "\",\"pid\":0,\"tid\":%" PRIu32 ",\"ts\":%llu.%03u}",
+                         record.event == TraceEvent::THREAD_IN ? 'B' : 'E',
+                         record.id, record.id, us, frac));
+      break;
+    case TraceEvent::ISR_ENTER:
+    case TraceEvent::ISR_EXIT: {
+      bool enter = record.event == TraceEvent::ISR_ENTER;
+      isr_depth = enter ? isr_depth + 1 : (isr_depth ? isr_depth - 1 : 0);
+      const char *isr = record.arg < std::size(ISR_NAMES)
+                            ? ISR_NAMES[record.arg]
+                            : "ISR";
+      emit(std::snprintf(line, sizeof(line),
+                         ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":0,"
+                         "\"tid\":%u,\"ts\":%llu.%03u,"
+                         "\"args\":{\"id\":\"0x%08" PRIx32 "\"}}",
+                         enter ? 'B' : 'E', isr,
+                         static_cast<unsigned>(ISR_TID), us, frac, record.id));
+      break;
+    }
+    default:
+      // 割り込みの中で起きたものは "isr" の行に出す
+      emit(std::snprintf(line, sizeof(line),
+                         ",\n{\"ph\":\"i\",\"name\":\"%s\",\"pid\":0,"
+                         "\"tid\":%" PRIu32 ",\"ts\":%llu.%03u,\"s\":\"t\","
+                         "\"args\":{\"id\":\"0x%08" PRIx32 "\",\"arg\":%u}}",
+                         name, isr_depth ? ISR_TID : current, us, frac,
+                         record.id, static_cast<unsigned>(record.arg)));
+      break;
+    }
+    ++count;
+  }
+  emit(std::snprintf(line, sizeof(line), "\n]}\n"));
+  return count;
+}
+
+} // namespace core
+} // namespace stm32rcos
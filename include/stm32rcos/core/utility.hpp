@@ -21,5 +21,30 @@ private:
   TimeOut_t timeout_state_;
 };
 
+class CriticalSection {
+public:
+  CriticalSection() { taskENTER_CRITICAL(); }
+
+  ~CriticalSection() { taskEXIT_CRITICAL(); }
+
+private:
+  CriticalSection(const CriticalSection &) = delete;
+  CriticalSection &operator=(const CriticalSection &) = delete;
+};
+
+// 割り込みからも使える。スレッドから使ってもよい
+class CriticalSectionFromISR {
+public:
+  CriticalSectionFromISR() : saved_(taskENTER_CRITICAL_FROM_ISR()) {}
+
+  ~CriticalSectionFromISR() { taskEXIT_CRITICAL_FROM_ISR(saved_); }
+
+private:
+  UBaseType_t saved_;
+
+  CriticalSectionFromISR(const CriticalSectionFromISR &) = delete;
+  CriticalSectionFromISR &operator=(const CriticalSectionFromISR &) = delete;
+};
+
 } // namespace core
 } // namespace stm32rcos
\ No newline at end of file
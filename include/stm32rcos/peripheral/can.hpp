@@ -1,10 +1,23 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
 #include "stm32rcos/hal.hpp"
 
 #include "can/can_base.hpp"
+#include "can/can_cyclic_tx.hpp"
+#include "can/can_fd_message.hpp"
 #include "can/can_filter.hpp"
+#include "can/can_filter_plan.hpp"
+#include "can/can_iso_tp.hpp"
+#include "can/can_mailbox.hpp"
 #include "can/can_message.hpp"
+#include "can/can_rx_handler.hpp"
+#include "can/can_statistics.hpp"
+#include "can/can_timestamp.hpp"
+#include "can/can_tx_event.hpp"
 
 #ifdef HAL_CAN_MODULE_ENABLED
 #include "can/detail/bxcan.hpp"
@@ -14,6 +27,12 @@
 #include "can/detail/fdcan.hpp"
 #endif
 
+// 実機なしで試すための仮想CANバス。VirtualCanBus を参照
+#ifdef STM32RCOS_VIRTUAL_CAN
+#include "can/detail/virtual_can.hpp"
+#include "can/virtual_can_bus.hpp"
+#endif
+
 namespace stm32rcos {
 namespace peripheral {
 
@@ -77,12 +96,125 @@ namespace peripheral {
 template <auto *Handle, class HandleType = decltype(Handle)>
 class Can : public CanBase {
 public:
+  /**
+   * @param tx_queue_size 送信メールボックス/FIFOが埋まっているときにフレームを
+   * 溜めておく、ソフトウェア送信キューの長さ
+   */
+  Can(size_t tx_queue_size = 16);
   bool start() override;
   bool stop() override;
   bool transmit(const CanMessage &msg, uint32_t timeout) override;
+  /**
+   * 空いている送信メールボックス/FIFOを一度にすべて埋め、残りを送信キューに
+   * 入れます。
+   *
+   * @return 送信または送信キューに入れたフレーム数
+   */
+  size_t transmit_burst(std::span<const CanMessage> msgs,
+                        uint32_t timeout) override;
   bool attach_rx_queue(const CanFilter &filter,
                        core::Queue<CanMessage> &queue) override;
+  /**
+   * ID の集合を受け付けるよう、ハードウェアフィルタをできるだけ少なく
+   * 割り当てます。
+   *
+   * bxCAN では BxCanFilterPlan、FDCAN では FdCanFilterPlan を受け取る
+   * オーバーロードもあり、plan_bxcan_filters()/plan_fdcan_filters() で
+   * コンパイル時に計算した割り当てをそのまま渡せます。
+   */
+  bool attach_rx_queue(std::span<const CanIdRange> ids,
+                       core::Queue<CanMessage> &queue) override;
   bool detach_rx_queue(const core::Queue<CanMessage> &queue) override;
+  /**
+   * フィルタに一致したフレームで mailbox を上書きします。キューと違い、
+   * 読み出されていない古いフレームは捨てられます。
+   */
+  bool attach_rx_mailbox(const CanFilter &filter,
+                         CanMailbox &mailbox) override;
+  bool attach_rx_mailbox(std::span<const CanIdRange> ids,
+                         CanMailbox &mailbox) override;
+  bool detach_rx_mailbox(const CanMailbox &mailbox) override;
+  /**
+   * ID が一致するフレームを受信したときに callback を呼びます。
+   * 登録されたIDはまとめて受信フィルタに詰め込まれ、受信キューより
+   * 優先されます。
+   *
+   * @param deferred false なら受信割り込みから直接呼びます。true なら
+   * start_rx_worker() で起動したスレッドから呼びます。
+   * @param fifo このIDを受信するFIFO
+   */
+  bool attach_rx_handler(uint32_t id, bool ide, CanRxCallback callback,
+                         void *context, bool deferred = false,
+                         CanRxFifo fifo = CanRxFifo::FIFO0) override;
+  bool detach_rx_handler(uint32_t id, bool ide) override;
+  /**
+   * deferred なハンドラを呼ぶスレッドを起動します。
+   *
+   * @param queue_size 割り込みからスレッドへ渡すフレームのキューの長さ
+   */
+  bool start_rx_worker(size_t queue_size, size_t stack_size,
+                       osPriority_t priority) override;
+  /**
+   * slot を周期送信に加えます。先に加えたものほど優先して送ります。
+   *
+   * 期限の来たフレームは送信キューより先に送信メールボックス/Tx FIFOへ
+   * 入るので、遅れは送信中のフレーム数個分に収まります。
+   */
+  bool attach_cyclic_tx(CanCyclicSlot &slot) override;
+  bool detach_cyclic_tx(const CanCyclicSlot &slot) override;
+  /**
+   * 周期送信の時間を1つ進め、期限の来たフレームを送り出します。
+   * 一定周期のハードウェアタイマ割り込みから呼んでください。
+   * 割り込み優先度は FreeRTOS の API を呼べる範囲にしてください。
+   */
+  void process_cyclic_tx() override;
+  /**
+   * 受信フレームと送信イベントの timestamp が1秒に進む数を返します。
+   * can_timestamp_to_us() でマイクロ秒に変換できます。
+   * 受信フレームの timestamp は STM32RCOS_CAN_TIMESTAMP を定義したときだけ
+   * 付きます。送信イベントには常に付きます。
+   *
+   * bxCAN では CubeMX で Time Triggered Communication Mode を有効にした
+   * ときだけ、ビットタイム単位のタイムスタンプが付きます。無効なら 0 です。
+   * FDCAN では start() がカウンタを有効にし、公称ビットタイム単位で数えます。
+   */
+  uint32_t timestamp_frequency() const override;
+  /**
+   * 送信が完了したフレームの ID と送信時刻を queue に入れます。
+   * 登録できるキューは1つだけです。
+   *
+   * bxCAN では timestamp_frequency() が 0 なら登録できません。FDCAN では
+   * Tx Event FIFO を使います。STM32H7 では CubeMX で Tx Events Nbr を1以上に
+   * してください。
+   */
+  bool attach_tx_event_queue(core::Queue<CanTxEvent> &queue) override;
+  bool detach_tx_event_queue(const core::Queue<CanTxEvent> &queue) override;
+  /**
+   * 受信先ごとに、登録してから受信したフレーム数を返します。
+   * 受信ハンドラは id、ide で指定します。
+   */
+  uint32_t rx_frames(const core::Queue<CanMessage> &queue) const override;
+  uint32_t rx_frames(const CanMailbox &mailbox) const override;
+  uint32_t rx_frames(uint32_t id, bool ide) const override;
+  /**
+   * 送信/受信エラーカウンタ(TEC/REC)とエラー状態を、レジスタから読み出します。
+   */
+  CanErrorState error_state() const override;
+  /**
+   * 直近0.5~1秒のバス負荷率を、0.1%単位で返します。
+   *
+   * 自分が送信したフレームと、受信フィルタを通ったフレームから見積もるので、
+   * フィルタで捨てたフレームの分は含まれません。スタッフビットも数えません。
+   */
+  uint32_t bus_load_permille() const override;
+  /**
+   * 送受信のカウンタです。受信割り込みでの更新は、フレームごとに数回の
+   * load/storeと、短い割り込み禁止だけです。
+   *
+   * FDCAN の tx_frames は Tx Event FIFO から数えます。STM32H7 では CubeMX で
+   * Tx Events Nbr を1以上にしてください。
+   */
+  const CanStatistics &statistics() const override;
 };
 
 } // namespace peripheral
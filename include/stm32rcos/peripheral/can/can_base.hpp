@@ -1,11 +1,18 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <span>
 
 #include "stm32rcos/core.hpp"
 
+#include "can_cyclic_tx.hpp"
 #include "can_filter.hpp"
+#include "can_mailbox.hpp"
 #include "can_message.hpp"
+#include "can_rx_handler.hpp"
+#include "can_statistics.hpp"
+#include "can_tx_event.hpp"
 
 namespace stm32rcos {
 namespace peripheral {
@@ -16,9 +23,36 @@ public:
   virtual bool start() = 0;
   virtual bool stop() = 0;
   virtual bool transmit(const CanMessage &msg, uint32_t timeout) = 0;
+  virtual size_t transmit_burst(std::span<const CanMessage> msgs,
+                                uint32_t timeout) = 0;
   virtual bool attach_rx_queue(const CanFilter &filter,
                                core::Queue<CanMessage> &queue) = 0;
+  virtual bool attach_rx_queue(std::span<const CanIdRange> ids,
+                               core::Queue<CanMessage> &queue) = 0;
   virtual bool detach_rx_queue(const core::Queue<CanMessage> &queue) = 0;
+  virtual bool attach_rx_mailbox(const CanFilter &filter,
+                                 CanMailbox &mailbox) = 0;
+  virtual bool attach_rx_mailbox(std::span<const CanIdRange> ids,
+                                 CanMailbox &mailbox) = 0;
+  virtual bool detach_rx_mailbox(const CanMailbox &mailbox) = 0;
+  virtual bool attach_rx_handler(uint32_t id, bool ide, CanRxCallback callback,
+                                 void *context, bool deferred = false,
+                                 CanRxFifo fifo = CanRxFifo::FIFO0) = 0;
+  virtual bool detach_rx_handler(uint32_t id, bool ide) = 0;
+  virtual bool start_rx_worker(size_t queue_size, size_t stack_size,
+                               osPriority_t priority) = 0;
+  virtual bool attach_cyclic_tx(CanCyclicSlot &slot) = 0;
+  virtual bool detach_cyclic_tx(const CanCyclicSlot &slot) = 0;
+  virtual void process_cyclic_tx() = 0;
+  virtual uint32_t timestamp_frequency() const = 0;
+  virtual bool attach_tx_event_queue(core::Queue<CanTxEvent> &queue) = 0;
+  virtual bool detach_tx_event_queue(const core::Queue<CanTxEvent> &queue) = 0;
+  virtual uint32_t rx_frames(const core::Queue<CanMessage> &queue) const = 0;
+  virtual uint32_t rx_frames(const CanMailbox &mailbox) const = 0;
+  virtual uint32_t rx_frames(uint32_t id, bool ide) const = 0;
+  virtual CanErrorState error_state() const = 0;
+  virtual uint32_t bus_load_permille() const = 0;
+  virtual const CanStatistics &statistics() const = 0;
 };
 
 } // namespace peripheral
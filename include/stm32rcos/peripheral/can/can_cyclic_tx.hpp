@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "can_message.hpp"
+#include "can_statistics.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+namespace detail {
+
+template <size_t N> class CanCyclicScheduler;
+
+} // namespace detail
+
+/**
+ * 一定周期で送信するフレームです。
+ *
+ * 周期は process_cyclic_tx() を呼ぶハードウェアタイマ割り込みの回数で
+ * 数えます。データは update() でロックを取らずに差し替えられます。
+ *
+ * @code{.cpp}
+ * // 1kHz のタイマ割り込みから can1.process_cyclic_tx() を呼ぶ
+ * CanCyclicSlot motor({.id = 0x200, .ide = false, .dlc = 8}, 1);
+ * CanCyclicSlot status({.id = 0x300, .ide = false, .dlc = 4}, 10, 5);
+ * can1.attach_cyclic_tx(motor);
+ * can1.attach_cyclic_tx(status);
+ *
+ * std::array<uint8_t, 8> command = {};
+ * motor.update(command);
+ * @endcode
+ */
+class CanCyclicSlot {
+public:
+  /**
+   * @param period 送信周期 [タイマ割り込みの回数]。1 以上
+   * @param phase 最初の送信までの回数。周期の同じフレームをずらすのに使う
+   */
+  CanCyclicSlot(const CanMessage &msg, uint32_t period, uint32_t phase = 0)
+      : buffers_{msg, msg}, period_{std::max<uint32_t>(period, 1)},
+        countdown_{phase + 1} {}
+
+  // 書き込む側は1つのスレッドに限る
+  void update(std::span<const uint8_t> data) {
+    uint8_t index = active_.load(std::memory_order_relaxed) ^ 1;
+    CanMessage &msg = buffers_[index];
+    msg.dlc = std::min<size_t>(data.size(), msg.data.size());
+    std::copy_n(data.begin(), msg.dlc, msg.data.begin());
+    // 割り込みは書き込み中のスレッドを追い越して最後まで読むので、
+    // 公開していない方のバッファに書いてから切り替えれば破れない
+    active_.store(index, std::memory_order_release);
+  }
+
+  // 前のフレームを送り出す前に次の周期が来た回数
+  uint32_t missed() const { return missed_.load(std::memory_order_relaxed); }
+
+  // 送信メールボックス/Tx FIFOへ渡した回数
+  uint32_t transmitted() const {
+    return transmitted_.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::array<CanMessage, 2> buffers_;
+  std::atomic<uint8_t> active_{0};
+  uint32_t period_;
+  uint32_t countdown_;
+  bool pending_ = false;
+  std::atomic<uint32_t> missed_{0};
+  std::atomic<uint32_t> transmitted_{0};
+
+  template <size_t N> friend class detail::CanCyclicScheduler;
+
+  CanCyclicSlot(const CanCyclicSlot &) = delete;
+  CanCyclicSlot &operator=(const CanCyclicSlot &) = delete;
+};
+
+namespace detail {
+
+/**
+ * 周期送信フレームの期限を数え、期限の来たフレームを送信キューより先に
+ * 取り出させます。呼び出し側でクリティカルセクションに入ってから使います。
+ */
+template <size_t N> class CanCyclicScheduler {
+public:
+  bool attach(CanCyclicSlot &slot) {
+    if (size_ == N || std::find(slots_.begin(), slots_.begin() + size_,
+                                &slot) != slots_.begin() + size_) {
+      return false;
+    }
+    slot.pending_ = false;
+    slots_[size_++] = &slot;
+    return true;
+  }
+
+  bool detach(const CanCyclicSlot &slot) {
+    auto it = std::find(slots_.begin(), slots_.begin() + size_, &slot);
+    if (it == slots_.begin() + size_) {
+      return false;
+    }
+    // attach した順が取り出す優先順位なので、詰めて順番を保つ
+    std::copy(it + 1, slots_.begin() + size_, it);
+    --size_;
+    return true;
+  }
+
+  // タイマ割り込みから呼ぶ
+  void tick() {
+    for (size_t i = 0; i < size_; ++i) {
+      CanCyclicSlot &slot = *slots_[i];
+      if (--slot.countdown_ != 0) {
+        continue;
+      }
+      slot.countdown_ = slot.period_;
+      if (slot.pending_) {
+        increment(slot.missed_);
+      }
+      slot.pending_ = true;
+    }
+  }
+
+  // 期限が来ていて、まだ送り出していないフレームを取り出す
+  bool pop(CanMessage &msg) {
+    for (size_t i = 0; i < size_; ++i) {
+      CanCyclicSlot &slot = *slots_[i];
+      if (slot.pending_) {
+        msg = slot.buffers_[slot.active_.load(std::memory_order_acquire)];
+        slot.pending_ = false;
+        increment(slot.transmitted_);
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  std::array<CanCyclicSlot *, N> slots_{};
+  size_t size_ = 0;
+};
+
+} // namespace detail
+
+} // namespace peripheral
+} // namespace stm32rcos
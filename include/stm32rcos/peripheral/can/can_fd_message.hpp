@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * CAN FDのフレームです。dlc はDLCの値(0~15)で、データ長は
+ * can_fd_dlc_to_length() で求めます。
+ *
+ * fdf が false なら従来のCANフレームとして送受信します。
+ * brs が true ならデータフェーズをデータビットレートで送信します。
+ * timestamp は CanMessage と同じく、STM32RCOS_CAN_TIMESTAMP を定義した
+ * ときだけあり、受信したときだけ設定されます。
+ */
+struct CanFdMessage {
+  uint32_t id;
+  bool ide;
+  bool fdf;
+  bool brs;
+  uint8_t dlc;
+  std::array<uint8_t, 64> data;
+#ifdef STM32RCOS_CAN_TIMESTAMP
+  uint64_t timestamp = 0;
+#endif
+};
+
+constexpr size_t can_fd_dlc_to_length(uint8_t dlc) {
+  constexpr uint8_t LENGTHS[] = {0,  1,  2,  3,  4,  5,  6,  7,
+                                 8,  12, 16, 20, 24, 32, 48, 64};
+  return dlc < 16 ? LENGTHS[dlc] : 64;
+}
+
+// length バイトが収まる最小のDLCを返す
+constexpr uint8_t can_fd_length_to_dlc(size_t length) {
+  uint8_t dlc = 0;
+  while (dlc < 15 && can_fd_dlc_to_length(dlc) < length) {
+    ++dlc;
+  }
+  return dlc;
+}
+
+} // namespace peripheral
+} // namespace stm32rcos
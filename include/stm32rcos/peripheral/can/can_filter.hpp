@@ -5,10 +5,29 @@
 namespace stm32rcos {
 namespace peripheral {
 
+/**
+ * 受信FIFOです。FIFO0 と FIFO1 は別々の割り込みで処理されます。
+ * 非常停止や制御用のフレームを FIFO1 に分けておくと、FIFO0 がテレメトリで
+ * 溢れても失われません。
+ */
+enum class CanRxFifo : uint8_t {
+  FIFO0,
+  FIFO1,
+};
+
 struct CanFilter {
   uint32_t id;
   uint32_t mask;
   bool ide;
+  CanRxFifo fifo = CanRxFifo::FIFO0;
+};
+
+// first から last までの連続したID。単一のIDは first == last で表す
+struct CanIdRange {
+  uint32_t first;
+  uint32_t last;
+  bool ide;
+  CanRxFifo fifo = CanRxFifo::FIFO0;
 };
 
 } // namespace peripheral
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "can_filter.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * bxCANのフィルタバンク1つ分の設定です。
+ * id/mask の各値は CAN_FilterTypeDef の同名フィールドにそのまま入ります。
+ */
+struct BxCanFilterBank {
+  bool list_mode = false;
+  bool scale_32bit = true;
+  uint16_t id_high = 0;
+  uint16_t id_low = 0;
+  uint16_t mask_id_high = 0;
+  uint16_t mask_id_low = 0;
+  CanRxFifo fifo = CanRxFifo::FIFO0;
+};
+
+enum class FdCanFilterType : uint8_t {
+  RANGE,
+  DUAL,
+  MASK,
+};
+
+/**
+ * FDCANのフィルタエレメント1つ分の設定です。
+ * id1/id2 は FDCAN_FilterTypeDef の FilterID1/FilterID2 に入ります。
+ */
+struct FdCanFilterElement {
+  FdCanFilterType type = FdCanFilterType::MASK;
+  bool ide = false;
+  uint32_t id1 = 0;
+  uint32_t id2 = 0;
+  CanRxFifo fifo = CanRxFifo::FIFO0;
+};
+
+/**
+ * ハードウェアフィルタの割り当て結果です。
+ * Capacity に収まらなかった場合は overflow() が true になります。
+ */
+template <class Element, size_t Capacity> class CanFilterPlan {
+public:
+  constexpr void push_back(const Element &element) {
+    if (size_ < Capacity) {
+      elements_[size_++] = element;
+    } else {
+      overflow_ = true;
+    }
+  }
+
+  constexpr const Element *begin() const { return elements_.data(); }
+  constexpr const Element *end() const { return elements_.data() + size_; }
+  constexpr size_t size() const { return size_; }
+  constexpr bool overflow() const { return overflow_; }
+
+private:
+  std::array<Element, Capacity> elements_{};
+  size_t size_ = 0;
+  bool overflow_ = false;
+};
+
+using BxCanFilterPlan = CanFilterPlan<BxCanFilterBank, 28>;
+using FdCanFilterPlan = CanFilterPlan<FdCanFilterElement, 32>;
+
+namespace detail {
+
+constexpr uint32_t max_can_id(bool ide) { return ide ? 0x1FFFFFFF : 0x7FF; }
+
+// FIFO、標準/拡張IDごとにIDの昇順で並べ、重なる範囲と隣り合う範囲をまとめる
+constexpr std::vector<CanIdRange>
+normalize_id_ranges(std::span<const CanIdRange> ranges) {
+  std::vector<CanIdRange> sorted;
+  for (const CanIdRange &range : ranges) {
+    uint32_t last = std::min(range.last, max_can_id(range.ide));
+    if (range.first <= last) {
+      sorted.push_back({range.first, last, range.ide, range.fifo});
+    }
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const CanIdRange &a, const CanIdRange &b) {
+              if (a.fifo != b.fifo) {
+                return a.fifo < b.fifo;
+              }
+              if (a.ide != b.ide) {
+                return b.ide;
+              }
+              return a.first < b.first;
+            });
+  std::vector<CanIdRange> merged;
+  for (const CanIdRange &range : sorted) {
+    if (!merged.empty() && merged.back().fifo == range.fifo &&
+        merged.back().ide == range.ide &&
+        range.first <= merged.back().last + 1) {
+      merged.back().last = std::max(merged.back().last, range.last);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
+}
+
+// 範囲を、下位ビットを無視するマスクで表せるブロックに分けて f(id, mask) を
+// 呼ぶ。マスクが全ビットなら単一のIDを表す
+template <class F>
+constexpr void for_each_mask_block(const CanIdRange &range, F f) {
+  uint32_t first = range.first;
+  while (true) {
+    uint32_t size = first & (~first + 1);
+    if (size == 0) {
+      size = max_can_id(range.ide) + 1;
+    }
+    while (size - 1 > range.last - first) {
+      size >>= 1;
+    }
+    f(first, max_can_id(range.ide) & ~(size - 1));
+    if (size - 1 == range.last - first) {
+      break;
+    }
+    first += size;
+  }
+}
+
+// 1つのFIFOに割り当てるIDを、バンクに詰めて plan に追加する
+constexpr void plan_bxcan_fifo(std::span<const CanIdRange> ranges,
+                               CanRxFifo fifo, BxCanFilterPlan &plan) {
+  std::vector<uint16_t> std_ids;
+  std::vector<std::array<uint16_t, 2>> std_masks;
+  std::vector<uint32_t> ext_ids;
+  std::vector<std::array<uint32_t, 2>> ext_masks;
+  for (const CanIdRange &range : ranges) {
+    if (range.fifo != fifo) {
+      continue;
+    }
+    for_each_mask_block(range, [&](uint32_t id, uint32_t mask) {
+      // 16bitはSTDID[10:0] RTR IDE EXID[17:15]、32bitは ID IDE RTR 0
+      // RTR、IDEも比較して、データフレームだけを通す
+      if (range.ide) {
+        uint32_t id_reg = (id << 3) | 0x4;
+        if (mask == max_can_id(true)) {
+          ext_ids.push_back(id_reg);
+        } else {
+          ext_masks.push_back({id_reg, (mask << 3) | 0x6});
+        }
+      } else {
+        uint16_t id_reg = id << 5;
+        if (mask == max_can_id(false)) {
+          std_ids.push_back(id_reg);
+        } else {
+          std_masks.push_back(
+              {id_reg, static_cast<uint16_t>((mask << 5) | 0x18)});
+        }
+      }
+    });
+  }
+
+  // リストの端数はマスクに回したほうがバンクが減ることがある
+  size_t best = 0;
+  size_t best_banks = SIZE_MAX;
+  for (size_t k = 0; k <= std::min<size_t>(3, std_ids.size()); ++k) {
+    size_t banks =
+        (std_ids.size() - k + 3) / 4 + (std_masks.size() + k + 1) / 2;
+    if (banks < best_banks) {
+      best = k;
+      best_banks = banks;
+    }
+  }
+  for (size_t k = 0; k < best; ++k) {
+    std_masks.push_back({std_ids.back(), 0xFFF8});
+    std_ids.pop_back();
+  }
+
+  // 空いた枠は同じ内容で埋める
+  for (size_t i = 0; i < std_ids.size(); i += 4) {
+    auto at = [&](size_t j) {
+      return std_ids[std::min(i + j, std_ids.size() - 1)];
+    };
+    plan.push_back({true, false, at(2), at(0), at(3), at(1), fifo});
+  }
+  for (size_t i = 0; i < std_masks.size(); i += 2) {
+    const auto &a = std_masks[i];
+    const auto &b = std_masks[std::min(i + 1, std_masks.size() - 1)];
+    plan.push_back({false, false, b[0], a[0], b[1], a[1], fifo});
+  }
+  for (size_t i = 0; i < ext_ids.size(); i += 2) {
+    uint32_t a = ext_ids[i];
+    uint32_t b = ext_ids[std::min(i + 1, ext_ids.size() - 1)];
+    plan.push_back({true, true, static_cast<uint16_t>(a >> 16),
+                    static_cast<uint16_t>(a), static_cast<uint16_t>(b >> 16),
+                    static_cast<uint16_t>(b), fifo});
+  }
+  for (const auto &[id_reg, mask_reg] : ext_masks) {
+    plan.push_back({false, true, static_cast<uint16_t>(id_reg >> 16),
+                    static_cast<uint16_t>(id_reg),
+                    static_cast<uint16_t>(mask_reg >> 16),
+                    static_cast<uint16_t>(mask_reg), fifo});
+  }
+}
+
+} // namespace detail
+
+/**
+ * IDの集合を、できるだけ少ないbxCANのフィルタバンクに詰め込みます。
+ *
+ * 単一の標準IDは16bitリストモード(1バンク4個)、標準IDの範囲は16bitマスク
+ * モード(1バンク2個)、拡張IDは32bitのリスト(1バンク2個)またはマスクで
+ * 表します。引数が定数式なら、コンパイル時に計算できます。
+ *
+ * @code{.cpp}
+ * constexpr CanIdRange ids[] = {
+ *     {0x201, 0x208, false},
+ *     {0x300, 0x300, false},
+ * };
+ * constexpr BxCanFilterPlan plan = plan_bxcan_filters(ids);
+ * static_assert(plan.size() == 2);
+ * can1.attach_rx_queue(plan, rx_queue);
+ * @endcode
+ */
+constexpr BxCanFilterPlan
+plan_bxcan_filters(std::span<const CanIdRange> ranges) {
+  std::vector<CanIdRange> normalized = detail::normalize_id_ranges(ranges);
+  BxCanFilterPlan plan;
+  detail::plan_bxcan_fifo(normalized, CanRxFifo::FIFO0, plan);
+  detail::plan_bxcan_fifo(normalized, CanRxFifo::FIFO1, plan);
+  return plan;
+}
+
+/**
+ * IDの集合を、できるだけ少ないFDCANのフィルタエレメントに詰め込みます。
+ *
+ * 連続したIDはレンジフィルタ1つ、単一のIDはデュアルフィルタ1つに2個ずつ
+ * 入れます。引数が定数式なら、コンパイル時に計算できます。
+ */
+constexpr FdCanFilterPlan
+plan_fdcan_filters(std::span<const CanIdRange> ranges) {
+  FdCanFilterPlan plan;
+  std::vector<CanIdRange> singles;
+  for (const CanIdRange &range : detail::normalize_id_ranges(ranges)) {
+    if (range.first == range.last) {
+      singles.push_back(range);
+    } else {
+      plan.push_back({FdCanFilterType::RANGE, range.ide, range.first,
+                      range.last, range.fifo});
+    }
+  }
+  for (size_t i = 0; i < singles.size();) {
+    const CanIdRange &a = singles[i];
+    if (i + 1 < singles.size() && singles[i + 1].ide == a.ide &&
+        singles[i + 1].fifo == a.fifo) {
+      plan.push_back({FdCanFilterType::DUAL, a.ide, a.first,
+                      singles[i + 1].first, a.fifo});
+      i += 2;
+    } else {
+      plan.push_back(
+          {FdCanFilterType::DUAL, a.ide, a.first, a.first, a.fifo});
+      i += 1;
+    }
+  }
+  return plan;
+}
+
+} // namespace peripheral
+} // namespace stm32rcos
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include <cmsis_os2.h>
+
+#include "stm32rcos/core.hpp"
+
+#include "can_base.hpp"
+#include "can_filter.hpp"
+#include "can_message.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+struct CanIsoTpConfig {
+  // 送信するフレームのID
+  uint32_t tx_id;
+  // 相手から受信するフレームのID
+  uint32_t rx_id;
+  bool ide = false;
+  // 受信側として相手に要求するブロックサイズ。0 なら最後まで一度に送らせる
+  uint8_t block_size = 0;
+  // 受信側として相手に要求するSTmin。ISO 15765-2 の符号化のまま指定する
+  uint8_t st_min = 0;
+  // Flow Control、Consecutive Frame を待つ時間の上限 (N_Bs、N_Cr) [ms]
+  uint32_t frame_timeout = 1000;
+  // 8バイトに満たないフレームの残りを埋める値
+  uint8_t padding = 0xCC;
+  CanRxFifo fifo = CanRxFifo::FIFO0;
+};
+
+/**
+ * ISO 15765-2 (ISO-TP) で、8バイトを超えるデータを分割して送受信します。
+ *
+ * 受信したフレームは受信割り込みの中で receive() に渡したバッファへ直接
+ * 組み立てるので、スレッドが起きるのは Flow Control を返すときと受信完了時
+ * だけです。送信は Consecutive Frame をまとめて transmit_burst() に渡し、
+ * STmin が 0 なら割り込みだけで送信メールボックス/FIFOを埋め続けます。
+ *
+ * 受信待ちでないときに届いたフレームは捨てます。データ長は最大4095バイトです。
+ *
+ * @code{.cpp}
+ * CanIsoTp iso_tp(can1, {.tx_id = 0x7E0, .rx_id = 0x7E8});
+ * iso_tp.start();
+ *
+ * std::array<uint8_t, 256> request = {};
+ * iso_tp.transmit(request.data(), request.size(), 1000);
+ *
+ * std::array<uint8_t, 4095> response;
+ * size_t size = iso_tp.receive(response.data(), response.size(), 1000);
+ * @endcode
+ */
+class CanIsoTp {
+public:
+  static constexpr size_t MAX_SIZE = 4095;
+
+  CanIsoTp(CanBase &can, const CanIsoTpConfig &config)
+      : can_{can}, config_{config}, tx_sem_{1, 0}, rx_sem_{1, 0} {}
+
+  ~CanIsoTp() { stop(); }
+
+  // 受信IDのハンドラを登録する
+  bool start() {
+    return can_.attach_rx_handler(config_.rx_id, config_.ide, on_frame, this,
+                                  false, config_.fifo);
+  }
+
+  bool stop() { return can_.detach_rx_handler(config_.rx_id, config_.ide); }
+
+  /**
+   * 複数のスレッドから呼んでもよく、先に呼んだスレッドの送信が終わるまで
+   * 待ちます。
+   */
+  bool transmit(const uint8_t *data, size_t size, uint32_t timeout) {
+    if (size == 0 || size > MAX_SIZE) {
+      return false;
+    }
+    // Flow Control の受け取り先は1つなので、同時に1つのデータだけ送る
+    core::TimeoutHelper timeout_helper;
+    if (!tx_mutex_.try_lock(timeout)) {
+      return false;
+    }
+    timeout_helper.is_timeout(timeout);
+    bool ok = transmit_frames(data, size, timeout);
+    tx_mutex_.unlock();
+    return ok;
+  }
+
+  /**
+   * data に1つのデータを受信します。
+   *
+   * @param timeout 最初のフレームを待つ時間。受信が始まってからは
+   * frame_timeout ごとに次のフレームを待ちます。
+   * @return 受信したバイト数。タイムアウト、または受信に失敗したら 0
+   */
+  size_t receive(uint8_t *data, size_t size, uint32_t timeout) {
+    {
+      core::CriticalSection critical_section;
+      if (rx_data_) {
+        return 0;
+      }
+      rx_data_ = data;
+      rx_capacity_ = size;
+      rx_state_ = RxState::IDLE;
+      rx_event_ = RxEvent::NONE;
+    }
+    core::TimeoutHelper timeout_helper;
+    size_t received = 0;
+    while (true) {
+      RxEvent event;
+      bool receiving;
+      {
+        core::CriticalSection critical_section;
+        event = rx_event_;
+        rx_event_ = RxEvent::NONE;
+        receiving = rx_state_ == RxState::RECEIVING;
+        if (event == RxEvent::DONE) {
+          received = rx_size_;
+        }
+      }
+      if (event == RxEvent::DONE || event == RxEvent::ERROR) {
+        break;
+      }
+      if (event == RxEvent::OVERFLOW) {
+        transmit_flow_control(FLOW_STATUS_OVERFLOW);
+        break;
+      }
+      if (event == RxEvent::FLOW_CONTROL) {
+        if (!transmit_flow_control(FLOW_STATUS_CONTINUE)) {
+          break;
+        }
+        continue;
+      }
+      if (receiving) {
+        if (!rx_sem_.acquire(config_.frame_timeout)) {
+          break;
+        }
+      } else {
+        if (timeout_helper.is_timeout(timeout)) {
+          break;
+        }
+        rx_sem_.acquire(timeout);
+      }
+    }
+    // 戻った後に割り込みがバッファへ書き込まないよう、先に外す
+    core::CriticalSection critical_section;
+    rx_data_ = nullptr;
+    rx_state_ = RxState::IDLE;
+    return received;
+  }
+
+private:
+  static constexpr uint8_t SINGLE_FRAME = 0x00;
+  static constexpr uint8_t FIRST_FRAME = 0x10;
+  static constexpr uint8_t CONSECUTIVE_FRAME = 0x20;
+  static constexpr uint8_t FLOW_CONTROL = 0x30;
+  static constexpr uint8_t FLOW_STATUS_CONTINUE = 0;
+  static constexpr uint8_t FLOW_STATUS_WAIT = 1;
+  static constexpr uint8_t FLOW_STATUS_OVERFLOW = 2;
+  static constexpr size_t TX_BATCH_SIZE = 8;
+
+  enum class RxState : uint8_t {
+    IDLE,
+    RECEIVING,
+  };
+
+  // 受信割り込みから receive() への通知
+  enum class RxEvent : uint8_t {
+    NONE,
+    FLOW_CONTROL,
+    OVERFLOW,
+    DONE,
+    ERROR,
+  };
+
+  CanBase &can_;
+  CanIsoTpConfig config_;
+  core::Mutex tx_mutex_;
+  core::Semaphore tx_sem_;
+  core::Semaphore rx_sem_;
+
+  // 送信側。相手から受け取った Flow Control
+  bool tx_flow_control_received_ = false;
+  uint8_t tx_flow_status_ = 0;
+  uint8_t tx_block_size_ = 0;
+  uint8_t tx_st_min_ = 0;
+
+  // 受信側。rx_data_ が nullptr の間は受信待ちではない
+  uint8_t *rx_data_ = nullptr;
+  size_t rx_capacity_ = 0;
+  size_t rx_size_ = 0;
+  size_t rx_offset_ = 0;
+  uint8_t rx_sequence_number_ = 0;
+  uint8_t rx_block_count_ = 0;
+  RxState rx_state_ = RxState::IDLE;
+  RxEvent rx_event_ = RxEvent::NONE;
+
+  CanIsoTp(const CanIsoTp &) = delete;
+  CanIsoTp &operator=(const CanIsoTp &) = delete;
+
+  CanMessage create_message() const {
+    CanMessage msg{};
+    msg.id = config_.tx_id;
+    msg.ide = config_.ide;
+    msg.dlc = 8;
+    msg.data.fill(config_.padding);
+    return msg;
+  }
+
+  bool transmit_frames(const uint8_t *data, size_t size, uint32_t timeout) {
+    CanMessage msg = create_message();
+    if (size <= 7) {
+      msg.data[0] = SINGLE_FRAME | size;
+      std::copy_n(data, size, msg.data.begin() + 1);
+      return can_.transmit(msg, timeout);
+    }
+
+    {
+      core::CriticalSection critical_section;
+      tx_flow_control_received_ = false;
+    }
+    msg.data[0] = FIRST_FRAME | (size >> 8);
+    msg.data[1] = size & 0xFF;
+    std::copy_n(data, 6, msg.data.begin() + 2);
+    if (!can_.transmit(msg, timeout)) {
+      return false;
+    }
+
+    size_t offset = 6;
+    uint8_t sequence_number = 1;
+    while (offset < size) {
+      uint8_t block_size;
+      uint8_t st_min;
+      if (!wait_flow_control(block_size, st_min)) {
+        return false;
+      }
+      size_t remaining_frames = (size - offset + 6) / 7;
+      size_t frames = block_size == 0
+                          ? remaining_frames
+                          : std::min<size_t>(block_size, remaining_frames);
+      uint32_t delay = st_min_to_ticks(st_min);
+      // STmin が 0 なら送信キューにまとめて入れ、送信完了割り込みで詰めさせる
+      std::array<CanMessage, TX_BATCH_SIZE> batch;
+      while (frames > 0) {
+        size_t count = delay == 0 ? std::min(frames, batch.size()) : 1;
+        for (size_t i = 0; i < count; ++i) {
+          size_t length = std::min<size_t>(7, size - offset);
+          batch[i] = create_message();
+          batch[i].data[0] = CONSECUTIVE_FRAME | sequence_number;
+          std::copy_n(data + offset, length, batch[i].data.begin() + 1);
+          offset += length;
+          sequence_number = (sequence_number + 1) & 0xF;
+        }
+        if (can_.transmit_burst({batch.data(), count}, timeout) != count) {
+          return false;
+        }
+        frames -= count;
+        if (delay != 0 && offset < size) {
+          osDelay(delay);
+        }
+      }
+    }
+    return true;
+  }
+
+  bool transmit_flow_control(uint8_t flow_status) {
+    CanMessage msg = create_message();
+    msg.data[0] = FLOW_CONTROL | flow_status;
+    msg.data[1] = config_.block_size;
+    msg.data[2] = config_.st_min;
+    return can_.transmit(msg, config_.frame_timeout);
+  }
+
+  bool wait_flow_control(uint8_t &block_size, uint8_t &st_min) {
+    while (true) {
+      if (!tx_sem_.acquire(config_.frame_timeout)) {
+        return false;
+      }
+      uint8_t flow_status;
+      {
+        core::CriticalSection critical_section;
+        if (!tx_flow_control_received_) {
+          continue;
+        }
+        tx_flow_control_received_ = false;
+        flow_status = tx_flow_status_;
+        block_size = tx_block_size_;
+        st_min = tx_st_min_;
+      }
+      // WAIT なら次の Flow Control を待ち直す
+      if (flow_status == FLOW_STATUS_CONTINUE) {
+        return true;
+      }
+      if (flow_status != FLOW_STATUS_WAIT) {
+        return false;
+      }
+    }
+  }
+
+  // STmin 以上空けるのに必要な osDelay() の tick 数
+  static uint32_t st_min_to_ticks(uint8_t st_min) {
+    uint32_t us;
+    if (st_min <= 0x7F) {
+      us = st_min * 1000;
+    } else if (st_min >= 0xF1 && st_min <= 0xF9) {
+      us = (st_min - 0xF0) * 100;
+    } else {
+      // 予約された値は最大値として扱う
+      us = 0x7F * 1000;
+    }
+    if (us == 0) {
+      return 0;
+    }
+    // osDelay(n) は n - 1 tick しか待たないことがあるので1足す
+    uint64_t tick_freq = osKernelGetTickFreq();
+    return (us * tick_freq + 999999) / 1000000 + 1;
+  }
+
+  // 受信割り込みから呼ばれる
+  static void on_frame(const CanMessage &msg, void *context) {
+    auto iso_tp = static_cast<CanIsoTp *>(context);
+    if (msg.dlc == 0) {
+      return;
+    }
+    if ((msg.data[0] & 0xF0) == FLOW_CONTROL) {
+      if (msg.dlc < 3) {
+        return;
+      }
+      iso_tp->tx_flow_status_ = msg.data[0] & 0x0F;
+      iso_tp->tx_block_size_ = msg.data[1];
+      iso_tp->tx_st_min_ = msg.data[2];
+      iso_tp->tx_flow_control_received_ = true;
+      iso_tp->tx_sem_.release();
+      return;
+    }
+    if (!iso_tp->rx_data_) {
+      return;
+    }
+    RxEvent event = iso_tp->receive_frame(msg);
+    if (event != RxEvent::NONE) {
+      iso_tp->rx_event_ = event;
+      iso_tp->rx_sem_.release();
+    }
+  }
+
+  RxEvent receive_frame(const CanMessage &msg) {
+    size_t dlc = std::min<size_t>(msg.dlc, 8);
+    switch (msg.data[0] & 0xF0) {
+    case SINGLE_FRAME: {
+      size_t size = msg.data[0] & 0x0F;
+      if (size == 0 || size > dlc - 1) {
+        return RxEvent::NONE;
+      }
+      if (size > rx_capacity_) {
+        return RxEvent::ERROR;
+      }
+      std::copy_n(msg.data.begin() + 1, size, rx_data_);
+      rx_size_ = size;
+      rx_state_ = RxState::IDLE;
+      return RxEvent::DONE;
+    }
+    case FIRST_FRAME: {
+      size_t size = ((msg.data[0] & 0x0F) << 8) | msg.data[1];
+      if (size <= 7 || dlc < 8) {
+        return RxEvent::NONE;
+      }
+      if (size > rx_capacity_) {
+        rx_state_ = RxState::IDLE;
+        return RxEvent::OVERFLOW;
+      }
+      std::copy_n(msg.data.begin() + 2, 6, rx_data_);
+      rx_size_ = size;
+      rx_offset_ = 6;
+      rx_sequence_number_ = 1;
+      rx_block_count_ = 0;
+      rx_state_ = RxState::RECEIVING;
+      return RxEvent::FLOW_CONTROL;
+    }
+    case CONSECUTIVE_FRAME: {
+      if (rx_state_ != RxState::RECEIVING) {
+        return RxEvent::NONE;
+      }
+      if ((msg.data[0] & 0x0F) != rx_sequence_number_) {
+        rx_state_ = RxState::IDLE;
+        return RxEvent::ERROR;
+      }
+      size_t length = std::min(rx_size_ - rx_offset_, dlc - 1);
+      std::copy_n(msg.data.begin() + 1, length, rx_data_ + rx_offset_);
+      rx_offset_ += length;
+      rx_sequence_number_ = (rx_sequence_number_ + 1) & 0x0F;
+      if (rx_offset_ == rx_size_) {
+        rx_state_ = RxState::IDLE;
+        return RxEvent::DONE;
+      }
+      if (config_.block_size != 0 && ++rx_block_count_ == config_.block_size) {
+        rx_block_count_ = 0;
+        return RxEvent::FLOW_CONTROL;
+      }
+      return RxEvent::NONE;
+    }
+    default:
+      return RxEvent::NONE;
+    }
+  }
+};
+
+} // namespace peripheral
+} // namespace stm32rcos
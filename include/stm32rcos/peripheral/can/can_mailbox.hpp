@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include <cmsis_os2.h>
+
+#include "can_message.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * 最新の1フレームだけを保持する受信先です。
+ *
+ * 受信割り込みは常に上書きし、読み出し側はシーケンスロックで一貫した
+ * スナップショットを取り出します。どちらもロックを取りません。
+ *
+ * @code{.cpp}
+ * CanMailbox encoder;
+ * can1.attach_rx_mailbox({.id = 0x201, .mask = 0x7FF, .ide = false},
+ *                        encoder);
+ *
+ * uint32_t last_sequence = 0;
+ * CanMessage msg;
+ * uint32_t sequence;
+ * if (encoder.read(msg, sequence) && sequence != last_sequence) {
+ *   last_sequence = sequence;
+ *   // msg を使う
+ * }
+ * if (encoder.is_stale(10)) {
+ *   // 10ms 以上更新されていない
+ * }
+ * @endcode
+ */
+class CanMailbox {
+public:
+  CanMailbox() = default;
+
+  // 受信割り込みから呼ぶ。書き込み側は1つに限る
+  void write(const CanMessage &msg) {
+    uint32_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    msg_ = msg;
+    timestamp_ = osKernelGetTickCount();
+    // 0 は未受信を表すので、一周したら飛ばす
+    seq += 2;
+    seq_.store(seq != 0 ? seq : 2, std::memory_order_release);
+  }
+
+  /**
+   * 最新のフレームを読み出します。
+   *
+   * @param sequence 書き込まれるたびに1ずつ増える番号。前回の値と比べると
+   * 新しいフレームかどうかが分かります。
+   * @return まだ一度も受信していなければ false
+   */
+  bool read(CanMessage &msg, uint32_t &sequence) const {
+    uint32_t timestamp;
+    return read(msg, sequence, timestamp);
+  }
+
+  uint32_t sequence() const {
+    return seq_.load(std::memory_order_acquire) / 2;
+  }
+
+  // 最後に受信してからの経過時間[tick]。未受信なら UINT32_MAX
+  uint32_t age() const {
+    CanMessage msg;
+    uint32_t sequence;
+    uint32_t timestamp;
+    if (!read(msg, sequence, timestamp)) {
+      return UINT32_MAX;
+    }
+    return osKernelGetTickCount() - timestamp;
+  }
+
+  bool is_stale(uint32_t max_age) const { return age() > max_age; }
+
+private:
+  std::atomic<uint32_t> seq_{0};
+  CanMessage msg_{};
+  uint32_t timestamp_ = 0;
+
+  CanMailbox(const CanMailbox &) = delete;
+  CanMailbox &operator=(const CanMailbox &) = delete;
+
+  // 読み出し中に割り込みが書き込んだら、シーケンス番号が変わるので読み直す
+  bool read(CanMessage &msg, uint32_t &sequence, uint32_t &timestamp) const {
+    uint32_t seq;
+    do {
+      seq = seq_.load(std::memory_order_acquire);
+      if (seq % 2 != 0) {
+        continue;
+      }
+      msg = msg_;
+      timestamp = timestamp_;
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while (seq % 2 != 0 || seq_.load(std::memory_order_relaxed) != seq);
+    sequence = seq / 2;
+    return seq != 0;
+  }
+};
+
+} // namespace peripheral
+} // namespace stm32rcos
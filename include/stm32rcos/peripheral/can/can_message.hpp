@@ -6,12 +6,27 @@
 namespace stm32rcos {
 namespace peripheral {
 
+/**
+ * timestamp は STM32RCOS_CAN_TIMESTAMP を定義したときだけあり、受信した
+ * ときだけ設定されます。単位はハードウェアのカウンタの1カウントで、
+ * CanBase::timestamp_frequency() が 0 なら常に 0 です。
+ *
+ * 定義しなければ 16 バイトに収まり、受信キューが小さくなります。受信割り込み
+ * でタイムスタンプを拡張する処理も省きます。
+ */
 struct CanMessage {
   uint32_t id;
   bool ide;
   uint8_t dlc;
   std::array<uint8_t, 8> data;
+#ifdef STM32RCOS_CAN_TIMESTAMP
+  uint64_t timestamp = 0;
+#endif
 };
 
+#ifndef STM32RCOS_CAN_TIMESTAMP
+static_assert(sizeof(CanMessage) == 16);
+#endif
+
 } // namespace peripheral
 } // namespace stm32rcos
\ No newline at end of file
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#include <cmsis_os2.h>
+
+#include "stm32rcos/core.hpp"
+
+#include "can_fd_message.hpp"
+#include "can_filter.hpp"
+#include "can_mailbox.hpp"
+#include "can_message.hpp"
+#include "can_statistics.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * 受信ハンドラの型です。context には attach_rx_handler() に渡した値が
+ * そのまま渡されます。
+ */
+using CanRxCallback = void (*)(const CanMessage &msg, void *context);
+
+namespace detail {
+
+// ハードウェアフィルタ1つ分の受信先
+struct CanRxSlot {
+  core::Queue<CanMessage> *queue = nullptr;
+  core::Queue<CanFdMessage> *fd_queue = nullptr;
+  CanMailbox *mailbox = nullptr;
+  // attach_rx_handler() で確保したフィルタなら true
+  bool handler = false;
+
+  bool empty() const { return !queue && !fd_queue && !mailbox && !handler; }
+
+  bool operator==(const CanRxSlot &) const = default;
+};
+
+/**
+ * ID をキーにした、線形探索のオープンアドレス法のハッシュテーブルで受信
+ * ハンドラを引きます。キーに黄金比の定数を掛けた上位ビットを使うので、
+ * 連番のIDも散らばります。外したエントリは後ろを詰め直すので、attach と
+ * detach を繰り返しても探索は長くなりません。
+ */
+template <size_t N> class CanRxDispatcher {
+  static_assert(std::has_single_bit(N));
+
+public:
+  CanRxDispatcher() = default;
+
+  bool attach(uint32_t id, bool ide, CanRxCallback callback, void *context,
+              bool deferred, CanRxFifo fifo) {
+    if (deferred && !worker_queue_) {
+      return false;
+    }
+    uint32_t key = make_key(id, ide);
+    core::CriticalSection critical_section;
+    if (find(key)) {
+      return false;
+    }
+    for (size_t i = 0; i < N; ++i) {
+      Entry &entry = entries_[(hash(key) + i) & (N - 1)];
+      if (entry.key == EMPTY_KEY) {
+        entry.callback = callback;
+        entry.context = context;
+        entry.deferred = deferred;
+        entry.fifo = fifo;
+        entry.frames = 0;
+        entry.key = key;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool detach(uint32_t id, bool ide) {
+    core::CriticalSection critical_section;
+    Entry *entry = find(make_key(id, ide));
+    if (!entry) {
+      return false;
+    }
+    // 空いた位置より前に入るべき後ろのエントリを詰め、探索の途切れを防ぐ。
+    // 表が埋まっていれば空きに当たらないので、一周で止める
+    size_t hole = entry - entries_.data();
+    size_t end = hole;
+    for (size_t i = (hole + 1) & (N - 1);
+         i != end && entries_[i].key != EMPTY_KEY; i = (i + 1) & (N - 1)) {
+      size_t home = hash(entries_[i].key);
+      if (((i - home) & (N - 1)) >= ((i - hole) & (N - 1))) {
+        entries_[hole] = entries_[i];
+        hole = i;
+      }
+    }
+    entries_[hole] = Entry{};
+    return true;
+  }
+
+  // 受信割り込みから呼ぶ。ハンドラが登録されていれば true を返す。
+  // スレッドへのキューが一杯なら drops を増やす。drops は呼び出し側が
+  // 割り込みの終わりにまとめて統計に足す
+  bool dispatch(const CanMessage &msg, uint32_t &drops) {
+    Entry *entry = find(make_key(msg.id, msg.ide));
+    if (!entry) {
+      return false;
+    }
+    // 1つのIDは1つのFIFOでしか受信しないので、書き込み側は1つ
+    ++entry->frames;
+    if (entry->deferred) {
+      if (!worker_queue_->push(msg, 0)) {
+        ++drops;
+      }
+    } else {
+      entry->callback(msg, entry->context);
+    }
+    return true;
+  }
+
+  /**
+   * dispatch() と同じく渡すが、割り込みではなくスレッドから呼ぶ。
+   * attach()/detach() と競合しないよう、エントリはクリティカルセクション内で
+   * 写し、ハンドラはその外で呼ぶ。
+   */
+  bool dispatch_from_thread(const CanMessage &msg, uint32_t &drops) {
+    Entry entry;
+    {
+      core::CriticalSection critical_section;
+      Entry *found = find(make_key(msg.id, msg.ide));
+      if (!found) {
+        return false;
+      }
+      ++found->frames;
+      entry = *found;
+    }
+    if (entry.deferred) {
+      if (!worker_queue_->push(msg, 0)) {
+        ++drops;
+      }
+    } else {
+      entry.callback(msg, entry.context);
+    }
+    return true;
+  }
+
+  // ハンドラを登録してから受信したフレーム数
+  uint32_t frames(uint32_t id, bool ide) const {
+    core::CriticalSection critical_section;
+    const Entry *entry = find(make_key(id, ide));
+    return entry ? entry->frames : 0;
+  }
+
+  template <class F> void for_each_id(F f) const {
+    for (const Entry &entry : entries_) {
+      if (entry.key != EMPTY_KEY) {
+        f(entry.key & 0x1FFFFFFF, (entry.key & 0x80000000) != 0,
+          entry.fifo);
+      }
+    }
+  }
+
+  bool start_worker(size_t queue_size, size_t stack_size,
+                    osPriority_t priority) {
+    if (worker_queue_) {
+      return false;
+    }
+    worker_queue_.emplace(queue_size, 0, "can_rx_worker");
+    worker_thread_.emplace(&CanRxDispatcher::worker, this, stack_size,
+                           priority, 0, "can_rx_worker");
+    return true;
+  }
+
+private:
+  // 拡張IDは29bitなので、IDと重なることはない
+  static constexpr uint32_t EMPTY_KEY = 0xFFFFFFFF;
+
+  struct Entry {
+    uint32_t key = EMPTY_KEY;
+    CanRxCallback callback = nullptr;
+    void *context = nullptr;
+    bool deferred = false;
+    CanRxFifo fifo = CanRxFifo::FIFO0;
+    uint32_t frames = 0;
+  };
+
+  std::array<Entry, N> entries_{};
+  std::optional<core::Queue<CanMessage>> worker_queue_;
+  std::optional<core::Thread> worker_thread_;
+
+  CanRxDispatcher(const CanRxDispatcher &) = delete;
+  CanRxDispatcher &operator=(const CanRxDispatcher &) = delete;
+
+  static constexpr uint32_t make_key(uint32_t id, bool ide) {
+    return ide ? (id | 0x80000000) : id;
+  }
+
+  // Fibonacci hashing。上位 log2(N) ビットを使う
+  static constexpr size_t hash(uint32_t key) {
+    if constexpr (N == 1) {
+      return 0;
+    } else {
+      return (key * 0x9E3779B1u) >> (32 - std::countr_zero(N));
+    }
+  }
+
+  Entry *find(uint32_t key) {
+    return const_cast<Entry *>(std::as_const(*this).find(key));
+  }
+
+  const Entry *find(uint32_t key) const {
+    for (size_t i = 0; i < N; ++i) {
+      const Entry &entry = entries_[(hash(key) + i) & (N - 1)];
+      if (entry.key == key) {
+        return &entry;
+      }
+      if (entry.key == EMPTY_KEY) {
+        return nullptr;
+      }
+    }
+    return nullptr;
+  }
+
+  static void worker(void *args) {
+    auto dispatcher = static_cast<CanRxDispatcher *>(args);
+    CanMessage msg;
+    while (true) {
+      if (!dispatcher->worker_queue_->pop(msg, osWaitForever)) {
+        continue;
+      }
+      // detach() と競合しないよう、エントリをコピーしてから呼ぶ
+      Entry entry;
+      {
+        core::CriticalSection critical_section;
+        Entry *found = dispatcher->find(make_key(msg.id, msg.ide));
+        if (!found) {
+          continue;
+        }
+        entry = *found;
+      }
+      entry.callback(msg, entry.context);
+    }
+  }
+};
+
+} // namespace detail
+
+} // namespace peripheral
+} // namespace stm32rcos
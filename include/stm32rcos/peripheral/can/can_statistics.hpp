@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <cmsis_os2.h>
+
+#include "stm32rcos/core.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * 各カウンタはどのスレッドからでもロックなしで読み出せます。
+ */
+struct CanStatistics {
+  // 受信したフレーム数。フィルタごとの数は CanBase::rx_frames() で取得する
+  std::atomic<uint32_t> rx_frames{0};
+  // 送信が完了したフレーム数
+  std::atomic<uint32_t> tx_frames{0};
+  // 受信キュー、または受信ハンドラのスレッドへのキューが一杯で捨てたフレーム数
+  std::atomic<uint32_t> rx_queue_drops{0};
+  // 送信キューが一杯で、timeout までに送信できなかったフレーム数
+  std::atomic<uint32_t> tx_queue_drops{0};
+  // 送信キューに溜まったフレーム数の最大値
+  std::atomic<uint32_t> tx_queue_high_water{0};
+  // 受信FIFOが一杯で、フレームを受け取れなかった回数
+  std::atomic<uint32_t> rx_fifo0_overruns{0};
+  std::atomic<uint32_t> rx_fifo1_overruns{0};
+  // バスオフになった回数
+  std::atomic<uint32_t> bus_offs{0};
+};
+
+/**
+ * エラーカウンタとエラー状態です。CanBase::error_state() でレジスタから
+ * 読み出します。
+ */
+struct CanErrorState {
+  uint8_t tx_error_count;
+  uint8_t rx_error_count;
+  bool error_passive;
+  bool bus_off;
+};
+
+namespace detail {
+
+// 書き込み側は割り込みかクリティカルセクション内の1箇所に限られるので、
+// Cortex-M0でも使えるload/storeだけで更新する
+inline void increment(std::atomic<uint32_t> &counter, uint32_t value = 1) {
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+inline void update_max(std::atomic<uint32_t> &counter, uint32_t value) {
+  if (value > counter.load(std::memory_order_relaxed)) {
+    counter.store(value, std::memory_order_relaxed);
+  }
+}
+
+// 優先度の違う割り込み(FIFO0とFIFO1など)から更新するカウンタ用
+inline void increment_shared(std::atomic<uint32_t> &counter,
+                             uint32_t value = 1) {
+  core::CriticalSectionFromISR critical_section;
+  increment(counter, value);
+}
+
+/**
+ * フレームが公称ビットレートで何ビット分バスを使うかを見積もります。
+ * スタッフビットは含まず、フレーム間スペースを含みます。
+ *
+ * @param data_scale BRSありのデータフェーズを公称ビットに換算する係数。
+ * 公称ビットレート / データビットレート を256倍した値
+ */
+constexpr uint32_t can_frame_bits(bool ide, bool fdf, bool brs,
+                                  size_t length, uint32_t data_scale = 256) {
+  if (!fdf) {
+    return (ide ? 67 : 47) + 8 * length;
+  }
+  // 調停フェーズ(SOFからBRSまで)とACKからフレーム間スペースまで
+  uint32_t nominal_bits = (ide ? 36 : 17) + 12;
+  // ESIからCRCまで。CRCの固定スタッフビットを含む
+  uint32_t data_bits = (length <= 16 ? 31 : 36) + 8 * length;
+  if (brs) {
+    data_bits = data_bits * data_scale / 256;
+  }
+  return nominal_bits + data_bits;
+}
+
+/**
+ * 送受信したフレームのビット数から、直近 WINDOW_MS 程度のバス負荷率を
+ * 見積もります。
+ *
+ * 2つのバケツに交互にビット数を溜め、前のバケツは経過時間に応じて重みを
+ * 下げて足します。受信フィルタで捨てられたフレームは数えられません。
+ */
+class CanBusLoadMeter {
+public:
+  static constexpr uint32_t WINDOW_MS = 500;
+
+  CanBusLoadMeter() = default;
+
+  void reset(uint32_t bit_rate) {
+    core::CriticalSectionFromISR critical_section;
+    window_ = osKernelGetTickFreq() * WINDOW_MS / 1000;
+    capacity_ = static_cast<uint64_t>(bit_rate) * WINDOW_MS / 1000;
+    bucket_start_ = osKernelGetTickCount();
+    previous_bits_ = 0;
+    current_bits_ = 0;
+  }
+
+  // 受信、送信完了の割り込みで、クリティカルセクション内から呼ぶ。
+  // 割り込み1回で受け取ったフレームの分はまとめて足す
+  void add(uint32_t bits) {
+    rotate(osKernelGetTickCount());
+    current_bits_ += bits;
+  }
+
+  // バス負荷率[0.1%]
+  uint32_t load_permille() {
+    core::CriticalSectionFromISR critical_section;
+    if (capacity_ == 0 || window_ == 0) {
+      return 0;
+    }
+    uint32_t tick = osKernelGetTickCount();
+    rotate(tick);
+    uint32_t elapsed = tick - bucket_start_;
+    uint64_t bits =
+        static_cast<uint64_t>(previous_bits_) * (window_ - elapsed) / window_ +
+        current_bits_;
+    return bits * 1000 / capacity_;
+  }
+
+private:
+  uint32_t window_ = 0;
+  uint64_t capacity_ = 0;
+  uint32_t bucket_start_ = 0;
+  uint32_t previous_bits_ = 0;
+  uint32_t current_bits_ = 0;
+
+  CanBusLoadMeter(const CanBusLoadMeter &) = delete;
+  CanBusLoadMeter &operator=(const CanBusLoadMeter &) = delete;
+
+  void rotate(uint32_t tick) {
+    uint32_t elapsed = tick - bucket_start_;
+    if (elapsed < window_) {
+      return;
+    }
+    if (elapsed < window_ * 2) {
+      previous_bits_ = current_bits_;
+      bucket_start_ += window_;
+    } else {
+      previous_bits_ = 0;
+      bucket_start_ = tick;
+    }
+    current_bits_ = 0;
+  }
+};
+
+} // namespace detail
+
+} // namespace peripheral
+} // namespace stm32rcos
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+
+#include <cmsis_os2.h>
+
+#include "stm32rcos/core.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * タイムスタンプをマイクロ秒に変換します。
+ *
+ * @param frequency CanBase::timestamp_frequency() の値
+ */
+constexpr uint64_t can_timestamp_to_us(uint64_t timestamp,
+                                       uint32_t frequency) {
+  if (frequency == 0) {
+    return 0;
+  }
+  return timestamp / frequency * 1000000 +
+         timestamp % frequency * 1000000 / frequency;
+}
+
+namespace detail {
+
+/**
+ * 16bitで一周するハードウェアのタイムスタンプを、64bitに拡張します。
+ *
+ * 前回の値からの経過時間をカーネルのtickから見積もり、下位16bitが一致する
+ * 値のうち見積もりに最も近いものを選びます。見積もりの誤差が半周(1Mbpsで
+ * 約32ms)に収まっていれば、フレームの間隔が空いても正しく拡張できます。
+ */
+class CanTimestampExtender {
+public:
+  CanTimestampExtender() = default;
+
+  // frequency はカウンタの周波数[Hz]。0 なら extend() は常に 0 を返す
+  void reset(uint32_t frequency) {
+    core::CriticalSectionFromISR critical_section;
+    counts_per_tick_ = frequency / osKernelGetTickFreq();
+    enabled_ = frequency != 0;
+    initialized_ = false;
+  }
+
+  // 受信、送信完了の割り込みから呼ぶ
+  uint64_t extend(uint16_t raw) {
+    core::CriticalSectionFromISR critical_section;
+    if (!enabled_) {
+      return 0;
+    }
+    uint32_t tick = osKernelGetTickCount();
+    if (!initialized_) {
+      last_ = raw;
+      last_tick_ = tick;
+      initialized_ = true;
+      return last_;
+    }
+    uint64_t expected =
+        last_ + static_cast<uint64_t>(tick - last_tick_) * counts_per_tick_;
+    uint64_t timestamp = (expected & ~uint64_t{0xFFFF}) | raw;
+    if (timestamp + 0x8000 < expected) {
+      timestamp += 0x10000;
+    } else if (timestamp > expected + 0x8000 && timestamp >= 0x10000) {
+      timestamp -= 0x10000;
+    }
+    // 送信イベントは受信より遅れて届くことがあるので、基準は進めるだけにする
+    if (timestamp > last_) {
+      last_ = timestamp;
+      last_tick_ = tick;
+    }
+    return timestamp;
+  }
+
+private:
+  uint64_t last_ = 0;
+  uint32_t last_tick_ = 0;
+  uint32_t counts_per_tick_ = 0;
+  bool enabled_ = false;
+  bool initialized_ = false;
+
+  CanTimestampExtender(const CanTimestampExtender &) = delete;
+  CanTimestampExtender &operator=(const CanTimestampExtender &) = delete;
+};
+
+} // namespace detail
+
+} // namespace peripheral
+} // namespace stm32rcos
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * 送信が完了したフレームの記録です。timestamp はフレームを送信した時刻で、
+ * 受信したフレームの timestamp と同じ基準で数えます。
+ */
+struct CanTxEvent {
+  uint32_t id;
+  bool ide;
+  uint8_t dlc;
+  uint64_t timestamp;
+};
+
+} // namespace peripheral
+} // namespace stm32rcos
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <cmsis_os2.h>
+
+#include "stm32rcos/core.hpp"
+
+#include "can_message.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+namespace detail {
+
+/**
+ * 送信キューのフレームを、送信メールボックスやTx FIFOへ順に移します。
+ *
+ * キューから取り出すとスレッドが切り替わることがあるので、クリティカル
+ * セクションの外で N 個まで取り出し、中で送信バッファへ入れます。
+ * 割り込みに追い越されないよう、キューから取り出すのは一度に1箇所だけで、
+ * ほかの呼び出しは取り出し済みのフレームを入れるだけにします。
+ * スレッドが取り出す間はスケジューラを止めるので、取り出したまま他の
+ * スレッドに切り替わって送信が止まることはありません。
+ */
+template <size_t N> class CanTxFeeder {
+public:
+  /**
+   * 割り込みとスレッドのどちらからでも呼べます。クリティカルセクションの
+   * 外で呼んでください。
+   *
+   * @param load クリティカルセクション内で呼ばれ、pop() で取り出した
+   * フレームを空いている送信バッファへ入れて、残りの空きの数を返す
+   */
+  template <class Load>
+  void fill(core::Queue<CanMessage> &tx_queue, Load &&load) {
+    // 割り込みからは osKernelLock() が失敗するので、そのまま進める
+    int32_t lock = osKernelLock();
+    fill_locked(tx_queue, load);
+    if (lock >= 0) {
+      osKernelRestoreLock(lock);
+    }
+  }
+
+  // クリティカルセクション内から呼ぶ
+  bool pop(CanMessage &msg) {
+    if (begin_ == end_) {
+      return false;
+    }
+    msg = staged_[begin_++];
+    return true;
+  }
+
+  // クリティカルセクション内から呼ぶ。キューに残っているかは見ない
+  bool empty() const { return begin_ == end_ && !filling_; }
+
+private:
+  std::array<CanMessage, N> staged_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  bool filling_ = false;
+  bool refill_ = false;
+
+  template <class Load>
+  void fill_locked(core::Queue<CanMessage> &tx_queue, Load &load) {
+    {
+      core::CriticalSectionFromISR critical_section;
+      if (filling_) {
+        // 取り出している側に、終わったらもう一度見てもらう
+        refill_ = true;
+        load();
+        return;
+      }
+      filling_ = true;
+    }
+    while (true) {
+      size_t free_level;
+      {
+        core::CriticalSectionFromISR critical_section;
+        free_level = load();
+        refill_ = false;
+        if (free_level == 0) {
+          filling_ = false;
+          return;
+        }
+      }
+      // 空きがあるので staged_ は空で、ほかの呼び出しは読まない
+      size_t count = tx_queue.pop_n(
+          std::span{staged_}.first(std::min<size_t>(free_level, N)), 0);
+      core::CriticalSectionFromISR critical_section;
+      begin_ = 0;
+      end_ = count;
+      if (count == 0 && !refill_) {
+        filling_ = false;
+        return;
+      }
+    }
+  }
+};
+
+} // namespace detail
+} // namespace peripheral
+} // namespace stm32rcos
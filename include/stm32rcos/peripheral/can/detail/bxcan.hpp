@@ -2,8 +2,13 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
 #include <cstdint>
 #include <iterator>
+#include <span>
+#include <vector>
 
 #include <stm32cubemx_helper/context.hpp>
 #include <stm32cubemx_helper/device.hpp>
@@ -11,8 +16,16 @@
 #include "stm32rcos/core.hpp"
 
 #include "../can_base.hpp"
+#include "../can_cyclic_tx.hpp"
 #include "../can_filter.hpp"
+#include "../can_filter_plan.hpp"
+#include "../can_mailbox.hpp"
 #include "../can_message.hpp"
+#include "../can_rx_handler.hpp"
+#include "../can_statistics.hpp"
+#include "../can_timestamp.hpp"
+#include "../can_tx_event.hpp"
+#include "../can_tx_feeder.hpp"
 
 namespace stm32rcos {
 namespace peripheral {
@@ -22,39 +35,55 @@ template <auto *Handle, class HandleType> class Can;
 template <auto *Handle>
 class Can<Handle, CAN_HandleTypeDef *> : public CanBase {
 public:
-  Can() {
+  Can(size_t tx_queue_size = 16) : tx_queue_{tx_queue_size} {
     stm32cubemx_helper::set_context<Handle, Can>(this);
+    update_filter_match_index();
     HAL_CAN_RegisterCallback(
-        Handle, HAL_CAN_RX_FIFO0_MSG_PENDING_CB_ID,
-        [](CAN_HandleTypeDef *hcan) {
-          static CAN_RxHeaderTypeDef rx_header;
-          static CanMessage msg;
-
+        Handle, HAL_CAN_RX_FIFO0_MSG_PENDING_CB_ID, [](CAN_HandleTypeDef *) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_RX};
           auto bxcan = stm32cubemx_helper::get_context<Handle, Can>();
-
-          while (HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &rx_header,
-                                      msg.data.data()) == HAL_OK) {
-            if (rx_header.FilterMatchIndex >= Can::FILTER_BANK_SIZE) {
-              continue;
-            }
-            core::Queue<CanMessage> *rx_queue =
-                bxcan->rx_queues_[rx_header.FilterMatchIndex];
-            if (rx_queue) {
-              update_rx_message(msg, rx_header);
-              rx_queue->push(msg, 0);
-            }
-          }
+          bxcan->template receive<CAN_RX_FIFO0>();
+        });
+    HAL_CAN_RegisterCallback(
+        Handle, HAL_CAN_RX_FIFO1_MSG_PENDING_CB_ID, [](CAN_HandleTypeDef *) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_RX};
+          auto bxcan = stm32cubemx_helper::get_context<Handle, Can>();
+          bxcan->template receive<CAN_RX_FIFO1>();
         });
+    HAL_CAN_RegisterCallback(
+        Handle, HAL_CAN_ERROR_CB_ID, [](CAN_HandleTypeDef *) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_ERROR};
+          auto bxcan = stm32cubemx_helper::get_context<Handle, Can>();
+          bxcan->error_callback();
+        });
+    HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX0_COMPLETE_CB_ID,
+                             tx_callback<0, true>);
+    HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX1_COMPLETE_CB_ID,
+                             tx_callback<1, true>);
+    HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX2_COMPLETE_CB_ID,
+                             tx_callback<2, true>);
+    HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX0_ABORT_CB_ID,
+                             tx_callback<0, false>);
+    HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX1_ABORT_CB_ID,
+                             tx_callback<1, false>);
+    HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX2_ABORT_CB_ID,
+                             tx_callback<2, false>);
   }
 
   ~Can() override {
     HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_RX_FIFO0_MSG_PENDING_CB_ID);
+    HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_RX_FIFO1_MSG_PENDING_CB_ID);
+    HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_ERROR_CB_ID);
+    for (auto callback_id : TX_CALLBACK_IDS) {
+      HAL_CAN_UnRegisterCallback(Handle, callback_id);
+    }
     stm32cubemx_helper::set_context<Handle, Can>(nullptr);
   }
 
   bool start() override {
-    if (HAL_CAN_ActivateNotification(Handle, CAN_IT_RX_FIFO0_MSG_PENDING) !=
-        HAL_OK) {
+    timestamp_.reset(timestamp_frequency());
+    bus_load_.reset(bit_rate());
+    if (HAL_CAN_ActivateNotification(Handle, NOTIFICATIONS) != HAL_OK) {
       return false;
     }
     return HAL_CAN_Start(Handle) == HAL_OK;
@@ -64,67 +93,524 @@ public:
     if (HAL_CAN_Stop(Handle) != HAL_OK) {
       return false;
     }
-    return HAL_CAN_DeactivateNotification(
-               Handle, CAN_IT_RX_FIFO0_MSG_PENDING) == HAL_OK;
+    return HAL_CAN_DeactivateNotification(Handle, NOTIFICATIONS) == HAL_OK;
   }
 
   bool transmit(const CanMessage &msg, uint32_t timeout) override {
-    CAN_TxHeaderTypeDef tx_header = create_tx_header(msg);
-    uint32_t tx_mailbox;
-    core::TimeoutHelper timeout_helper;
-    while (HAL_CAN_AddTxMessage(Handle, &tx_header, msg.data.data(),
-                                &tx_mailbox) != HAL_OK) {
-      if (timeout_helper.is_timeout(timeout)) {
-        return false;
+    return transmit_burst({&msg, 1}, timeout) == 1;
+  }
+
+  size_t transmit_burst(std::span<const CanMessage> msgs,
+                        uint32_t timeout) override {
+    core::trace(core::TraceEvent::TRANSMIT, Handle,
+                std::min<size_t>(msgs.size(), UINT16_MAX));
+    size_t count = 0;
+    // 先に送信キューをメールボックスへ移してから、
+    // 送信キューが空なら空いている分を直接送信する
+    fill_tx_mailboxes();
+    {
+      core::CriticalSection critical_section;
+      load_tx_mailboxes();
+      if (tx_feeder_.empty() && tx_queue_.size() == 0) {
+        while (count < msgs.size() &&
+               HAL_CAN_GetTxMailboxesFreeLevel(Handle) > 0 &&
+               add_tx_message(msgs[count])) {
+          ++count;
+        }
       }
-      osDelay(1);
     }
-    return true;
+    if (count == msgs.size()) {
+      return count;
+    }
+    size_t queued = tx_queue_.push_n(msgs.subspan(count), timeout);
+    {
+      core::CriticalSection critical_section;
+      detail::increment(stats_.tx_queue_drops, msgs.size() - count - queued);
+      detail::update_max(stats_.tx_queue_high_water, tx_queue_.size());
+    }
+    // push中にメールボックスが空いていた場合、割り込みは来ないのでここで詰める
+    fill_tx_mailboxes();
+    return count + queued;
   }
 
   bool attach_rx_queue(const CanFilter &filter,
                        core::Queue<CanMessage> &queue) override {
-    size_t rx_queue_index = find_rx_queue_index(nullptr);
-    if (rx_queue_index >= FILTER_BANK_SIZE) {
+    BxCanFilterBank bank = create_filter_bank(filter);
+    return attach_filter_banks({&bank, 1}, {.queue = &queue});
+  }
+
+  bool attach_rx_queue(std::span<const CanIdRange> ids,
+                       core::Queue<CanMessage> &queue) override {
+    return attach_rx_queue(plan_bxcan_filters(ids), queue);
+  }
+
+  bool attach_rx_queue(const BxCanFilterPlan &plan,
+                       core::Queue<CanMessage> &queue) {
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_banks({plan.begin(), plan.end()}, {.queue = &queue});
+  }
+
+  bool detach_rx_queue(const core::Queue<CanMessage> &queue) override {
+    return release_rx_slots([&queue](const detail::CanRxSlot &slot) {
+      return slot.queue == &queue;
+    });
+  }
+
+  bool attach_rx_mailbox(const CanFilter &filter,
+                         CanMailbox &mailbox) override {
+    BxCanFilterBank bank = create_filter_bank(filter);
+    return attach_filter_banks({&bank, 1}, {.mailbox = &mailbox});
+  }
+
+  bool attach_rx_mailbox(std::span<const CanIdRange> ids,
+                         CanMailbox &mailbox) override {
+    return attach_rx_mailbox(plan_bxcan_filters(ids), mailbox);
+  }
+
+  bool attach_rx_mailbox(const BxCanFilterPlan &plan, CanMailbox &mailbox) {
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_banks({plan.begin(), plan.end()},
+                               {.mailbox = &mailbox});
+  }
+
+  bool detach_rx_mailbox(const CanMailbox &mailbox) override {
+    return release_rx_slots([&mailbox](const detail::CanRxSlot &slot) {
+      return slot.mailbox == &mailbox;
+    });
+  }
+
+  bool attach_rx_handler(uint32_t id, bool ide, CanRxCallback callback,
+                         void *context, bool deferred = false,
+                         CanRxFifo fifo = CanRxFifo::FIFO0) override {
+    if (!rx_dispatcher_.attach(id, ide, callback, context, deferred, fifo)) {
       return false;
     }
-    CAN_FilterTypeDef filter_config = create_filter_config(
-        filter, rx_queue_index_to_filter_index(Handle, rx_queue_index));
-    if (HAL_CAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
+    if (!update_rx_handler_filters()) {
+      rx_dispatcher_.detach(id, ide);
+      update_rx_handler_filters();
       return false;
     }
-    rx_queues_[rx_queue_index] = &queue;
     return true;
   }
 
-  bool detach_rx_queue(const core::Queue<CanMessage> &queue) override {
-    size_t rx_queue_index = find_rx_queue_index(&queue);
-    if (rx_queue_index >= FILTER_BANK_SIZE) {
+  bool detach_rx_handler(uint32_t id, bool ide) override {
+    if (!rx_dispatcher_.detach(id, ide)) {
       return false;
     }
-    CAN_FilterTypeDef filter_config{};
-    filter_config.FilterBank =
-        rx_queue_index_to_filter_index(Handle, rx_queue_index);
-    filter_config.FilterActivation = DISABLE;
-    if (HAL_CAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
+    return update_rx_handler_filters();
+  }
+
+  bool start_rx_worker(size_t queue_size, size_t stack_size,
+                       osPriority_t priority) override {
+    return rx_dispatcher_.start_worker(queue_size, stack_size, priority);
+  }
+
+  bool attach_cyclic_tx(CanCyclicSlot &slot) override {
+    core::CriticalSection critical_section;
+    return cyclic_tx_.attach(slot);
+  }
+
+  bool detach_cyclic_tx(const CanCyclicSlot &slot) override {
+    core::CriticalSection critical_section;
+    return cyclic_tx_.detach(slot);
+  }
+
+  void process_cyclic_tx() override {
+    {
+      core::CriticalSectionFromISR critical_section;
+      cyclic_tx_.tick();
+    }
+    fill_tx_mailboxes();
+  }
+
+  uint32_t timestamp_frequency() const override {
+    // TTCMのタイマーは1ビットタイムごとに進む
+    if (Handle->Init.TimeTriggeredMode != ENABLE) {
+      return 0;
+    }
+    return bit_rate();
+  }
+
+  bool attach_tx_event_queue(core::Queue<CanTxEvent> &queue) override {
+    if (timestamp_frequency() == 0) {
+      return false;
+    }
+    core::CriticalSection critical_section;
+    if (tx_event_queue_) {
       return false;
     }
-    rx_queues_[rx_queue_index] = nullptr;
+    tx_event_queue_ = &queue;
     return true;
   }
 
+  bool detach_tx_event_queue(const core::Queue<CanTxEvent> &queue) override {
+    core::CriticalSection critical_section;
+    if (tx_event_queue_ != &queue) {
+      return false;
+    }
+    tx_event_queue_ = nullptr;
+    return true;
+  }
+
+  uint32_t rx_frames(const core::Queue<CanMessage> &queue) const override {
+    return sum_rx_frames([&queue](const detail::CanRxSlot &slot) {
+      return slot.queue == &queue;
+    });
+  }
+
+  uint32_t rx_frames(const CanMailbox &mailbox) const override {
+    return sum_rx_frames([&mailbox](const detail::CanRxSlot &slot) {
+      return slot.mailbox == &mailbox;
+    });
+  }
+
+  uint32_t rx_frames(uint32_t id, bool ide) const override {
+    return rx_dispatcher_.frames(id, ide);
+  }
+
+  CanErrorState error_state() const override {
+    uint32_t esr = Handle->Instance->ESR;
+    CanErrorState state;
+    state.tx_error_count = (esr & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+    state.rx_error_count = (esr & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+    state.error_passive = esr & CAN_ESR_EPVF;
+    state.bus_off = esr & CAN_ESR_BOFF;
+    return state;
+  }
+
+  uint32_t bus_load_permille() const override {
+    return bus_load_.load_permille();
+  }
+
+  const CanStatistics &statistics() const override { return stats_; }
+
 private:
   static constexpr uint32_t FILTER_BANK_SIZE = 14;
+  static constexpr size_t RX_HANDLER_TABLE_SIZE = 64;
+  static constexpr size_t CYCLIC_TX_SIZE = 16;
+  static constexpr uint32_t NOTIFICATIONS =
+      CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO1_MSG_PENDING |
+      CAN_IT_RX_FIFO0_OVERRUN | CAN_IT_RX_FIFO1_OVERRUN |
+      CAN_IT_TX_MAILBOX_EMPTY | CAN_IT_ERROR | CAN_IT_BUSOFF;
+  static constexpr uint32_t TX_MAILBOX_SIZE = 3;
+  static constexpr uint32_t TX_ERRORS[] = {
+      HAL_CAN_ERROR_TX_ALST0 | HAL_CAN_ERROR_TX_TERR0,
+      HAL_CAN_ERROR_TX_ALST1 | HAL_CAN_ERROR_TX_TERR1,
+      HAL_CAN_ERROR_TX_ALST2 | HAL_CAN_ERROR_TX_TERR2,
+  };
+  static constexpr HAL_CAN_CallbackIDTypeDef TX_CALLBACK_IDS[] = {
+      HAL_CAN_TX_MAILBOX0_COMPLETE_CB_ID, HAL_CAN_TX_MAILBOX1_COMPLETE_CB_ID,
+      HAL_CAN_TX_MAILBOX2_COMPLETE_CB_ID, HAL_CAN_TX_MAILBOX0_ABORT_CB_ID,
+      HAL_CAN_TX_MAILBOX1_ABORT_CB_ID,    HAL_CAN_TX_MAILBOX2_ABORT_CB_ID,
+  };
 
-  std::array<core::Queue<CanMessage> *, FILTER_BANK_SIZE> rx_queues_{};
+  std::array<detail::CanRxSlot, FILTER_BANK_SIZE> rx_slots_{};
+  // フィルタバンクごとの受信フレーム数
+  std::array<std::atomic<uint32_t>, FILTER_BANK_SIZE> rx_slot_frames_{};
+  // FIFOごとに FilterMatchIndex からフィルタバンクを引く。1バンクに最大4つ
+  std::array<std::array<uint8_t, FILTER_BANK_SIZE * 4>, 2> rx_slot_indices_{};
+  detail::CanRxDispatcher<RX_HANDLER_TABLE_SIZE> rx_dispatcher_;
+  detail::CanCyclicScheduler<CYCLIC_TX_SIZE> cyclic_tx_;
+  core::Queue<CanMessage> tx_queue_;
+  detail::CanTxFeeder<TX_MAILBOX_SIZE> tx_feeder_;
+  core::Queue<CanTxEvent> *tx_event_queue_ = nullptr;
+  // 送信メールボックスに入れたフレームの、送信イベントの下書き
+  std::array<CanTxEvent, TX_MAILBOX_SIZE> tx_events_{};
+  std::array<bool, TX_MAILBOX_SIZE> tx_event_pending_{};
+  detail::CanTimestampExtender timestamp_;
+  mutable detail::CanBusLoadMeter bus_load_;
+  CanStatistics stats_;
 
   Can(const Can &) = delete;
   Can &operator=(const Can &) = delete;
 
-  size_t find_rx_queue_index(const core::Queue<CanMessage> *queue) {
-    return std::distance(
-        rx_queues_.begin(),
-        std::find(rx_queues_.begin(), rx_queues_.end(), queue));
+  // FIFOごとに割り込みの優先度が違ってもよいよう、受信バッファを分ける
+  template <uint32_t RxFifo> void receive() {
+    static CAN_RxHeaderTypeDef rx_header;
+    static CanMessage msg;
+    static bool receiving = false;
+
+    // HAL_CAN_IRQHandler() はどのベクタからでも両方のFIFOを処理するので、
+    // 優先度の高い割り込みが割り込んできたら、外側のループに任せる
+    if (receiving) {
+      return;
+    }
+    receiving = true;
+
+    // 統計はループの後で、クリティカルセクション1回でまとめて更新する
+    uint32_t frames = 0;
+    uint32_t bits = 0;
+    uint32_t drops = 0;
+    auto &rx_slot_indices = rx_slot_indices_[RxFifo == CAN_RX_FIFO0 ? 0 : 1];
+    while (HAL_CAN_GetRxMessage(Handle, RxFifo, &rx_header,
+                                msg.data.data()) == HAL_OK) {
+      update_rx_message(msg, rx_header);
+#ifdef STM32RCOS_CAN_TIMESTAMP
+      msg.timestamp = timestamp_.extend(rx_header.Timestamp);
+#endif
+      ++frames;
+      bits += detail::can_frame_bits(msg.ide, false, false,
+                                     std::min<uint8_t>(msg.dlc, 8));
+      if (rx_dispatcher_.dispatch(msg, drops)) {
+        continue;
+      }
+      if (rx_header.FilterMatchIndex >= rx_slot_indices.size()) {
+        continue;
+      }
+      uint8_t rx_slot_index = rx_slot_indices[rx_header.FilterMatchIndex];
+      if (rx_slot_index >= FILTER_BANK_SIZE) {
+        continue;
+      }
+      detail::increment(rx_slot_frames_[rx_slot_index]);
+      detail::CanRxSlot &rx_slot = rx_slots_[rx_slot_index];
+      if (rx_slot.queue) {
+        if (!rx_slot.queue->push(msg, 0)) {
+          ++drops;
+        }
+      } else if (rx_slot.mailbox) {
+        rx_slot.mailbox->write(msg);
+      }
+    }
+    receiving = false;
+    if (frames == 0) {
+      return;
+    }
+    core::CriticalSectionFromISR critical_section;
+    detail::increment(stats_.rx_frames, frames);
+    detail::increment(stats_.rx_queue_drops, drops);
+    bus_load_.add(bits);
+  }
+
+  // どのCANの割り込みベクタからも呼ばれうる
+  void error_callback() {
+    uint32_t error = HAL_CAN_GetError(Handle);
+    if (error & HAL_CAN_ERROR_RX_FOV0) {
+      detail::increment_shared(stats_.rx_fifo0_overruns);
+    }
+    if (error & HAL_CAN_ERROR_RX_FOV1) {
+      detail::increment_shared(stats_.rx_fifo1_overruns);
+    }
+    if (error & HAL_CAN_ERROR_BOF) {
+      detail::increment_shared(stats_.bus_offs);
+    }
+    HAL_CAN_ResetError(Handle);
+    // NARTで調停負けや送信エラーになったメールボックスには、完了もアボートの
+    // 割り込みも来ないので、ここで失敗として片付けて詰め直す
+    bool tx_failed = false;
+    for (uint32_t i = 0; i < TX_MAILBOX_SIZE; ++i) {
+      if (error & TX_ERRORS[i]) {
+        core::CriticalSectionFromISR critical_section;
+        complete_tx_event(i, false);
+        tx_failed = true;
+      }
+    }
+    if (tx_failed) {
+      fill_tx_mailboxes();
+    }
+  }
+
+  // 送信完了、またはアボートの割り込みから呼ばれる
+  template <uint32_t Index, bool Complete>
+  static void tx_callback(CAN_HandleTypeDef *) {
+    core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_TX};
+    auto bxcan = stm32cubemx_helper::get_context<Handle, Can>();
+    // 送信完了フラグは割り込みの中でクリアされているので、
+    // メールボックスを詰め直す前に結果を記録する
+    {
+      // 優先度の高いタイマ割り込みの process_cyclic_tx() と競合させない
+      core::CriticalSectionFromISR critical_section;
+      bxcan->complete_tx_event(Index, Complete);
+    }
+    bxcan->fill_tx_mailboxes();
+  }
+
+  bool add_tx_message(const CanMessage &msg) {
+    CAN_TxHeaderTypeDef tx_header = create_tx_header(msg);
+    uint32_t tx_mailbox;
+    flush_tx_events();
+    if (HAL_CAN_AddTxMessage(Handle, &tx_header, msg.data.data(),
+                             &tx_mailbox) != HAL_OK) {
+      return false;
+    }
+    size_t index = std::countr_zero(tx_mailbox);
+    tx_events_[index] = {msg.id, msg.ide, msg.dlc, 0};
+    tx_event_pending_[index] = true;
+    return true;
+  }
+
+  void complete_tx_event(uint32_t index, bool complete) {
+    // 割り込みが来る前に、同じメールボックスへ次のフレームを入れていれば
+    // その完了を待つ
+    uint32_t tx_mailbox = CAN_TX_MAILBOX0 << index;
+    if (!tx_event_pending_[index] ||
+        HAL_CAN_IsTxMessagePending(Handle, tx_mailbox)) {
+      return;
+    }
+    tx_event_pending_[index] = false;
+    if (!complete) {
+      return;
+    }
+    CanTxEvent &event = tx_events_[index];
+    detail::increment(stats_.tx_frames);
+    bus_load_.add(detail::can_frame_bits(event.ide, false, false,
+                                         std::min<uint8_t>(event.dlc, 8)));
+    core::Queue<CanTxEvent> *queue = tx_event_queue_;
+    if (!queue) {
+      return;
+    }
+    event.timestamp =
+        timestamp_.extend(HAL_CAN_GetTxTimestamp(Handle, tx_mailbox));
+    queue->push(event, 0);
+  }
+
+  // 割り込みが処理される前に空いたメールボックスを上書きすると、送信完了の
+  // 割り込みが来なくなるので、先に送信イベントを取り出す
+  void flush_tx_events() {
+    for (uint32_t i = 0; i < TX_MAILBOX_SIZE; ++i) {
+      if (tx_event_pending_[i]) {
+        bool complete = Handle->Instance->TSR & (CAN_TSR_TXOK0 << (8 * i));
+        complete_tx_event(i, complete);
+      }
+    }
+  }
+
+  // クリティカルセクションの外から呼ぶ
+  void fill_tx_mailboxes() {
+    tx_feeder_.fill(tx_queue_, [this] { return load_tx_mailboxes(); });
+  }
+
+  // クリティカルセクション内から呼び、残りの空きの数を返す
+  uint32_t load_tx_mailboxes() {
+    CanMessage msg;
+    // 期限の来た周期送信フレームを送信キューより先に入れる
+    while (HAL_CAN_GetTxMailboxesFreeLevel(Handle) > 0 &&
+           (cyclic_tx_.pop(msg) || tx_feeder_.pop(msg))) {
+      add_tx_message(msg);
+    }
+    return HAL_CAN_GetTxMailboxesFreeLevel(Handle);
+  }
+
+  bool attach_filter_banks(std::span<const BxCanFilterBank> banks,
+                           const detail::CanRxSlot &target) {
+    size_t free_count = std::count_if(
+        rx_slots_.begin(), rx_slots_.end(),
+        [](const detail::CanRxSlot &slot) { return slot.empty(); });
+    if (banks.size() > free_count) {
+      return false;
+    }
+    for (const BxCanFilterBank &bank : banks) {
+      size_t rx_queue_index = std::distance(
+          rx_slots_.begin(),
+          std::find_if(rx_slots_.begin(), rx_slots_.end(),
+                       [](const detail::CanRxSlot &slot) {
+                         return slot.empty();
+                       }));
+      CAN_FilterTypeDef filter_config = create_filter_config(
+          bank, rx_queue_index_to_filter_index(Handle, rx_queue_index));
+      // バンクの設定が変わるとFilterMatchIndexがずれるので、
+      // 受信割り込みを止めて対応表と一緒に更新する
+      core::CriticalSection critical_section;
+      if (HAL_CAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
+        release_rx_slots([&target](const detail::CanRxSlot &slot) {
+          return slot == target;
+        });
+        return false;
+      }
+      rx_slots_[rx_queue_index] = target;
+      rx_slot_frames_[rx_queue_index].store(0, std::memory_order_relaxed);
+      update_filter_match_index();
+    }
+    return true;
+  }
+
+  template <class Pred> bool release_rx_slots(Pred pred) {
+    bool found = false;
+    for (size_t i = 0; i < FILTER_BANK_SIZE; ++i) {
+      if (!pred(rx_slots_[i])) {
+        continue;
+      }
+      // 無効にしたバンクも番号を1つ使うよう、32bitマスクモードにしておく
+      CAN_FilterTypeDef filter_config{};
+      filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO0;
+      filter_config.FilterBank = rx_queue_index_to_filter_index(Handle, i);
+      filter_config.FilterMode = CAN_FILTERMODE_IDMASK;
+      filter_config.FilterScale = CAN_FILTERSCALE_32BIT;
+      filter_config.FilterActivation = DISABLE;
+      filter_config.SlaveStartFilterBank = FILTER_BANK_SIZE;
+      core::CriticalSection critical_section;
+      if (HAL_CAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
+        return false;
+      }
+      rx_slots_[i] = {};
+      update_filter_match_index();
+      found = true;
+    }
+    return found;
+  }
+
+  template <class Pred> uint32_t sum_rx_frames(Pred pred) const {
+    uint32_t frames = 0;
+    for (size_t i = 0; i < FILTER_BANK_SIZE; ++i) {
+      if (pred(rx_slots_[i])) {
+        frames += rx_slot_frames_[i].load(std::memory_order_relaxed);
+      }
+    }
+    return frames;
+  }
+
+  // ハンドラのIDをまとめてフィルタバンクに詰め直す
+  bool update_rx_handler_filters() {
+    std::vector<CanIdRange> ids;
+    rx_dispatcher_.for_each_id([&ids](uint32_t id, bool ide, CanRxFifo fifo) {
+      ids.push_back({id, id, ide, fifo});
+    });
+    BxCanFilterPlan plan = plan_bxcan_filters(ids);
+    release_rx_slots(
+        [](const detail::CanRxSlot &slot) { return slot.handler; });
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_banks({plan.begin(), plan.end()}, {.handler = true});
+  }
+
+  // FilterMatchIndex はFIFOごとに、無効なバンクも含めて先頭のバンクから
+  // 数えられる。1バンクあたりの数はスケールとモードで決まる
+  void update_filter_match_index() {
+    const CAN_TypeDef *can_ip = filter_instance();
+    size_t filter_numbers[2] = {0, 0};
+    for (auto &rx_slot_indices : rx_slot_indices_) {
+      rx_slot_indices.fill(UINT8_MAX);
+    }
+    for (size_t i = 0; i < FILTER_BANK_SIZE; ++i) {
+      uint32_t bank_bit = 1u << rx_queue_index_to_filter_index(Handle, i);
+      size_t fifo = (can_ip->FFA1R & bank_bit) ? 1 : 0;
+      size_t count = ((can_ip->FS1R & bank_bit) ? 1 : 2) *
+                     ((can_ip->FM1R & bank_bit) ? 2 : 1);
+      for (size_t j = 0; j < count; ++j) {
+        rx_slot_indices_[fifo][filter_numbers[fifo]++] = i;
+      }
+    }
+  }
+
+  // CAN_BS1_xTQ などは x - 1 をレジスタの位置にずらした値
+  static inline uint32_t bit_rate() {
+    uint32_t time_quanta = 1 +
+                           ((Handle->Init.TimeSeg1 >> CAN_BTR_TS1_Pos) + 1) +
+                           ((Handle->Init.TimeSeg2 >> CAN_BTR_TS2_Pos) + 1);
+    return HAL_RCC_GetPCLK1Freq() / (Handle->Init.Prescaler * time_quanta);
+  }
+
+  // デュアルCANではフィルタのレジスタはCAN1にしかない
+  static inline const CAN_TypeDef *filter_instance() {
+#ifdef CAN2
+    return CAN1;
+#else
+    return Handle->Instance;
+#endif
   }
 
   static inline uint32_t
@@ -138,24 +624,40 @@ private:
     return rx_queue_index;
   }
 
-  static inline CAN_FilterTypeDef create_filter_config(const CanFilter &filter,
-                                                       uint32_t filter_index) {
-    CAN_FilterTypeDef filter_config{};
+  static inline BxCanFilterBank create_filter_bank(const CanFilter &filter) {
+    BxCanFilterBank bank;
     if (filter.ide) {
-      filter_config.FilterIdHigh = filter.id >> 13;
-      filter_config.FilterIdLow = ((filter.id << 3) & 0xFFFF) | 0x4;
-      filter_config.FilterMaskIdHigh = filter.mask >> 13;
-      filter_config.FilterMaskIdLow = ((filter.mask << 3) & 0xFFFF) | 0x4;
+      bank.id_high = filter.id >> 13;
+      bank.id_low = ((filter.id << 3) & 0xFFFF) | 0x4;
+      bank.mask_id_high = filter.mask >> 13;
+      bank.mask_id_low = ((filter.mask << 3) & 0xFFFF) | 0x4;
+    } else {
+      bank.id_high = filter.id << 5;
+      bank.id_low = 0x0;
+      bank.mask_id_high = filter.mask << 5;
+      bank.mask_id_low = 0x0;
+    }
+    bank.fifo = filter.fifo;
+    return bank;
+  }
+
+  static inline CAN_FilterTypeDef
+  create_filter_config(const BxCanFilterBank &bank, uint32_t filter_index) {
+    CAN_FilterTypeDef filter_config{};
+    filter_config.FilterIdHigh = bank.id_high;
+    filter_config.FilterIdLow = bank.id_low;
+    filter_config.FilterMaskIdHigh = bank.mask_id_high;
+    filter_config.FilterMaskIdLow = bank.mask_id_low;
+    if (bank.fifo == CanRxFifo::FIFO1) {
+      filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO1;
     } else {
-      filter_config.FilterIdHigh = filter.id << 5;
-      filter_config.FilterIdLow = 0x0;
-      filter_config.FilterMaskIdHigh = filter.mask << 5;
-      filter_config.FilterMaskIdLow = 0x0;
+      filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO0;
     }
-    filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO0;
     filter_config.FilterBank = filter_index;
-    filter_config.FilterMode = CAN_FILTERMODE_IDMASK;
-    filter_config.FilterScale = CAN_FILTERSCALE_32BIT;
+    filter_config.FilterMode =
+        bank.list_mode ? CAN_FILTERMODE_IDLIST : CAN_FILTERMODE_IDMASK;
+    filter_config.FilterScale =
+        bank.scale_32bit ? CAN_FILTERSCALE_32BIT : CAN_FILTERSCALE_16BIT;
     filter_config.FilterActivation = ENABLE;
     filter_config.SlaveStartFilterBank = FILTER_BANK_SIZE;
     return filter_config;
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <iterator>
+#include <span>
 #include <vector>
 
 #include <stm32cubemx_helper/context.hpp>
@@ -11,8 +14,17 @@
 #include "stm32rcos/core.hpp"
 
 #include "../can_base.hpp"
+#include "../can_cyclic_tx.hpp"
+#include "../can_fd_message.hpp"
 #include "../can_filter.hpp"
+#include "../can_filter_plan.hpp"
+#include "../can_mailbox.hpp"
 #include "../can_message.hpp"
+#include "../can_rx_handler.hpp"
+#include "../can_statistics.hpp"
+#include "../can_timestamp.hpp"
+#include "../can_tx_event.hpp"
+#include "../can_tx_feeder.hpp"
 
 namespace stm32rcos {
 namespace peripheral {
@@ -22,60 +34,101 @@ template <auto *Handle, class HandleType> class Can;
 template <auto *Handle>
 class Can<Handle, FDCAN_HandleTypeDef *> : public CanBase {
 public:
-  Can()
-      : std_rx_queues_(Handle->Init.StdFiltersNbr, nullptr),
-        ext_rx_queues_(Handle->Init.ExtFiltersNbr, nullptr) {
+  Can(size_t tx_queue_size = 16)
+      : std_rx_slots_(Handle->Init.StdFiltersNbr),
+        ext_rx_slots_(Handle->Init.ExtFiltersNbr),
+        std_rx_slot_frames_(Handle->Init.StdFiltersNbr),
+        ext_rx_slot_frames_(Handle->Init.ExtFiltersNbr),
+        tx_queue_{tx_queue_size}, tx_fifo_sem_{1, 0} {
     stm32cubemx_helper::set_context<Handle, Can>(this);
     HAL_FDCAN_RegisterRxFifo0Callback(
-        Handle, [](FDCAN_HandleTypeDef *hfdcan, uint32_t) {
-          static FDCAN_RxHeaderTypeDef rx_header;
-          static CanMessage msg;
-
+        Handle, [](FDCAN_HandleTypeDef *, uint32_t its) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_RX};
           auto fdcan = stm32cubemx_helper::get_context<Handle, Can>();
-
-          while (HAL_FDCAN_GetRxMessage(hfdcan, FDCAN_RX_FIFO0, &rx_header,
-                                        msg.data.data()) == HAL_OK) {
-            if (rx_header.IsFilterMatchingFrame == 1) {
-              continue;
-            }
-            if (rx_header.IdType == FDCAN_STANDARD_ID) {
-              if (rx_header.FilterIndex >= fdcan->std_rx_queues_.size()) {
-                continue;
-              }
-              core::Queue<CanMessage> *rx_queue =
-                  fdcan->std_rx_queues_[rx_header.FilterIndex];
-              if (rx_queue) {
-                update_rx_message(msg, rx_header);
-                rx_queue->push(msg, 0);
-              }
-            } else if (rx_header.IdType == FDCAN_EXTENDED_ID) {
-              if (rx_header.FilterIndex >= fdcan->ext_rx_queues_.size()) {
-                continue;
-              }
-              core::Queue<CanMessage> *rx_queue =
-                  fdcan->ext_rx_queues_[rx_header.FilterIndex];
-              if (rx_queue) {
-                update_rx_message(msg, rx_header);
-                rx_queue->push(msg, 0);
-              }
-            }
+          if (its & FDCAN_IT_RX_FIFO0_MESSAGE_LOST) {
+            detail::increment_shared(fdcan->stats_.rx_fifo0_overruns);
+          }
+          fdcan->template receive<FDCAN_RX_FIFO0>();
+        });
+    HAL_FDCAN_RegisterRxFifo1Callback(
+        Handle, [](FDCAN_HandleTypeDef *, uint32_t its) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_RX};
+          auto fdcan = stm32cubemx_helper::get_context<Handle, Can>();
+          if (its & FDCAN_IT_RX_FIFO1_MESSAGE_LOST) {
+            detail::increment_shared(fdcan->stats_.rx_fifo1_overruns);
+          }
+          fdcan->template receive<FDCAN_RX_FIFO1>();
+        });
+    HAL_FDCAN_RegisterTxEventFifoCallback(
+        Handle, [](FDCAN_HandleTypeDef *, uint32_t) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_TX};
+          auto fdcan = stm32cubemx_helper::get_context<Handle, Can>();
+          fdcan->receive_tx_events();
+        });
+    HAL_FDCAN_RegisterErrorStatusCallback(
+        Handle, [](FDCAN_HandleTypeDef *, uint32_t its) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_ERROR};
+          auto fdcan = stm32cubemx_helper::get_context<Handle, Can>();
+          // 割り込みはバスオフに入ったときと抜けたときの両方で来る
+          FDCAN_ProtocolStatusTypeDef protocol_status;
+          if ((its & FDCAN_IT_BUS_OFF) &&
+              HAL_FDCAN_GetProtocolStatus(Handle, &protocol_status) ==
+                  HAL_OK &&
+              protocol_status.BusOff) {
+            detail::increment_shared(fdcan->stats_.bus_offs);
           }
         });
+    // Tx FIFOが空になるのを待たず、1フレーム送り終えるごとに詰め直す
+    HAL_FDCAN_RegisterTxBufferCompleteCallback(
+        Handle, [](FDCAN_HandleTypeDef *, uint32_t) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::CAN_TX};
+          auto fdcan = stm32cubemx_helper::get_context<Handle, Can>();
+          fdcan->fill_tx_fifo();
+          fdcan->tx_fifo_sem_.release();
+        });
   }
 
   ~Can() override {
     HAL_FDCAN_UnRegisterRxFifo0Callback(Handle);
+    HAL_FDCAN_UnRegisterRxFifo1Callback(Handle);
+    HAL_FDCAN_UnRegisterTxEventFifoCallback(Handle);
+    HAL_FDCAN_UnRegisterErrorStatusCallback(Handle);
+    HAL_FDCAN_UnRegisterTxBufferCompleteCallback(Handle);
     stm32cubemx_helper::set_context<Handle, Can>(nullptr);
   }
 
   bool start() override {
+    if (HAL_FDCAN_ConfigTimestampCounter(Handle, FDCAN_TIMESTAMP_PRESC_1) !=
+            HAL_OK ||
+        HAL_FDCAN_EnableTimestampCounter(Handle, FDCAN_TIMESTAMP_INTERNAL) !=
+            HAL_OK) {
+      return false;
+    }
+    timestamp_.reset(timestamp_frequency());
+    bus_load_.reset(nominal_bit_rate());
+    // BRSありのデータフェーズを、公称ビットタイムに換算する係数
+    data_phase_scale_ =
+        256 * Handle->Init.DataPrescaler *
+        (1 + Handle->Init.DataTimeSeg1 + Handle->Init.DataTimeSeg2) /
+        (Handle->Init.NominalPrescaler *
+         (1 + Handle->Init.NominalTimeSeg1 + Handle->Init.NominalTimeSeg2));
     if (HAL_FDCAN_ConfigGlobalFilter(Handle, FDCAN_REJECT, FDCAN_REJECT,
                                      FDCAN_REJECT_REMOTE,
                                      FDCAN_REJECT_REMOTE) != HAL_OK) {
       return false;
     }
-    if (HAL_FDCAN_ActivateNotification(Handle, FDCAN_IT_RX_FIFO0_NEW_MESSAGE,
-                                       0) != HAL_OK) {
+    // FIFO1は割り込みライン1に回し、FIFO0と別の優先度で処理できるようにする
+#ifdef FDCAN_IT_GROUP_RX_FIFO1
+    uint32_t rx_fifo1_its = FDCAN_IT_GROUP_RX_FIFO1;
+#else
+    uint32_t rx_fifo1_its = FDCAN_IT_LIST_RX_FIFO1;
+#endif
+    if (HAL_FDCAN_ConfigInterruptLines(Handle, rx_fifo1_its,
+                                       FDCAN_INTERRUPT_LINE1) != HAL_OK) {
+      return false;
+    }
+    if (HAL_FDCAN_ActivateNotification(Handle, NOTIFICATIONS, TX_BUFFERS) !=
+        HAL_OK) {
       return false;
     }
     return HAL_FDCAN_Start(Handle) == HAL_OK;
@@ -85,109 +138,556 @@ public:
     if (HAL_FDCAN_Stop(Handle) != HAL_OK) {
       return false;
     }
-    return HAL_FDCAN_DeactivateNotification(
-               Handle, FDCAN_IT_RX_FIFO0_NEW_MESSAGE) == HAL_OK;
+    return HAL_FDCAN_DeactivateNotification(Handle, NOTIFICATIONS) == HAL_OK;
   }
 
   bool transmit(const CanMessage &msg, uint32_t timeout) override {
-    FDCAN_TxHeaderTypeDef tx_header = create_tx_header(msg);
+    return transmit_burst({&msg, 1}, timeout) == 1;
+  }
+
+  size_t transmit_burst(std::span<const CanMessage> msgs,
+                        uint32_t timeout) override {
+    core::trace(core::TraceEvent::TRANSMIT, Handle,
+                std::min<size_t>(msgs.size(), UINT16_MAX));
+    size_t count = 0;
+    // 先に送信キューをTx FIFOへ移してから、
+    // 送信キューが空なら空いている分を直接送信する
+    fill_tx_fifo();
+    {
+      core::CriticalSection critical_section;
+      load_tx_fifo();
+      if (tx_feeder_.empty() && tx_queue_.size() == 0) {
+        while (count < msgs.size() &&
+               HAL_FDCAN_GetTxFifoFreeLevel(Handle) > 0 &&
+               add_tx_message(msgs[count])) {
+          ++count;
+        }
+      }
+    }
+    if (count == msgs.size()) {
+      return count;
+    }
+    size_t queued = tx_queue_.push_n(msgs.subspan(count), timeout);
+    {
+      core::CriticalSection critical_section;
+      detail::increment(stats_.tx_queue_drops, msgs.size() - count - queued);
+      detail::update_max(stats_.tx_queue_high_water, tx_queue_.size());
+    }
+    // push中にTx FIFOが空いていた場合、割り込みは来ないのでここで詰める
+    fill_tx_fifo();
+    return count + queued;
+  }
+
+  /**
+   * CAN FDフレームを送信します。送信キューに溜まっているフレームを
+   * 送り終え、Tx FIFOに空きができるまで待ちます。
+   */
+  bool transmit_fd(const CanFdMessage &msg, uint32_t timeout) {
+    core::trace(core::TraceEvent::TRANSMIT, Handle, 1);
     core::TimeoutHelper timeout_helper;
-    while (HAL_FDCAN_AddMessageToTxFifoQ(Handle, &tx_header, msg.data.data()) !=
-           HAL_OK) {
+    while (true) {
+      fill_tx_fifo();
+      {
+        core::CriticalSection critical_section;
+        load_tx_fifo();
+        if (tx_feeder_.empty() && tx_queue_.size() == 0 &&
+            HAL_FDCAN_GetTxFifoFreeLevel(Handle) > 0) {
+          FDCAN_TxHeaderTypeDef tx_header = create_tx_header(msg);
+          return HAL_FDCAN_AddMessageToTxFifoQ(Handle, &tx_header,
+                                               msg.data.data()) == HAL_OK;
+        }
+      }
       if (timeout_helper.is_timeout(timeout)) {
         return false;
       }
-      osDelay(1);
+      tx_fifo_sem_.acquire(timeout);
     }
-    return true;
   }
 
   bool attach_rx_queue(const CanFilter &filter,
                        core::Queue<CanMessage> &queue) override {
-    if (filter.ide) {
-      size_t rx_queue_index = find_ext_rx_queue_index(nullptr);
-      if (rx_queue_index >= ext_rx_queues_.size()) {
-        return false;
+    FdCanFilterElement element = create_filter_element(filter);
+    return attach_filter_elements({&element, 1}, {.queue = &queue});
+  }
+
+  bool attach_rx_queue(std::span<const CanIdRange> ids,
+                       core::Queue<CanMessage> &queue) override {
+    return attach_rx_queue(plan_fdcan_filters(ids), queue);
+  }
+
+  bool attach_rx_queue(const FdCanFilterPlan &plan,
+                       core::Queue<CanMessage> &queue) {
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_elements({plan.begin(), plan.end()},
+                                  {.queue = &queue});
+  }
+
+  bool detach_rx_queue(const core::Queue<CanMessage> &queue) override {
+    return release_rx_slots([&queue](const detail::CanRxSlot &slot) {
+      return slot.queue == &queue;
+    });
+  }
+
+  /**
+   * CAN FDフレームを受け取る受信キューを登録します。
+   * CanMessage の受信先と違い、8バイトを超えるフレームも受け取れます。
+   */
+  bool attach_rx_queue(const CanFilter &filter,
+                       core::Queue<CanFdMessage> &queue) {
+    FdCanFilterElement element = create_filter_element(filter);
+    return attach_filter_elements({&element, 1}, {.fd_queue = &queue});
+  }
+
+  bool attach_rx_queue(std::span<const CanIdRange> ids,
+                       core::Queue<CanFdMessage> &queue) {
+    return attach_rx_queue(plan_fdcan_filters(ids), queue);
+  }
+
+  bool attach_rx_queue(const FdCanFilterPlan &plan,
+                       core::Queue<CanFdMessage> &queue) {
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_elements({plan.begin(), plan.end()},
+                                  {.fd_queue = &queue});
+  }
+
+  bool detach_rx_queue(const core::Queue<CanFdMessage> &queue) {
+    return release_rx_slots([&queue](const detail::CanRxSlot &slot) {
+      return slot.fd_queue == &queue;
+    });
+  }
+
+  bool attach_rx_mailbox(const CanFilter &filter,
+                         CanMailbox &mailbox) override {
+    FdCanFilterElement element = create_filter_element(filter);
+    return attach_filter_elements({&element, 1}, {.mailbox = &mailbox});
+  }
+
+  bool attach_rx_mailbox(std::span<const CanIdRange> ids,
+                         CanMailbox &mailbox) override {
+    return attach_rx_mailbox(plan_fdcan_filters(ids), mailbox);
+  }
+
+  bool attach_rx_mailbox(const FdCanFilterPlan &plan, CanMailbox &mailbox) {
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_elements({plan.begin(), plan.end()},
+                                  {.mailbox = &mailbox});
+  }
+
+  bool detach_rx_mailbox(const CanMailbox &mailbox) override {
+    return release_rx_slots([&mailbox](const detail::CanRxSlot &slot) {
+      return slot.mailbox == &mailbox;
+    });
+  }
+
+  bool attach_rx_handler(uint32_t id, bool ide, CanRxCallback callback,
+                         void *context, bool deferred = false,
+                         CanRxFifo fifo = CanRxFifo::FIFO0) override {
+    if (!rx_dispatcher_.attach(id, ide, callback, context, deferred, fifo)) {
+      return false;
+    }
+    if (!update_rx_handler_filters()) {
+      rx_dispatcher_.detach(id, ide);
+      update_rx_handler_filters();
+      return false;
+    }
+    return true;
+  }
+
+  bool detach_rx_handler(uint32_t id, bool ide) override {
+    if (!rx_dispatcher_.detach(id, ide)) {
+      return false;
+    }
+    return update_rx_handler_filters();
+  }
+
+  bool start_rx_worker(size_t queue_size, size_t stack_size,
+                       osPriority_t priority) override {
+    return rx_dispatcher_.start_worker(queue_size, stack_size, priority);
+  }
+
+  bool attach_cyclic_tx(CanCyclicSlot &slot) override {
+    core::CriticalSection critical_section;
+    return cyclic_tx_.attach(slot);
+  }
+
+  bool detach_cyclic_tx(const CanCyclicSlot &slot) override {
+    core::CriticalSection critical_section;
+    return cyclic_tx_.detach(slot);
+  }
+
+  void process_cyclic_tx() override {
+    {
+      core::CriticalSectionFromISR critical_section;
+      cyclic_tx_.tick();
+    }
+    fill_tx_fifo();
+  }
+
+  uint32_t timestamp_frequency() const override {
+    // カウンタは公称ビットタイムごとに進む
+    return nominal_bit_rate();
+  }
+
+  bool attach_tx_event_queue(core::Queue<CanTxEvent> &queue) override {
+    core::CriticalSection critical_section;
+    if (tx_event_queue_) {
+      return false;
+    }
+    tx_event_queue_ = &queue;
+    return true;
+  }
+
+  bool detach_tx_event_queue(const core::Queue<CanTxEvent> &queue) override {
+    core::CriticalSection critical_section;
+    if (tx_event_queue_ != &queue) {
+      return false;
+    }
+    tx_event_queue_ = nullptr;
+    return true;
+  }
+
+  uint32_t rx_frames(const core::Queue<CanMessage> &queue) const override {
+    return sum_rx_frames([&queue](const detail::CanRxSlot &slot) {
+      return slot.queue == &queue;
+    });
+  }
+
+  uint32_t rx_frames(const core::Queue<CanFdMessage> &queue) const {
+    return sum_rx_frames([&queue](const detail::CanRxSlot &slot) {
+      return slot.fd_queue == &queue;
+    });
+  }
+
+  uint32_t rx_frames(const CanMailbox &mailbox) const override {
+    return sum_rx_frames([&mailbox](const detail::CanRxSlot &slot) {
+      return slot.mailbox == &mailbox;
+    });
+  }
+
+  uint32_t rx_frames(uint32_t id, bool ide) const override {
+    return rx_dispatcher_.frames(id, ide);
+  }
+
+  CanErrorState error_state() const override {
+    FDCAN_ErrorCountersTypeDef error_counters{};
+    FDCAN_ProtocolStatusTypeDef protocol_status{};
+    HAL_FDCAN_GetErrorCounters(Handle, &error_counters);
+    HAL_FDCAN_GetProtocolStatus(Handle, &protocol_status);
+    CanErrorState state;
+    state.tx_error_count = error_counters.TxErrorCnt;
+    state.rx_error_count = error_counters.RxErrorCnt;
+    state.error_passive = protocol_status.ErrorPassive;
+    state.bus_off = protocol_status.BusOff;
+    return state;
+  }
+
+  uint32_t bus_load_permille() const override {
+    return bus_load_.load_permille();
+  }
+
+  const CanStatistics &statistics() const override { return stats_; }
+
+private:
+  static constexpr size_t RX_HANDLER_TABLE_SIZE = 64;
+  static constexpr size_t CYCLIC_TX_SIZE = 16;
+  // 送信キューから一度に取り出す数。G4のTx FIFOの段数に合わせる
+  static constexpr size_t TX_FEED_SIZE = 3;
+  static constexpr uint32_t NOTIFICATIONS =
+      FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO1_NEW_MESSAGE |
+      FDCAN_IT_RX_FIFO0_MESSAGE_LOST | FDCAN_IT_RX_FIFO1_MESSAGE_LOST |
+      FDCAN_IT_TX_COMPLETE | FDCAN_IT_TX_EVT_FIFO_NEW_DATA |
+      FDCAN_IT_BUS_OFF;
+  // 送信完了の割り込みを有効にする送信バッファ。Tx FIFOはすべて使う
+#ifdef FDCAN_TX_BUFFER31
+  static constexpr uint32_t TX_BUFFERS = 0xFFFFFFFF;
+#else
+  static constexpr uint32_t TX_BUFFERS =
+      FDCAN_TX_BUFFER0 | FDCAN_TX_BUFFER1 | FDCAN_TX_BUFFER2;
+#endif
+  // DLCの値から FDCAN_TxHeaderTypeDef::DataLength への対応
+  static constexpr uint32_t DATA_LENGTHS[] = {
+      FDCAN_DLC_BYTES_0,  FDCAN_DLC_BYTES_1,  FDCAN_DLC_BYTES_2,
+      FDCAN_DLC_BYTES_3,  FDCAN_DLC_BYTES_4,  FDCAN_DLC_BYTES_5,
+      FDCAN_DLC_BYTES_6,  FDCAN_DLC_BYTES_7,  FDCAN_DLC_BYTES_8,
+      FDCAN_DLC_BYTES_12, FDCAN_DLC_BYTES_16, FDCAN_DLC_BYTES_20,
+      FDCAN_DLC_BYTES_24, FDCAN_DLC_BYTES_32, FDCAN_DLC_BYTES_48,
+      FDCAN_DLC_BYTES_64,
+  };
+
+  std::vector<detail::CanRxSlot> std_rx_slots_{};
+  std::vector<detail::CanRxSlot> ext_rx_slots_{};
+  // フィルタエレメントごとの受信フレーム数
+  std::vector<std::atomic<uint32_t>> std_rx_slot_frames_;
+  std::vector<std::atomic<uint32_t>> ext_rx_slot_frames_;
+  detail::CanRxDispatcher<RX_HANDLER_TABLE_SIZE> rx_dispatcher_;
+  detail::CanCyclicScheduler<CYCLIC_TX_SIZE> cyclic_tx_;
+  core::Queue<CanMessage> tx_queue_;
+  detail::CanTxFeeder<TX_FEED_SIZE> tx_feeder_;
+  core::Semaphore tx_fifo_sem_;
+  core::Queue<CanTxEvent> *tx_event_queue_ = nullptr;
+  detail::CanTimestampExtender timestamp_;
+  mutable detail::CanBusLoadMeter bus_load_;
+  uint32_t data_phase_scale_ = 256;
+  CanStatistics stats_;
+
+  Can(const Can &) = delete;
+  Can &operator=(const Can &) = delete;
+
+  // FIFOごとに割り込みの優先度が違ってもよいよう、受信バッファを分ける
+  template <uint32_t RxFifo> void receive() {
+    static FDCAN_RxHeaderTypeDef rx_header;
+    static CanFdMessage fd_msg;
+    static CanMessage msg;
+    static bool receiving = false;
+
+    // HAL_FDCAN_IRQHandler() はどちらの割り込みラインからでも両方のFIFOを
+    // 処理するので、優先度の高い割り込みが割り込んできたら外側のループに任せる
+    if (receiving) {
+      return;
+    }
+    receiving = true;
+
+    // 統計はループの後で、クリティカルセクション1回でまとめて更新する
+    uint32_t frames = 0;
+    uint32_t bits = 0;
+    uint32_t drops = 0;
+    // FDフレームでも溢れないよう、64バイトのバッファで受信する
+    while (HAL_FDCAN_GetRxMessage(Handle, RxFifo, &rx_header,
+                                  fd_msg.data.data()) == HAL_OK) {
+      if (rx_header.IsFilterMatchingFrame == 1) {
+        continue;
       }
-      FDCAN_FilterTypeDef filter_config =
-          create_filter_config(filter, rx_queue_index);
-      if (HAL_FDCAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
-        return false;
+      update_rx_message(fd_msg, rx_header);
+#ifdef STM32RCOS_CAN_TIMESTAMP
+      fd_msg.timestamp = timestamp_.extend(rx_header.RxTimestamp);
+#endif
+      size_t length = frame_length(fd_msg.fdf, fd_msg.dlc);
+      ++frames;
+      bits += detail::can_frame_bits(fd_msg.ide, fd_msg.fdf, fd_msg.brs,
+                                     length, data_phase_scale_);
+      // 8バイトを超えるフレームは CanFdMessage の受信キューにだけ渡す
+      bool fits = length <= msg.data.size();
+      if (fits) {
+        to_can_message(msg, fd_msg);
+        if (rx_dispatcher_.dispatch(msg, drops)) {
+          continue;
+        }
       }
-      ext_rx_queues_[rx_queue_index] = &queue;
-    } else {
-      size_t rx_queue_index = find_std_rx_queue_index(nullptr);
-      if (rx_queue_index >= std_rx_queues_.size()) {
-        return false;
+      bool ide = rx_header.IdType != FDCAN_STANDARD_ID;
+      auto &rx_slots = ide ? ext_rx_slots_ : std_rx_slots_;
+      if (rx_header.FilterIndex >= rx_slots.size()) {
+        continue;
       }
-      FDCAN_FilterTypeDef filter_config =
-          create_filter_config(filter, rx_queue_index);
-      if (HAL_FDCAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
-        return false;
+      auto &rx_slot_frames = ide ? ext_rx_slot_frames_ : std_rx_slot_frames_;
+      detail::increment(rx_slot_frames[rx_header.FilterIndex]);
+      detail::CanRxSlot &rx_slot = rx_slots[rx_header.FilterIndex];
+      bool pushed = true;
+      if (rx_slot.fd_queue) {
+        pushed = rx_slot.fd_queue->push(fd_msg, 0);
+      } else if (fits && rx_slot.queue) {
+        pushed = rx_slot.queue->push(msg, 0);
+      } else if (fits && rx_slot.mailbox) {
+        rx_slot.mailbox->write(msg);
+      }
+      if (!pushed) {
+        ++drops;
       }
-      std_rx_queues_[rx_queue_index] = &queue;
     }
-    return true;
+    receiving = false;
+    if (frames == 0) {
+      return;
+    }
+    core::CriticalSectionFromISR critical_section;
+    detail::increment(stats_.rx_frames, frames);
+    detail::increment(stats_.rx_queue_drops, drops);
+    bus_load_.add(bits);
   }
 
-  bool detach_rx_queue(const core::Queue<CanMessage> &queue) override {
-    size_t rx_queue_index = find_std_rx_queue_index(&queue);
-    if (rx_queue_index < std_rx_queues_.size()) {
-      FDCAN_FilterTypeDef filter_config{};
-      filter_config.FilterIndex = rx_queue_index;
-      filter_config.FilterConfig = FDCAN_FILTER_DISABLE;
-      if (HAL_FDCAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
-        return false;
-      }
-      std_rx_queues_[rx_queue_index] = nullptr;
-    } else {
-      rx_queue_index = find_ext_rx_queue_index(&queue);
-      if (rx_queue_index >= ext_rx_queues_.size()) {
-        return false;
+  // 送信完了を数えるため、送信イベントは常にTx Event FIFOに記録させている
+  void receive_tx_events() {
+    static bool receiving = false;
+
+    if (receiving) {
+      return;
+    }
+    receiving = true;
+    uint32_t frames = 0;
+    uint32_t bits = 0;
+    FDCAN_TxEventFifoTypeDef tx_event;
+    while (HAL_FDCAN_GetTxEvent(Handle, &tx_event) == HAL_OK) {
+      CanTxEvent event;
+      event.id = tx_event.Identifier;
+      event.ide = tx_event.IdType == FDCAN_EXTENDED_ID;
+      event.dlc = to_dlc(tx_event.DataLength);
+      ++frames;
+      bool fdf = tx_event.FDFormat == FDCAN_FD_CAN;
+      bits += detail::can_frame_bits(
+          event.ide, fdf, tx_event.BitRateSwitch == FDCAN_BRS_ON,
+          frame_length(fdf, event.dlc), data_phase_scale_);
+      core::Queue<CanTxEvent> *queue = tx_event_queue_;
+      if (!queue) {
+        continue;
       }
-      FDCAN_FilterTypeDef filter_config{};
-      filter_config.FilterIndex = rx_queue_index;
-      filter_config.FilterConfig = FDCAN_FILTER_DISABLE;
+      event.timestamp = timestamp_.extend(tx_event.TxTimestamp);
+      queue->push(event, 0);
+    }
+    receiving = false;
+    if (frames == 0) {
+      return;
+    }
+    core::CriticalSectionFromISR critical_section;
+    detail::increment(stats_.tx_frames, frames);
+    bus_load_.add(bits);
+  }
+
+  bool add_tx_message(const CanMessage &msg) {
+    FDCAN_TxHeaderTypeDef tx_header = create_tx_header(msg);
+    return HAL_FDCAN_AddMessageToTxFifoQ(Handle, &tx_header,
+                                         msg.data.data()) == HAL_OK;
+  }
+
+  // クリティカルセクションの外から呼ぶ
+  void fill_tx_fifo() {
+    tx_feeder_.fill(tx_queue_, [this] { return load_tx_fifo(); });
+  }
+
+  // クリティカルセクション内から呼び、残りの空きの数を返す
+  uint32_t load_tx_fifo() {
+    CanMessage msg;
+    // 期限の来た周期送信フレームを送信キューより先に入れる
+    while (HAL_FDCAN_GetTxFifoFreeLevel(Handle) > 0 &&
+           (cyclic_tx_.pop(msg) || tx_feeder_.pop(msg))) {
+      add_tx_message(msg);
+    }
+    return HAL_FDCAN_GetTxFifoFreeLevel(Handle);
+  }
+
+  bool attach_filter_elements(std::span<const FdCanFilterElement> elements,
+                              const detail::CanRxSlot &target) {
+    auto is_empty = [](const detail::CanRxSlot &slot) { return slot.empty(); };
+    size_t ext_count = std::count_if(
+        elements.begin(), elements.end(),
+        [](const FdCanFilterElement &element) { return element.ide; });
+    size_t std_free =
+        std::count_if(std_rx_slots_.begin(), std_rx_slots_.end(), is_empty);
+    size_t ext_free =
+        std::count_if(ext_rx_slots_.begin(), ext_rx_slots_.end(), is_empty);
+    if (elements.size() - ext_count > std_free || ext_count > ext_free) {
+      return false;
+    }
+    for (const FdCanFilterElement &element : elements) {
+      auto &rx_slots = element.ide ? ext_rx_slots_ : std_rx_slots_;
+      size_t rx_queue_index = std::distance(
+          rx_slots.begin(),
+          std::find_if(rx_slots.begin(), rx_slots.end(), is_empty));
+      FDCAN_FilterTypeDef filter_config =
+          create_filter_config(element, rx_queue_index);
       if (HAL_FDCAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
+        release_rx_slots([&target](const detail::CanRxSlot &slot) {
+          return slot == target;
+        });
         return false;
       }
-      ext_rx_queues_[rx_queue_index] = nullptr;
+      rx_slots[rx_queue_index] = target;
+      auto &rx_slot_frames =
+          element.ide ? ext_rx_slot_frames_ : std_rx_slot_frames_;
+      rx_slot_frames[rx_queue_index].store(0, std::memory_order_relaxed);
     }
     return true;
   }
 
-private:
-  std::vector<core::Queue<CanMessage> *> std_rx_queues_{};
-  std::vector<core::Queue<CanMessage> *> ext_rx_queues_{};
+  template <class Pred> uint32_t sum_rx_frames(Pred pred) const {
+    uint32_t frames = 0;
+    for (bool ide : {false, true}) {
+      auto &rx_slots = ide ? ext_rx_slots_ : std_rx_slots_;
+      auto &rx_slot_frames = ide ? ext_rx_slot_frames_ : std_rx_slot_frames_;
+      for (size_t i = 0; i < rx_slots.size(); ++i) {
+        if (pred(rx_slots[i])) {
+          frames += rx_slot_frames[i].load(std::memory_order_relaxed);
+        }
+      }
+    }
+    return frames;
+  }
 
-  Can(const Can &) = delete;
-  Can &operator=(const Can &) = delete;
+  template <class Pred> bool release_rx_slots(Pred pred) {
+    bool found = false;
+    for (bool ide : {false, true}) {
+      auto &rx_slots = ide ? ext_rx_slots_ : std_rx_slots_;
+      for (size_t i = 0; i < rx_slots.size(); ++i) {
+        if (!pred(rx_slots[i])) {
+          continue;
+        }
+        FDCAN_FilterTypeDef filter_config{};
+        filter_config.IdType = ide ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+        filter_config.FilterIndex = i;
+        filter_config.FilterConfig = FDCAN_FILTER_DISABLE;
+        if (HAL_FDCAN_ConfigFilter(Handle, &filter_config) != HAL_OK) {
+          return false;
+        }
+        rx_slots[i] = {};
+        found = true;
+      }
+    }
+    return found;
+  }
 
-  size_t find_std_rx_queue_index(const core::Queue<CanMessage> *queue) {
-    return std::distance(
-        std_rx_queues_.begin(),
-        std::find(std_rx_queues_.begin(), std_rx_queues_.end(), queue));
+  // ハンドラのIDをまとめてフィルタエレメントに詰め直す
+  bool update_rx_handler_filters() {
+    std::vector<CanIdRange> ids;
+    rx_dispatcher_.for_each_id([&ids](uint32_t id, bool ide, CanRxFifo fifo) {
+      ids.push_back({id, id, ide, fifo});
+    });
+    FdCanFilterPlan plan = plan_fdcan_filters(ids);
+    release_rx_slots(
+        [](const detail::CanRxSlot &slot) { return slot.handler; });
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_elements({plan.begin(), plan.end()},
+                                  {.handler = true});
   }
 
-  size_t find_ext_rx_queue_index(const core::Queue<CanMessage> *queue) {
-    return std::distance(
-        ext_rx_queues_.begin(),
-        std::find(ext_rx_queues_.begin(), ext_rx_queues_.end(), queue));
+  static inline FdCanFilterElement
+  create_filter_element(const CanFilter &filter) {
+    return {FdCanFilterType::MASK, filter.ide, filter.id, filter.mask,
+            filter.fifo};
   }
 
   static inline FDCAN_FilterTypeDef
-  create_filter_config(const CanFilter &filter, uint32_t filter_index) {
+  create_filter_config(const FdCanFilterElement &element,
+                       uint32_t filter_index) {
     FDCAN_FilterTypeDef filter_config{};
-    if (filter.ide) {
+    if (element.ide) {
       filter_config.IdType = FDCAN_EXTENDED_ID;
     } else {
       filter_config.IdType = FDCAN_STANDARD_ID;
     }
     filter_config.FilterIndex = filter_index;
-    filter_config.FilterType = FDCAN_FILTER_MASK;
-    filter_config.FilterConfig = FDCAN_FILTER_TO_RXFIFO0;
-    filter_config.FilterID1 = filter.id;
-    filter_config.FilterID2 = filter.mask;
+    switch (element.type) {
+    case FdCanFilterType::RANGE:
+      filter_config.FilterType = FDCAN_FILTER_RANGE;
+      break;
+    case FdCanFilterType::DUAL:
+      filter_config.FilterType = FDCAN_FILTER_DUAL;
+      break;
+    case FdCanFilterType::MASK:
+      filter_config.FilterType = FDCAN_FILTER_MASK;
+      break;
+    }
+    if (element.fifo == CanRxFifo::FIFO1) {
+      filter_config.FilterConfig = FDCAN_FILTER_TO_RXFIFO1;
+    } else {
+      filter_config.FilterConfig = FDCAN_FILTER_TO_RXFIFO0;
+    }
+    filter_config.FilterID1 = element.id1;
+    filter_config.FilterID2 = element.id2;
     return filter_config;
   }
 
@@ -200,44 +700,44 @@ private:
       tx_header.IdType = FDCAN_STANDARD_ID;
     }
     tx_header.TxFrameType = FDCAN_DATA_FRAME;
-    switch (msg.dlc) {
-    case 0:
-      tx_header.DataLength = FDCAN_DLC_BYTES_0;
-      break;
-    case 1:
-      tx_header.DataLength = FDCAN_DLC_BYTES_1;
-      break;
-    case 2:
-      tx_header.DataLength = FDCAN_DLC_BYTES_2;
-      break;
-    case 3:
-      tx_header.DataLength = FDCAN_DLC_BYTES_3;
-      break;
-    case 4:
-      tx_header.DataLength = FDCAN_DLC_BYTES_4;
-      break;
-    case 5:
-      tx_header.DataLength = FDCAN_DLC_BYTES_5;
-      break;
-    case 6:
-      tx_header.DataLength = FDCAN_DLC_BYTES_6;
-      break;
-    case 7:
-      tx_header.DataLength = FDCAN_DLC_BYTES_7;
-      break;
-    case 8:
-      tx_header.DataLength = FDCAN_DLC_BYTES_8;
-      break;
-    }
+    // 8を超えるDLCは、0バイトにせず8バイトとして送る
+    tx_header.DataLength = DATA_LENGTHS[std::min<uint8_t>(msg.dlc, 8)];
     tx_header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
     tx_header.BitRateSwitch = FDCAN_BRS_OFF;
     tx_header.FDFormat = FDCAN_CLASSIC_CAN;
-    tx_header.TxEventFifoControl = FDCAN_NO_TX_EVENTS;
+    tx_header.TxEventFifoControl = FDCAN_STORE_TX_EVENTS;
     tx_header.MessageMarker = 0;
     return tx_header;
   }
 
-  static inline void update_rx_message(CanMessage &msg,
+  static inline FDCAN_TxHeaderTypeDef
+  create_tx_header(const CanFdMessage &msg) {
+    FDCAN_TxHeaderTypeDef tx_header{};
+    tx_header.Identifier = msg.id;
+    if (msg.ide) {
+      tx_header.IdType = FDCAN_EXTENDED_ID;
+    } else {
+      tx_header.IdType = FDCAN_STANDARD_ID;
+    }
+    tx_header.TxFrameType = FDCAN_DATA_FRAME;
+    tx_header.DataLength = DATA_LENGTHS[msg.dlc & 0xF];
+    tx_header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+    if (msg.fdf && msg.brs) {
+      tx_header.BitRateSwitch = FDCAN_BRS_ON;
+    } else {
+      tx_header.BitRateSwitch = FDCAN_BRS_OFF;
+    }
+    if (msg.fdf) {
+      tx_header.FDFormat = FDCAN_FD_CAN;
+    } else {
+      tx_header.FDFormat = FDCAN_CLASSIC_CAN;
+    }
+    tx_header.TxEventFifoControl = FDCAN_STORE_TX_EVENTS;
+    tx_header.MessageMarker = 0;
+    return tx_header;
+  }
+
+  static inline void update_rx_message(CanFdMessage &msg,
                                        const FDCAN_RxHeaderTypeDef &rx_header) {
     msg.id = rx_header.Identifier;
     if (rx_header.IdType == FDCAN_STANDARD_ID) {
@@ -245,35 +745,49 @@ private:
     } else if (rx_header.IdType == FDCAN_EXTENDED_ID) {
       msg.ide = true;
     }
-    switch (rx_header.DataLength) {
-    case FDCAN_DLC_BYTES_0:
-      msg.dlc = 0;
-      break;
-    case FDCAN_DLC_BYTES_1:
-      msg.dlc = 1;
-      break;
-    case FDCAN_DLC_BYTES_2:
-      msg.dlc = 2;
-      break;
-    case FDCAN_DLC_BYTES_3:
-      msg.dlc = 3;
-      break;
-    case FDCAN_DLC_BYTES_4:
-      msg.dlc = 4;
-      break;
-    case FDCAN_DLC_BYTES_5:
-      msg.dlc = 5;
-      break;
-    case FDCAN_DLC_BYTES_6:
-      msg.dlc = 6;
-      break;
-    case FDCAN_DLC_BYTES_7:
-      msg.dlc = 7;
-      break;
-    case FDCAN_DLC_BYTES_8:
-      msg.dlc = 8;
-      break;
+    msg.fdf = rx_header.FDFormat == FDCAN_FD_CAN;
+    msg.brs = rx_header.BitRateSwitch == FDCAN_BRS_ON;
+    msg.dlc = to_dlc(rx_header.DataLength);
+  }
+
+  static inline uint32_t nominal_bit_rate() {
+#ifdef RCC_PERIPHCLK_FDCAN1
+    uint32_t clock = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN1);
+#else
+    uint32_t clock = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN);
+#endif
+#ifdef FDCAN_CLOCK_DIV1
+    // FDCAN_CLOCK_DIVx は DIV1 が 0、それ以外は x / 2
+    if (Handle->Init.ClockDivider != FDCAN_CLOCK_DIV1) {
+      clock /= Handle->Init.ClockDivider * 2;
     }
+#endif
+    uint32_t time_quanta =
+        1 + Handle->Init.NominalTimeSeg1 + Handle->Init.NominalTimeSeg2;
+    return clock / (Handle->Init.NominalPrescaler * time_quanta);
+  }
+
+  static inline uint8_t to_dlc(uint32_t data_length) {
+    return std::distance(
+        std::begin(DATA_LENGTHS),
+        std::find(std::begin(DATA_LENGTHS), std::end(DATA_LENGTHS),
+                  data_length));
+  }
+
+  // クラシックCANのDLC 9〜15は8バイト
+  static inline size_t frame_length(bool fdf, uint8_t dlc) {
+    return fdf ? can_fd_dlc_to_length(dlc) : std::min<size_t>(dlc, 8);
+  }
+
+  static inline void to_can_message(CanMessage &msg,
+                                    const CanFdMessage &fd_msg) {
+    msg.id = fd_msg.id;
+    msg.ide = fd_msg.ide;
+    msg.dlc = fd_msg.dlc;
+#ifdef STM32RCOS_CAN_TIMESTAMP
+    msg.timestamp = fd_msg.timestamp;
+#endif
+    std::copy_n(fd_msg.data.begin(), msg.data.size(), msg.data.begin());
   }
 };
 
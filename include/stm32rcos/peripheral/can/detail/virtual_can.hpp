@@ -0,0 +1,435 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <span>
+#include <vector>
+
+#include "stm32rcos/core.hpp"
+
+#include "../can_base.hpp"
+#include "../can_cyclic_tx.hpp"
+#include "../can_filter.hpp"
+#include "../can_filter_plan.hpp"
+#include "../can_mailbox.hpp"
+#include "../can_message.hpp"
+#include "../can_rx_handler.hpp"
+#include "../can_statistics.hpp"
+#include "../can_tx_event.hpp"
+#include "../can_tx_feeder.hpp"
+#include "../virtual_can_bus.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+template <auto *Handle, class HandleType> class Can;
+
+/**
+ * VirtualCanNode につながる Can です。
+ *
+ * フィルタはFDCANと同じく、VirtualCanNode に指定した数のフィルタエレメントを
+ * 番号の小さい順に照合し、最初に一致したものの受信先へ渡します。
+ * エラーは起きないので、error_state() は常に0です。
+ */
+template <auto *Handle>
+class Can<Handle, VirtualCanNode *> : public CanBase {
+public:
+  Can(size_t tx_queue_size = 16)
+      : std_rx_slots_(Handle->std_filters()),
+        ext_rx_slots_(Handle->ext_filters()),
+        std_filters_(Handle->std_filters()),
+        ext_filters_(Handle->ext_filters()),
+        std_rx_slot_frames_(Handle->std_filters()),
+        ext_rx_slot_frames_(Handle->ext_filters()), tx_queue_{tx_queue_size} {
+    Handle->set_callbacks(
+        [](const CanMessage &msg, void *context) {
+          static_cast<Can *>(context)->receive(msg);
+        },
+        [](const CanMessage &msg, void *context) {
+          static_cast<Can *>(context)->complete_tx(msg);
+        },
+        this);
+  }
+
+  ~Can() override {
+    Handle->stop();
+    Handle->set_callbacks(nullptr, nullptr, nullptr);
+  }
+
+  bool start() override {
+    bus_load_.reset(Handle->bus().bit_rate());
+    Handle->start();
+    return true;
+  }
+
+  bool stop() override {
+    Handle->stop();
+    return true;
+  }
+
+  bool transmit(const CanMessage &msg, uint32_t timeout) override {
+    return transmit_burst({&msg, 1}, timeout) == 1;
+  }
+
+  size_t transmit_burst(std::span<const CanMessage> msgs,
+                        uint32_t timeout) override {
+    size_t count = 0;
+    fill_tx_mailboxes();
+    {
+      core::CriticalSection critical_section;
+      load_tx_mailboxes();
+      if (tx_feeder_.empty() && tx_queue_.size() == 0) {
+        while (count < msgs.size() && Handle->tx_free_level() > 0 &&
+               Handle->add_tx_message(msgs[count])) {
+          ++count;
+        }
+      }
+    }
+    if (count == msgs.size()) {
+      return count;
+    }
+    size_t queued = tx_queue_.push_n(msgs.subspan(count), timeout);
+    {
+      core::CriticalSection critical_section;
+      detail::increment(stats_.tx_queue_drops, msgs.size() - count - queued);
+      detail::update_max(stats_.tx_queue_high_water, tx_queue_.size());
+    }
+    fill_tx_mailboxes();
+    return count + queued;
+  }
+
+  bool attach_rx_queue(const CanFilter &filter,
+                       core::Queue<CanMessage> &queue) override {
+    FdCanFilterElement element = create_filter_element(filter);
+    return attach_filter_elements({&element, 1}, {.queue = &queue});
+  }
+
+  bool attach_rx_queue(std::span<const CanIdRange> ids,
+                       core::Queue<CanMessage> &queue) override {
+    FdCanFilterPlan plan = plan_fdcan_filters(ids);
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_elements({plan.begin(), plan.end()},
+                                  {.queue = &queue});
+  }
+
+  bool detach_rx_queue(const core::Queue<CanMessage> &queue) override {
+    return release_rx_slots([&queue](const detail::CanRxSlot &slot) {
+      return slot.queue == &queue;
+    });
+  }
+
+  bool attach_rx_mailbox(const CanFilter &filter,
+                         CanMailbox &mailbox) override {
+    FdCanFilterElement element = create_filter_element(filter);
+    return attach_filter_elements({&element, 1}, {.mailbox = &mailbox});
+  }
+
+  bool attach_rx_mailbox(std::span<const CanIdRange> ids,
+                         CanMailbox &mailbox) override {
+    FdCanFilterPlan plan = plan_fdcan_filters(ids);
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_elements({plan.begin(), plan.end()},
+                                  {.mailbox = &mailbox});
+  }
+
+  bool detach_rx_mailbox(const CanMailbox &mailbox) override {
+    return release_rx_slots([&mailbox](const detail::CanRxSlot &slot) {
+      return slot.mailbox == &mailbox;
+    });
+  }
+
+  bool attach_rx_handler(uint32_t id, bool ide, CanRxCallback callback,
+                         void *context, bool deferred = false,
+                         CanRxFifo fifo = CanRxFifo::FIFO0) override {
+    if (!rx_dispatcher_.attach(id, ide, callback, context, deferred, fifo)) {
+      return false;
+    }
+    if (!update_rx_handler_filters()) {
+      rx_dispatcher_.detach(id, ide);
+      update_rx_handler_filters();
+      return false;
+    }
+    return true;
+  }
+
+  bool detach_rx_handler(uint32_t id, bool ide) override {
+    if (!rx_dispatcher_.detach(id, ide)) {
+      return false;
+    }
+    return update_rx_handler_filters();
+  }
+
+  bool start_rx_worker(size_t queue_size, size_t stack_size,
+                       osPriority_t priority) override {
+    return rx_dispatcher_.start_worker(queue_size, stack_size, priority);
+  }
+
+  bool attach_cyclic_tx(CanCyclicSlot &slot) override {
+    core::CriticalSection critical_section;
+    return cyclic_tx_.attach(slot);
+  }
+
+  bool detach_cyclic_tx(const CanCyclicSlot &slot) override {
+    core::CriticalSection critical_section;
+    return cyclic_tx_.detach(slot);
+  }
+
+  void process_cyclic_tx() override {
+    {
+      core::CriticalSectionFromISR critical_section;
+      cyclic_tx_.tick();
+    }
+    fill_tx_mailboxes();
+  }
+
+  // タイムスタンプはバスのビットタイム単位
+  uint32_t timestamp_frequency() const override {
+    return Handle->bus().bit_rate();
+  }
+
+  bool attach_tx_event_queue(core::Queue<CanTxEvent> &queue) override {
+    core::CriticalSection critical_section;
+    if (tx_event_queue_) {
+      return false;
+    }
+    tx_event_queue_ = &queue;
+    return true;
+  }
+
+  bool detach_tx_event_queue(const core::Queue<CanTxEvent> &queue) override {
+    core::CriticalSection critical_section;
+    if (tx_event_queue_ != &queue) {
+      return false;
+    }
+    tx_event_queue_ = nullptr;
+    return true;
+  }
+
+  uint32_t rx_frames(const core::Queue<CanMessage> &queue) const override {
+    return sum_rx_frames([&queue](const detail::CanRxSlot &slot) {
+      return slot.queue == &queue;
+    });
+  }
+
+  uint32_t rx_frames(const CanMailbox &mailbox) const override {
+    return sum_rx_frames([&mailbox](const detail::CanRxSlot &slot) {
+      return slot.mailbox == &mailbox;
+    });
+  }
+
+  uint32_t rx_frames(uint32_t id, bool ide) const override {
+    return rx_dispatcher_.frames(id, ide);
+  }
+
+  CanErrorState error_state() const override { return {}; }
+
+  uint32_t bus_load_permille() const override {
+    return bus_load_.load_permille();
+  }
+
+  const CanStatistics &statistics() const override { return stats_; }
+
+private:
+  static constexpr size_t RX_HANDLER_TABLE_SIZE = 64;
+  static constexpr size_t CYCLIC_TX_SIZE = 16;
+
+  std::vector<detail::CanRxSlot> std_rx_slots_;
+  std::vector<detail::CanRxSlot> ext_rx_slots_;
+  std::vector<FdCanFilterElement> std_filters_;
+  std::vector<FdCanFilterElement> ext_filters_;
+  std::vector<std::atomic<uint32_t>> std_rx_slot_frames_;
+  std::vector<std::atomic<uint32_t>> ext_rx_slot_frames_;
+  detail::CanRxDispatcher<RX_HANDLER_TABLE_SIZE> rx_dispatcher_;
+  detail::CanCyclicScheduler<CYCLIC_TX_SIZE> cyclic_tx_;
+  core::Queue<CanMessage> tx_queue_;
+  detail::CanTxFeeder<VirtualCanNode::TX_MAILBOX_SIZE> tx_feeder_;
+  core::Queue<CanTxEvent> *tx_event_queue_ = nullptr;
+  mutable detail::CanBusLoadMeter bus_load_;
+  CanStatistics stats_;
+
+  Can(const Can &) = delete;
+  Can &operator=(const Can &) = delete;
+
+  // VirtualCanBus::step() から、クリティカルセクションの外で呼ばれる。
+  // フィルタの照合だけ割り込みを止めて行い、受信先へはその外で渡す
+  void receive(const CanMessage &msg) {
+    size_t index;
+    {
+      core::CriticalSection critical_section;
+      auto &filters = msg.ide ? ext_filters_ : std_filters_;
+      auto &rx_slots = msg.ide ? ext_rx_slots_ : std_rx_slots_;
+      // FDCANと同じく、番号の小さいエレメントから照合して最初の一致で止める
+      index = 0;
+      while (index < filters.size() &&
+             (rx_slots[index].empty() || !matches(filters[index], msg.id))) {
+        ++index;
+      }
+      if (index == filters.size()) {
+        return;
+      }
+      detail::increment(stats_.rx_frames);
+      bus_load_.add(detail::can_frame_bits(msg.ide, false, false,
+                                           std::min<uint8_t>(msg.dlc, 8)));
+    }
+    uint32_t drops = 0;
+    if (rx_dispatcher_.dispatch_from_thread(msg, drops)) {
+      core::CriticalSection critical_section;
+      detail::increment(stats_.rx_queue_drops, drops);
+      return;
+    }
+    detail::CanRxSlot rx_slot;
+    {
+      core::CriticalSection critical_section;
+      auto &rx_slot_frames =
+          msg.ide ? ext_rx_slot_frames_ : std_rx_slot_frames_;
+      detail::increment(rx_slot_frames[index]);
+      rx_slot = (msg.ide ? ext_rx_slots_ : std_rx_slots_)[index];
+    }
+    if (rx_slot.queue) {
+      if (!rx_slot.queue->push(msg, 0)) {
+        core::CriticalSection critical_section;
+        detail::increment(stats_.rx_queue_drops);
+      }
+    } else if (rx_slot.mailbox) {
+      rx_slot.mailbox->write(msg);
+    }
+  }
+
+  // VirtualCanBus::step() から、クリティカルセクションの外で呼ばれる
+  void complete_tx(const CanMessage &msg) {
+    core::Queue<CanTxEvent> *tx_event_queue;
+    {
+      core::CriticalSection critical_section;
+      detail::increment(stats_.tx_frames);
+      bus_load_.add(detail::can_frame_bits(msg.ide, false, false,
+                                           std::min<uint8_t>(msg.dlc, 8)));
+      tx_event_queue = tx_event_queue_;
+    }
+    if (tx_event_queue) {
+      tx_event_queue->push(
+          {msg.id, msg.ide, msg.dlc, Handle->bus().bit_time()}, 0);
+    }
+    fill_tx_mailboxes();
+  }
+
+  // クリティカルセクションの外から呼ぶ
+  void fill_tx_mailboxes() {
+    tx_feeder_.fill(tx_queue_, [this] { return load_tx_mailboxes(); });
+  }
+
+  // クリティカルセクション内から呼び、残りの空きの数を返す
+  size_t load_tx_mailboxes() {
+    CanMessage msg;
+    // 期限の来た周期送信フレームを送信キューより先に入れる
+    while (Handle->tx_free_level() > 0 &&
+           (cyclic_tx_.pop(msg) || tx_feeder_.pop(msg))) {
+      Handle->add_tx_message(msg);
+    }
+    return Handle->tx_free_level();
+  }
+
+  bool attach_filter_elements(std::span<const FdCanFilterElement> elements,
+                              const detail::CanRxSlot &target) {
+    auto is_empty = [](const detail::CanRxSlot &slot) { return slot.empty(); };
+    core::CriticalSection critical_section;
+    size_t ext_count = std::count_if(
+        elements.begin(), elements.end(),
+        [](const FdCanFilterElement &element) { return element.ide; });
+    size_t std_free =
+        std::count_if(std_rx_slots_.begin(), std_rx_slots_.end(), is_empty);
+    size_t ext_free =
+        std::count_if(ext_rx_slots_.begin(), ext_rx_slots_.end(), is_empty);
+    if (elements.size() - ext_count > std_free || ext_count > ext_free) {
+      return false;
+    }
+    for (const FdCanFilterElement &element : elements) {
+      auto &rx_slots = element.ide ? ext_rx_slots_ : std_rx_slots_;
+      auto &filters = element.ide ? ext_filters_ : std_filters_;
+      auto &rx_slot_frames =
+          element.ide ? ext_rx_slot_frames_ : std_rx_slot_frames_;
+      size_t index = std::distance(
+          rx_slots.begin(),
+          std::find_if(rx_slots.begin(), rx_slots.end(), is_empty));
+      rx_slots[index] = target;
+      filters[index] = element;
+      rx_slot_frames[index].store(0, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  template <class Pred> bool release_rx_slots(Pred pred) {
+    core::CriticalSection critical_section;
+    bool found = false;
+    for (bool ide : {false, true}) {
+      auto &rx_slots = ide ? ext_rx_slots_ : std_rx_slots_;
+      auto &filters = ide ? ext_filters_ : std_filters_;
+      for (size_t i = 0; i < rx_slots.size(); ++i) {
+        if (!pred(rx_slots[i])) {
+          continue;
+        }
+        rx_slots[i] = {};
+        filters[i] = {};
+        found = true;
+      }
+    }
+    return found;
+  }
+
+  template <class Pred> uint32_t sum_rx_frames(Pred pred) const {
+    uint32_t frames = 0;
+    for (bool ide : {false, true}) {
+      auto &rx_slots = ide ? ext_rx_slots_ : std_rx_slots_;
+      auto &rx_slot_frames = ide ? ext_rx_slot_frames_ : std_rx_slot_frames_;
+      for (size_t i = 0; i < rx_slots.size(); ++i) {
+        if (pred(rx_slots[i])) {
+          frames += rx_slot_frames[i].load(std::memory_order_relaxed);
+        }
+      }
+    }
+    return frames;
+  }
+
+  // ハンドラのIDをまとめてフィルタエレメントに詰め直す
+  bool update_rx_handler_filters() {
+    std::vector<CanIdRange> ids;
+    rx_dispatcher_.for_each_id([&ids](uint32_t id, bool ide, CanRxFifo fifo) {
+      ids.push_back({id, id, ide, fifo});
+    });
+    FdCanFilterPlan plan = plan_fdcan_filters(ids);
+    release_rx_slots(
+        [](const detail::CanRxSlot &slot) { return slot.handler; });
+    if (plan.overflow()) {
+      return false;
+    }
+    return attach_filter_elements({plan.begin(), plan.end()},
+                                  {.handler = true});
+  }
+
+  static inline bool matches(const FdCanFilterElement &element, uint32_t id) {
+    switch (element.type) {
+    case FdCanFilterType::RANGE:
+      return element.id1 <= id && id <= element.id2;
+    case FdCanFilterType::DUAL:
+      return id == element.id1 || id == element.id2;
+    case FdCanFilterType::MASK:
+      return (id & element.id2) == (element.id1 & element.id2);
+    }
+    return false;
+  }
+
+  static inline FdCanFilterElement
+  create_filter_element(const CanFilter &filter) {
+    return {FdCanFilterType::MASK, filter.ide, filter.id, filter.mask,
+            filter.fifo};
+  }
+};
+
+} // namespace peripheral
+} // namespace stm32rcos
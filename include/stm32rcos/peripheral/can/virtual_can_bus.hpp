@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "stm32rcos/core.hpp"
+
+#include "can_message.hpp"
+#include "can_statistics.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+// 複数のノードが同時に送信しようとしたときに、どのフレームを先に流すか
+enum class VirtualCanArbitration : uint8_t {
+  // 実際のバスと同じく、調停フィールドの小さいフレームから
+  ID,
+  // 送信メールボックスに入った順
+  FIFO,
+};
+
+class VirtualCanNode;
+
+/**
+ * プロセス内で完結する仮想CANバスです。実機なしで Can の受信振り分けや
+ * 送信キュー、周期送信を動かすのに使います。
+ *
+ * フレームは step()/run() を呼んだときにだけバスへ流れ、その呼び出しの
+ * 中で受信割り込みと送信完了割り込みに相当する処理が走ります。時間は
+ * ビットタイム単位で数え、フレームのビット数だけ進みます。
+ * step()/run() は1つのスレッドから呼んでください。
+ *
+ * can.hpp は STM32RCOS_VIRTUAL_CAN を定義したときだけこのヘッダと
+ * Can<&node> を読み込みます。PC 上では README の「PC 上でのテストと
+ * ベンチマーク」の手順でビルドでき、tests/test_can_iso_tp.cpp が使用例です。
+ *
+ * Can<&node> のテンプレート引数にするので、ノードは静的な記憶域に置きます。
+ *
+ * @code{.cpp}
+ * VirtualCanBus bus(1000000);
+ * VirtualCanNode node1(bus);
+ * VirtualCanNode node2(bus);
+ *
+ * void run() {
+ *   Can<&node1> can1;
+ *   Can<&node2> can2;
+ *   Queue<CanMessage> rx_queue(16);
+ *   can2.attach_rx_queue({.id = 0x100, .mask = 0x7F0, .ide = false},
+ *                        rx_queue);
+ *   can1.start();
+ *   can2.start();
+ *
+ *   can1.transmit({.id = 0x101, .ide = false, .dlc = 1, .data = {1}}, 0);
+ *   bus.run();
+ * }
+ * @endcode
+ */
+class VirtualCanBus {
+public:
+  static constexpr size_t MAX_NODES = 16;
+
+  VirtualCanBus(uint32_t bit_rate = 1000000,
+                VirtualCanArbitration arbitration = VirtualCanArbitration::ID)
+      : bit_rate_{bit_rate}, arbitration_{arbitration} {}
+
+  /**
+   * 調停に勝ったフレームを1つバスに流します。
+   *
+   * @return 送信待ちのフレームがなければ false
+   */
+  bool step();
+
+  /**
+   * 送信待ちのフレームがなくなるか、max_frames 個流すまで step() します。
+   *
+   * @return 流したフレーム数
+   */
+  size_t run(size_t max_frames = SIZE_MAX) {
+    size_t count = 0;
+    while (count < max_frames && step()) {
+      ++count;
+    }
+    return count;
+  }
+
+  uint32_t bit_rate() const { return bit_rate_; }
+
+  // バスが始まってから流れたフレームのビット数の合計
+  uint64_t bit_time() const {
+    core::CriticalSection critical_section;
+    return bit_time_;
+  }
+
+private:
+  uint32_t bit_rate_;
+  VirtualCanArbitration arbitration_;
+  std::array<VirtualCanNode *, MAX_NODES> nodes_{};
+  size_t node_count_ = 0;
+  uint64_t bit_time_ = 0;
+  // 送信メールボックスに入った順番。FIFO の調停に使う
+  uint64_t sequence_ = 0;
+
+  friend class VirtualCanNode;
+
+  VirtualCanBus(const VirtualCanBus &) = delete;
+  VirtualCanBus &operator=(const VirtualCanBus &) = delete;
+
+  // クリティカルセクション内から呼ぶ。調停に勝ったフレームを取り出す
+  bool arbitrate(CanMessage &msg, VirtualCanNode *&sender);
+
+  // 調停フィールドの順。標準IDは同じベースIDの拡張IDより優先される
+  static constexpr uint64_t arbitration_key(const CanMessage &msg) {
+    if (!msg.ide) {
+      return static_cast<uint64_t>(msg.id & 0x7FF) << 19;
+    }
+    return (static_cast<uint64_t>((msg.id >> 18) & 0x7FF) << 19) |
+           (1u << 18) | (msg.id & 0x3FFFF);
+  }
+};
+
+/**
+ * 仮想CANバスにつながるコントローラです。Can<&node> のハンドルとして
+ * 使います。
+ */
+class VirtualCanNode {
+public:
+  static constexpr size_t TX_MAILBOX_SIZE = 3;
+
+  using Callback = void (*)(const CanMessage &msg, void *context);
+  using RxCallback = Callback;
+  using TxCallback = Callback;
+
+  /**
+   * @param loopback true なら自分の送信したフレームも受信する
+   * @param std_filters 標準IDのフィルタエレメントの数
+   * @param ext_filters 拡張IDのフィルタエレメントの数
+   */
+  VirtualCanNode(VirtualCanBus &bus, bool loopback = false,
+                 size_t std_filters = 28, size_t ext_filters = 8)
+      : bus_{bus}, loopback_{loopback}, std_filters_{std_filters},
+        ext_filters_{ext_filters} {
+    core::CriticalSection critical_section;
+    if (bus_.node_count_ < bus_.nodes_.size()) {
+      bus_.nodes_[bus_.node_count_++] = this;
+    }
+  }
+
+  ~VirtualCanNode() {
+    core::CriticalSection critical_section;
+    auto end = bus_.nodes_.begin() + bus_.node_count_;
+    auto it = std::find(bus_.nodes_.begin(), end, this);
+    if (it != end) {
+      std::copy(it + 1, end, it);
+      --bus_.node_count_;
+    }
+  }
+
+  VirtualCanBus &bus() { return bus_; }
+  size_t std_filters() const { return std_filters_; }
+  size_t ext_filters() const { return ext_filters_; }
+
+  // 以下は Can<&node> から使う
+
+  void set_callbacks(RxCallback rx_callback, TxCallback tx_callback,
+                     void *context) {
+    core::CriticalSection critical_section;
+    rx_callback_ = rx_callback;
+    tx_callback_ = tx_callback;
+    context_ = context;
+  }
+
+  void start() {
+    core::CriticalSection critical_section;
+    started_ = true;
+  }
+
+  // 送信待ちのフレームは捨てる
+  void stop() {
+    core::CriticalSection critical_section;
+    started_ = false;
+    tx_mailboxes_.fill({});
+  }
+
+  // クリティカルセクション内から呼ぶ
+  size_t tx_free_level() const {
+    return std::count_if(tx_mailboxes_.begin(), tx_mailboxes_.end(),
+                         [](const TxMailbox &mailbox) {
+                           return !mailbox.pending;
+                         });
+  }
+
+  // クリティカルセクション内から呼ぶ
+  bool add_tx_message(const CanMessage &msg) {
+    if (!started_) {
+      return false;
+    }
+    auto it = std::find_if(
+        tx_mailboxes_.begin(), tx_mailboxes_.end(),
+        [](const TxMailbox &mailbox) { return !mailbox.pending; });
+    if (it == tx_mailboxes_.end()) {
+      return false;
+    }
+    *it = {msg, bus_.sequence_++, true};
+    return true;
+  }
+
+private:
+  struct TxMailbox {
+    CanMessage msg;
+    uint64_t sequence;
+    bool pending;
+  };
+
+  VirtualCanBus &bus_;
+  bool loopback_;
+  size_t std_filters_;
+  size_t ext_filters_;
+  bool started_ = false;
+  std::array<TxMailbox, TX_MAILBOX_SIZE> tx_mailboxes_{};
+  RxCallback rx_callback_ = nullptr;
+  TxCallback tx_callback_ = nullptr;
+  void *context_ = nullptr;
+
+  friend class VirtualCanBus;
+
+  VirtualCanNode(const VirtualCanNode &) = delete;
+  VirtualCanNode &operator=(const VirtualCanNode &) = delete;
+
+  // 受信、または送信完了のコールバックを、クリティカルセクションの外で呼ぶ
+  void deliver(const CanMessage &msg, bool transmitted);
+};
+
+inline bool VirtualCanBus::step() {
+  // 調停とフレームの取り出しだけ割り込みを止めて行い、コールバックはその
+  // 外で呼ぶ。受信先の Queue やハンドラが待ったり起床させたりできるように
+  CanMessage msg;
+  VirtualCanNode *sender = nullptr;
+  std::array<VirtualCanNode *, MAX_NODES> receivers;
+  size_t receiver_count = 0;
+  {
+    core::CriticalSection critical_section;
+    if (!arbitrate(msg, sender)) {
+      return false;
+    }
+    for (size_t i = 0; i < node_count_; ++i) {
+      VirtualCanNode *node = nodes_[i];
+      if (node->started_ && (node != sender || node->loopback_)) {
+        receivers[receiver_count++] = node;
+      }
+    }
+  }
+  for (size_t i = 0; i < receiver_count; ++i) {
+    receivers[i]->deliver(msg, false);
+  }
+  sender->deliver(msg, true);
+  return true;
+}
+
+inline bool VirtualCanBus::arbitrate(CanMessage &msg,
+                                     VirtualCanNode *&sender) {
+  VirtualCanNode::TxMailbox *winner = nullptr;
+  for (size_t i = 0; i < node_count_; ++i) {
+    VirtualCanNode *node = nodes_[i];
+    if (!node->started_) {
+      continue;
+    }
+    for (VirtualCanNode::TxMailbox &mailbox : node->tx_mailboxes_) {
+      if (!mailbox.pending) {
+        continue;
+      }
+      bool wins =
+          !winner ||
+          (arbitration_ == VirtualCanArbitration::ID
+               ? std::pair{arbitration_key(mailbox.msg), mailbox.sequence} <
+                     std::pair{arbitration_key(winner->msg), winner->sequence}
+               : mailbox.sequence < winner->sequence);
+      if (wins) {
+        winner = &mailbox;
+        sender = node;
+      }
+    }
+  }
+  if (!winner) {
+    return false;
+  }
+  msg = winner->msg;
+  winner->pending = false;
+  bit_time_ += detail::can_frame_bits(msg.ide, false, false,
+                                      std::min<uint8_t>(msg.dlc, 8));
+#ifdef STM32RCOS_CAN_TIMESTAMP
+  msg.timestamp = bit_time_;
+#endif
+  return true;
+}
+
+inline void VirtualCanNode::deliver(const CanMessage &msg, bool transmitted) {
+  Callback callback;
+  void *context;
+  {
+    core::CriticalSection critical_section;
+    callback = transmitted ? tx_callback_ : rx_callback_;
+    context = context_;
+  }
+  if (callback) {
+    callback(msg, context);
+  }
+}
+
+} // namespace peripheral
+} // namespace stm32rcos
@@ -1,13 +1,23 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <span>
 
+#include <stm32cubemx_helper/context.hpp>
+
+#include "stm32rcos/core.hpp"
 #include "stm32rcos/hal.hpp"
 
 #include "uart/stdout.hpp"
 #include "uart/uart_base.hpp"
+#include "uart/uart_instrumentation.hpp"
+#include "uart/uart_log.hpp"
+#include "uart/uart_trace.hpp"
 #include "uart/uart_type.hpp"
+#include "uart/virtual_uart.hpp"
 
 #ifdef HAL_UART_MODULE_ENABLED
 #include "uart/detail/uart_dma.hpp"
@@ -63,16 +73,73 @@ template <UART_HandleTypeDef *Handle, UartType TxType = UartType::IT,
           UartType RxType = UartType::IT>
 class Uart : public UartBase {
 public:
-  Uart(size_t rx_buf_size = 64) : rx_{rx_buf_size} {}
+  Uart(size_t rx_buf_size = 64, size_t tx_buf_size = 64)
+      : tx_{tx_buf_size}, rx_{rx_buf_size} {
+    stm32cubemx_helper::set_context<Handle, Uart>(this);
+    // Tx, Rxで共有されるエラーコールバックを振り分ける
+    HAL_UART_RegisterCallback(
+        Handle, HAL_UART_ERROR_CB_ID, [](UART_HandleTypeDef *) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::UART_ERROR};
+          auto uart = stm32cubemx_helper::get_context<Handle, Uart>();
+          uart->tx_.error_callback();
+          uart->rx_.error_callback();
+        });
+  }
+
+  ~Uart() {
+    HAL_UART_UnRegisterCallback(Handle, HAL_UART_ERROR_CB_ID);
+    stm32cubemx_helper::set_context<Handle, Uart>(nullptr);
+  }
 
   bool transmit(const uint8_t *data, size_t size, uint32_t timeout) {
+    core::trace(core::TraceEvent::TRANSMIT, Handle, trace_size(size));
     return tx_.transmit(data, size, timeout);
   }
 
+  /**
+   * データを送信バッファにコピーして即座に戻ります。
+   * 送信はDMAの完了割り込みから順に行われます。
+   */
+  bool transmit_async(const uint8_t *data, size_t size, uint32_t timeout)
+    requires(TxType == UartType::DMA)
+  {
+    core::trace(core::TraceEvent::TRANSMIT, Handle, trace_size(size));
+    return tx_.transmit_async(data, size, timeout);
+  }
+
   bool receive(uint8_t *data, size_t size, uint32_t timeout) {
     return rx_.receive(data, size, timeout);
   }
 
+  /**
+   * 1バイト以上受信するまで待ち、受信済みのデータを最大sizeバイト読み出します。
+   * DMA では Half/Full Transfer かアイドルラインのイベントで起こされます。
+   *
+   * @return 読み出したバイト数
+   */
+  size_t receive_some(uint8_t *data, size_t size, uint32_t timeout)
+    requires(RxType != UartType::POLL)
+  {
+    return rx_.receive_some(data, size, timeout);
+  }
+
+  /**
+   * DMAの受信バッファ上の受信済みデータを、コピーせずに最大2つの区間として
+   * 返します。読み終えた分は consume() で解放してください。
+   * バッファが一周するまで放置すると、DMAに上書きされます。
+   */
+  std::array<std::span<const uint8_t>, 2> peek()
+    requires(RxType == UartType::DMA)
+  {
+    return rx_.peek();
+  }
+
+  void consume(size_t size)
+    requires(RxType == UartType::DMA)
+  {
+    rx_.consume(size);
+  }
+
   void flush() { rx_.flush(); }
 
   size_t available() { return rx_.available(); }
@@ -80,6 +147,13 @@ public:
 private:
   detail::UartTx<Handle, TxType> tx_;
   detail::UartRx<Handle, RxType> rx_;
+
+  Uart(const Uart &) = delete;
+  Uart &operator=(const Uart &) = delete;
+
+  static uint16_t trace_size(size_t size) {
+    return std::min<size_t>(size, UINT16_MAX);
+  }
 };
 
 } // namespace peripheral
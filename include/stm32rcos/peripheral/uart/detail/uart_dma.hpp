@@ -1,9 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <span>
 #include <vector>
 
+#include <stm32cubemx_helper/context.hpp>
 #include <stm32cubemx_helper/device.hpp>
 
 #include "stm32rcos/core.hpp"
@@ -17,57 +23,294 @@ namespace detail {
 template <UART_HandleTypeDef *Handle, UartType TxType> class UartTx;
 template <UART_HandleTypeDef *Handle, UartType RxType> class UartRx;
 
+/**
+ * 複数のスレッドから送ってもよく、バッファの容量以下の1回分のデータは
+ * 他のスレッドのデータと混ざりません。空きを待つ間も送信の完了を待つ間も
+ * ロックは持たず、書き込む位置の確保と公開だけを短いクリティカルセクション
+ * で行います。
+ */
 template <UART_HandleTypeDef *Handle> class UartTx<Handle, UartType::DMA> {
 public:
-  UartTx() = default;
+  UartTx(size_t buf_size) : buf_(buf_size) {
+    stm32cubemx_helper::set_context<Handle, UartTx>(this);
+    HAL_UART_RegisterCallback(
+        Handle, HAL_UART_TX_COMPLETE_CB_ID, [](UART_HandleTypeDef *) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::UART_TX};
+          auto uart = stm32cubemx_helper::get_context<Handle, UartTx>();
+          uart->complete_transfer();
+        });
+  }
+
+  ~UartTx() {
+    HAL_UART_AbortTransmit(Handle);
+    HAL_UART_UnRegisterCallback(Handle, HAL_UART_TX_COMPLETE_CB_ID);
+    stm32cubemx_helper::set_context<Handle, UartTx>(nullptr);
+  }
 
+  /**
+   * 送信し終わるまで待ちます。待っている間に HAL が DMA を起動できないと、
+   * このデータも捨てられて false を返します。タイムアウトしたときは待つのを
+   * やめるだけで、書き込んだデータはそのまま送られます。
+   */
   bool transmit(const uint8_t *data, size_t size, uint32_t timeout) {
-    if (HAL_UART_Transmit_DMA(Handle, data, size) != HAL_OK) {
-      HAL_UART_AbortTransmit_IT(Handle);
+    core::TimeoutHelper timeout_helper;
+    uint32_t failures = failures_.load(std::memory_order_acquire);
+    size_t end;
+    if (!enqueue(data, size, timeout_helper, timeout, end)) {
+      return false;
+    }
+    auto sent = [this, end] {
+      return static_cast<std::ptrdiff_t>(
+                 tail_.load(std::memory_order_relaxed) - end) >= 0;
+    };
+    if (!wait_until(sent, timeout_helper, timeout)) {
       return false;
     }
+    return failures_.load(std::memory_order_acquire) == failures;
+  }
+
+  bool transmit_async(const uint8_t *data, size_t size, uint32_t timeout) {
     core::TimeoutHelper timeout_helper;
-    while (Handle->gState != HAL_UART_STATE_READY) {
-      if (timeout_helper.is_timeout(timeout)) {
-        HAL_UART_AbortTransmit_IT(Handle);
-        return false;
-      }
-      osDelay(1);
+    size_t end;
+    return enqueue(data, size, timeout_helper, timeout, end);
+  }
+
+  void error_callback() {
+    if (busy_ && Handle->gState == HAL_UART_STATE_READY) {
+      fail_transfer();
     }
-    return true;
   }
 
 private:
+  // 待っているスレッドを起こすスレッドフラグ
+  static constexpr uint32_t WAKE_FLAG = 1u << 30;
+
+  // 空きや完了を待っているスレッド。スタック上に置いてつなぐ
+  struct Waiter {
+    osThreadId_t thread;
+    Waiter *next;
+    bool linked;
+  };
+
+  std::vector<uint8_t> buf_;
+  // 書き込みを確保した位置、DMA に渡してよい位置、送信済みの位置
+  size_t reserved_ = 0;
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+  // 確保したまま書き込み中のスレッドの数
+  size_t writers_ = 0;
+  Waiter *waiters_ = nullptr;
+  bool busy_ = false;
+  size_t tx_size_ = 0;
+  // DMA を起動できなかったりエラーで止まったりして、データを捨てた回数
+  std::atomic<uint32_t> failures_{0};
+
   UartTx(const UartTx &) = delete;
   UartTx &operator=(const UartTx &) = delete;
+
+  bool enqueue(const uint8_t *data, size_t size,
+               core::TimeoutHelper &timeout_helper, uint32_t &timeout,
+               size_t &end) {
+    end = tail_.load(std::memory_order_acquire);
+    while (size > 0) {
+      // バッファより大きいデータだけは、分けて書くので他と混ざりうる
+      size_t len = std::min(size, buf_.size());
+      size_t start;
+      auto reserved = [this, len, &start] { return reserve(len, start); };
+      if (!wait_until(reserved, timeout_helper, timeout)) {
+        return false;
+      }
+      size_t idx = start % buf_.size();
+      size_t first = std::min(len, buf_.size() - idx);
+      std::memcpy(&buf_[idx], data, first);
+      std::memcpy(buf_.data(), data + first, len - first);
+      commit();
+      data += len;
+      size -= len;
+      end = start + len;
+    }
+    return true;
+  }
+
+  // クリティカルセクションの中で呼ぶ
+  bool reserve(size_t len, size_t &start) {
+    if (buf_.size() - (reserved_ - tail_.load(std::memory_order_relaxed)) <
+        len) {
+      return false;
+    }
+    start = reserved_;
+    reserved_ += len;
+    ++writers_;
+    return true;
+  }
+
+  // 先に確保した他のスレッドがまだ書き込み中なら、最後に書き終えた
+  // スレッドがまとめて DMA に渡す
+  void commit() {
+    // Tx完了割り込みと同時にDMAを起動しないよう、割り込みを止めて呼ぶ
+    core::CriticalSection critical_section;
+    if (--writers_ == 0) {
+      head_.store(reserved_, std::memory_order_release);
+      start_transfer();
+    }
+  }
+
+  /**
+   * ready() が true になるまで待つ。ready() は割り込みを止めて呼ぶので、
+   * 確かめてから待ち始めるまでの間に起こされても取りこぼさない。
+   * 完了割り込みは待っている全員を、それぞれのスレッドフラグで起こす。
+   */
+  template <class F>
+  bool wait_until(F &&ready, core::TimeoutHelper &timeout_helper,
+                  uint32_t &timeout) {
+    Waiter waiter{osThreadGetId(), nullptr, false};
+    while (true) {
+      // 前にタイムアウトした後で立ったフラグを消しておく
+      osThreadFlagsClear(WAKE_FLAG);
+      {
+        core::CriticalSection critical_section;
+        if (ready()) {
+          return true;
+        }
+        if (timeout_helper.is_timeout(timeout)) {
+          return false;
+        }
+        waiter.next = waiters_;
+        waiter.linked = true;
+        waiters_ = &waiter;
+      }
+      osThreadFlagsWait(WAKE_FLAG, osFlagsWaitAny, timeout);
+      core::CriticalSection critical_section;
+      if (waiter.linked) {
+        Waiter **it = &waiters_;
+        while (*it != &waiter) {
+          it = &(*it)->next;
+        }
+        *it = waiter.next;
+        waiter.linked = false;
+      }
+    }
+  }
+
+  // 割り込み、またはクリティカルセクションの中で呼ぶ
+  void notify() {
+    for (Waiter *waiter = waiters_; waiter; waiter = waiter->next) {
+      waiter->linked = false;
+      osThreadFlagsSet(waiter->thread, WAKE_FLAG);
+    }
+    waiters_ = nullptr;
+  }
+
+  void start_transfer() {
+    if (busy_) {
+      return;
+    }
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t idx = tail % buf_.size();
+    tx_size_ = std::min(head_.load(std::memory_order_relaxed) - tail,
+                        buf_.size() - idx);
+    if (tx_size_ == 0) {
+      return;
+    }
+    busy_ = true;
+    if (HAL_UART_Transmit_DMA(Handle, &buf_[idx], tx_size_) != HAL_OK) {
+      // 起動できなければ、待っているデータを捨てて送信側に知らせる
+      fail_transfer();
+    }
+  }
+
+  void complete_transfer() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + tx_size_,
+                std::memory_order_release);
+    busy_ = false;
+    start_transfer();
+    notify();
+  }
+
+  void fail_transfer() {
+    tail_.store(head_.load(std::memory_order_relaxed),
+                std::memory_order_release);
+    busy_ = false;
+    failures_.store(failures_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    notify();
+  }
 };
 
+/**
+ * 受信を待つスレッドは Half Transfer、Transfer Complete、アイドルラインの
+ * いずれかのイベントでだけ起こされます。バイトが届いていても、これらが
+ * 起きるまでは receive() は戻りません。
+ * 受信は1つのスレッドから行ってください。
+ */
 template <UART_HandleTypeDef *Handle> class UartRx<Handle, UartType::DMA> {
 public:
-  UartRx(size_t buf_size) : buf_(buf_size) {
-    HAL_UART_Receive_DMA(Handle, buf_.data(), buf_.size());
+  UartRx(size_t buf_size) : buf_(buf_size), rx_sem_{1, 0} {
+    stm32cubemx_helper::set_context<Handle, UartRx>(this);
+    // Half/Full Transfer、アイドルラインのいずれでも呼ばれる
+    HAL_UART_RegisterRxEventCallback(
+        Handle, [](UART_HandleTypeDef *, uint16_t) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::UART_RX};
+          auto uart = stm32cubemx_helper::get_context<Handle, UartRx>();
+          uart->rx_sem_.release();
+        });
+    start_reception();
   }
 
-  ~UartRx() { HAL_UART_Abort_IT(Handle); }
+  ~UartRx() {
+    HAL_UART_AbortReceive(Handle);
+    HAL_UART_UnRegisterRxEventCallback(Handle);
+    stm32cubemx_helper::set_context<Handle, UartRx>(nullptr);
+  }
 
   bool receive(uint8_t *data, size_t size, uint32_t timeout) {
     core::TimeoutHelper timeout_helper;
-    while (available() < size) {
-      if (timeout_helper.is_timeout(timeout)) {
+    while (true) {
+      if (!wait(size, timeout_helper, timeout)) {
         return false;
       }
-      osDelay(1);
+      // 待った後に受信が再開されていれば揃っていないので、読まずに待ち直す
+      auto segments = peek();
+      if (segments[0].size() + segments[1].size() >= size) {
+        copy(segments, data, size);
+        return true;
+      }
     }
-    for (size_t i = 0; i < size; ++i) {
-      data[i] = buf_[read_idx_];
-      advance(1);
+  }
+
+  size_t receive_some(uint8_t *data, size_t size, uint32_t timeout) {
+    core::TimeoutHelper timeout_helper;
+    if (!wait(1, timeout_helper, timeout)) {
+      return 0;
     }
-    return true;
+    return copy(peek(), data, size);
+  }
+
+  std::array<std::span<const uint8_t>, 2> peek() {
+    sync_restart();
+    size_t size = available();
+    size_t first = std::min(size, buf_.size() - read_idx_);
+    return {std::span<const uint8_t>{buf_.data() + read_idx_, first},
+            std::span<const uint8_t>{buf_.data(), size - first}};
   }
 
+  void consume(size_t size) { advance(std::min(size, available())); }
+
   void flush() { advance(available()); }
 
+  void error_callback() {
+    // DMA受信中のエラーではHALが受信を中断するので、先頭から再開する。
+    // read_idx_ は読み出し側だけが書くので、再開したことを知らせて起こす
+    if (Handle->RxState == HAL_UART_STATE_READY) {
+      restarts_.store(restarts_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+      start_reception();
+      rx_sem_.release();
+    }
+  }
+
   size_t available() {
+    sync_restart();
     size_t write_idx = buf_.size() - __HAL_DMA_GET_COUNTER(Handle->hdmarx);
     return (buf_.size() + write_idx - read_idx_) % buf_.size();
   }
@@ -75,10 +318,48 @@ public:
 private:
   std::vector<uint8_t> buf_;
   size_t read_idx_ = 0;
+  // 受信を先頭から再開した回数。割り込みだけが書く
+  std::atomic<uint32_t> restarts_{0};
+  uint32_t seen_restarts_ = 0;
+  core::Semaphore rx_sem_;
 
   UartRx(const UartRx &) = delete;
   UartRx &operator=(const UartRx &) = delete;
 
+  void start_reception() {
+    HAL_UARTEx_ReceiveToIdle_DMA(Handle, buf_.data(), buf_.size());
+  }
+
+  // 再開前に届いていた未読のデータは捨てる
+  void sync_restart() {
+    uint32_t restarts = restarts_.load(std::memory_order_acquire);
+    if (restarts != seen_restarts_) {
+      seen_restarts_ = restarts;
+      read_idx_ = 0;
+    }
+  }
+
+  bool wait(size_t size, core::TimeoutHelper &timeout_helper,
+            uint32_t &timeout) {
+    while (available() < size) {
+      if (timeout_helper.is_timeout(timeout)) {
+        return false;
+      }
+      rx_sem_.acquire(timeout);
+    }
+    return true;
+  }
+
+  size_t copy(const std::array<std::span<const uint8_t>, 2> &segments,
+              uint8_t *data, size_t size) {
+    size_t first = std::min(size, segments[0].size());
+    size_t second = std::min(size - first, segments[1].size());
+    std::memcpy(data, segments[0].data(), first);
+    std::memcpy(data + first, segments[1].data(), second);
+    advance(first + second);
+    return first + second;
+  }
+
   void advance(size_t len) { read_idx_ = (read_idx_ + len) % buf_.size(); }
 };
 
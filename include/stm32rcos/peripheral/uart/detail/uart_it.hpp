@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 
@@ -19,82 +20,123 @@ template <UART_HandleTypeDef *Handle, UartType RxType> class UartRx;
 
 template <UART_HandleTypeDef *Handle> class UartTx<Handle, UartType::IT> {
 public:
-  UartTx() = default;
+  UartTx(size_t) : tx_sem_{1, 0} {
+    stm32cubemx_helper::set_context<Handle, UartTx>(this);
+    HAL_UART_RegisterCallback(
+        Handle, HAL_UART_TX_COMPLETE_CB_ID, [](UART_HandleTypeDef *) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::UART_TX};
+          auto uart = stm32cubemx_helper::get_context<Handle, UartTx>();
+          uart->tx_sem_.release();
+        });
+  }
+
+  ~UartTx() {
+    HAL_UART_AbortTransmit(Handle);
+    HAL_UART_UnRegisterCallback(Handle, HAL_UART_TX_COMPLETE_CB_ID);
+    stm32cubemx_helper::set_context<Handle, UartTx>(nullptr);
+  }
 
   bool transmit(const uint8_t *data, size_t size, uint32_t timeout) {
+    // 前回のタイムアウトやエラーで残った通知を捨てる
+    tx_sem_.acquire(0);
     if (HAL_UART_Transmit_IT(Handle, data, size) != HAL_OK) {
       HAL_UART_AbortTransmit_IT(Handle);
       return false;
     }
-    core::TimeoutHelper timeout_helper;
-    while (Handle->gState != HAL_UART_STATE_READY) {
-      if (timeout_helper.is_timeout(timeout)) {
-        HAL_UART_AbortTransmit_IT(Handle);
-        return false;
-      }
-      osDelay(1);
+    if (!tx_sem_.acquire(timeout)) {
+      HAL_UART_AbortTransmit_IT(Handle);
+      return false;
     }
     return true;
   }
 
+  void error_callback() {
+    if (Handle->gState == HAL_UART_STATE_READY) {
+      tx_sem_.release();
+    }
+  }
+
 private:
+  core::Semaphore tx_sem_;
+
   UartTx(const UartTx &) = delete;
   UartTx &operator=(const UartTx &) = delete;
 };
 
 template <UART_HandleTypeDef *Handle> class UartRx<Handle, UartType::IT> {
 public:
-  UartRx(size_t buf_size) : queue_{buf_size} {
+  UartRx(size_t buf_size) : ring_{buf_size}, rx_sem_{1, 0} {
     stm32cubemx_helper::set_context<Handle, UartRx>(this);
-    HAL_UART_RegisterCallback(
-        Handle, HAL_UART_RX_COMPLETE_CB_ID, [](UART_HandleTypeDef *huart) {
+    // RX_CHUNK_SIZEバイト受信するか、アイドルラインを検出すると呼ばれる
+    HAL_UART_RegisterRxEventCallback(
+        Handle, [](UART_HandleTypeDef *, uint16_t size) {
+          core::TraceIsrScope trace{Handle, core::TraceIsr::UART_RX};
           auto uart = stm32cubemx_helper::get_context<Handle, UartRx>();
-          uart->queue_.push(uart->buf_, 0);
-          HAL_UART_Receive_IT(huart, &uart->buf_, 1);
+          uart->ring_.push_n({uart->buf_.data(), size});
+          uart->start_reception();
+          uart->rx_sem_.release();
         });
     HAL_UART_RegisterCallback(
-        Handle, HAL_UART_ERROR_CB_ID,
-        [](UART_HandleTypeDef *huart) { HAL_UART_Abort_IT(huart); });
-    HAL_UART_RegisterCallback(
-        Handle, HAL_UART_ABORT_COMPLETE_CB_ID, [](UART_HandleTypeDef *huart) {
+        Handle, HAL_UART_ABORT_RECEIVE_COMPLETE_CB_ID,
+        [](UART_HandleTypeDef *) {
           auto uart = stm32cubemx_helper::get_context<Handle, UartRx>();
-          HAL_UART_Receive_IT(huart, &uart->buf_, 1);
+          uart->start_reception();
         });
-    HAL_UART_Receive_IT(Handle, &buf_, 1);
+    start_reception();
   }
 
   ~UartRx() {
-    HAL_UART_Abort_IT(Handle);
-    HAL_UART_UnRegisterCallback(Handle, HAL_UART_RX_COMPLETE_CB_ID);
-    HAL_UART_UnRegisterCallback(Handle, HAL_UART_ERROR_CB_ID);
-    HAL_UART_UnRegisterCallback(Handle, HAL_UART_ABORT_COMPLETE_CB_ID);
+    HAL_UART_AbortReceive(Handle);
+    HAL_UART_UnRegisterRxEventCallback(Handle);
+    HAL_UART_UnRegisterCallback(Handle, HAL_UART_ABORT_RECEIVE_COMPLETE_CB_ID);
     stm32cubemx_helper::set_context<Handle, UartRx>(nullptr);
   }
 
   bool receive(uint8_t *data, size_t size, uint32_t timeout) {
-    core::TimeoutHelper timeout_helper;
-    while (queue_.size() < size) {
-      if (timeout_helper.is_timeout(timeout)) {
-        return false;
-      }
-      osDelay(1);
-    }
-    for (size_t i = 0; i < size; ++i) {
-      queue_.pop(data[i], 0);
+    if (!wait(size, timeout)) {
+      return false;
     }
+    ring_.pop_n({data, size});
     return true;
   }
 
-  void flush() { queue_.clear(); }
+  size_t receive_some(uint8_t *data, size_t size, uint32_t timeout) {
+    if (!wait(1, timeout)) {
+      return 0;
+    }
+    return ring_.pop_n({data, size});
+  }
+
+  void flush() { ring_.consume(ring_.size()); }
+
+  size_t available() { return ring_.size(); }
 
-  size_t available() { return queue_.size(); }
+  void error_callback() { HAL_UART_AbortReceive_IT(Handle); }
 
 private:
-  core::Queue<uint8_t> queue_;
-  uint8_t buf_;
+  static constexpr size_t RX_CHUNK_SIZE = 16;
+
+  core::RingBuffer<uint8_t> ring_;
+  std::array<uint8_t, RX_CHUNK_SIZE> buf_;
+  core::Semaphore rx_sem_;
 
   UartRx(const UartRx &) = delete;
   UartRx &operator=(const UartRx &) = delete;
+
+  void start_reception() {
+    HAL_UARTEx_ReceiveToIdle_IT(Handle, buf_.data(), buf_.size());
+  }
+
+  bool wait(size_t size, uint32_t timeout) {
+    core::TimeoutHelper timeout_helper;
+    while (ring_.size() < size) {
+      if (timeout_helper.is_timeout(timeout)) {
+        return false;
+      }
+      rx_sem_.acquire(timeout);
+    }
+    return true;
+  }
 };
 
 } // namespace detail
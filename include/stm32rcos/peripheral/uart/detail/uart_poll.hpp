@@ -16,12 +16,14 @@ template <UART_HandleTypeDef *Handle, UartType RxType> class UartRx;
 
 template <UART_HandleTypeDef *Handle> class UartTx<Handle, UartType::POLL> {
 public:
-  UartTx() = default;
+  UartTx(size_t) {}
 
   bool transmit(const uint8_t *data, size_t size, uint32_t timeout) {
     return HAL_UART_Transmit(Handle, data, size, timeout) == HAL_OK;
   }
 
+  void error_callback() {}
+
 private:
   UartTx(const UartTx &) = delete;
   UartTx &operator=(const UartTx &) = delete;
@@ -32,13 +34,15 @@ public:
   UartRx(size_t) {}
 
   bool receive(uint8_t *data, size_t size, uint32_t timeout) {
-    return HAL_UART_Receive(Handle, data, size, timeout);
+    return HAL_UART_Receive(Handle, data, size, timeout) == HAL_OK;
   }
 
   void flush() {}
 
   size_t available() { return 0; }
 
+  void error_callback() {}
+
 private:
   UartRx(const UartRx &) = delete;
   UartRx &operator=(const UartRx &) = delete;
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "stm32rcos/core.hpp"
+
+#include "uart_base.hpp"
+
+#ifdef STM32RCOS_INSTRUMENTATION
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * スレッド、Queue、Semaphore の情報を uart に書き出します。
+ *
+ * @param timeout 1行ごとの送信にかける時間の上限
+ * @return 送信に失敗した行があれば false
+ */
+inline bool dump_instrumentation(UartBase &uart, uint32_t timeout) {
+  bool ok = true;
+  core::dump_instrumentation([&](const char *data, size_t size) {
+    ok &= uart.transmit(reinterpret_cast<const uint8_t *>(data), size,
+                        timeout);
+  });
+  return ok;
+}
+
+} // namespace peripheral
+} // namespace stm32rcos
+
+#endif
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "stm32rcos/core.hpp"
+
+#include "uart_base.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+/**
+ * log() で書き込んだ記録を、バックグラウンドのスレッドから uart へ
+ * 流し続けます。送信中に CPU を使わないよう、Tx に DMA を使う Uart を
+ * 渡してください。受け取ったバイト列は decode_log() で文字列に戻せます。
+ *
+ * @code{.cpp}
+ * Uart<&huart2, UartType::DMA, UartType::IT> uart2(64, 1024);
+ * LogStream log_stream(uart2);
+ *
+ * while (true) {
+ *   log("angle=%f rpm=%d\r\n", angle, rpm);
+ *   osDelay(1);
+ * }
+ * @endcode
+ */
+class LogStream {
+public:
+  /**
+   * @param period 取り出す間隔 [ms]
+   * @param tx_buf_size まとめて送信するバイト数
+   */
+  LogStream(UartBase &uart, uint32_t period = 10,
+            osPriority_t priority = osPriorityLow, size_t stack_size = 1024,
+            size_t tx_buf_size = 256)
+      : uart_{uart}, period_{period},
+        tx_buf_(std::max(tx_buf_size, core::detail::LOG_PACKET_MAX)),
+        thread_{&LogStream::run, this, stack_size, priority, 0,
+                "log_stream"} {}
+
+  // 受信側をつなぎ直したときなどに呼ぶと、書式文字列をもう一度送る
+  void resend_formats() { resend_.store(true, std::memory_order_relaxed); }
+
+private:
+  UartBase &uart_;
+  uint32_t period_;
+  std::vector<uint8_t> tx_buf_;
+  size_t tx_size_ = 0;
+  std::atomic<bool> resend_{false};
+  core::LogReader reader_;
+  core::Thread thread_;
+
+  LogStream(const LogStream &) = delete;
+  LogStream &operator=(const LogStream &) = delete;
+
+  static void run(void *args) {
+    auto stream = static_cast<LogStream *>(args);
+    while (true) {
+      if (stream->resend_.load(std::memory_order_relaxed)) {
+        stream->resend_.store(false, std::memory_order_relaxed);
+        stream->reader_.reset();
+      }
+      stream->reader_.read([stream](const uint8_t *data, size_t size) {
+        if (stream->tx_buf_.size() - stream->tx_size_ < size) {
+          stream->flush();
+        }
+        std::memcpy(stream->tx_buf_.data() + stream->tx_size_, data, size);
+        stream->tx_size_ += size;
+      });
+      stream->flush();
+      osDelay(stream->period_);
+    }
+  }
+
+  void flush() {
+    if (tx_size_ != 0) {
+      uart_.transmit(tx_buf_.data(), tx_size_, osWaitForever);
+      tx_size_ = 0;
+    }
+  }
+};
+
+} // namespace peripheral
+} // namespace stm32rcos
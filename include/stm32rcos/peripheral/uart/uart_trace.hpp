@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "stm32rcos/core.hpp"
+
+#include "stm32rcos/hal.hpp"
+
+#include "uart_base.hpp"
+#include "uart_type.hpp"
+
+#ifdef STM32RCOS_TRACE
+
+namespace stm32rcos {
+namespace peripheral {
+
+template <UART_HandleTypeDef *Handle, UartType TxType, UartType RxType>
+class Uart;
+
+/**
+ * トレースバッファの記録を、バックグラウンドのスレッドから uart へ
+ * 流し続けます。送信中に CPU を使わないよう、Tx に DMA を使う Uart を
+ * 渡してください。受け取ったバイト列は write_chrome_trace() で変換できます。
+ *
+ * 送り出す処理自身の記録は残しません。このスレッドの切り替えと、Uart を
+ * 渡したときはその UART の割り込みと transmit() が対象です。UartBase として
+ * 渡した場合、UART の記録は残り、送るたびにトレースが増えます。
+ *
+ * @code{.cpp}
+ * Uart<&huart2, UartType::DMA, UartType::IT> uart2(64, 1024);
+ * trace_start();
+ * TraceStream trace_stream(uart2);
+ * @endcode
+ */
+class TraceStream {
+public:
+  /**
+   * @param period 取り出す間隔 [ms]
+   */
+  TraceStream(UartBase &uart, uint32_t period = 10,
+              osPriority_t priority = osPriorityLow, size_t stack_size = 512)
+      : TraceStream(uart, nullptr, period, priority, stack_size) {}
+
+  template <UART_HandleTypeDef *Handle, UartType TxType, UartType RxType>
+  TraceStream(Uart<Handle, TxType, RxType> &uart, uint32_t period = 10,
+              osPriority_t priority = osPriorityLow, size_t stack_size = 512)
+      : TraceStream(uart, Handle, period, priority, stack_size) {}
+
+private:
+  UartBase &uart_;
+  const volatile void *uart_id_;
+  uint32_t period_;
+  core::Thread thread_;
+
+  TraceStream(const TraceStream &) = delete;
+  TraceStream &operator=(const TraceStream &) = delete;
+
+  TraceStream(UartBase &uart, const volatile void *uart_id, uint32_t period,
+              osPriority_t priority, size_t stack_size)
+      : uart_{uart}, uart_id_{uart_id}, period_{period},
+        thread_{&TraceStream::run, this, stack_size, priority, 0,
+                "trace_stream"} {}
+
+  static void run(void *args) {
+    auto stream = static_cast<TraceStream *>(args);
+    core::trace_ignore(osThreadGetId());
+    if (stream->uart_id_) {
+      core::trace_ignore(stream->uart_id_);
+    }
+    while (true) {
+      core::trace_drain([stream](const uint8_t *data, size_t size) {
+        stream->uart_.transmit(data, size, osWaitForever);
+      });
+      osDelay(stream->period_);
+    }
+  }
+};
+
+} // namespace peripheral
+} // namespace stm32rcos
+
+#endif
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "stm32rcos/core.hpp"
+
+#include "uart_base.hpp"
+
+namespace stm32rcos {
+namespace peripheral {
+
+class VirtualUart;
+
+/**
+ * 2つの VirtualUart をつなぐ、プロセス内で完結する仮想の通信路です。
+ * 実機なしで UartBase を使うプロトコル処理を動かすのに使います。
+ *
+ * バイトは advance() で進めた時間の分だけ、ボーレートに従って相手の
+ * 受信バッファへ移ります。1バイトは 8N1 の 10 ビットとして数えます。
+ *
+ * @code{.cpp}
+ * VirtualUartLink link(115200);
+ * VirtualUart a(link);
+ * VirtualUart b(link);
+ *
+ * uint8_t data[] = {'h', 'i'};
+ * a.transmit(data, sizeof(data), 0);
+ * link.advance(1000); // 1ms で約11バイト流れる
+ * b.receive(data, sizeof(data), 0);
+ * @endcode
+ */
+class VirtualUartLink {
+public:
+  static constexpr uint32_t BITS_PER_BYTE = 10;
+
+  VirtualUartLink(uint32_t baud_rate) : baud_rate_{baud_rate} {}
+
+  /**
+   * 時間を us マイクロ秒進め、その間に送れるバイトを両方向に流します。
+   *
+   * @return 流したバイト数
+   */
+  size_t advance(uint32_t us);
+
+  // 送信待ちのバイトがなくなるまで時間を進める
+  size_t run();
+
+  uint32_t baud_rate() const { return baud_rate_; }
+
+  // advance() で進めた時間の合計 [us]
+  uint64_t elapsed_us() const {
+    core::CriticalSection critical_section;
+    return elapsed_us_;
+  }
+
+private:
+  uint32_t baud_rate_;
+  std::array<VirtualUart *, 2> ports_{};
+  uint64_t elapsed_us_ = 0;
+  // 1バイトに満たない時間をビット数 * 1000000 で持ち越す
+  uint64_t carry_ = 0;
+
+  friend class VirtualUart;
+
+  VirtualUartLink(const VirtualUartLink &) = delete;
+  VirtualUartLink &operator=(const VirtualUartLink &) = delete;
+
+  size_t transfer(VirtualUart &from, VirtualUart &to, size_t size);
+};
+
+/**
+ * VirtualUartLink の一端です。
+ *
+ * transmit() は送信バッファに入れた時点で戻ります。通信路に流れるのは
+ * advance()/run() を呼んだときです。
+ */
+class VirtualUart : public UartBase {
+public:
+  VirtualUart(VirtualUartLink &link, size_t rx_buf_size = 64,
+              size_t tx_buf_size = 64)
+      : link_{link}, tx_ring_{tx_buf_size}, rx_ring_{rx_buf_size},
+        tx_sem_{1, 0}, rx_sem_{1, 0} {
+    core::CriticalSection critical_section;
+    auto it = std::find(link_.ports_.begin(), link_.ports_.end(), nullptr);
+    if (it != link_.ports_.end()) {
+      *it = this;
+    }
+  }
+
+  ~VirtualUart() override {
+    core::CriticalSection critical_section;
+    auto it = std::find(link_.ports_.begin(), link_.ports_.end(), this);
+    if (it != link_.ports_.end()) {
+      *it = nullptr;
+    }
+  }
+
+  bool transmit(const uint8_t *data, size_t size, uint32_t timeout) override {
+    // 前回のタイムアウトで残った通知を捨てる
+    tx_sem_.acquire(0);
+    core::TimeoutHelper timeout_helper;
+    size_t sent = 0;
+    while (true) {
+      sent += tx_ring_.push_n({data + sent, size - sent});
+      if (sent == size) {
+        return true;
+      }
+      if (timeout_helper.is_timeout(timeout)) {
+        return false;
+      }
+      tx_sem_.acquire(timeout);
+    }
+  }
+
+  bool receive(uint8_t *data, size_t size, uint32_t timeout) override {
+    if (!wait(size, timeout)) {
+      return false;
+    }
+    rx_ring_.pop_n({data, size});
+    return true;
+  }
+
+  size_t receive_some(uint8_t *data, size_t size, uint32_t timeout) {
+    if (!wait(1, timeout)) {
+      return 0;
+    }
+    return rx_ring_.pop_n({data, size});
+  }
+
+  void flush() override { rx_ring_.consume(rx_ring_.size()); }
+
+  size_t available() override { return rx_ring_.size(); }
+
+  // 受信バッファが一杯で捨てたバイト数
+  size_t overruns() const {
+    core::CriticalSection critical_section;
+    return overruns_;
+  }
+
+private:
+  VirtualUartLink &link_;
+  core::RingBuffer<uint8_t> tx_ring_;
+  core::RingBuffer<uint8_t> rx_ring_;
+  core::Semaphore tx_sem_;
+  core::Semaphore rx_sem_;
+  size_t overruns_ = 0;
+
+  friend class VirtualUartLink;
+
+  VirtualUart(const VirtualUart &) = delete;
+  VirtualUart &operator=(const VirtualUart &) = delete;
+
+  bool wait(size_t size, uint32_t timeout) {
+    core::TimeoutHelper timeout_helper;
+    while (rx_ring_.size() < size) {
+      if (timeout_helper.is_timeout(timeout)) {
+        return false;
+      }
+      rx_sem_.acquire(timeout);
+    }
+    return true;
+  }
+};
+
+inline size_t VirtualUartLink::advance(uint32_t us) {
+  core::CriticalSection critical_section;
+  elapsed_us_ += us;
+  carry_ += static_cast<uint64_t>(us) * baud_rate_;
+  size_t size = carry_ / (BITS_PER_BYTE * 1000000);
+  carry_ %= BITS_PER_BYTE * 1000000;
+  // 全二重なので、両方向に同じバイト数まで流れる
+  size_t count = 0;
+  if (ports_[0] && ports_[1]) {
+    count += transfer(*ports_[0], *ports_[1], size);
+    count += transfer(*ports_[1], *ports_[0], size);
+  }
+  return count;
+}
+
+inline size_t VirtualUartLink::run() {
+  size_t count = 0;
+  while (true) {
+    size_t pending;
+    {
+      core::CriticalSection critical_section;
+      pending = 0;
+      for (VirtualUart *port : ports_) {
+        if (port) {
+          pending = std::max(pending, port->tx_ring_.size());
+        }
+      }
+    }
+    if (pending == 0 || !ports_[0] || !ports_[1]) {
+      return count;
+    }
+    uint64_t bits = static_cast<uint64_t>(pending) * BITS_PER_BYTE * 1000000;
+    count += advance((bits + baud_rate_ - 1) / baud_rate_);
+  }
+}
+
+// 受信割り込みと送信完了割り込みの代わりに、相手と自分のセマフォを起こす
+inline size_t VirtualUartLink::transfer(VirtualUart &from, VirtualUart &to,
+                                        size_t size) {
+  std::array<uint8_t, 64> buf;
+  size_t count = 0;
+  while (count < size) {
+    size_t chunk = from.tx_ring_.pop_n(
+        std::span{buf}.first(std::min(buf.size(), size - count)));
+    if (chunk == 0) {
+      break;
+    }
+    size_t pushed = to.rx_ring_.push_n(std::span{buf}.first(chunk));
+    to.overruns_ += chunk - pushed;
+    count += chunk;
+  }
+  if (count != 0) {
+    from.tx_sem_.release();
+    to.rx_sem_.release();
+  }
+  return count;
+}
+
+} // namespace peripheral
+} // namespace stm32rcos
@@ -0,0 +1,21 @@
+#include "stm32rcos/core/trace.hpp"
+
+#ifdef STM32RCOS_TRACE
+
+#include <FreeRTOS.h>
+
+#include <task.h>
+
+// FreeRTOSConfig.h の traceTASK_SWITCHED_IN/OUT から呼ばれる
+
+extern "C" void stm32rcos_trace_task_switched_in(void) {
+  stm32rcos::core::trace(stm32rcos::core::TraceEvent::THREAD_IN,
+                         xTaskGetCurrentTaskHandle());
+}
+
+extern "C" void stm32rcos_trace_task_switched_out(void) {
+  stm32rcos::core::trace(stm32rcos::core::TraceEvent::THREAD_OUT,
+                         xTaskGetCurrentTaskHandle());
+}
+
+#endif
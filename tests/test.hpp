@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// 失敗しても最後まで続け、main の最後で test::result() を返す
+
+namespace test {
+
+inline int &failures() {
+  static int failures = 0;
+  return failures;
+}
+
+inline int result() {
+  if (failures() != 0) {
+    std::printf("%d check(s) failed\n", failures());
+    return EXIT_FAILURE;
+  }
+  std::printf("OK\n");
+  return EXIT_SUCCESS;
+}
+
+} // namespace test
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);     \
+      ++test::failures();                                                      \
+    }                                                                          \
+  } while (0)
@@ -0,0 +1,186 @@
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <stm32rcos/peripheral/can/can_filter_plan.hpp>
+
+#include "test.hpp"
+
+using namespace stm32rcos::peripheral;
+
+namespace {
+
+// コンパイル時にも計算できる
+constexpr CanIdRange DOC_IDS[] = {
+    {0x201, 0x208, false},
+    {0x300, 0x300, false},
+};
+static_assert(plan_bxcan_filters(DOC_IDS).size() == 2);
+static_assert(plan_fdcan_filters(DOC_IDS).size() == 2);
+
+// 標準IDは4個、標準IDの範囲と拡張IDは2個ずつで1バンク
+constexpr CanIdRange PACKED_IDS[] = {
+    {0x100, 0x100, false}, {0x102, 0x102, false}, {0x104, 0x104, false},
+    {0x106, 0x106, false}, {0x200, 0x20F, false}, {0x300, 0x33F, false},
+    {0x1000, 0x1000, true}, {0x2000, 0x2000, true},
+};
+static_assert(plan_bxcan_filters(PACKED_IDS).size() == 3);
+
+struct Frame {
+  uint32_t id;
+  bool ide;
+  bool rtr;
+};
+
+// bxCAN のフィルタバンクが frame を通すかを、リファレンスマニュアルの
+// レジスタ配置どおりに判定する
+bool bxcan_accepts(const BxCanFilterBank &bank, const Frame &frame) {
+  if (bank.scale_32bit) {
+    // ID IDE RTR 0。標準IDは STDID[10:0] を上位に置く
+    uint32_t reg = (frame.ide ? frame.id << 3 : frame.id << 21) |
+                   (frame.ide ? 0x4 : 0) | (frame.rtr ? 0x2 : 0);
+    uint32_t fr1 = (uint32_t{bank.id_high} << 16) | bank.id_low;
+    uint32_t fr2 = (uint32_t{bank.mask_id_high} << 16) | bank.mask_id_low;
+    if (bank.list_mode) {
+      return reg == fr1 || reg == fr2;
+    }
+    return ((reg ^ fr1) & fr2) == 0;
+  }
+  // STDID[10:0] RTR IDE EXID[17:15]
+  uint32_t std_id = frame.ide ? frame.id >> 18 : frame.id;
+  uint32_t reg = (std_id << 5) | (frame.rtr ? 0x10 : 0) |
+                 (frame.ide ? 0x8 : 0) | (frame.ide ? (frame.id >> 15) & 7 : 0);
+  if (bank.list_mode) {
+    return reg == bank.id_low || reg == bank.mask_id_low ||
+           reg == bank.id_high || reg == bank.mask_id_high;
+  }
+  return ((reg ^ bank.id_low) & bank.mask_id_low) == 0 ||
+         ((reg ^ bank.id_high) & bank.mask_id_high) == 0;
+}
+
+bool fdcan_accepts(const FdCanFilterElement &element, const Frame &frame) {
+  if (element.ide != frame.ide) {
+    return false;
+  }
+  switch (element.type) {
+  case FdCanFilterType::RANGE:
+    return element.id1 <= frame.id && frame.id <= element.id2;
+  case FdCanFilterType::DUAL:
+    return frame.id == element.id1 || frame.id == element.id2;
+  case FdCanFilterType::MASK:
+    return (frame.id & element.id2) == (element.id1 & element.id2);
+  }
+  return false;
+}
+
+bool expected(const std::vector<CanIdRange> &ranges, const Frame &frame,
+              CanRxFifo fifo) {
+  for (const CanIdRange &range : ranges) {
+    if (range.fifo == fifo && range.ide == frame.ide &&
+        range.first <= frame.id && frame.id <= range.last) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <class Plan, class Accepts>
+bool accepted(const Plan &plan, const Frame &frame, CanRxFifo fifo,
+              Accepts accepts) {
+  for (const auto &element : plan) {
+    if (element.fifo == fifo && accepts(element, frame)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 各範囲の端とその前後、標準IDはすべて、拡張IDは乱数で選んだものを調べる
+std::vector<Frame> frames_to_check(const std::vector<CanIdRange> &ranges,
+                                   std::mt19937 &rng) {
+  std::vector<Frame> frames;
+  for (uint32_t id = 0; id <= 0x7FF; ++id) {
+    frames.push_back({id, false, false});
+  }
+  for (const CanIdRange &range : ranges) {
+    for (uint32_t id : {range.first - 1, range.first, range.last,
+                        range.last + 1}) {
+      if (range.ide && id <= 0x1FFFFFFF) {
+        frames.push_back({id, true, false});
+      }
+    }
+  }
+  std::uniform_int_distribution<uint32_t> ext_id(0, 0x1FFFFFFF);
+  for (size_t i = 0; i < 256; ++i) {
+    frames.push_back({ext_id(rng), true, false});
+  }
+  return frames;
+}
+
+std::vector<CanIdRange> random_ranges(std::mt19937 &rng) {
+  std::uniform_int_distribution<size_t> count(1, 8);
+  std::uniform_int_distribution<uint32_t> std_id(0, 0x7FF);
+  std::uniform_int_distribution<uint32_t> ext_id(0, 0x1FFFFFFF);
+  std::uniform_int_distribution<uint32_t> length(0, 40);
+  std::bernoulli_distribution coin;
+  std::vector<CanIdRange> ranges(count(rng));
+  for (CanIdRange &range : ranges) {
+    range.ide = coin(rng);
+    range.first = range.ide ? ext_id(rng) : std_id(rng);
+    // 単一のIDを多めに混ぜる
+    range.last = range.first + (coin(rng) ? 0 : length(rng));
+    range.fifo = coin(rng) ? CanRxFifo::FIFO0 : CanRxFifo::FIFO1;
+  }
+  return ranges;
+}
+
+void test_random_sets() {
+  std::mt19937 rng(12345);
+  size_t planned = 0;
+  for (size_t i = 0; i < 200; ++i) {
+    std::vector<CanIdRange> ranges = random_ranges(rng);
+    BxCanFilterPlan bxcan = plan_bxcan_filters(ranges);
+    FdCanFilterPlan fdcan = plan_fdcan_filters(ranges);
+    // 範囲は最大 8 個なので、FDCAN のエレメントは足りる
+    CHECK(!fdcan.overflow());
+    bool ok = true;
+    for (const Frame &frame : frames_to_check(ranges, rng)) {
+      for (CanRxFifo fifo : {CanRxFifo::FIFO0, CanRxFifo::FIFO1}) {
+        bool want = expected(ranges, frame, fifo);
+        if (!bxcan.overflow()) {
+          ok &= accepted(bxcan, frame, fifo, bxcan_accepts) == want;
+        }
+        ok &= accepted(fdcan, frame, fifo, fdcan_accepts) == want;
+      }
+      // リモートフレームは通さない
+      Frame remote{frame.id, frame.ide, true};
+      for (CanRxFifo fifo : {CanRxFifo::FIFO0, CanRxFifo::FIFO1}) {
+        if (!bxcan.overflow()) {
+          ok &= !accepted(bxcan, remote, fifo, bxcan_accepts);
+        }
+      }
+    }
+    CHECK(ok);
+    planned += !bxcan.overflow();
+  }
+  // バンクが足りない組はほとんど無い
+  CHECK(planned > 190);
+}
+
+void test_overflow() {
+  // 間を空けた拡張IDの範囲は、それぞれ複数のマスクに分かれる
+  std::vector<CanIdRange> ranges;
+  for (uint32_t i = 0; i < 20; ++i) {
+    ranges.push_back({i * 0x100 + 1, i * 0x100 + 0x7E, true});
+  }
+  CHECK(plan_bxcan_filters(ranges).overflow());
+}
+
+} // namespace
+
+int main() {
+  test_random_sets();
+  test_overflow();
+  return test::result();
+}
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/peripheral.hpp>
+
+#include "test.hpp"
+
+using namespace stm32rcos::core;
+using namespace stm32rcos::peripheral;
+
+VirtualCanBus bus;
+VirtualCanNode node1(bus);
+VirtualCanNode node2(bus);
+
+namespace {
+
+constexpr uint32_t TESTER_ID = 0x7E0;
+constexpr uint32_t ECU_ID = 0x7E8;
+
+std::atomic<bool> bus_running{true};
+
+// 割り込みの代わりに、別スレッドでバスを流し続ける
+void run_bus(void *) {
+  while (bus_running.load()) {
+    bus.run();
+    osDelay(1);
+  }
+}
+
+std::array<uint8_t, CanIsoTp::MAX_SIZE> pattern(uint8_t first) {
+  std::array<uint8_t, CanIsoTp::MAX_SIZE> data;
+  std::iota(data.begin(), data.end(), first);
+  return data;
+}
+
+struct Receiver {
+  CanIsoTp &iso_tp;
+  size_t capacity;
+  std::array<uint8_t, CanIsoTp::MAX_SIZE> data{};
+  size_t size = 0;
+};
+
+void receive(void *args) {
+  auto receiver = static_cast<Receiver *>(args);
+  receiver->size = receiver->iso_tp.receive(receiver->data.data(),
+                                            receiver->capacity, 1000);
+}
+
+struct Sender {
+  CanIsoTp &iso_tp;
+  const uint8_t *data;
+  size_t size;
+  bool ok = false;
+};
+
+void transmit(void *args) {
+  auto sender = static_cast<Sender *>(args);
+  sender->ok = sender->iso_tp.transmit(sender->data, sender->size, 1000);
+}
+
+// 受信側が待ち始めてから送る
+bool transfer(CanIsoTp &tester, CanIsoTp &ecu, const uint8_t *data,
+              size_t size) {
+  Receiver receiver{ecu, CanIsoTp::MAX_SIZE};
+  Thread thread{receive, &receiver, 1024, osPriorityNormal};
+  osDelay(5);
+  bool ok = tester.transmit(data, size, 1000);
+  thread.join();
+  return ok && receiver.size == size &&
+         std::equal(data, data + size, receiver.data.begin());
+}
+
+void test_single_frame(Can<&node1> &can1, Can<&node2> &can2) {
+  CanIsoTp tester(can1, {.tx_id = TESTER_ID, .rx_id = ECU_ID});
+  CanIsoTp ecu(can2, {.tx_id = ECU_ID, .rx_id = TESTER_ID});
+  CHECK(tester.start());
+  CHECK(ecu.start());
+
+  auto data = pattern(0);
+  CHECK(transfer(tester, ecu, data.data(), 1));
+  CHECK(transfer(tester, ecu, data.data(), 7));
+}
+
+void test_multi_frame(Can<&node1> &can1, Can<&node2> &can2) {
+  CanIsoTp tester(can1, {.tx_id = TESTER_ID, .rx_id = ECU_ID});
+  // 4 フレームごとに Flow Control を返し、1ms 空けさせる
+  CanIsoTp ecu(can2, {.tx_id = ECU_ID,
+                      .rx_id = TESTER_ID,
+                      .block_size = 4,
+                      .st_min = 1});
+  CHECK(tester.start());
+  CHECK(ecu.start());
+
+  auto data = pattern(0);
+  CHECK(transfer(tester, ecu, data.data(), 8));
+  CHECK(transfer(tester, ecu, data.data(), 100));
+  // 逆向きは BS = 0、STmin = 0 なので、一度にまとめて送る
+  CHECK(transfer(ecu, tester, data.data(), CanIsoTp::MAX_SIZE));
+}
+
+// 相手が WAIT を返している間は Consecutive Frame を送らない
+void test_flow_control_wait(Can<&node1> &can1, Can<&node2> &can2) {
+  CanIsoTp tester(can1, {.tx_id = TESTER_ID, .rx_id = ECU_ID});
+  CHECK(tester.start());
+  Queue<CanMessage> rx_queue(16);
+  CHECK(can2.attach_rx_queue({.id = TESTER_ID, .mask = 0x7FF, .ide = false},
+                             rx_queue));
+
+  auto data = pattern(0);
+  Sender sender{tester, data.data(), 20};
+  Thread thread{transmit, &sender, 1024, osPriorityNormal};
+  CanMessage msg;
+  CHECK(rx_queue.pop(msg, 100));
+  CHECK(msg.data[0] == 0x10 && msg.data[1] == 20);
+  uint64_t first_frame_time = msg.timestamp;
+
+  CanMessage flow_control{.id = ECU_ID, .ide = false, .dlc = 3, .data = {}};
+  flow_control.data = {0x31, 0, 0};
+  for (size_t i = 0; i < 3; ++i) {
+    CHECK(can2.transmit(flow_control, 100));
+    CHECK(!rx_queue.pop(msg, 20));
+  }
+  flow_control.data = {0x30, 0, 0};
+  CHECK(can2.transmit(flow_control, 100));
+  CHECK(rx_queue.pop(msg, 100));
+  CHECK(msg.data[0] == 0x21 && msg.data[1] == data[6]);
+  // タイムスタンプはバスのビットタイムで数える
+  CHECK(msg.timestamp > first_frame_time);
+  CHECK(rx_queue.pop(msg, 100));
+  CHECK(msg.data[0] == 0x22 && msg.data[1] == data[13]);
+  thread.join();
+  CHECK(sender.ok);
+  CHECK(can2.detach_rx_queue(rx_queue));
+}
+
+// 受信バッファに入らなければ OVFLW を返し、送信側は諦める
+void test_flow_control_overflow(Can<&node1> &can1, Can<&node2> &can2) {
+  CanIsoTp tester(can1, {.tx_id = TESTER_ID, .rx_id = ECU_ID});
+  CanIsoTp ecu(can2, {.tx_id = ECU_ID, .rx_id = TESTER_ID});
+  CHECK(tester.start());
+  CHECK(ecu.start());
+
+  Receiver receiver{ecu, 10};
+  Thread thread{receive, &receiver, 1024, osPriorityNormal};
+  osDelay(5);
+  auto data = pattern(0);
+  uint32_t start = osKernelGetTickCount();
+  CHECK(!tester.transmit(data.data(), 100, 1000));
+  CHECK(osKernelGetTickCount() - start < 100);
+  thread.join();
+  CHECK(receiver.size == 0);
+
+  // その後の受信には影響しない
+  CHECK(transfer(tester, ecu, data.data(), 10));
+}
+
+// 複数のスレッドから送っても、1つずつ順に送られる
+void test_concurrent_transmit(Can<&node1> &can1, Can<&node2> &can2) {
+  CanIsoTp tester(can1, {.tx_id = TESTER_ID, .rx_id = ECU_ID});
+  CHECK(tester.start());
+  Queue<CanMessage> rx_queue(64);
+  CHECK(can2.attach_rx_queue({.id = TESTER_ID, .mask = 0x7FF, .ide = false},
+                             rx_queue));
+
+  auto first = pattern(0);
+  auto second = pattern(100);
+  Sender sender1{tester, first.data(), 50};
+  Sender sender2{tester, second.data(), 60};
+  Thread thread1{transmit, &sender1, 1024, osPriorityNormal};
+  Thread thread2{transmit, &sender2, 1024, osPriorityNormal};
+
+  // First Frame ごとに CTS を返し、次の First Frame までに
+  // 1つのデータが欠けずに揃うことを確かめる
+  CanMessage flow_control{.id = ECU_ID, .ide = false, .dlc = 3, .data = {}};
+  flow_control.data = {0x30, 0, 0};
+  bool ok = true;
+  for (size_t n = 0; n < 2; ++n) {
+    CanMessage msg;
+    if (!rx_queue.pop(msg, 1000) || (msg.data[0] & 0xF0) != 0x10) {
+      ok = false;
+      break;
+    }
+    size_t size = msg.data[1];
+    const uint8_t *expected = size == 50 ? first.data() : second.data();
+    std::array<uint8_t, CanIsoTp::MAX_SIZE> received{};
+    std::copy_n(msg.data.begin() + 2, 6, received.begin());
+    CHECK(can2.transmit(flow_control, 100));
+    for (size_t offset = 6; offset < size; offset += 7) {
+      if (!rx_queue.pop(msg, 1000) || (msg.data[0] & 0xF0) != 0x20) {
+        ok = false;
+        break;
+      }
+      std::copy_n(msg.data.begin() + 1, std::min<size_t>(7, size - offset),
+                  received.begin() + offset);
+    }
+    ok &= std::equal(expected, expected + size, received.begin());
+  }
+  thread1.join();
+  thread2.join();
+  CHECK(ok);
+  CHECK(sender1.ok && sender2.ok);
+  CHECK(can2.detach_rx_queue(rx_queue));
+}
+
+} // namespace
+
+int main() {
+  Thread bus_thread{run_bus, nullptr, 1024, osPriorityHigh};
+  {
+    Can<&node1> can1;
+    Can<&node2> can2;
+    CHECK(can1.start());
+    CHECK(can2.start());
+
+    test_single_frame(can1, can2);
+    test_multi_frame(can1, can2);
+    test_flow_control_wait(can1, can2);
+    test_flow_control_overflow(can1, can2);
+    test_concurrent_transmit(can1, can2);
+  }
+  bus_running.store(false);
+  bus_thread.join();
+  return test::result();
+}
@@ -0,0 +1,97 @@
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <utility>
+
+#include <stm32rcos/peripheral/can/can_rx_handler.hpp>
+
+#include "test.hpp"
+
+using namespace stm32rcos::peripheral;
+
+namespace {
+
+constexpr size_t TABLE_SIZE = 16;
+
+using Key = std::pair<uint32_t, bool>;
+
+// 呼ばれたハンドラの context を記録する
+uintptr_t called = 0;
+
+void handler(const CanMessage &, void *context) {
+  called = reinterpret_cast<uintptr_t>(context);
+}
+
+// dispatch() が登録したハンドラだけを呼ぶこと
+bool dispatches(detail::CanRxDispatcher<TABLE_SIZE> &dispatcher,
+                const std::map<Key, uintptr_t> &model, const Key &key) {
+  uint32_t drops = 0;
+  called = 0;
+  CanMessage msg{.id = key.first, .ide = key.second, .dlc = 0, .data = {}};
+  bool found = dispatcher.dispatch(msg, drops);
+  auto it = model.find(key);
+  if (it == model.end()) {
+    return !found && called == 0;
+  }
+  return found && called == it->second;
+}
+
+// 衝突の多い狭いIDの範囲で登録と解除を繰り返し、表と同じ結果になること
+void test_random_attach_detach() {
+  detail::CanRxDispatcher<TABLE_SIZE> dispatcher;
+  std::map<Key, uintptr_t> model;
+  std::mt19937 rng(12345);
+  std::uniform_int_distribution<uint32_t> id(0, 40);
+  std::bernoulli_distribution coin;
+  uintptr_t next_context = 1;
+  bool ok = true;
+  for (size_t i = 0; i < 20000; ++i) {
+    Key key{coin(rng) ? id(rng) : id(rng) * 0x10000, coin(rng)};
+    if (coin(rng)) {
+      uintptr_t context = next_context++;
+      bool attached =
+          dispatcher.attach(key.first, key.second, handler,
+                            reinterpret_cast<void *>(context), false,
+                            CanRxFifo::FIFO0);
+      bool expected = !model.contains(key) && model.size() < TABLE_SIZE;
+      ok &= attached == expected;
+      if (attached) {
+        model[key] = context;
+      }
+    } else {
+      ok &= dispatcher.detach(key.first, key.second) == model.erase(key);
+    }
+    Key probe{coin(rng) ? id(rng) : id(rng) * 0x10000, coin(rng)};
+    ok &= dispatches(dispatcher, model, probe);
+  }
+  for (const auto &[key, context] : model) {
+    ok &= dispatches(dispatcher, model, key);
+  }
+  CHECK(ok);
+}
+
+// 連番の標準IDで表を埋められ、すべて外すと空に戻る
+void test_sequential_ids() {
+  detail::CanRxDispatcher<TABLE_SIZE> dispatcher;
+  for (uint32_t id = 0x100; id < 0x100 + TABLE_SIZE; ++id) {
+    CHECK(dispatcher.attach(id, false, handler, nullptr, false,
+                            CanRxFifo::FIFO0));
+  }
+  CHECK(!dispatcher.attach(0x200, false, handler, nullptr, false,
+                           CanRxFifo::FIFO0));
+  for (uint32_t id = 0x100; id < 0x100 + TABLE_SIZE; ++id) {
+    CHECK(dispatcher.detach(id, false));
+  }
+  size_t count = 0;
+  dispatcher.for_each_id([&count](uint32_t, bool, CanRxFifo) { ++count; });
+  CHECK(count == 0);
+}
+
+} // namespace
+
+int main() {
+  test_random_attach_detach();
+  test_sequential_ids();
+  return test::result();
+}
@@ -0,0 +1,109 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos_host.hpp>
+
+#include "test.hpp"
+
+// STM32RCOS_INSTRUMENTATION を定義してビルドする。ホストの FreeRTOS.h は
+// configUSE_TRACE_FACILITY が 0 なので、スレッドの情報は出ない
+
+using namespace stm32rcos::core;
+
+namespace {
+
+const QueueInfo *find_queue(const std::vector<QueueInfo> &infos,
+                            const char *name) {
+  for (const QueueInfo &info : infos) {
+    if (info.name && std::strcmp(info.name, name) == 0) {
+      return &info;
+    }
+  }
+  return nullptr;
+}
+
+// 溢れた回数とピークは、割り込みからの push も数える
+void test_queue() {
+  Queue<uint32_t> queue(2, 0, "queue");
+  CHECK(queue.push(1, 0));
+  stm32rcos_host::run_isr([&queue] { queue.push(2, 0); });
+  CHECK(!queue.push(3, 0));
+  stm32rcos_host::run_isr([&queue] { queue.push(4, 0); });
+
+  std::vector<QueueInfo> infos = get_queue_info();
+  const QueueInfo *info = find_queue(infos, "queue");
+  CHECK(info && info->size == 2 && info->capacity == 2 &&
+        info->high_water == 2 && info->overflows == 2);
+}
+
+// 移動しても登録簿には1つだけ残り、数えた値も引き継ぐ
+void test_move() {
+  Queue<uint32_t> queue(1, 0, "moved");
+  CHECK(queue.push(1, 0));
+  CHECK(!queue.push(2, 0));
+  Queue<uint32_t> moved = std::move(queue);
+
+  std::vector<QueueInfo> infos = get_queue_info();
+  const QueueInfo *info = find_queue(infos, "moved");
+  CHECK(info && info->high_water == 1 && info->overflows == 1);
+  CHECK(infos.size() == 1);
+
+  std::vector<Queue<uint32_t>> queues;
+  queues.emplace_back(4, 0, "first");
+  queues.emplace_back(4, 0, "second");
+  queues.emplace_back(4, 0, "third");
+  CHECK(get_queue_info().size() == 4);
+  queues.erase(queues.begin());
+  infos = get_queue_info();
+  CHECK(infos.size() == 3 && !find_queue(infos, "first") &&
+        find_queue(infos, "second") && find_queue(infos, "third"));
+
+  // 上書きされた側は登録簿から外れる
+  moved = std::move(queues.back());
+  infos = get_queue_info();
+  CHECK(infos.size() == 2 && !find_queue(infos, "moved") &&
+        find_queue(infos, "third"));
+
+  Semaphore semaphore(1, 0, 0, "semaphore");
+  CHECK(!semaphore.acquire(1));
+  Semaphore moved_semaphore = std::move(semaphore);
+  std::vector<SemaphoreInfo> semaphores = get_semaphore_info();
+  CHECK(semaphores.size() == 1 && semaphores[0].timeouts == 1);
+}
+
+// スレッドの統計がなくても、Queue と Semaphore だけ出す
+void test_dump() {
+  Queue<uint32_t> queue(4, 0, "dump");
+  CHECK(queue.push(1, 0));
+  std::string text;
+  dump_instrumentation(
+      [&text](const char *data, size_t size) { text.append(data, size); });
+  CHECK(text.find("queue dump size=1/4 peak=1 overflows=0\r\n") !=
+        std::string::npos);
+  CHECK(text.find("thread ") == std::string::npos);
+
+  // 長すぎて切り詰めた行も、改行で終わる
+  std::string name(100, 'x');
+  Queue<uint32_t> long_queue(4, 0, name.c_str());
+  text.clear();
+  dump_instrumentation([&text](const char *data, size_t size) {
+    CHECK(size >= 2 && data[size - 2] == '\r' && data[size - 1] == '\n');
+    text.append(data, size);
+  });
+  CHECK(text.find("queue dump size=1/4 peak=1 overflows=0\r\n") !=
+        std::string::npos);
+}
+
+} // namespace
+
+int main() {
+  test_queue();
+  test_move();
+  test_dump();
+  return test::result();
+}
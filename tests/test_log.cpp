@@ -0,0 +1,136 @@
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos_host.hpp>
+
+#include "test.hpp"
+
+using namespace stm32rcos::core;
+
+namespace {
+
+std::vector<uint8_t> read(LogReader &reader) {
+  std::vector<uint8_t> data;
+  reader.read([&data](const uint8_t *bytes, size_t size) {
+    data.insert(data.end(), bytes, bytes + size);
+  });
+  return data;
+}
+
+// 行ごとに分け、先頭の "[tick] " を除く
+std::vector<std::string> decode(const std::vector<uint8_t> &data,
+                                size_t &count) {
+  std::string text;
+  count = decode_log(
+      data, [&text](const char *s, size_t n) { text.append(s, n); });
+  std::vector<std::string> lines;
+  size_t begin = 0;
+  for (size_t end = text.find("\r\n"); end != std::string::npos;
+       begin = end + 2, end = text.find("\r\n", begin)) {
+    std::string line = text.substr(begin, end - begin);
+    if (line.starts_with("[")) {
+      line.erase(0, line.find("] ") + 2);
+    }
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+// log() で書いた値が、decode_log() で printf と同じ文字列に戻る
+std::vector<uint8_t> test_round_trip(LogReader &reader) {
+  CHECK(log("int %d %i %+d\r\n", -5, 7, int8_t{3}));
+  CHECK(log("uint %u %x %08X\r\n", 42u, 255u, uint16_t{0xBEEF}));
+  CHECK(log("64bit %lld %llu\r\n", int64_t{-1234567890123},
+            uint64_t{18446744073709551615u}));
+  CHECK(log("float %.2f %g %e\r\n", 1.5f, 0.25, -2.0));
+  CHECK(log("str %s|%5s|%c %%\r\n", "abc", std::string_view{"xy"}, 'z'));
+  // 文字列は LOG_MAX_STRING バイトまで
+  CHECK(log("long %s\r\n", "0123456789012345678901234567890123456789"));
+  stm32rcos_host::run_isr([] { log("isr %d\r\n", 1); });
+
+  std::vector<uint8_t> data = read(reader);
+  size_t count;
+  std::vector<std::string> lines = decode(data, count);
+  std::vector<std::string> expected = {
+      "int -5 7 +3",
+      "uint 42 ff 0000BEEF",
+      "64bit -1234567890123 18446744073709551615",
+      "float 1.50 0.25 -2.000000e+00",
+      "str abc|   xy|z %",
+      "long 01234567890123456789012345678901",
+      "isr 1",
+  };
+  CHECK(count == expected.size());
+  CHECK(lines == expected);
+  return data;
+}
+
+// 2回目の読み出しには FORMAT が付かないので、途中から受信すると書式が分からない
+void test_unknown_format(LogReader &reader) {
+  CHECK(log("int %d %i %+d\r\n", 1, 2, 3));
+  size_t count;
+  std::vector<std::string> lines = decode(read(reader), count);
+  CHECK(count == 1);
+  CHECK(lines.size() == 1 && lines[0].starts_with("<format 0x") &&
+        lines[0].ends_with("> ? ? ?"));
+
+  // reset() すると書式をもう一度送る
+  reader.reset();
+  CHECK(log("int %d %i %+d\r\n", 1, 2, 3));
+  lines = decode(read(reader), count);
+  CHECK(lines == std::vector<std::string>{"int 1 2 +3"});
+}
+
+// 欠けたバイトや余計なバイトがあっても、次のパケットから読み直す
+void test_resync(const std::vector<uint8_t> &packets) {
+  // ノイズの後から受信し始め、最初の RECORD の途中が欠けた。
+  // ノイズや欠けたパケットの長さは、後ろのパケットにはみ出す
+  std::vector<uint8_t> data = {0x12, LOG_MAGIC, 0x00, 0xFF, 0x12};
+  size_t first = packets[2] + 3;
+  size_t second = first + packets[first + 2] + 3;
+  data.insert(data.end(), packets.begin(), packets.begin() + first + 6);
+  data.insert(data.end(), packets.begin() + second, packets.end());
+  size_t count;
+  std::vector<std::string> lines = decode(data, count);
+  CHECK(count == 6);
+  CHECK(!lines.empty() && lines[0] == "uint 42 ff 0000BEEF");
+}
+
+// 溢れた数は DROPPED で知らされる
+void test_dropped(LogReader &reader) {
+  size_t written = 0;
+  size_t dropped = 0;
+  for (size_t i = 0; i < STM32RCOS_LOG_SIZE; ++i) {
+    if (log("fill %u\r\n", i)) {
+      ++written;
+    } else {
+      ++dropped;
+    }
+  }
+  CHECK(dropped != 0);
+  size_t count;
+  std::vector<std::string> lines = decode(read(reader), count);
+  CHECK(count == written);
+  CHECK(!lines.empty() &&
+        lines[0] == "<dropped " + std::to_string(dropped) + " records>");
+}
+
+} // namespace
+
+int main() {
+  LogReader reader;
+  std::vector<uint8_t> packets = test_round_trip(reader);
+  test_unknown_format(reader);
+  test_resync(packets);
+  test_dropped(reader);
+
+  // stm32rcos_log2text のテストで変換する
+  std::ofstream file("log.bin", std::ios::binary);
+  file.write(reinterpret_cast<const char *>(packets.data()), packets.size());
+  return test::result();
+}
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <thread>
+
+#include <stm32rcos/core.hpp>
+
+#include "test.hpp"
+
+using namespace stm32rcos::core;
+
+namespace {
+
+constexpr uint32_t COUNT = 1000000;
+
+// producer と consumer を別の std::thread で動かし、連番が順に届くかを見る。
+// 容量が小さいので、何度も終端をまたいで折り返す
+template <class Ring, class Produce, class Consume>
+void test_spsc(Ring &ring, Produce produce, Consume consume) {
+  std::thread producer([&] {
+    uint32_t next = 0;
+    while (next < COUNT) {
+      uint32_t size = produce(ring, next);
+      if (size == 0) {
+        // コアが1つでも相手に回るよう、進めないときは譲る
+        std::this_thread::yield();
+      }
+      next += size;
+    }
+  });
+  uint32_t expected = 0;
+  bool ok = true;
+  std::array<uint32_t, 16> received;
+  while (expected < COUNT) {
+    size_t size = consume(ring, std::span{received});
+    if (size == 0) {
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < size; ++i) {
+      ok &= received[i] == expected++;
+    }
+  }
+  producer.join();
+  CHECK(ok);
+  CHECK(ring.empty());
+}
+
+// 1回に書く個数を 1〜7 個で変えて、折り返しの位置をずらす
+size_t batch_size(uint32_t next) { return next % 7 + 1; }
+
+template <class Ring> void test_push_pop(Ring &ring) {
+  test_spsc(
+      ring,
+      [](Ring &ring, uint32_t next) -> uint32_t { return ring.push(next); },
+      [](Ring &ring, std::span<uint32_t> data) -> size_t {
+        return ring.pop(data[0]);
+      });
+}
+
+template <class Ring> void test_push_n_pop_n(Ring &ring) {
+  test_spsc(
+      ring,
+      [](Ring &ring, uint32_t next) -> uint32_t {
+        std::array<uint32_t, 7> data;
+        size_t size = std::min<size_t>(batch_size(next), COUNT - next);
+        for (size_t i = 0; i < size; ++i) {
+          data[i] = next + i;
+        }
+        return ring.push_n(std::span{data}.first(size));
+      },
+      [](Ring &ring, std::span<uint32_t> data) -> size_t {
+        return ring.pop_n(data);
+      });
+}
+
+template <class Ring> void test_write_span_read_span(Ring &ring) {
+  test_spsc(
+      ring,
+      [](Ring &ring, uint32_t next) -> uint32_t {
+        auto span = ring.write_span();
+        size_t size =
+            std::min<size_t>({span.size(), batch_size(next), COUNT - next});
+        for (size_t i = 0; i < size; ++i) {
+          span[i] = next + i;
+        }
+        ring.commit(size);
+        return size;
+      },
+      [](Ring &ring, std::span<uint32_t> data) -> size_t {
+        auto span = ring.read_span();
+        size_t size = std::min(span.size(), data.size());
+        std::copy_n(span.begin(), size, data.begin());
+        ring.consume(size);
+        return size;
+      });
+}
+
+template <class Ring> void test_all(Ring &ring) {
+  test_push_pop(ring);
+  test_push_n_pop_n(ring);
+  test_write_span_read_span(ring);
+}
+
+} // namespace
+
+int main() {
+  RingBuffer<uint32_t, 16> fixed;
+  test_all(fixed);
+
+  // 容量が2のべき乗でなければ、格納領域の一部は使われない
+  RingBuffer<uint32_t> dynamic(13);
+  test_all(dynamic);
+
+  RingBuffer<uint32_t, 16, 64> aligned;
+  test_all(aligned);
+  return test::result();
+}
@@ -0,0 +1,130 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos_host.hpp>
+
+#include "test.hpp"
+
+// STM32RCOS_TRACE を定義してビルドする
+
+using namespace stm32rcos::core;
+
+namespace {
+
+std::vector<uint8_t> drain() {
+  std::vector<uint8_t> data;
+  trace_drain([&data](const uint8_t *bytes, size_t size) {
+    data.insert(data.end(), bytes, bytes + size);
+  });
+  return data;
+}
+
+std::string to_json(const std::vector<uint8_t> &data, size_t &count) {
+  std::string json;
+  count = write_chrome_trace(
+      data, [&json](const char *s, size_t n) { json.append(s, n); });
+  return json;
+}
+
+size_t occurrences(const std::string &json, const std::string &word) {
+  size_t count = 0;
+  for (size_t pos = json.find(word); pos != std::string::npos;
+       pos = json.find(word, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+// "ts" が記録の順に減らないこと
+bool timestamps_monotonic(const std::string &json) {
+  double last = 0;
+  for (size_t pos = json.find("\"ts\":"); pos != std::string::npos;
+       pos = json.find("\"ts\":", pos + 1)) {
+    double ts = std::strtod(json.c_str() + pos + 5, nullptr);
+    if (ts < last) {
+      return false;
+    }
+    last = ts;
+  }
+  return true;
+}
+
+// 記録したものが、変換後にすべて順に現れる
+std::vector<uint8_t> test_round_trip() {
+  int marker = 0;
+  int ignored = 0;
+  trace_ignore(&ignored);
+
+  trace_mark(1, &marker);
+  Queue<uint32_t> queue(4);
+  queue.push(7, 0);
+  queue.pop(0);
+  trace_mark(2, &ignored);
+  osDelay(2);
+  stm32rcos_host::run_isr([&] {
+    TraceIsrScope scope{&marker, TraceIsr::UART_RX};
+    trace_mark(3, &marker);
+  });
+
+  std::vector<uint8_t> data = drain();
+  CHECK(data.size() == sizeof(TraceRecord) * 7);
+  size_t count;
+  std::string json = to_json(data, count);
+  CHECK(count == 7);
+  CHECK(json.starts_with("{\"traceEvents\":["));
+  CHECK(json.ends_with("]}\n"));
+  CHECK(occurrences(json, "\"name\":\"MARK\"") == 2);
+  CHECK(occurrences(json, "\"name\":\"QUEUE_PUSH\"") == 1);
+  CHECK(occurrences(json, "\"name\":\"QUEUE_POP\"") == 1);
+  CHECK(occurrences(json, "\"name\":\"UART_RX\"") == 2);
+  // 割り込みの中の MARK は "isr" の行 (tid 0) に出る
+  CHECK(json.find("\"name\":\"MARK\",\"pid\":0,\"tid\":0,") !=
+        std::string::npos);
+  CHECK(timestamps_monotonic(json));
+  return data;
+}
+
+// 欠けたバイトや余計なバイトがあっても、次の SYNC から読み直す
+void test_resync(const std::vector<uint8_t> &records) {
+  std::vector<uint8_t> data = {1, 2, 3, 4, 5};
+  // 最後の記録の後ろ 3 バイトがノイズに化けた
+  data.insert(data.end(), records.begin(), records.end() - 3);
+  data.insert(data.end(), {0xFF, 0xFF, 0xFF});
+  data.insert(data.end(), records.begin(), records.end());
+  size_t count;
+  std::string json = to_json(data, count);
+  // 1回目の最後の記録だけが欠ける
+  CHECK(count == 13);
+  CHECK(occurrences(json, "\"name\":\"QUEUE_PUSH\"") == 2);
+}
+
+// 溢れた数は次の SYNC で知らされる
+void test_dropped() {
+  for (size_t i = 0; i < STM32RCOS_TRACE_SIZE + 10; ++i) {
+    trace_mark(i);
+  }
+  size_t count;
+  std::string json = to_json(drain(), count);
+  CHECK(count == STM32RCOS_TRACE_SIZE + 1);
+  CHECK(json.find("\"name\":\"dropped\"") != std::string::npos);
+  CHECK(json.find("\"count\":10}") != std::string::npos);
+}
+
+} // namespace
+
+int main() {
+  trace_start();
+  std::vector<uint8_t> records = test_round_trip();
+  test_resync(records);
+  test_dropped();
+
+  // stm32rcos_trace2json のテストで変換する
+  std::ofstream file("trace.bin", std::ios::binary);
+  file.write(reinterpret_cast<const char *>(records.data()), records.size());
+  return test::result();
+}
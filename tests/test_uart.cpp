@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <optional>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/hal.hpp>
+#include <stm32rcos/peripheral.hpp>
+#include <stm32rcos_host.hpp>
+
+#include "test.hpp"
+
+using namespace stm32rcos::core;
+using namespace stm32rcos::peripheral;
+
+UART_HandleTypeDef huart1;
+UART_HandleTypeDef huart2;
+
+namespace {
+
+constexpr size_t SIZE = 200;
+
+std::array<uint8_t, SIZE> pattern(uint8_t first) {
+  std::array<uint8_t, SIZE> data;
+  std::iota(data.begin(), data.end(), first);
+  return data;
+}
+
+// 相手側は受信を取りこぼさないよう、Tx/Rx とも DMA にしておく
+using Peer = Uart<&huart2, UartType::DMA, UartType::DMA>;
+
+struct Sender {
+  Peer &peer;
+  std::array<uint8_t, SIZE> data;
+};
+
+// POLL の受信は待ち始めてからでないと取りこぼすので、少し遅らせて送る
+void send_later(void *args) {
+  auto sender = static_cast<Sender *>(args);
+  osDelay(5);
+  sender->peer.transmit(sender->data.data(), sender->data.size(), 1000);
+}
+
+template <UartType TxType, UartType RxType> void test_transfer() {
+  Uart<&huart1, TxType, RxType> uart(256, 256);
+  Peer peer(256, 256);
+
+  auto tx_data = pattern(0);
+  std::array<uint8_t, SIZE> received{};
+  CHECK(uart.transmit(tx_data.data(), tx_data.size(), 1000));
+  CHECK(peer.receive(received.data(), received.size(), 1000));
+  CHECK(received == tx_data);
+
+  Sender sender{peer, pattern(100)};
+  Thread thread{send_later, &sender, 1024, osPriorityNormal};
+  received = {};
+  CHECK(uart.receive(received.data(), received.size(), 1000));
+  CHECK(received == sender.data);
+  CHECK(thread.join());
+
+  // 何も届かなければタイムアウトする
+  uint8_t byte;
+  CHECK(!uart.receive(&byte, 1, 10));
+}
+
+void test_receive_some() {
+  Uart<&huart1, UartType::IT, UartType::IT> uart(256, 256);
+  Peer peer(256, 256);
+
+  auto data = pattern(0);
+  CHECK(peer.transmit(data.data(), 10, 1000));
+  std::array<uint8_t, SIZE> received{};
+  size_t size = 0;
+  while (size < 10) {
+    size_t n = uart.receive_some(received.data() + size, SIZE - size, 1000);
+    CHECK(n != 0);
+    if (n == 0) {
+      break;
+    }
+    size += n;
+  }
+  CHECK(size == 10);
+  CHECK(std::equal(data.begin(), data.begin() + 10, received.begin()));
+}
+
+void test_transmit_async() {
+  Uart<&huart1, UartType::DMA, UartType::DMA> uart(256, 64);
+  Peer peer(256, 256);
+
+  // 送信バッファより大きいデータも、空くのを待って順に送られる
+  auto data = pattern(0);
+  CHECK(uart.transmit_async(data.data(), data.size(), 1000));
+  std::array<uint8_t, SIZE> received{};
+  CHECK(peer.receive(received.data(), received.size(), 1000));
+  CHECK(received == data);
+}
+
+struct Writer {
+  Uart<&huart1, UartType::DMA, UartType::DMA> &uart;
+  uint8_t tag;
+  bool ok = true;
+};
+
+constexpr size_t MESSAGE_SIZE = 50;
+constexpr size_t MESSAGES = 20;
+
+void write_messages(void *args) {
+  auto writer = static_cast<Writer *>(args);
+  for (size_t i = 0; i < MESSAGES; ++i) {
+    std::array<uint8_t, MESSAGE_SIZE> message;
+    message.fill(static_cast<uint8_t>(writer->tag + i));
+    writer->ok &= writer->uart.transmit(message.data(), message.size(), 1000);
+  }
+}
+
+// 送信バッファに収まるメッセージは、複数のスレッドから送っても混ざらない
+void test_concurrent_transmit() {
+  Uart<&huart1, UartType::DMA, UartType::DMA> uart(256, 64);
+  Peer peer(4096, 256);
+
+  std::array<Writer, 3> writers{
+      Writer{uart, 0}, Writer{uart, 64}, Writer{uart, 128}};
+  Thread thread0{write_messages, &writers[0], 1024, osPriorityNormal};
+  Thread thread1{write_messages, &writers[1], 1024, osPriorityNormal};
+  Thread thread2{write_messages, &writers[2], 1024, osPriorityNormal};
+  std::array<size_t, 256> counts{};
+  bool contiguous = true;
+  for (size_t i = 0; i < writers.size() * MESSAGES; ++i) {
+    std::array<uint8_t, MESSAGE_SIZE> message{};
+    if (!peer.receive(message.data(), message.size(), 1000)) {
+      contiguous = false;
+      break;
+    }
+    contiguous &= std::all_of(message.begin(), message.end(),
+                              [&](uint8_t b) { return b == message[0]; });
+    ++counts[message[0]];
+  }
+  CHECK(contiguous);
+  CHECK(thread0.join());
+  CHECK(thread1.join());
+  CHECK(thread2.join());
+  for (const Writer &writer : writers) {
+    CHECK(writer.ok);
+    for (size_t i = 0; i < MESSAGES; ++i) {
+      CHECK(counts[writer.tag + i] == 1);
+    }
+  }
+}
+
+// 多くのスレッドが同時に待っても、全員が起こされる
+void test_many_waiters() {
+  Uart<&huart1, UartType::DMA, UartType::DMA> uart(64, 64);
+  Peer peer(4096, 256);
+
+  constexpr size_t WRITERS = 12;
+  std::array<std::optional<Writer>, WRITERS> writers;
+  std::array<std::optional<Thread>, WRITERS> threads;
+  for (size_t i = 0; i < WRITERS; ++i) {
+    writers[i].emplace(uart, static_cast<uint8_t>(i * MESSAGES));
+    threads[i].emplace(write_messages, &*writers[i], 1024, osPriorityNormal);
+  }
+  std::array<uint8_t, MESSAGE_SIZE> message{};
+  size_t received = 0;
+  while (received < WRITERS * MESSAGES &&
+         peer.receive(message.data(), message.size(), 1000)) {
+    ++received;
+  }
+  CHECK(received == WRITERS * MESSAGES);
+  for (size_t i = 0; i < WRITERS; ++i) {
+    CHECK(threads[i]->join());
+    CHECK(writers[i]->ok);
+  }
+}
+
+// タイムアウトしても、書き込んだデータや他のスレッドのデータは捨てない
+void test_transmit_timeout() {
+  Uart<&huart1, UartType::DMA, UartType::DMA> uart(64, 256);
+  Peer peer(256, 256);
+
+  auto data = pattern(0);
+  CHECK(uart.transmit_async(data.data(), 100, 1000));
+  CHECK(!uart.transmit(data.data() + 100, 100, 1));
+  std::array<uint8_t, SIZE> received{};
+  CHECK(peer.receive(received.data(), received.size(), 1000));
+  CHECK(received == data);
+}
+
+// HAL が送信を始められなければ、待ち続けずに失敗を返す
+void test_transmit_failure() {
+  Uart<&huart1, UartType::DMA, UartType::DMA> uart(256, 64);
+  Peer peer(256, 256);
+
+  auto data = pattern(0);
+  stm32rcos_host::uart_fail_transmit(&huart1, 1);
+  uint32_t start = osKernelGetTickCount();
+  CHECK(!uart.transmit(data.data(), 10, osWaitForever));
+  CHECK(osKernelGetTickCount() - start < 100);
+
+  // 次の送信は届く
+  std::array<uint8_t, SIZE> received{};
+  CHECK(uart.transmit(data.data(), 10, 1000));
+  CHECK(peer.receive(received.data(), 10, 1000));
+  CHECK(std::equal(data.begin(), data.begin() + 10, received.begin()));
+}
+
+void test_dma_peek() {
+  Uart<&huart1, UartType::IT, UartType::DMA> uart(64, 64);
+  Peer peer(256, 256);
+
+  auto data = pattern(0);
+  std::array<uint8_t, 64> received{};
+  CHECK(peer.transmit(data.data(), 40, 1000));
+  CHECK(uart.receive(received.data(), 40, 1000));
+  CHECK(std::equal(data.begin(), data.begin() + 40, received.begin()));
+
+  // 受信バッファの終端をまたぐので、2つの区間に分かれる
+  CHECK(peer.transmit(data.data(), 40, 1000));
+  osDelay(5);
+  auto segments = uart.peek();
+  CHECK(segments[0].size() + segments[1].size() == 40);
+  CHECK(segments[1].size() != 0);
+  CHECK(std::equal(segments[0].begin(), segments[0].end(), data.begin()));
+  uart.consume(40);
+  CHECK(uart.available() == 0);
+}
+
+// エラーで受信が中断されたら、未読のデータを捨ててバッファの先頭から再開する
+void test_dma_error_restart() {
+  Uart<&huart1, UartType::IT, UartType::DMA> uart(64, 64);
+  Peer peer(256, 256);
+
+  auto data = pattern(0);
+  CHECK(peer.transmit(data.data(), 10, 1000));
+  osDelay(5);
+  CHECK(uart.available() == 10);
+  stm32rcos_host::uart_inject_error(&huart1, HAL_UART_ERROR_ORE);
+  CHECK(uart.available() == 0);
+
+  CHECK(peer.transmit(data.data() + 100, 20, 1000));
+  std::array<uint8_t, 20> received{};
+  CHECK(uart.receive(received.data(), received.size(), 1000));
+  CHECK(std::equal(received.begin(), received.end(), data.begin() + 100));
+}
+
+} // namespace
+
+int main() {
+  for (UART_HandleTypeDef *huart : {&huart1, &huart2}) {
+    huart->Init.BaudRate = 1000000;
+    HAL_UART_Init(huart);
+  }
+  stm32rcos_host::uart_connect(&huart1, &huart2);
+
+  test_transfer<UartType::POLL, UartType::POLL>();
+  test_transfer<UartType::IT, UartType::IT>();
+  test_transfer<UartType::DMA, UartType::DMA>();
+  test_transfer<UartType::DMA, UartType::IT>();
+  test_receive_some();
+  test_transmit_async();
+  test_concurrent_transmit();
+  test_many_waiters();
+  test_transmit_timeout();
+  test_transmit_failure();
+  test_dma_peek();
+  test_dma_error_restart();
+  return test::result();
+}
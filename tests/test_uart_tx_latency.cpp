@@ -0,0 +1,51 @@
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include <stm32rcos/core.hpp>
+#include <stm32rcos/core/benchmark.hpp>
+#include <stm32rcos/hal.hpp>
+#include <stm32rcos/peripheral.hpp>
+#include <stm32rcos_host.hpp>
+
+#include "test.hpp"
+
+using namespace stm32rcos::core;
+using namespace stm32rcos::peripheral;
+
+UART_HandleTypeDef huart1;
+
+namespace {
+
+constexpr size_t ITERATIONS = 100;
+
+uint32_t samples[ITERATIONS];
+
+/**
+ * 最後のバイトを送り終えて TxCpltCallback が呼ばれてから、transmit() が
+ * 戻るまでの時間を測ります。完了をティックごとに見に行く実装では
+ * 1ms 前後かかるので、中央値がそれより十分小さいことを確かめます。
+ */
+template <UartType TxType> void test_wake_up(const char *name) {
+  Uart<&huart1, TxType, UartType::IT> uart;
+  std::array<uint8_t, 8> data{};
+  for (uint32_t &sample : samples) {
+    CHECK(uart.transmit(data.data(), data.size(), 1000));
+    sample = osKernelGetSysTimerCount() -
+             stm32rcos_host::uart_tx_complete_time(&huart1);
+  }
+  BenchmarkResult result = summarize_benchmark(name, samples);
+  result.print_json();
+  CHECK(result.p50_ns < 200000);
+}
+
+} // namespace
+
+int main() {
+  huart1.Init.BaudRate = 1000000;
+  HAL_UART_Init(&huart1);
+
+  test_wake_up<UartType::IT>("uart_tx_it_wake_up");
+  test_wake_up<UartType::DMA>("uart_tx_dma_wake_up");
+  return test::result();
+}
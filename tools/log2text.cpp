@@ -0,0 +1,32 @@
+// LogStream で受け取ったバイト列を、printf で整形した文字列に戻す
+//
+//   stm32rcos_log2text log.bin
+//   stm32rcos_log2text < log.bin
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include <stm32rcos/core/log_format.hpp>
+
+int main(int argc, char **argv) {
+  std::vector<uint8_t> data;
+  if (argc > 1) {
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+      std::fprintf(stderr, "cannot open %s\n", argv[1]);
+      return 1;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), {});
+  } else {
+    data.assign(std::istreambuf_iterator<char>(std::cin), {});
+  }
+  size_t count = stm32rcos::core::decode_log(
+      data, [](const char *s, size_t n) { std::fwrite(s, 1, n, stdout); });
+  std::fprintf(stderr, "%zu records\n", count);
+  return 0;
+}
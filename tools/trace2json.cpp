@@ -0,0 +1,33 @@
+// TraceStream や trace_drain() で受け取ったバイト列を、Chrome の
+// about:tracing や Perfetto で開ける JSON に変換する
+//
+//   stm32rcos_trace2json trace.bin > trace.json
+//   stm32rcos_trace2json < trace.bin > trace.json
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include <stm32rcos/core/trace_format.hpp>
+
+int main(int argc, char **argv) {
+  std::vector<uint8_t> data;
+  if (argc > 1) {
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+      std::fprintf(stderr, "cannot open %s\n", argv[1]);
+      return 1;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), {});
+  } else {
+    data.assign(std::istreambuf_iterator<char>(std::cin), {});
+  }
+  size_t count = stm32rcos::core::write_chrome_trace(
+      data, [](const char *s, size_t n) { std::fwrite(s, 1, n, stdout); });
+  std::fprintf(stderr, "%zu records\n", count);
+  return 0;
+}